@@ -0,0 +1,89 @@
+#include "neuralnet.h"
+#include "neuralnet_batcher.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <omp.h>
+
+/* Compares application threads that call neuralnet_predict() one sample at a time, with the same
+ * threads calling neuralnet_batcher_predict(), such that the concurrent samples are predicted in
+ * batches. Usage:
+ *
+ *     ./benchmark_batcher [n_threads] [n_samples_per_thread] [n_input] [n_hidden]
+ */
+
+typedef struct {
+    const neuralnet_t   *nn;
+    neuralnet_batcher_t *batcher;
+    const float         *inputs;
+    int                  n_samples;
+    int                  n_output;
+} job_t;
+
+static void *predict_thread( void *arg )
+{
+    job_t *job = (job_t *) arg;
+    const int n_input = job->nn->layer[0].n_input;
+    float output[job->n_output];
+    for( int i = 0; i < job->n_samples; i++ ){
+        const float *input = job->inputs + (size_t) (i % 1024) * n_input;
+        if( job->batcher )
+            neuralnet_batcher_predict( job->batcher, input, output );
+        else
+            neuralnet_predict( job->nn, input, output );
+    }
+    return NULL;
+}
+
+static double run( const neuralnet_t *nn, neuralnet_batcher_t *batcher, const float *inputs, const int n_threads,
+        const int n_samples )
+{
+    job_t job = { .nn = nn, .batcher = batcher, .inputs = inputs, .n_samples = n_samples,
+        .n_output = nn->layer[nn->n_layers - 1].n_output };
+    pthread_t thread[n_threads];
+    const double start = omp_get_wtime();
+    for( int t = 0; t < n_threads; t++ ){
+        const int started = pthread_create( &thread[t], NULL, predict_thread, &job );
+        assert( started == 0 );
+    }
+    for( int t = 0; t < n_threads; t++ )
+        pthread_join( thread[t], NULL );
+    return (double) n_threads * n_samples / (omp_get_wtime() - start);
+}
+
+int main( int argc, char *argv[] )
+{
+    const int n_threads = argc > 1 ? atoi( argv[1] ) : 8;
+    const int n_samples = argc > 2 ? atoi( argv[2] ) : 20000;
+    const int n_input   = argc > 3 ? atoi( argv[3] ) : 256;
+    const int n_hidden  = argc > 4 ? atoi( argv[4] ) : 512;
+
+    neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( n_input, n_hidden, 10 ), STR_ARRAY( "relu", "softmax" ));
+    assert( nn );
+    neuralnet_initialize( nn, NULL );
+    float *inputs = malloc( (size_t) 1024 * n_input * sizeof(float));
+    assert( inputs );
+    for( int i = 0; i < 1024 * n_input; i++ )
+        inputs[i] = (float) rand() / (float) RAND_MAX;
+
+    printf("%d threads, %d-%d-10 network\n", n_threads, n_input, n_hidden );
+    printf("neuralnet_predict()         : %10.0f samples/s\n", run( nn, NULL, inputs, n_threads, n_samples ));
+
+    const int windows[] = { 0, 20, 100 };
+    for( int w = 0; w < 3; w++ ){
+        neuralnet_batcher_t *batcher = neuralnet_batcher_new( nn, NEURALNET_BATCHER_PROPERTIES( .window_us = windows[w] ));
+        assert( batcher );
+        const double rate = run( nn, batcher, inputs, n_threads, n_samples );
+        neuralnet_batcher_stats_t stats;
+        neuralnet_batcher_stats( batcher, &stats );
+        printf("batcher, window %3d us      : %10.0f samples/s, %5.1f samples per batch\n", windows[w], rate,
+                (double) stats.n_requests / stats.n_batches );
+        neuralnet_batcher_free( batcher );
+    }
+
+    free( inputs );
+    neuralnet_free( nn );
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include "neuralnet.h"
+#include "sparse_matrix.h"
+
+#include "optimizer.h"
+#include "SGD.h"
+#include "adagrad.h"
+#include "evaluate.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <omp.h>
+
+/* Compares the synchronous training (all threads on one batch, one update) with the Hogwild
+ * mode (each thread on its own batches, lock free updates) for 1, 2, 4, ... threads.
+ *
+ * The data is synthetic and sparse, like a bag-of-features model: Each sample has a few
+ * active features out of many, and the label is given by the sum of some hidden feature
+ * weights. Usage:
+ *
+ *     ./benchmark_hogwild [n_samples] [n_features] [n_active] [batchsize]
+ *
+ * Set OMP_NUM_THREADS to the number of cores. The synchronous mode keeps the gradients on the
+ * stack, so with many features, also raise the stack sizes (ulimit -s and OMP_STACKSIZE).
+ */
+int main( int argc, char *argv[] )
+{
+    const int n_samples  = argc > 1 ? atoi( argv[1] ) : 20000;
+    const int n_features = argc > 2 ? atoi( argv[2] ) : 5000;
+    const int n_active   = argc > 3 ? atoi( argv[3] ) : 20;
+    const int batchsize  = argc > 4 ? atoi( argv[4] ) : 16;
+    const int n_epochs   = 3;
+
+    srand( 42 );
+    float *hidden = malloc( n_features * sizeof(float));
+    float *X = calloc( (size_t) n_samples * n_features, sizeof(float));
+    float *Y = malloc( n_samples * sizeof(float));
+    assert( hidden && X && Y );
+    for( int j = 0; j < n_features; j++ )
+        hidden[j] = 2.0f * (float) rand() / (float) RAND_MAX - 1.0f;
+    for( int i = 0; i < n_samples; i++ ){
+        float sum = 0.0f;
+        for( int k = 0; k < n_active; k++ ){
+            const int j = rand() % n_features;
+            X[(size_t) i * n_features + j] = 1.0f;
+            sum += hidden[j];
+        }
+        Y[i] = sum > 0.0f ? 1.0f : 0.0f;
+    }
+    sparse_matrix_t *sX = sparse_matrix_from_dense( n_samples, n_features, X );
+    assert( sX );
+    free( X );
+
+    printf("%d samples, %d features (%d active), batchsize %d, %d epochs\n", n_samples, n_features, n_active,
+            batchsize, n_epochs );
+    printf("%-9s %-8s %7s %14s %10s\n", "optimizer", "mode", "threads", "samples/sec", "loss" );
+
+    const int max_threads = omp_get_max_threads();
+    for( int which = 0; which < 2; which++ ){
+        for( int n_threads = 1; n_threads <= max_threads; n_threads *= 2 ){
+            for( int hogwild = 0; hogwild < 2; hogwild++ ){
+                /* The same initial weights for all */
+                neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( n_features, 64, 1 ), STR_ARRAY( "relu", "sigmoid" ));
+                assert( nn );
+                srand( 7 );
+                neuralnet_initialize( nn, NULL );
+                neuralnet_set_loss( nn, "binary_crossentropy" );
+                const optimizer_properties_t props = OPTIMIZER_PROPERTIES( .batchsize = batchsize, .progress = NULL,
+                        .hogwild = hogwild, .metrics = METRIC_LIST( get_metric_func( "binary_crossentropy" )));
+                optimizer_t *opt = which == 0 ?
+                    OPTIMIZER( SGD_new( nn, props, SGD_PROPERTIES( .learning_rate = 0.05f ))) :
+                    OPTIMIZER( adagrad_new( nn, props, ADAGRAD_PROPERTIES( .learning_rate = 0.05f )));
+                assert( opt );
+
+                omp_set_num_threads( n_threads );
+                float results[1];
+                double seconds = 0.0;
+                for( int epoch = 0; epoch < n_epochs; epoch++ ){
+                    /* Only the training is timed, so the evaluation of the train set after the epoch is subtracted */
+                    const double start = omp_get_wtime();
+                    optimizer_run_epoch_sparse( opt, sX, Y, NULL, NULL, results );
+                    const double trained = omp_get_wtime();
+                    evaluate_sparse( nn, sX, Y, opt->metrics, results );
+                    seconds += 2.0 * trained - start - omp_get_wtime();
+                }
+                printf("%-9s %-8s %7d %14.0f %10.5f\n", which == 0 ? "SGD" : "adagrad", hogwild ? "hogwild" : "sync",
+                        n_threads, (double) n_epochs * n_samples / seconds, results[0] );
+                optimizer_free( opt );
+                neuralnet_free( nn );
+            }
+        }
+    }
+    omp_set_num_threads( max_threads );
+
+    sparse_matrix_free( sX );
+    free( hidden );
+    free( Y );
+    return 0;
+}
@@ -0,0 +1,134 @@
+#define _DEFAULT_SOURCE   /* syscall() */
+#include "neuralnet.h"
+
+#include "optimizer.h"
+#include "SGD.h"
+#include "simd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <omp.h>
+
+/* Compares training with the dataset, weights, optimizer state and gradients on normal pages and
+ * on huge pages (see `simd_malloc_huge()` in simd.h). The batches are gathered in random order from
+ * a large dataset, which is where the TLB misses come from. Usage:
+ *
+ *     ./benchmark_hugepages [n_samples] [n_features] [n_epochs]
+ *
+ * The data TLB misses are counted with perf_event_open(), which may need
+ * /proc/sys/kernel/perf_event_paranoid <= 2. The hugetlb policy needs huge pages in the pool:
+ *
+ *     echo 512 | sudo tee /proc/sys/vm/nr_hugepages
+ *
+ * The AnonHugePages column shows how much memory actually got huge pages.
+ */
+
+static int open_dtlb_counter( void )
+{
+    struct perf_event_attr attr;
+    memset( &attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.inherit = 1;  /* The OpenMP threads as well */
+    return (int) syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+}
+
+/* The memory on transparent huge pages in this process, in MB */
+static long anon_huge_mb( void )
+{
+    FILE *fp = fopen( "/proc/self/smaps_rollup", "r" );
+    if( !fp )
+        return -1;
+    char line[256];
+    long kb = -1;
+    while( fgets( line, sizeof(line), fp ))
+        if( sscanf( line, "AnonHugePages: %ld kB", &kb ) == 1 )
+            break;
+    fclose( fp );
+    return kb < 0 ? -1 : kb / 1024;
+}
+
+int main( int argc, char *argv[] )
+{
+    const int n_samples  = argc > 1 ? atoi( argv[1] ) : 100000;
+    const int n_features = argc > 2 ? atoi( argv[2] ) : 256;
+    const int n_epochs   = argc > 3 ? atoi( argv[3] ) : 2;
+    const int n_output   = 4;
+
+    printf("%d samples, %d features (%.0f MB), %d epochs\n", n_samples, n_features,
+            (double) n_samples * n_features * sizeof(float) / (1 << 20), n_epochs );
+    printf("%-12s %12s %16s %16s\n", "pages", "sec/epoch", "dTLB misses", "AnonHugePages" );
+
+    const char *names[] = { "normal", "transparent", "hugetlb" };
+    const simd_hugepage_policy_t policies[] = { SIMD_HUGEPAGE_NONE, SIMD_HUGEPAGE_TRANSPARENT, SIMD_HUGEPAGE_HUGETLB };
+    for( int p = 0; p < 3; p++ ){
+        simd_set_hugepage_policy( policies[p] );
+
+        /* The same data for all */
+        srand( 42 );
+        float *X = simd_malloc_huge( (size_t) n_samples * n_features * sizeof(float));
+        float *Y = simd_malloc_huge( (size_t) n_samples * n_output * sizeof(float));
+        assert( X && Y );
+        memset( Y, 0, (size_t) n_samples * n_output * sizeof(float));
+        for( int i = 0; i < n_samples; i++ ){
+            float sum = 0.0f;
+            for( int j = 0; j < n_features; j++ ){
+                X[(size_t) i * n_features + j] = 2.0f * (float) rand() / (float) RAND_MAX - 1.0f;
+                sum += X[(size_t) i * n_features + j] * (float) (j % 3);
+            }
+            Y[i*n_output + (sum > 4.0f) + (sum > 0.0f) + (sum > -4.0f)] = 1.0f;
+        }
+
+        neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( n_features, 256, n_output ), STR_ARRAY( "relu", "softmax" ));
+        assert( nn );
+        srand( 7 );
+        neuralnet_initialize( nn, NULL );
+        neuralnet_set_loss( nn, "categorical_crossentropy" );
+        optimizer_t *opt = OPTIMIZER( SGD_new( nn,
+                    OPTIMIZER_PROPERTIES( .batchsize = 32, .progress = NULL, .running_metrics = true,
+                        .metrics = METRIC_LIST( get_metric_func( "categorical_crossentropy" ))),
+                    SGD_PROPERTIES( .learning_rate = 0.01f, .momentum = 0.9f )));
+        assert( opt );
+
+        const int fd = open_dtlb_counter();
+        if( fd >= 0 ){
+            ioctl( fd, PERF_EVENT_IOC_RESET, 0 );
+            ioctl( fd, PERF_EVENT_IOC_ENABLE, 0 );
+        }
+        float results[1];
+        const double start = omp_get_wtime();
+        for( int epoch = 0; epoch < n_epochs; epoch++ )
+            optimizer_run_epoch( opt, n_samples, X, Y, 0, NULL, NULL, results );
+        const double seconds = (omp_get_wtime() - start) / n_epochs;
+
+        long long misses = -1;
+        if( fd >= 0 ){
+            ioctl( fd, PERF_EVENT_IOC_DISABLE, 0 );
+            if( read( fd, &misses, sizeof(misses)) != sizeof(misses))
+                misses = -1;
+            close( fd );
+        }
+        char misses_str[32] = "n/a", huge_str[32] = "n/a";
+        if( misses >= 0 )
+            sprintf( misses_str, "%lld", misses / n_epochs );
+        if( anon_huge_mb() >= 0 )
+            sprintf( huge_str, "%ld MB", anon_huge_mb());
+        printf("%-12s %12.3f %16s %16s\n", names[p], seconds, misses_str, huge_str );
+
+        optimizer_free( opt );
+        neuralnet_free( nn );
+        simd_free_huge( X );
+        simd_free_huge( Y );
+    }
+    simd_set_hugepage_policy( SIMD_HUGEPAGE_NONE );
+    return 0;
+}
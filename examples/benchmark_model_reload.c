@@ -0,0 +1,181 @@
+#define _POSIX_C_SOURCE 200112L  /* clock_gettime() and pthread_rwlock_t */
+#include "neuralnet.h"
+#include "model_handle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Latency of single sample predictions while the network is replaced over and over. The readers
+ * predict through a model_handle_t, or through a network behind a pthread_rwlock_t which the
+ * writer holds while it creates the new network and frees the old one (which is what reloading
+ * without a handle amounts to). The new networks are created in memory, or loaded from file when a
+ * filename is given. Usage:
+ *
+ *     ./benchmark_model_reload [n_readers] [seconds] [swaps_per_second] [model.npz]
+ */
+
+#define N_INPUT  256
+#define N_HIDDEN 512
+#define N_OUTPUT 10
+
+typedef struct {
+    model_handle_t   *handle;      /* Either this ... */
+    pthread_rwlock_t *lock;        /* ... or this and nn */
+    neuralnet_t     **nn;
+    const float      *inputs;
+    double            stop_time;
+    double           *latency;
+    int               n_latency;
+    int               size;
+} reader_job_t;
+
+static double now_seconds( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (double) ts.tv_sec + 1.0e-9 * (double) ts.tv_nsec;
+}
+
+static int compare_double( const void *a, const void *b )
+{
+    const double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static neuralnet_t *new_network( const char *filename )
+{
+    if( filename )
+        return neuralnet_load_mmap( filename );
+    neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( N_INPUT, N_HIDDEN, N_OUTPUT ), STR_ARRAY( "relu", "softmax" ));
+    if( nn )
+        neuralnet_initialize( nn, NULL );
+    return nn;
+}
+
+static void *reader_thread( void *arg )
+{
+    reader_job_t *job = (reader_job_t *) arg;
+    float output[N_OUTPUT];
+    for( int i = 0; ; i++ ){
+        const double start = now_seconds();
+        if( start >= job->stop_time )
+            break;
+        const float *input = job->inputs + (i % 1024) * N_INPUT;
+        if( job->handle ){
+            model_handle_predict( job->handle, input, output );
+        } else {
+            pthread_rwlock_rdlock( job->lock );
+            neuralnet_predict( *job->nn, input, output );
+            pthread_rwlock_unlock( job->lock );
+        }
+        if( job->n_latency == job->size ){
+            job->size = job->size ? 2 * job->size : 4096;
+            job->latency = realloc( job->latency, job->size * sizeof(double));
+            assert( job->latency );
+        }
+        job->latency[job->n_latency++] = now_seconds() - start;
+    }
+    return NULL;
+}
+
+static void run( const char *name, const int n_readers, const double seconds, const int swaps_per_second,
+        const char *filename, const float *inputs, const int use_handle )
+{
+    model_handle_t *handle = NULL;
+    pthread_rwlock_t lock;
+    neuralnet_t *nn = new_network( filename );
+    assert( nn );
+    if( use_handle ){
+        handle = model_handle_new( nn );
+        assert( handle );
+    } else {
+        pthread_rwlock_init( &lock, NULL );
+    }
+
+    reader_job_t job[n_readers];
+    pthread_t thread[n_readers];
+    const double start = now_seconds();
+    for( int r = 0; r < n_readers; r++ ){
+        job[r] = (reader_job_t) { .handle = handle, .lock = &lock, .nn = &nn, .inputs = inputs,
+            .stop_time = start + seconds };
+        const int started = pthread_create( &thread[r], NULL, reader_thread, &job[r] );
+        assert( started == 0 );
+    }
+
+    int n_swaps = 0;
+    while( swaps_per_second > 0 && now_seconds() < start + seconds ){
+        struct timespec pause = { 0, 1000000000L / swaps_per_second };
+        nanosleep( &pause, NULL );
+        if( use_handle ){
+            if( filename ){
+                n_swaps += model_handle_reload( handle, filename ) == 0;
+            } else {
+                neuralnet_t *next = new_network( NULL );
+                assert( next );
+                if( model_handle_swap( handle, next ) == 0 )
+                    n_swaps++;
+                else
+                    neuralnet_free( next );
+            }
+        } else {
+            pthread_rwlock_wrlock( &lock );
+            neuralnet_free( nn );
+            nn = new_network( filename );
+            assert( nn );
+            pthread_rwlock_unlock( &lock );
+            n_swaps++;
+        }
+    }
+
+    int n_total = 0;
+    for( int r = 0; r < n_readers; r++ ){
+        pthread_join( thread[r], NULL );
+        n_total += job[r].n_latency;
+    }
+    double *latency = malloc(( n_total + 1 ) * sizeof(double));
+    assert( latency );
+    int n = 0;
+    for( int r = 0; r < n_readers; r++ ){
+        for( int i = 0; i < job[r].n_latency; i++ )
+            latency[n++] = job[r].latency[i];
+        free( job[r].latency );
+    }
+    qsort( latency, n_total, sizeof(double), compare_double );
+    if( n_total > 0 )
+        printf("%-22s %8d %14.0f %10.1f %10.1f %10.1f %10.1f\n", name, n_swaps, n_total / seconds,
+                1.0e6 * latency[n_total / 2], 1.0e6 * latency[(int) (0.99 * (n_total - 1))],
+                1.0e6 * latency[(int) (0.999 * (n_total - 1))], 1.0e6 * latency[n_total - 1] );
+    free( latency );
+
+    if( use_handle ){
+        model_handle_free( handle );
+    } else {
+        neuralnet_free( nn );
+        pthread_rwlock_destroy( &lock );
+    }
+}
+
+int main( int argc, char *argv[] )
+{
+    const int n_readers        = argc > 1 ? atoi( argv[1] ) : 4;
+    const double seconds       = argc > 2 ? atof( argv[2] ) : 2.0;
+    const int swaps_per_second = argc > 3 ? atoi( argv[3] ) : 20;
+    const char *filename       = argc > 4 ? argv[4] : NULL;
+
+    float *inputs = malloc( 1024 * N_INPUT * sizeof(float));
+    assert( inputs );
+    for( int i = 0; i < 1024 * N_INPUT; i++ )
+        inputs[i] = (float) rand() / (float) RAND_MAX;
+
+    printf("%d readers, %d swaps per second\n", n_readers, swaps_per_second );
+    printf("%-22s %8s %14s %10s %10s %10s %10s\n", "", "swaps", "predictions/s", "p50 (us)", "p99 (us)", "p99.9 (us)", "max (us)" );
+    run( "no swaps",         n_readers, seconds, 0,                filename, inputs, 1 );
+    run( "model_handle_t",   n_readers, seconds, swaps_per_second, filename, inputs, 1 );
+    run( "pthread_rwlock_t", n_readers, seconds, swaps_per_second, filename, inputs, 0 );
+
+    free( inputs );
+    return 0;
+}
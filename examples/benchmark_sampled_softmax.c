@@ -0,0 +1,96 @@
+#include "neuralnet.h"
+#include "sampled_softmax.h"
+
+#include "optimizer.h"
+#include "SGD.h"
+#include "evaluate.h"
+#include "threadpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <omp.h>
+
+/* Compares the training time of the full softmax (the 'sparse_categorical_crossentropy' loss) and the
+ * sampled softmax for output layers of 1000, 10000, ... classes. The data is synthetic: The class of a
+ * sample is given by the signs of its first inputs, scattered over all the classes. Usage:
+ *
+ *     ./benchmark_sampled_softmax [n_samples] [max_classes] [n_sampled] [batchsize]
+ *
+ * Set OMP_NUM_THREADS to the number of cores. The batch gradient is calculated in the thread pool,
+ * as the gradients of the large output layers are too big for the stack of the OpenMP threads. The
+ * optimizer still keeps a batch gradient on the stack, so for 100000 classes and more, also raise
+ * the stack size (ulimit -s).
+ */
+int main( int argc, char *argv[] )
+{
+    const int n_samples   = argc > 1 ? atoi( argv[1] ) : 4000;
+    const int max_classes = argc > 2 ? atoi( argv[2] ) : 10000;
+    const int n_sampled   = argc > 3 ? atoi( argv[3] ) : 64;
+    const int batchsize   = argc > 4 ? atoi( argv[4] ) : 32;
+    const int n_input     = 64;
+    const int n_hidden    = 128;
+
+    srand( 42 );
+    float *X = malloc( (size_t) n_samples * n_input * sizeof(float));
+    float *Y = malloc( n_samples * sizeof(float));
+    assert( X && Y );
+    for( int i = 0; i < n_samples * n_input; i++ )
+        X[i] = 2.0f * (float) rand() / (float) RAND_MAX - 1.0f;
+
+    threadpool_t *pool = threadpool_new( omp_get_max_threads() );
+    assert( pool );
+    threadpool_set_default( pool );
+
+    printf("%d samples, network %d-%d-n_classes, batchsize %d, %d sampled, %d threads\n", n_samples, n_input,
+            n_hidden, batchsize, n_sampled, omp_get_max_threads() );
+    printf("%10s %-8s %14s %10s %9s\n", "n_classes", "softmax", "samples/sec", "loss", "speedup" );
+
+    for( int n_classes = 1000; n_classes <= max_classes; n_classes *= 10 ){
+        for( int i = 0; i < n_samples; i++ ){
+            unsigned int h = 0;
+            for( int j = 0; j < 8; j++ )
+                h = 2 * h + (X[i*n_input + j] > 0.0f);
+            Y[i] = (float) ((h * 2654435761u) % (unsigned int) n_classes);
+        }
+
+        double samples_per_sec[2];
+        for( int sampled = 0; sampled < 2; sampled++ ){
+            /* The same initial weights for both */
+            neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( n_input, n_hidden, n_classes ), STR_ARRAY( "relu", "softmax" ));
+            assert( nn );
+            srand( 7 );
+            neuralnet_initialize( nn, NULL );
+            if( sampled )
+                neuralnet_set_sampled_softmax( nn, SAMPLED_SOFTMAX_PROPERTIES( .n_sampled = n_sampled, .proposal = "uniform" ));
+            else
+                neuralnet_set_loss( nn, "sparse_categorical_crossentropy" );
+            metric_func *metrics = METRIC_LIST( get_metric_func( "sparse_categorical_crossentropy" ));
+            optimizer_t *opt = OPTIMIZER( SGD_new( nn, OPTIMIZER_PROPERTIES( .batchsize = batchsize, .progress = NULL,
+                            .metrics = metrics ), SGD_PROPERTIES( .learning_rate = 0.1f )));
+            assert( opt );
+
+            /* Only the training is timed, so the evaluation of the train set after the epoch is subtracted */
+            float loss;
+            const double start = omp_get_wtime();
+            optimizer_run_epoch( opt, n_samples, X, Y, 0, NULL, NULL, &loss );
+            const double trained = omp_get_wtime();
+            evaluate( nn, n_samples, X, Y, metrics, &loss );
+            const double seconds = 2.0 * trained - start - omp_get_wtime();
+
+            samples_per_sec[sampled] = (double) n_samples / seconds;
+            printf("%10d %-8s %14.0f %10.5f", n_classes, sampled ? "sampled" : "full", samples_per_sec[sampled], loss );
+            if( sampled )
+                printf(" %8.1fx", samples_per_sec[1] / samples_per_sec[0] );
+            printf("\n");
+            optimizer_free( opt );
+            neuralnet_free( nn );
+        }
+    }
+
+    threadpool_set_default( NULL );
+    threadpool_free( pool );
+    free( X );
+    free( Y );
+    return 0;
+}
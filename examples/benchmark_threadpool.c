@@ -0,0 +1,88 @@
+#include "neuralnet.h"
+
+#include "optimizer.h"
+#include "SGD.h"
+#include "adam.h"
+#include "threadpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <omp.h>
+
+/* Compares the training throughput with the OpenMP regions per batch, and with the persistent
+ * thread pool, for 1, 2, 4, ... threads. The default is a small network with small batches,
+ * where the cost of starting the threads for each batch matters the most. Usage:
+ *
+ *     ./benchmark_threadpool [n_samples] [n_hidden] [batchsize]
+ *
+ * Set OMP_NUM_THREADS to the number of cores.
+ */
+int main( int argc, char *argv[] )
+{
+    const int n_samples = argc > 1 ? atoi( argv[1] ) : 50000;
+    const int n_hidden  = argc > 2 ? atoi( argv[2] ) : 64;
+    const int batchsize = argc > 3 ? atoi( argv[3] ) : 32;
+    const int n_input   = 32;
+    const int n_output  = 4;
+    const int n_epochs  = 3;
+
+    srand( 42 );
+    float *X = malloc( (size_t) n_samples * n_input * sizeof(float));
+    float *Y = calloc( (size_t) n_samples * n_output, sizeof(float));
+    assert( X && Y );
+    for( int i = 0; i < n_samples; i++ ){
+        float sum = 0.0f;
+        for( int j = 0; j < n_input; j++ ){
+            X[i*n_input + j] = 2.0f * (float) rand() / (float) RAND_MAX - 1.0f;
+            sum += X[i*n_input + j] * (float) (j % 3);
+        }
+        Y[i*n_output + (sum > 1.0f) + (sum > 0.0f) + (sum > -1.0f)] = 1.0f;
+    }
+
+    printf("%d samples, network %d-%d-%d-%d, batchsize %d, %d epochs\n", n_samples, n_input, n_hidden, n_hidden,
+            n_output, batchsize, n_epochs );
+    printf("%-9s %-10s %7s %14s %10s\n", "optimizer", "threads", "count", "samples/sec", "loss" );
+
+    const int max_threads = omp_get_max_threads();
+    for( int which = 0; which < 2; which++ ){
+        for( int n_threads = 1; n_threads <= max_threads; n_threads *= 2 ){
+            for( int pooled = 0; pooled < 2; pooled++ ){
+                /* The same initial weights for all */
+                neuralnet_t *nn = neuralnet_create( 3, INT_ARRAY( n_input, n_hidden, n_hidden, n_output ),
+                        STR_ARRAY( "relu", "relu", "softmax" ));
+                assert( nn );
+                srand( 7 );
+                neuralnet_initialize( nn, NULL );
+                neuralnet_set_loss( nn, "categorical_crossentropy" );
+                const optimizer_properties_t props = OPTIMIZER_PROPERTIES( .batchsize = batchsize, .progress = NULL,
+                        .running_metrics = true, .metrics = METRIC_LIST( get_metric_func( "categorical_crossentropy" )));
+                optimizer_t *opt = which == 0 ?
+                    OPTIMIZER( SGD_new( nn, props, SGD_PROPERTIES( .learning_rate = 0.01f, .momentum = 0.9f ))) :
+                    OPTIMIZER( adam_new( nn, props, ADAM_PROPERTIES( .learning_rate = 0.001f )));
+                assert( opt );
+
+                omp_set_num_threads( n_threads );
+                threadpool_t *pool = pooled ? threadpool_new( n_threads ) : NULL;
+                threadpool_set_default( pool );
+
+                float results[1];
+                const double start = omp_get_wtime();
+                for( int epoch = 0; epoch < n_epochs; epoch++ )
+                    optimizer_run_epoch( opt, n_samples, X, Y, 0, NULL, NULL, results );
+                const double seconds = omp_get_wtime() - start;
+
+                printf("%-9s %-10s %7d %14.0f %10.5f\n", which == 0 ? "SGD" : "adam", pooled ? "pool" : "OpenMP",
+                        n_threads, (double) n_epochs * n_samples / seconds, results[0] );
+                threadpool_free( pool );
+                optimizer_free( opt );
+                neuralnet_free( nn );
+            }
+        }
+    }
+    omp_set_num_threads( max_threads );
+
+    free( X );
+    free( Y );
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include "npy_array.h"
+#include "npy_array_list.h"
+#include "neuralnet.h"
+#include "sparse_matrix.h"
+
+#include "optimizer.h"
+#include "adam.h"
+#include "loss.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+/* The mushroom dataset is one-hot encoded, so more than 90% of the input values
+ * are zero. This example converts the inputs to sparse (CSR) matrices and trains
+ * with optimizer_run_epoch_sparse(). The first layer then only gathers (forward)
+ * and scatters (backward) the rows of the weights that corresponds to the nonzero
+ * input features. With lazy updates, the optimizer only updates those rows too. */
+int main( int argc, char *argv[] )
+{
+    /* Read the datafile created in python+numpy */
+    npy_array_list_t *filelist = npy_array_list_load( "mushroom_train.npz" );
+    assert( filelist );
+
+    npy_array_list_t *iter = filelist;
+    npy_array_t *train_X = iter->array;  iter = iter->next;
+    npy_array_t *train_Y = iter->array;  iter = iter->next;
+    npy_array_t *test_X = iter->array;   iter = iter->next;
+    npy_array_t *test_Y = iter->array;
+
+    assert( train_X->fortran_order == false );
+    assert( test_X->fortran_order == false );
+
+    /* Convert the inputs to sparse matrices */
+    sparse_matrix_t *sparse_train_X = sparse_matrix_from_dense( train_X->shape[0], train_X->shape[1], (float*) train_X->data );
+    sparse_matrix_t *sparse_test_X  = sparse_matrix_from_dense( test_X->shape[0],  test_X->shape[1],  (float*) test_X->data );
+    assert( sparse_train_X && sparse_test_X );
+
+    printf("Train input: %ld x %ld with %u nonzeros (%.1f%% dense)%s\n",
+            train_X->shape[0], train_X->shape[1], sparse_matrix_nnz( sparse_train_X ),
+            100.0f * sparse_matrix_nnz( sparse_train_X ) / (float) (train_X->shape[0] * train_X->shape[1]),
+            sparse_train_X->values ? "" : " - all ones, only indices stored" );
+
+    /* Set up a new Neural Network */
+    neuralnet_t *nn = neuralnet_create( 3,
+            INT_ARRAY( train_X->shape[1], 64, 32, 1 ),
+            STR_ARRAY( "relu", "relu", "sigmoid" ) );
+    assert( nn );
+
+    neuralnet_initialize( nn, STR_ARRAY("kaiming", "kaiming", "kaiming"));
+    neuralnet_set_loss( nn, "binary_crossentropy" );
+
+    optimizer_t *adam = OPTIMIZER(
+         adam_new(
+             nn,
+             OPTIMIZER_PROPERTIES(
+                .batchsize = 16,
+                .metrics   = ((metric_func[]){ get_metric_func( get_loss_name( nn->loss ) ),
+                    get_metric_func( "binary_accuracy" ), NULL }),
+                .progress  = NULL,
+                .lazy      = true
+            ),
+            ADAM_PROPERTIES( .learning_rate = 0.001f )
+         )
+    );
+
+    int n_metrics = optimizer_get_n_metrics( adam );
+    float results[ 2 * n_metrics ];
+
+    for ( int epoch = 0; epoch < 5; epoch++ ){
+        optimizer_run_epoch_sparse( adam, sparse_train_X, (float*) train_Y->data,
+                                          sparse_test_X,  (float*) test_Y->data, results );
+        printf("Epoch %d ", epoch );
+        for ( int p = 0; p < 2 ; p++ )
+            for ( int i = 0; i < n_metrics; i++)
+                printf("%s%s: %5.5f ", p ? "val_" : "", get_metric_name( adam->metrics[i]), results[i + p*n_metrics ]  );
+        printf("\n");
+    }
+
+    /* Clean up the resources */
+    optimizer_free( adam );
+    neuralnet_free( nn );
+    sparse_matrix_free( sparse_train_X );
+    sparse_matrix_free( sparse_test_X );
+    npy_array_list_free( filelist );
+    return 0;
+}
@@ -244,6 +244,32 @@ int main(int argc, char *argv[]) {
                     )
                 );
 
+    if( !strcmp( optimizer, "LARS" ))
+        optim = OPTIMIZER(
+                LARS_new(
+                    nn,
+                    OPTIMIZER_PROPERTIES(
+                        .batchsize = batch_size,
+                        .shuffle   = true,
+                        .metrics   = metric_func_array,
+                        ),
+                    LARS_PROPERTIES( .learning_rate=learning_rate )
+                    )
+                );
+
+    if( !strcmp( optimizer, "LAMB" ))
+        optim = OPTIMIZER(
+                LAMB_new(
+                    nn,
+                    OPTIMIZER_PROPERTIES(
+                        .batchsize = batch_size,
+                        .shuffle   = true,
+                        .metrics   = metric_func_array,
+                        ),
+                    LAMB_PROPERTIES( .learning_rate=learning_rate )
+                    )
+                );
+
 
     int n_metrics = optimizer_get_n_metrics( optim );
 #if 0
@@ -0,0 +1,59 @@
+#include "neuralnet.h"
+#include "inference_server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+
+/* Serves the predictions of a neural network on a Unix domain socket, with dynamic batching of the
+ * requests. See inference_server.h for the protocol, and inference_loadgen.c for a client. Usage:
+ *
+ *     ./inference_daemon model.npz /tmp/neuralnet.sock [max_batch] [max_latency_us] [n_workers]
+ *
+ * Stop it with Ctrl-C (or SIGTERM), and it prints how the requests were batched.
+ */
+
+static inference_server_t *server = NULL;
+
+static void handle_signal( int sig )
+{
+    if( server )
+        inference_server_stop( server );
+}
+
+int main( int argc, char *argv[] )
+{
+    if( argc < 3 ){
+        fprintf( stderr, "Usage: %s model.npz socket_path [max_batch] [max_latency_us] [n_workers]\n", argv[0] );
+        return 1;
+    }
+    neuralnet_t *nn = neuralnet_load( argv[1] );
+    if( !nn ){
+        fprintf( stderr, "Cannot load the neural network '%s'.\n", argv[1] );
+        return 1;
+    }
+
+    server = inference_server_new( nn, argv[2], INFERENCE_SERVER_PROPERTIES(
+                .max_batch      = argc > 3 ? atoi( argv[3] ) : 64,
+                .max_latency_us = argc > 4 ? atoi( argv[4] ) : 1000,
+                .n_workers      = argc > 5 ? atoi( argv[5] ) : 2 ));
+    if( !server ){
+        neuralnet_free( nn );
+        return 1;
+    }
+    signal( SIGINT, handle_signal );
+    signal( SIGTERM, handle_signal );
+
+    printf("Serving '%s' on '%s'\n", argv[1], argv[2] );
+    const int ret = inference_server_run( server );
+
+    inference_server_stats_t stats;
+    inference_server_stats( server, &stats );
+    printf("%llu requests, %llu samples in %llu batches (%.1f samples per batch), %llu rejected\n",
+            stats.n_requests, stats.n_samples, stats.n_batches,
+            stats.n_batches ? (double) stats.n_samples / stats.n_batches : 0.0, stats.n_rejected );
+
+    inference_server_free( server );
+    neuralnet_free( nn );
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,151 @@
+#define _POSIX_C_SOURCE 200112L  /* clock_gettime() */
+#include "inference_server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Load generator for the inference server (see inference_daemon.c). Each client thread has its own
+ * connection and sends one request at a time, and the next one as soon as the answer is back. The
+ * number of clients is doubled from 1 up to max_clients, and for each it prints the throughput and
+ * the latency percentiles, which shows the latency cost of the batching as the load increases. Usage:
+ *
+ *     ./inference_loadgen /tmp/neuralnet.sock [seconds] [max_clients] [samples_per_request]
+ */
+
+typedef struct {
+    const char *path;
+    int         n_samples;
+    double      stop_time;
+    double     *latency;     /* In seconds */
+    int         n_latency;
+    int         size;
+    int         n_errors;
+} client_job_t;
+
+static double now_seconds( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (double) ts.tv_sec + 1.0e-9 * (double) ts.tv_nsec;
+}
+
+static int compare_double( const void *a, const void *b )
+{
+    const double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void *client_thread( void *arg )
+{
+    client_job_t *job = (client_job_t *) arg;
+    inference_client_t *client = inference_client_connect( job->path );
+    if( !client ){
+        job->n_errors++;
+        return NULL;
+    }
+    const int n_input  = inference_client_n_input( client );
+    const int n_output = inference_client_n_output( client );
+    float *input  = malloc( job->n_samples * n_input * sizeof(float));
+    float *output = malloc( job->n_samples * n_output * sizeof(float));
+    if( !input || !output ){
+        job->n_errors++;
+        free( input );
+        free( output );
+        inference_client_free( client );
+        return NULL;
+    }
+    unsigned int seed = (unsigned int) (size_t) job;
+    for( int i = 0; i < job->n_samples * n_input; i++ )
+        input[i] = (float) (rand_r( &seed ) % 1000) / 1000.0f;
+
+    for(;;){
+        const double start = now_seconds();
+        if( start >= job->stop_time )
+            break;
+        if( inference_client_predict( client, job->n_samples, input, output ) < 0 ){
+            job->n_errors++;
+            break;
+        }
+        if( job->n_latency == job->size ){
+            job->size = job->size ? 2 * job->size : 4096;
+            double *latency = realloc( job->latency, job->size * sizeof(double));
+            if( !latency ){
+                job->n_errors++;
+                break;
+            }
+            job->latency = latency;
+        }
+        job->latency[job->n_latency++] = now_seconds() - start;
+    }
+    free( input );
+    free( output );
+    inference_client_free( client );
+    return NULL;
+}
+
+int main( int argc, char *argv[] )
+{
+    if( argc < 2 ){
+        fprintf( stderr, "Usage: %s socket_path [seconds] [max_clients] [samples_per_request]\n", argv[0] );
+        return 1;
+    }
+    const char *path      = argv[1];
+    const double seconds  = argc > 2 ? atof( argv[2] ) : 2.0;
+    const int max_clients = argc > 3 ? atoi( argv[3] ) : 64;
+    const int n_samples   = argc > 4 ? atoi( argv[4] ) : 1;
+
+    printf("%8s %14s %14s %10s %10s %10s\n", "clients", "requests/s", "samples/s", "p50 (us)", "p99 (us)", "p99.9 (us)" );
+    for( int n_clients = 1; n_clients <= max_clients; n_clients *= 2 ){
+        client_job_t *job = calloc( n_clients, sizeof(client_job_t));
+        pthread_t *thread = malloc( n_clients * sizeof(pthread_t));
+        if( !job || !thread ){
+            fprintf( stderr, "Cannot allocate the clients.\n");
+            return 1;
+        }
+        const double start = now_seconds();
+        for( int c = 0; c < n_clients; c++ ){
+            job[c] = (client_job_t) { .path = path, .n_samples = n_samples, .stop_time = start + seconds };
+            if( pthread_create( &thread[c], NULL, client_thread, &job[c] ) != 0 ){
+                fprintf( stderr, "Cannot start the clients.\n");
+                return 1;
+            }
+        }
+        int n_total = 0, n_errors = 0;
+        for( int c = 0; c < n_clients; c++ ){
+            pthread_join( thread[c], NULL );
+            n_total  += job[c].n_latency;
+            n_errors += job[c].n_errors;
+        }
+        const double elapsed = now_seconds() - start;
+
+        double *latency = malloc(( n_total + 1 ) * sizeof(double));
+        if( !latency ){
+            fprintf( stderr, "Cannot allocate the latencies.\n");
+            return 1;
+        }
+        int n = 0;
+        for( int c = 0; c < n_clients; c++ ){
+            if( job[c].n_latency )
+                memcpy( latency + n, job[c].latency, job[c].n_latency * sizeof(double));
+            n += job[c].n_latency;
+            free( job[c].latency );
+        }
+        qsort( latency, n_total, sizeof(double), compare_double );
+        if( n_total > 0 ){
+            printf("%8d %14.0f %14.0f %10.1f %10.1f %10.1f\n", n_clients, n_total / elapsed, n_total * n_samples / elapsed,
+                    1.0e6 * latency[n_total / 2], 1.0e6 * latency[(int) (0.99 * (n_total - 1))],
+                    1.0e6 * latency[(int) (0.999 * (n_total - 1))] );
+        }
+        if( n_errors )
+            printf("%d clients failed.\n", n_errors );
+        free( latency );
+        free( job );
+        free( thread );
+        if( n_errors )
+            return 1;
+    }
+    return 0;
+}
@@ -35,6 +35,7 @@ OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
 IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#define _DEFAULT_SOURCE   /* MAP_POPULATE and madvise() with -std=c99 */
 #include "npy_array.h"
 
 #include <stdio.h>
@@ -303,6 +304,22 @@ static int64_t read_mapped( void *map, void *buffer, uint64_t nbytes )
 }
 
 npy_array_t * npy_array_mmap( const char *filename )
+{
+    return npy_array_mmap_flags( filename, 0 );
+}
+
+/* Like npy_array_mmap(), with some hints to the OS about how the array is used:
+ *
+ *   NPY_ARRAY_MMAP_POPULATE: Read the whole file into the page cache at once (MAP_POPULATE), such
+ *                            that there are no page faults when the array is read later.
+ *   NPY_ARRAY_MMAP_HUGEPAGE: Ask for transparent huge pages (MADV_HUGEPAGE). For random access
+ *                            into a large array, this saves many TLB misses. For files, this needs
+ *                            a kernel with CONFIG_READ_ONLY_THP_FOR_FS. Files on a hugetlbfs mount
+ *                            are always mapped with huge pages.
+ *   NPY_ARRAY_MMAP_RANDOM:   The array is read in random order, so don't read ahead (MADV_RANDOM).
+ *
+ * The hints that are not supported by the system are ignored. */
+npy_array_t * npy_array_mmap_flags( const char *filename, const int flags )
 {
     int fd = -1;
     if( (fd = open( filename, O_RDONLY  )) == -1 ){
@@ -312,12 +329,23 @@ npy_array_t * npy_array_mmap( const char *filename )
 
     off_t len = lseek( fd, 0, SEEK_END );
 
-    char *data = mmap( 0, len, PROT_READ,MAP_SHARED, fd, 0);
+    int map_flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if( flags & NPY_ARRAY_MMAP_POPULATE )
+        map_flags |= MAP_POPULATE;
+#endif
+    char *data = mmap( 0, len, PROT_READ, map_flags, fd, 0);
     close( fd );
     if( data == MAP_FAILED ){
         perror("mmap failed!");
         return NULL;
     }
+#ifdef MADV_HUGEPAGE
+    if( flags & NPY_ARRAY_MMAP_HUGEPAGE )
+        madvise( data, len, MADV_HUGEPAGE );
+#endif
+    if( flags & NPY_ARRAY_MMAP_RANDOM )
+        madvise( data, len, MADV_RANDOM );
 
     map_handler_t mh = { .start_pos = (char*) data, .current_pos = (char*) data, .length = len };
 
@@ -329,6 +357,31 @@ npy_array_t * npy_array_mmap( const char *filename )
     return m;
 }
 
+/* Reads an array from a buffer that is already in memory, like a file that is mmap()'ed by the
+ * caller. The returned array points into the buffer and does not own it, so the buffer must stay
+ * alive (and mapped) until the array is freed. npy_array_free() frees only the array structure. */
+npy_array_t * npy_array_view( const char *buffer, const size_t length )
+{
+    if( length < NPY_ARRAY_PREHEADER_LENGTH ){
+        fprintf(stderr, "Buffer too small for a numpy array.\n");
+        return NULL;
+    }
+    map_handler_t mh = { .start_pos = (char*) buffer, .current_pos = (char*) buffer, .length = length };
+
+    npy_array_t *m = _read_matrix( &mh, &read_mapped);
+    if( !m ){
+        fprintf(stderr, "Cannot read matrix.\n");
+        return NULL;
+    }
+    if( npy_array_calculate_datasize( m ) > length - (size_t) (mh.current_pos - mh.start_pos) ){
+        fprintf(stderr, "Buffer too small for the matrix data.\n");
+        free( m );
+        return NULL;
+    }
+    m->map_addr = NULL;
+    return m;
+}
+
 void npy_array_dump( const npy_array_t *m )
 {
     if(!m){
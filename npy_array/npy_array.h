@@ -45,6 +45,11 @@ IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define NPY_ARRAY_MAX_DIMENSIONS 8
 
+/* Flags for npy_array_mmap_flags() */
+#define NPY_ARRAY_MMAP_POPULATE  0x01
+#define NPY_ARRAY_MMAP_HUGEPAGE  0x02
+#define NPY_ARRAY_MMAP_RANDOM    0x04
+
 typedef struct _npy_array_t {
     char             *data;
     size_t            shape[ NPY_ARRAY_MAX_DIMENSIONS ];
@@ -61,6 +66,8 @@ typedef struct _npy_array_t {
 
 npy_array_t*      npy_array_load       ( const char *filename );
 npy_array_t*      npy_array_mmap       ( const char *filename );
+npy_array_t*      npy_array_mmap_flags ( const char *filename, const int flags );
+npy_array_t*      npy_array_view       ( const char *buffer, const size_t length );
 npy_array_t*      npy_array_deepcopy   ( const npy_array_t *m );
 npy_array_t*      npy_array_copy       ( const npy_array_t *m );
 void              npy_array_dump       ( const npy_array_t *m );
@@ -228,6 +228,82 @@ npy_array_list_t * npy_array_list_load( const char *filename )
     return list;
 }
 
+/* Little endian fields of the zip headers */
+static inline uint64_t _zip_uint( const unsigned char *p, const int nbytes )
+{
+    uint64_t value = 0;
+    for( int i = nbytes - 1; i >= 0; i-- )
+        value = (value << 8) | p[i];
+    return value;
+}
+
+#define ZIP_LOCAL_HEADER_SIGNATURE 0x04034b50
+#define ZIP_LOCAL_HEADER_LENGTH    30
+#define ZIP_ZIP64_EXTRA_ID         0x0001
+
+/* Reads the arrays of a .npz file that is already in memory, typically mmap()'ed by the caller,
+ * without copying the data. The arrays point into the buffer (see npy_array_view()), so the buffer
+ * must stay alive until the list is freed.
+ *
+ * This is only possible when the arrays are stored uncompressed in the archive, which is what
+ * npy_array_list_save() and numpy.savez() write. If an entry is compressed (numpy.savez_compressed()
+ * and npy_array_list_save_compressed()), NULL is returned and the file has to be read with
+ * npy_array_list_load() instead. */
+npy_array_list_t * npy_array_list_view( const char *buffer, const size_t length )
+{
+    const unsigned char *p   = (const unsigned char *) buffer;
+    const unsigned char *end = p + length;
+
+    npy_array_list_t *list = NULL;
+    while( end - p >= ZIP_LOCAL_HEADER_LENGTH && _zip_uint( p, 4 ) == ZIP_LOCAL_HEADER_SIGNATURE ){
+        const unsigned int flags     = (unsigned int) _zip_uint( p + 6, 2 );
+        const unsigned int method    = (unsigned int) _zip_uint( p + 8, 2 );
+        uint64_t           comp_size = _zip_uint( p + 18, 4 );
+        const size_t       name_len  = (size_t) _zip_uint( p + 26, 2 );
+        const size_t       extra_len = (size_t) _zip_uint( p + 28, 2 );
+        if( (size_t) (end - p) - ZIP_LOCAL_HEADER_LENGTH < name_len + extra_len ) goto truncated;
+        const unsigned char *name    = p + ZIP_LOCAL_HEADER_LENGTH;
+        const unsigned char *extra   = name + name_len;
+        const unsigned char *data    = extra + extra_len;
+
+        if( method != ZIP_CM_STORE || (flags & 0x08) ){
+            /* Compressed, or the sizes are in a data descriptor after the data. */
+            npy_array_list_free( list );
+            return NULL;
+        }
+
+        /* Zip64: The 32 bit sizes are 0xFFFFFFFF and the real sizes are in an extra field. */
+        if( comp_size == 0xFFFFFFFF ){
+            const unsigned char *e = extra;
+            while( e + 4 <= data ){
+                const unsigned int id   = (unsigned int) _zip_uint( e, 2 );
+                const size_t       size = (size_t) _zip_uint( e + 2, 2 );
+                if( e + 4 + size > data ) goto truncated;
+                if( id == ZIP_ZIP64_EXTRA_ID && size >= 16 ){
+                    comp_size = _zip_uint( e + 12, 8 );  /* After the uncompressed size */
+                    break;
+                }
+                e += 4 + size;
+            }
+        }
+        if( comp_size > (uint64_t) (end - data) ) goto truncated;
+
+        npy_array_t *arr = npy_array_view( (const char *) data, (size_t) comp_size );
+        if( !arr ){
+            fprintf(stderr, "Warning: Cannot read matrix.\n");
+        } else {
+            list = npy_array_list_append( list, arr, "%.*s", (int) name_len, (const char *) name );
+        }
+        p = data + comp_size;
+    }
+    return list;
+
+truncated:
+    fprintf(stderr, "Zip archive is truncated.\n");
+    npy_array_list_free( list );
+    return NULL;
+}
+
 size_t npy_array_list_length( npy_array_list_t *arr)
 {
     if (!arr) return 0;
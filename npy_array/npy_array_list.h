@@ -48,6 +48,7 @@ typedef struct _npy_array_list_t {
 } npy_array_list_t;
 
 npy_array_list_t* npy_array_list_load           ( const char *filename );
+npy_array_list_t* npy_array_list_view           ( const char *buffer, const size_t length );
 int               npy_array_list_save           ( const char *filename, npy_array_list_t *array_list );
 int               npy_array_list_save_compressed( const char *filename, npy_array_list_t *array_list,
                                                   zip_int32_t comp, zip_uint32_t comp_flags);
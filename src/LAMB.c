@@ -0,0 +1,216 @@
+#include "LAMB.h"
+
+#include "simd.h" 
+#include "threadpool.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#ifdef __AVX__ 
+#include <immintrin.h>
+#endif
+
+#include <omp.h>
+
+/*  LAMB.c  */
+struct _LAMB_t 
+{
+    optimizer_t opt;
+    /* Other data */
+    float learning_rate;
+    float beta_1;
+    float beta_2;
+    float epsilon;
+    float weight_decay;
+    unsigned int warmup;
+
+    /* private stuff - don't touch! */
+    unsigned int n_iterations;
+    float *s;
+    float *r;
+    float beta_1_corrected;   /* beta_1^t and beta_2^t after t updates */
+    float beta_2_corrected;
+};
+
+static void LAMB_optimizer_init( LAMB_t *lamb, lamb_properties_t *properties )
+{
+    lamb_properties_t *props = (lamb_properties_t*) properties;
+
+    lamb->n_iterations = 0;
+
+    lamb->learning_rate = props->learning_rate;
+    lamb->beta_1 = props->beta_1;
+    lamb->beta_2 = props->beta_2;
+    lamb->epsilon = props->epsilon;
+    lamb->weight_decay = props->weight_decay;
+    lamb->warmup = props->warmup;
+
+    /* The trust ratios need the whole gradient, so the updates are never lazy */
+    OPTIMIZER(lamb)->lazy = false;
+    lamb->beta_1_corrected = 1.0f;
+    lamb->beta_2_corrected = 1.0f;
+
+    const unsigned int n_param = neuralnet_total_n_parameters( OPTIMIZER(lamb)->nn );
+
+    lamb->s = simd_malloc_huge( n_param * sizeof(float) );
+    lamb->r = simd_malloc_huge( n_param * sizeof(float) );
+    assert( lamb->s );
+    assert( lamb->r );
+    memset( lamb->s, 0, n_param * sizeof(float));
+    memset( lamb->r, 0, n_param * sizeof(float));
+}
+
+static void LAMB_optimizer_free( optimizer_t *opt )
+{
+    if( !opt ) return;
+    simd_free_huge( LAMB_OPTIMIZER(opt)->s );
+    simd_free_huge( LAMB_OPTIMIZER(opt)->r );
+}
+
+OPTIMIZER_DEFINE(LAMB, 
+    LAMB_optimizer_init( newopt, properties );
+    newopt->opt.free = LAMB_optimizer_free;
+);
+
+/* The moments are updated, and the gradient is replaced by the direction of the update:
+ * m_hat / (sqrt(v_hat) + epsilon) + weight_decay * w, where s_scale = 1 / (1 - beta_1^t) and
+ * r_scale = 1 / (1 - beta_2^t) are the bias corrections. */
+static void lamb_direction( const LAMB_t *lamb, const int n, float *s, float *r, float *g, const float *w,
+        const float weight_decay, const float s_scale, const float r_scale )
+{
+    const float beta_1 = lamb->beta_1;
+    const float beta_2 = lamb->beta_2;
+    const float epsilon = lamb->epsilon;
+    int i = 0;
+#ifdef __AVX__
+    const __m256 beta_1_v = _mm256_set1_ps( beta_1 );
+    const __m256 one_minus_beta_1_v = _mm256_set1_ps( 1.0f - beta_1 );
+    const __m256 beta_2_v = _mm256_set1_ps( beta_2 );
+    const __m256 one_minus_beta_2_v = _mm256_set1_ps( 1.0f - beta_2 );
+    const __m256 s_scale_v = _mm256_set1_ps( s_scale );
+    const __m256 r_scale_v = _mm256_set1_ps( r_scale );
+    const __m256 eps_v = _mm256_set1_ps( epsilon );
+    const __m256 weight_decay_v = _mm256_set1_ps( weight_decay );
+    for( ; i <= n - 8; i += 8 ){
+        const __m256 gv = _mm256_loadu_ps( g + i );
+        const __m256 sv = _mm256_add_ps( _mm256_mul_ps( _mm256_loadu_ps( s + i ), beta_1_v ),
+                _mm256_mul_ps( gv, one_minus_beta_1_v ));
+        const __m256 rv = _mm256_add_ps( _mm256_mul_ps( _mm256_loadu_ps( r + i ), beta_2_v ),
+                _mm256_mul_ps( _mm256_mul_ps( gv, gv ), one_minus_beta_2_v ));
+        _mm256_storeu_ps( s + i, sv );
+        _mm256_storeu_ps( r + i, rv );
+        const __m256 direction = _mm256_div_ps( _mm256_mul_ps( sv, s_scale_v ),
+                _mm256_add_ps( _mm256_sqrt_ps( _mm256_mul_ps( rv, r_scale_v )), eps_v ));
+        _mm256_storeu_ps( g + i, _mm256_add_ps( direction, _mm256_mul_ps( weight_decay_v, _mm256_loadu_ps( w + i ))));
+    }
+#endif
+    for( ; i < n; i++ ){
+        s[i] = beta_1 * s[i] + (1.0f - beta_1) * g[i];
+        r[i] = beta_2 * r[i] + (1.0f - beta_2) * g[i] * g[i];
+        g[i] = s_scale * s[i] / (sqrtf( r_scale * r[i] ) + epsilon) + weight_decay * w[i];
+    }
+}
+
+static void scale_unaligned( const int n, float *g, const float alpha )
+{
+    for( int i = 0; i < n; i++ )
+        g[i] *= alpha;
+}
+
+/* Both passes are split over the threads, the biases and the weights of each layer separately.
+ * The first pass (rates == NULL) computes the directions, and the second one scales them by the
+ * negative learning rate of the biases and of the weights of each layer. */
+typedef struct {
+    LAMB_t *lamb;
+    float *g;
+    float s_scale;
+    float r_scale;
+    float learning_rate;
+    const float *rates;     /* Of the weights of each layer */
+} LAMB_job_t;
+
+static void LAMB_update_layers( const LAMB_job_t *job, const int thread, const int n_threads )
+{
+    LAMB_t *lamb = job->lamb;
+    const neuralnet_t *nn = OPTIMIZER(lamb)->nn;
+    unsigned int offset = 0;
+    for( int l = 0; l < nn->n_layers; l++ ){
+        const unsigned int n_bias = nn->layer[l].n_output;
+        const unsigned int n_weight = nn->layer[l].n_input * n_bias;
+        unsigned int first, last;
+        threadpool_split( n_bias, thread, n_threads, &first, &last );
+        if( !job->rates )
+            lamb_direction( lamb, last - first, lamb->s + offset + first, lamb->r + offset + first,
+                    job->g + offset + first, nn->layer[l].bias + first, 0.0f, job->s_scale, job->r_scale );
+        else
+            scale_unaligned( last - first, job->g + offset + first, -job->learning_rate );
+        offset += n_bias;
+        threadpool_split( n_weight, thread, n_threads, &first, &last );
+        if( !job->rates )
+            lamb_direction( lamb, last - first, lamb->s + offset + first, lamb->r + offset + first,
+                    job->g + offset + first, nn->layer[l].weight + first, lamb->weight_decay, job->s_scale, job->r_scale );
+        else
+            scale_unaligned( last - first, job->g + offset + first, -job->rates[l] );
+        offset += n_weight;
+    }
+}
+
+static void LAMB_update_job( threadpool_t *pool, void *arg, const int thread, const int n_threads )
+{
+    LAMB_update_layers( (const LAMB_job_t *) arg, thread, n_threads );
+    (void) pool;
+}
+
+static void LAMB_run_layers( LAMB_job_t *job )
+{
+    if( threadpool_run( threadpool_default(), LAMB_update_job, job ) < 0 ){
+        #pragma omp parallel
+        LAMB_update_layers( job, omp_get_thread_num(), omp_get_num_threads() );
+    }
+}
+
+/* Layer-wise Adaptive Moments for Batch training */
+void LAMB_run_epoch( optimizer_t *opt,
+        const unsigned int n_train_samples, const float *train_X, const float *train_Y )
+{
+    LAMB_t *lamb = LAMB_OPTIMIZER( opt );
+    neuralnet_t *nn = opt->nn;
+    const unsigned int n_parameters = neuralnet_total_n_parameters( nn );
+    const int n_layers = nn->n_layers;
+
+    for ( unsigned int i = 0; i < n_train_samples ;  ){
+
+        float SIMD_ALIGN(g[n_parameters]);
+        optimizer_calc_batch_gradient( opt, n_train_samples, train_X, train_Y, &i, g );
+        if( opt->failed ) break;
+        if(opt->progress) opt->progress( i, n_train_samples, "Train: " );
+
+        /* Learning rate warmup */
+        float learning_rate = lamb->learning_rate;
+        if( lamb->n_iterations < lamb->warmup )
+            learning_rate *= (float) (lamb->n_iterations + 1) / (float) lamb->warmup;
+        lamb->n_iterations++;
+
+        const float beta_1_corrected = lamb->beta_1_corrected *= lamb->beta_1;
+        const float beta_2_corrected = lamb->beta_2_corrected *= lamb->beta_2;
+        LAMB_job_t job = { .lamb = lamb, .g = g, .s_scale = 1.0f / (1.0f - beta_1_corrected),
+            .r_scale = 1.0f / (1.0f - beta_2_corrected), .learning_rate = learning_rate, .rates = NULL };
+        LAMB_run_layers( &job );
+
+        /* The trust ratio of each layer */
+        float weight_norms[n_layers], update_norms[n_layers], rates[n_layers];
+        optimizer_layer_norms( opt, NULL, weight_norms );
+        optimizer_layer_norms( opt, g, update_norms );
+        for( int l = 0; l < n_layers; l++ ){
+            rates[l] = learning_rate;
+            if( weight_norms[l] > 0.0f && update_norms[l] > 0.0f )
+                rates[l] *= weight_norms[l] / update_norms[l];
+        }
+        job.rates = rates;
+        LAMB_run_layers( &job );
+
+        neuralnet_update( nn, g );
+    }
+}
@@ -0,0 +1,24 @@
+/* This is the implementation of the abstract optimizer type */
+#include "optimizer.h"
+
+/* ---- Layer-wise Adaptive Moments for Batch training (LAMB), You et al. (2019) ---- */
+/* Adam with decoupled weight decay for large batches. The update of the weights of each layer,
+ * r = m_hat / (sqrt(v_hat) + epsilon) + weight_decay * w, is scaled by the trust ratio ||w|| / ||r||,
+ * such that the size of the update follows the size of the weights in all the layers. The biases
+ * are not scaled and not decayed. The learning rate increases linearly over the first `warmup`
+ * batches. */
+OPTIMIZER_DECLARE(LAMB);
+#define LAMB_OPTIMIZER(v) ((LAMB_t*)(v))
+
+typedef struct _lamb_properties_t {
+    float learning_rate;
+    float beta_1;
+    float beta_2;
+    float epsilon;
+    float weight_decay;
+    unsigned int warmup;      /* Number of batches */
+} lamb_properties_t;
+#define LAMB_PROPERTIES(...) \
+    &((lamb_properties_t)  \
+            { .learning_rate = 0.001f, .beta_1 = 0.9f, .beta_2 = 0.999f, .epsilon = 1.0e-6f, \
+              .weight_decay = 0.01f, .warmup = 0, __VA_ARGS__ })
@@ -0,0 +1,169 @@
+#include "LARS.h"
+
+#include "simd.h" 
+#include "threadpool.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef __AVX__ 
+#include <immintrin.h>
+#endif
+
+#include <omp.h>
+
+/*  LARS.c  */
+struct _LARS_t 
+{
+    optimizer_t opt;
+    /* Other data */
+    float learning_rate;
+    float momentum;
+    float weight_decay;
+    float trust_coefficient;
+    unsigned int warmup;
+
+    /* private stuff - don't touch! */
+    unsigned int n_iterations;
+    float *velocity;
+};
+
+static void LARS_optimizer_init( LARS_t *lars, lars_properties_t *properties )
+{
+    lars_properties_t *props = (lars_properties_t*) properties;
+
+    lars->n_iterations = 0;
+
+    lars->learning_rate = props->learning_rate;
+    lars->momentum = props->momentum;
+    lars->weight_decay = props->weight_decay;
+    lars->trust_coefficient = props->trust_coefficient;
+    lars->warmup = props->warmup;
+
+    /* The trust ratios need the whole gradient, so the updates are never lazy */
+    OPTIMIZER(lars)->lazy = false;
+
+    const unsigned int n_param = neuralnet_total_n_parameters( OPTIMIZER(lars)->nn );
+
+    lars->velocity = simd_malloc_huge( n_param * sizeof(float) );
+    assert( lars->velocity );
+    memset( lars->velocity, 0, n_param * sizeof(float));
+}
+
+static void LARS_optimizer_free( optimizer_t *opt )
+{
+    if( !opt ) return;
+    simd_free_huge( LARS_OPTIMIZER(opt)->velocity );
+}
+
+OPTIMIZER_DEFINE(LARS, 
+    LARS_optimizer_init( newopt, properties );
+    newopt->opt.free = LARS_optimizer_free;
+);
+
+/* v = momentum * v + rate * (g + weight_decay * w), and the gradient is replaced by the update, -v */
+static void momentum_update( const int n, float *v, float *g, const float *w, const float rate,
+        const float weight_decay, const float momentum )
+{
+    int i = 0;
+#ifdef __AVX__
+    const __m256 rate_v = _mm256_set1_ps( rate );
+    const __m256 weight_decay_v = _mm256_set1_ps( weight_decay );
+    const __m256 momentum_v = _mm256_set1_ps( momentum );
+    const __m256 zero = _mm256_setzero_ps();
+    for( ; i <= n - 8; i += 8 ){
+        const __m256 step = _mm256_mul_ps( rate_v,
+                _mm256_add_ps( _mm256_loadu_ps( g + i ), _mm256_mul_ps( weight_decay_v, _mm256_loadu_ps( w + i ))));
+        const __m256 vv = _mm256_add_ps( _mm256_mul_ps( momentum_v, _mm256_loadu_ps( v + i )), step );
+        _mm256_storeu_ps( v + i, vv );
+        _mm256_storeu_ps( g + i, _mm256_sub_ps( zero, vv ));
+    }
+#endif
+    for( ; i < n; i++ ){
+        v[i] = momentum * v[i] + rate * (g[i] + weight_decay * w[i]);
+        g[i] = -v[i];
+    }
+}
+
+/* The update of each layer is split over the threads: The biases with the learning rate, and the
+ * weights with the learning rate of the layer. */
+typedef struct {
+    LARS_t *lars;
+    float *g;
+    float learning_rate;
+    const float *rates;     /* Of the weights of each layer */
+} LARS_job_t;
+
+static void LARS_update_layers( const LARS_job_t *job, const int thread, const int n_threads )
+{
+    LARS_t *lars = job->lars;
+    const neuralnet_t *nn = OPTIMIZER(lars)->nn;
+    unsigned int offset = 0;
+    for( int l = 0; l < nn->n_layers; l++ ){
+        const unsigned int n_bias = nn->layer[l].n_output;
+        const unsigned int n_weight = nn->layer[l].n_input * n_bias;
+        unsigned int first, last;
+        threadpool_split( n_bias, thread, n_threads, &first, &last );
+        momentum_update( last - first, lars->velocity + offset + first, job->g + offset + first,
+                nn->layer[l].bias + first, job->learning_rate, 0.0f, lars->momentum );
+        offset += n_bias;
+        threadpool_split( n_weight, thread, n_threads, &first, &last );
+        momentum_update( last - first, lars->velocity + offset + first, job->g + offset + first,
+                nn->layer[l].weight + first, job->rates[l], lars->weight_decay, lars->momentum );
+        offset += n_weight;
+    }
+}
+
+static void LARS_update_job( threadpool_t *pool, void *arg, const int thread, const int n_threads )
+{
+    LARS_update_layers( (const LARS_job_t *) arg, thread, n_threads );
+    (void) pool;
+}
+
+/* Layer-wise Adaptive Rate Scaling */
+void LARS_run_epoch( optimizer_t *opt,
+        const unsigned int n_train_samples, const float *train_X, const float *train_Y )
+{
+    LARS_t *lars = LARS_OPTIMIZER( opt );
+    neuralnet_t *nn = opt->nn;
+    const unsigned int n_parameters = neuralnet_total_n_parameters( nn );
+    const int n_layers = nn->n_layers;
+
+    for ( unsigned int i = 0; i < n_train_samples ;  ){
+
+        /* Calculate batch gradient */
+        float SIMD_ALIGN(batchgrad[n_parameters]);
+        optimizer_calc_batch_gradient( opt, n_train_samples, train_X, train_Y, &i, batchgrad );
+        if( opt->failed ) break;
+
+        /* Progress callback */
+        if( opt->progress) opt->progress( i, n_train_samples, "Train: " );
+
+        /* Learning rate warmup */
+        float learning_rate = lars->learning_rate;
+        if( lars->n_iterations < lars->warmup )
+            learning_rate *= (float) (lars->n_iterations + 1) / (float) lars->warmup;
+        lars->n_iterations++;
+
+        /* The local learning rate of each layer */
+        float weight_norms[n_layers], grad_norms[n_layers], rates[n_layers];
+        optimizer_layer_norms( opt, NULL, weight_norms );
+        optimizer_layer_norms( opt, batchgrad, grad_norms );
+        for( int l = 0; l < n_layers; l++ ){
+            rates[l] = learning_rate;
+            if( weight_norms[l] > 0.0f && grad_norms[l] > 0.0f )
+                rates[l] *= lars->trust_coefficient * weight_norms[l] /
+                    (grad_norms[l] + lars->weight_decay * weight_norms[l]);
+        }
+
+        LARS_job_t job = { .lars = lars, .g = batchgrad, .learning_rate = learning_rate, .rates = rates };
+        if( threadpool_run( threadpool_default(), LARS_update_job, &job ) < 0 ){
+            #pragma omp parallel
+            LARS_update_layers( &job, omp_get_thread_num(), omp_get_num_threads() );
+        }
+
+        /* Apply update */
+        neuralnet_update( nn, batchgrad );
+    }
+}
@@ -0,0 +1,22 @@
+/* This is the implementation of the abstract optimizer type */
+#include "optimizer.h"
+
+/* ---- Layer-wise Adaptive Rate Scaling (LARS), You, Gitman and Ginsburg (2017) ---- */
+/* SGD with momentum for large batches. The learning rate of the weights of each layer is scaled by
+ * the trust ratio  trust_coefficient * ||w|| / (||g|| + weight_decay * ||w||),  such that the size
+ * of the update follows the size of the weights in all the layers. The biases are not scaled and
+ * not decayed. The learning rate increases linearly over the first `warmup` batches. */
+OPTIMIZER_DECLARE(LARS);
+#define LARS_OPTIMIZER(v) ((LARS_t*)(v))
+
+typedef struct _lars_properties_t {
+    float learning_rate;
+    float momentum;
+    float weight_decay;
+    float trust_coefficient;
+    unsigned int warmup;      /* Number of batches */
+} lars_properties_t;
+#define LARS_PROPERTIES(...) \
+    &((lars_properties_t)  \
+            { .learning_rate = 0.1f, .momentum = 0.9f, .weight_decay = 5.0e-4f, .trust_coefficient = 0.001f, \
+              .warmup = 0, __VA_ARGS__ })
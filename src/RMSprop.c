@@ -41,13 +41,17 @@ static void RMSprop_optimizer_init( RMSprop_t *rmsprop, rmsprop_properties_t *pr
     rmsprop->decay = props->decay;
     rmsprop->rho = props->rho;
 
+    /* Lazy updates are not done with momentum, as the velocity moves all the weights */
+    if( rmsprop->momentum > 0.0f )
+        OPTIMIZER(rmsprop)->lazy = false;
+
     const unsigned int n_param = neuralnet_total_n_parameters( OPTIMIZER(rmsprop)->nn );
 
-    rmsprop->velocity   = simd_malloc( n_param * sizeof(float) );
+    rmsprop->velocity   = simd_malloc_huge( n_param * sizeof(float) );
     assert( rmsprop->velocity );
     memset( rmsprop->velocity, 0, n_param * sizeof(float));
 
-    rmsprop->r   = simd_malloc( n_param * sizeof(float) );
+    rmsprop->r   = simd_malloc_huge( n_param * sizeof(float) );
     assert( rmsprop->r );
     memset( rmsprop->r, 0, n_param * sizeof(float));
 }
@@ -55,8 +59,8 @@ static void RMSprop_optimizer_init( RMSprop_t *rmsprop, rmsprop_properties_t *pr
 static void RMSprop_optimizer_free( optimizer_t *opt )
 {
     if( !opt ) return;
-    simd_free( RMSPROP_OPTIMIZER(opt)->velocity );
-    simd_free( RMSPROP_OPTIMIZER(opt)->r );
+    simd_free_huge( RMSPROP_OPTIMIZER(opt)->velocity );
+    simd_free_huge( RMSPROP_OPTIMIZER(opt)->r );
 }
 
 OPTIMIZER_DEFINE(RMSprop, 
@@ -76,14 +80,56 @@ static void compute_update( const int n, float *delta_w, const float *r, const f
     const __m256 lr_v = _mm256_set1_ps(-lr);
     const __m256 eps_v = _mm256_set1_ps(epsilon);
     for( ; i <= ((n)-8) ; i += 8, delta_w += 8, r_ptr += 8 ){
-        _mm256_store_ps( delta_w, _mm256_mul_ps( _mm256_load_ps( delta_w ),
-                    _mm256_div_ps( lr_v, _mm256_add_ps( eps_v, _mm256_sqrt_ps( _mm256_load_ps( r_ptr ) )))));
+        _mm256_storeu_ps( delta_w, _mm256_mul_ps( _mm256_loadu_ps( delta_w ),
+                    _mm256_div_ps( lr_v, _mm256_add_ps( eps_v, _mm256_sqrt_ps( _mm256_loadu_ps( r_ptr ) )))));
     }
 #endif
     for( ; i < n; i++)
         *delta_w++ *= -lr / ( epsilon + sqrtf( *r_ptr++ ));
 }
 
+/* This function does  r <- rho * r + (1-rho) * g^2 */
+static void update_mean_square( const int n, float *r, const float *g, const float rho )
+{
+    int i = 0;
+    float *r_ptr = r;
+#ifdef __AVX__
+    const float *g_ptr = g;
+    const __m256 rhov = _mm256_set1_ps( rho );
+    const __m256 one_minus_rhov = _mm256_set1_ps( 1.0f - rho );
+    for( ; i <= ((n)-8); i += 8 , r_ptr += 8, g_ptr += 8 ){
+        __m256 gv = _mm256_loadu_ps( g_ptr );
+        _mm256_storeu_ps( r_ptr, _mm256_add_ps( _mm256_mul_ps( _mm256_loadu_ps( r_ptr ), rhov ),
+                    _mm256_mul_ps( _mm256_mul_ps( gv, gv ), one_minus_rhov )));
+    }
+#endif
+    for( ; i < n; i++, r_ptr++ ){
+        const float gval = g[i];
+        *r_ptr = (rho * *r_ptr) + (1.0f - rho) * gval * gval;
+    }
+}
+
+/* Lazy update with sparse input. Only the parameter ranges touched by the batch are updated,
+ * and the decay of r for the batches where a range was not touched, is applied when it is
+ * touched again. Without momentum this gives the same result as the dense update. */
+static void RMSprop_lazy_update( RMSprop_t *rmsprop, const int n_ranges, const param_range_t *ranges, float *delta_w )
+{
+    for ( int k = 0; k < n_ranges; k++ ){
+        const unsigned int offset = ranges[k].offset;
+        const int n = ranges[k].length;
+        float *r = rmsprop->r + offset;
+
+        if( ranges[k].n_skipped > 0 ){
+            const float decay = powf( rmsprop->rho, (float) ranges[k].n_skipped );
+            for ( int j = 0; j < n; j++ )
+                r[j] *= decay;
+        }
+        update_mean_square( n, r, delta_w + offset, rmsprop->rho );
+        compute_update( n, delta_w + offset, r, rmsprop->learning_rate );
+        neuralnet_update_range( OPTIMIZER(rmsprop)->nn, offset, n, delta_w );
+    }
+}
+
 void RMSprop_run_epoch( optimizer_t *opt,
         const unsigned int n_train_samples, const float *train_X, const float *train_Y )
 {
@@ -104,6 +150,7 @@ void RMSprop_run_epoch( optimizer_t *opt,
 
         float SIMD_ALIGN(batchgrad[n_parameters]);
         optimizer_calc_batch_gradient( opt, n_train_samples, train_X, train_Y, &i, batchgrad );
+        if( opt->failed ) break;
         if( opt->progress ) opt->progress( i, n_train_samples, "Train: " );
 
         
@@ -114,6 +161,13 @@ void RMSprop_run_epoch( optimizer_t *opt,
         float *delta_w = batchgrad;
         float *r = rmsprop->r; 
 
+        const param_range_t *ranges;
+        const int n_ranges = optimizer_lazy_ranges( opt, &ranges );
+        if( n_ranges > 0 ){
+            RMSprop_lazy_update( rmsprop, n_ranges, ranges, delta_w );
+            continue;
+        }
+
         float SIMD_ALIGN(g2[n_parameters]);
         vector_square_elements( n_parameters, g2, batchgrad );
         vector_saxpby( n_parameters, r, 1.0f - rmsprop->rho, g2, rmsprop->rho );
@@ -32,9 +32,12 @@ static void SGD_optimizer_init( SGD_t *sgd, sgd_properties_t *properties )
     sgd->nesterov = props->nesterov;
     sgd->decay = props->decay;
 
+    /* SGD does not do lazy updates, so the whole batch gradient is needed */
+    OPTIMIZER(sgd)->lazy = false;
+
     const unsigned int n_param = neuralnet_total_n_parameters( OPTIMIZER(sgd)->nn );
 
-    sgd->velocity   = simd_malloc( n_param * sizeof(float) );
+    sgd->velocity   = simd_malloc_huge( n_param * sizeof(float) );
     assert( sgd->velocity );
     memset( sgd->velocity, 0, n_param * sizeof(float));
 }
@@ -42,7 +45,7 @@ static void SGD_optimizer_init( SGD_t *sgd, sgd_properties_t *properties )
 static void SGD_optimizer_free( optimizer_t *opt )
 {
     if( !opt ) return;
-    simd_free( SGD_OPTIMIZER(opt)->velocity );
+    simd_free_huge( SGD_OPTIMIZER(opt)->velocity );
 }
 
 OPTIMIZER_DEFINE(SGD, 
@@ -50,6 +53,26 @@ OPTIMIZER_DEFINE(SGD,
     newopt->opt.free = SGD_optimizer_free;
 );
 
+/* The update in Hogwild mode. This is called by all the threads at the same time, and the velocity
+   is shared (and raced on) like the weights. Nesterov momentum is not used here. With sparse input,
+   only the first layer rows in the batch are updated, so the velocity of the other rows is not applied. */
+static void SGD_hogwild_update( optimizer_t *opt, float *batchgrad, const param_range_t *ranges, const int n_ranges )
+{
+    SGD_t *sgd = SGD_OPTIMIZER( opt );
+    const float learning_rate = optimizer_hogwild_learning_rate( &sgd->learning_rate, &sgd->n_iterations, sgd->decay );
+
+    for ( int k = 0; k < n_ranges; k++ ){
+        float *delta_w  = batchgrad + ranges[k].offset;
+        float *velocity = sgd->velocity + ranges[k].offset;
+        for ( unsigned int j = 0; j < ranges[k].length; j++ ){
+            delta_w[j] *= -learning_rate;
+            if ( sgd->momentum > 0.0f )
+                delta_w[j] = velocity[j] = sgd->momentum * velocity[j] + delta_w[j];
+        }
+        neuralnet_update_range( opt->nn, ranges[k].offset, ranges[k].length, batchgrad );
+    }
+}
+
 /* Stochastic Gradient Descent */
 void SGD_run_epoch( optimizer_t *opt,
         const unsigned int n_train_samples, const float *train_X, const float *train_Y )
@@ -58,6 +81,11 @@ void SGD_run_epoch( optimizer_t *opt,
     neuralnet_t *nn = opt->nn;
     const unsigned int n_parameters = neuralnet_total_n_parameters( nn );
 
+    if ( opt->hogwild ){
+        optimizer_run_epoch_hogwild( opt, n_train_samples, train_X, train_Y, SGD_hogwild_update );
+        return;
+    }
+
     for ( unsigned int i = 0; i < n_train_samples ;  ){
 
         /* Apply interim update */
@@ -70,6 +98,7 @@ void SGD_run_epoch( optimizer_t *opt,
         /* Calculate batch gradient */
         float SIMD_ALIGN(batchgrad[n_parameters]);
         optimizer_calc_batch_gradient( opt, n_train_samples, train_X, train_Y, &i, batchgrad );
+        if( opt->failed ) break;
 
         /* Progress callback */
         if( opt->progress) opt->progress( i, n_train_samples, "Train: " );
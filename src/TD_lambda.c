@@ -0,0 +1,114 @@
+#include "TD_lambda.h"
+
+#include "simd.h" 
+#include "matrix_operations.h" 
+
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+/*  TD_lambda.c  */
+struct _TD_lambda_t 
+{
+    optimizer_t opt;
+    /* Other data */
+    float learning_rate;
+    float lambda;
+    float gamma;
+
+    /* private stuff - don't touch! */
+    unsigned int stride;   /* The number of parameters, rounded up such that the vectors are aligned */
+    float *trace;          /* The eligibility trace of each output, n_output x stride */
+    float *grads;          /* The gradient of each output in the current state, n_output x stride */
+    float *delta_w;
+};
+
+static void TD_lambda_optimizer_init( TD_lambda_t *td, td_lambda_properties_t *properties )
+{
+    td_lambda_properties_t *props = (td_lambda_properties_t*) properties;
+
+    td->learning_rate = props->learning_rate;
+    td->lambda = props->lambda;
+    td->gamma = props->gamma;
+
+    const neuralnet_t *nn = OPTIMIZER(td)->nn;
+    const unsigned int n_param = neuralnet_total_n_parameters( nn );
+    const unsigned int n_output = nn->layer[nn->n_layers-1].n_output;
+    if( neuralnet_target_size( nn ) != (int) n_output )
+        fprintf( stderr, "Warning: The TD(lambda) optimizer needs a target (reward) for each output.\n");
+
+    td->stride  = (n_param + 15) & ~15u;
+    td->trace   = simd_malloc_huge( n_output * td->stride * sizeof(float) );
+    td->grads   = simd_malloc_huge( n_output * td->stride * sizeof(float) );
+    td->delta_w = simd_malloc_huge( td->stride * sizeof(float) );
+    assert( td->trace );
+    assert( td->grads );
+    assert( td->delta_w );
+    memset( td->trace, 0, n_output * td->stride * sizeof(float));
+}
+
+static void TD_lambda_optimizer_free( optimizer_t *opt )
+{
+    if( !opt ) return;
+    simd_free_huge( TD_LAMBDA_OPTIMIZER(opt)->trace );
+    simd_free_huge( TD_LAMBDA_OPTIMIZER(opt)->grads );
+    simd_free_huge( TD_LAMBDA_OPTIMIZER(opt)->delta_w );
+}
+
+OPTIMIZER_DEFINE(TD_lambda, 
+    TD_lambda_optimizer_init( newopt, properties );
+    newopt->opt.free = TD_lambda_optimizer_free;
+);
+
+/* The online (backward view) TD(lambda). For each state s_t, with the value V(s) (the output):
+
+       e_k     = gamma * lambda * e_k + grad V_k(s_t)        for each output k
+       delta_k = r_k + gamma * V_k(s_t+1) - V_k(s_t)          (V(s_t+1) = 0 after the last state)
+       w      += learning_rate * sum_k delta_k * e_k
+
+   The decay and the accumulation of the traces is done in one pass by vector_saxpby(). */
+void TD_lambda_run_epoch( optimizer_t *opt,
+        const unsigned int n_states, const float *states, const float *rewards )
+{
+    TD_lambda_t *td = TD_LAMBDA_OPTIMIZER( opt );
+    neuralnet_t *nn = opt->nn;
+    if( !states || opt->sparse_X ){
+        fprintf( stderr, "The TD(lambda) optimizer can only train on the dense states of an episode.\n");
+        return;
+    }
+    const unsigned int n_parameters = neuralnet_total_n_parameters( nn );
+    const int n_input  = nn->layer[0].n_input;
+    const int n_output = nn->layer[nn->n_layers-1].n_output;
+    const unsigned int stride = td->stride;
+    const float decay = td->gamma * td->lambda;
+
+    /* A new episode */
+    memset( td->trace, 0, n_output * stride * sizeof(float));
+
+    float SIMD_ALIGN(value[n_output]);
+    float SIMD_ALIGN(next_value[n_output]);
+    float td_target[n_output];
+    for ( unsigned int t = 0; t < n_states; t++ ){
+        neuralnet_output_gradients( nn, states + t * n_input, stride, td->grads, value );
+        for ( int k = 0; k < n_output; k++ )
+            vector_saxpby( n_parameters, td->trace + k * stride, 1.0f, td->grads + k * stride, decay );
+
+        const bool last = t + 1 == n_states;
+        if( !last )
+            neuralnet_predict( nn, states + (t + 1) * n_input, next_value );
+        for ( int k = 0; k < n_output; k++ )
+            td_target[k] = rewards[t * n_output + k] + (last ? 0.0f : td->gamma * next_value[k]);
+
+        /* The train metrics are of the values against the TD targets */
+        if( opt->metric_sums ){
+            for ( int j = 0; j < opt->n_metrics; j++ )
+                opt->metric_sums[j] += opt->metrics[j]( n_output, value, td_target );
+            opt->n_metric_samples++;
+        }
+
+        memset( td->delta_w, 0, n_parameters * sizeof(float));
+        for ( int k = 0; k < n_output; k++ )
+            vector_saxpy( n_parameters, td->delta_w, td->learning_rate * (td_target[k] - value[k]), td->trace + k * stride );
+        neuralnet_update( nn, td->delta_w );
+    }
+    if( opt->progress ) opt->progress( n_states, n_states, "Train: " );
+}
@@ -0,0 +1,19 @@
+/* This is the implementation of the abstract optimizer type */
+#include "optimizer.h"
+
+/* ---- TD(lambda), temporal difference learning (Sutton 1988, Tesauro 1992) ---- */
+/* Each call of run_epoch() is one episode: The states are given in order as the samples, and the
+ * target of a state is the reward that follows it. Use optimizer_step() to train on an episode.
+ * The network should have a regression loss (like "mean_squared_error"), which is only used for
+ * the metrics. */
+OPTIMIZER_DECLARE(TD_lambda);
+#define TD_LAMBDA_OPTIMIZER(v) ((TD_lambda_t*)(v))
+
+typedef struct _td_lambda_properties_t {
+    float learning_rate;
+    float lambda;        /* Decay of the eligibility traces. 0 is TD(0), 1 is Monte Carlo. */
+    float gamma;         /* Discount of the rewards */
+} td_lambda_properties_t;
+#define TD_LAMBDA_PROPERTIES(...) \
+    &((td_lambda_properties_t)  \
+            { .learning_rate = 0.1f, .lambda = 0.7f, .gamma = 1.0f, __VA_ARGS__ })
@@ -7,6 +7,7 @@
 
 #include <string.h>
 #include <math.h>
+#include <assert.h>
 
 #include <stdio.h>
 #include <errno.h>
@@ -434,66 +435,155 @@ static inline float hsum256_ps_avx(__m256 v) {
 }
 #endif
 
-static void softmax( const int n, float *ar )
+#ifdef __AVX2__
+static inline float hmax256_ps_avx(__m256 v) {
+    __m128 m = _mm_max_ps( _mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    m = _mm_max_ps( m, _mm_movehl_ps( m, m ));
+    m = _mm_max_ss( m, _mm_movehdup_ps( m ));
+    return _mm_cvtss_f32( m );
+}
+#endif
+
+static float max_element( const int n, const float *ar )
 {
-    /* There is an excellent article on how to do it here:
-     * https://arxiv.org/pdf/2001.04438.pdf
-     * The Two-Pass Softmax Algorithm - Marat Dukhan and Artsiom Ablavatski */
-    float sum = 0.0f;
     float maxval = ar[0];
-    int j = 1;
-    
-    /* This follows the three-pass with re-loading (Algorithm 2 in the article).
-       However I have not found a fast SIMD way to find the maximum element.
-       If you get to a time critical training of a classification problem with
-       many classes, it may pay off implement the two-pass algorithm */
+    int j = 0;
+#ifdef __AVX2__
+    if( n >= 8 ){
+        __m256 max_v = _mm256_loadu_ps( ar );
+        for ( j = 8; j <= ((n)-8); j += 8 )
+            max_v = _mm256_max_ps( max_v, _mm256_loadu_ps( ar + j ));
+        maxval = hmax256_ps_avx( max_v );
+    }
+#endif
     for (; j < n; j++ )
         if( ar[j] > maxval ) maxval = ar[j];
+    return maxval;
+}
 
-    j = 0;
+/* Does ar <- exp( ar - maxval ) and returns the sum of the exponentials. If y_real is given,
+   sum( y_real * (ar - maxval) ) and sum( y_real ) are accumulated in the same pass, as this
+   is what we need for the crossentropy. */
+static float exp_and_sum( const int n, float *ar, const float maxval, const float *y_real, float *yz, float *ysum )
+{
+    float sum = 0.0f, yz_sum = 0.0f, y_sum = 0.0f;
+    int j = 0;
 #ifdef __AVX2__
     /* I'm intentionally only using one register to make the vectorization work for "8 or more"-class
        classification problems. If using two registers, I will lose all vectorization for classification
        problems with less than 16 classes. This is of course a trade off, and if you ever do a classification
        problem with 16 or more classes, you could consider re-writing. */
-
-    /* Skip the unaligned - FIXME: This code is specific for AVX2,
-     *                             yet it checks align for whatever the computer supports */
-    for (; !is_aligned( ar+j ) && j<n; j++ ){
-        ar[j] = expf( ar[j] - maxval );
-        sum += ar[j];
-    }
-    __m256 max_v = _mm256_set1_ps( maxval );
-    __m256 sum_v = _mm256_set1_ps( 0.0f );
+    const __m256 max_v = _mm256_set1_ps( maxval );
+    __m256 sum_v = _mm256_setzero_ps();
+    __m256 yz_v  = _mm256_setzero_ps();
+    __m256 y_v   = _mm256_setzero_ps();
     for (; j <= ((n)-8); j += 8) {
-        __m256 YMM0 = _mm256_load_ps(ar + j);
-        YMM0 = _mm256_sub_ps( YMM0, max_v );
+        __m256 YMM0 = _mm256_sub_ps( _mm256_loadu_ps( ar + j ), max_v );
+        if( y_real ){
+            const __m256 YMM1 = _mm256_loadu_ps( y_real + j );
+            yz_v = _mm256_add_ps( yz_v, _mm256_mul_ps( YMM1, YMM0 ));
+            y_v  = _mm256_add_ps( y_v, YMM1 );
+        }
         YMM0 = exp256_ps(YMM0);
-        _mm256_store_ps( ar + j, YMM0 );
+        _mm256_storeu_ps( ar + j, YMM0 );
         sum_v = _mm256_add_ps( sum_v, YMM0 );
     }
     sum += hsum256_ps_avx( sum_v );
+    if( y_real ){
+        yz_sum += hsum256_ps_avx( yz_v );
+        y_sum  += hsum256_ps_avx( y_v );
+    }
 #endif
     for (; j < n; j++ ){
-        ar[j] = expf( ar[j] - maxval );
+        const float z = ar[j] - maxval;
+        if( y_real ){
+            yz_sum += y_real[j] * z;
+            y_sum  += y_real[j];
+        }
+        ar[j] = expf( z );
         sum += ar[j];
     }
-    j = 0;
-#ifdef __AVX__
-    for (; !is_aligned( ar + j ) && j < n; j++ ){
-        ar[j] /= sum;
+    if( y_real ){
+        *yz = yz_sum;
+        *ysum = y_sum;
     }
-    __m256 sum4 = _mm256_set1_ps( sum );
+    return sum;
+}
+
+/* Does ar <- ar * scale, and if grad is given also grad <- ar - y_real (or just ar if y_real is NULL). */
+static void scale_and_gradient( const int n, float *ar, const float scale, const float *y_real, float *grad )
+{
+    int j = 0;
+#ifdef __AVX__
+    const __m256 scale_v = _mm256_set1_ps( scale );
     for(; j <= ((n)-8); j+= 8 ) {
-        __m256 YMM0 = _mm256_load_ps( ar + j );
-        _mm256_store_ps( ar + j, _mm256_div_ps( YMM0, sum4 ) );
+        const __m256 YMM0 = _mm256_mul_ps( _mm256_loadu_ps( ar + j ), scale_v );
+        _mm256_storeu_ps( ar + j, YMM0 );
+        if( grad )
+            _mm256_storeu_ps( grad + j, y_real ? _mm256_sub_ps( YMM0, _mm256_loadu_ps( y_real + j )) : YMM0 );
     }
 #endif
     for (; j < n; j++ ){
-        ar[j] /= sum;
+        ar[j] *= scale;
+        if( grad )
+            grad[j] = y_real ? ar[j] - y_real[j] : ar[j];
     }
 }
 
+static void softmax( const int n, float *ar )
+{
+    /* There is an excellent article on how to do it here:
+     * https://arxiv.org/pdf/2001.04438.pdf
+     * The Two-Pass Softmax Algorithm - Marat Dukhan and Artsiom Ablavatski */
+
+    /* This follows the three-pass with re-loading (Algorithm 2 in the article).
+       If you get to a time critical training of a classification problem with
+       many classes, it may pay off implement the two-pass algorithm.
+       Also see softmax_crossentropy() below, which is used in training. */
+    const float maxval = max_element( n, ar );
+    const float sum = exp_and_sum( n, ar, maxval, NULL, NULL, NULL );
+    scale_and_gradient( n, ar, 1.0f / sum, NULL, NULL );
+}
+
+/**
+  @brief Fused softmax and categorical crossentropy.
+  @param n Number of outputs (classes)
+  @param ar The logits (output layer before softmax activation). Overwritten with the softmax probabilities.
+  @param y_real The target (one-hot encoded or any probability distribution)
+  @param grad If not NULL, the derivative of the loss w.r.t. the logits (softmax - y_real) is written here.
+  @return The crossentropy -sum( y_real * log( softmax ) ).
+
+  The crossentropy is calculated by log-sum-exp as sum( y_real * (LSE - logits) ), so there is no log of
+  (clipped) probabilities. It is numerically stable for any logits. All is done in three passes over the
+  outputs (max, exp-and-sum, normalize), where a separate softmax activation, loss derivative and metric
+  would need six.
+ */
+float softmax_crossentropy( const int n, float *ar, const float *y_real, float *grad )
+{
+    float yz = 0.0f, ysum = 0.0f;
+    const float maxval = max_element( n, ar );
+    const float sum = exp_and_sum( n, ar, maxval, y_real, &yz, &ysum );
+    scale_and_gradient( n, ar, 1.0f / sum, y_real, grad );
+    return ysum * logf( sum ) - yz;
+}
+
+/**
+  @brief Same as `softmax_crossentropy()`, but the target is the class label in y_label[0]. (Like in the
+         'sparse_categorical_crossentropy' loss).
+ */
+float sparse_softmax_crossentropy( const int n, float *ar, const float *y_label, float *grad )
+{
+    const int target_class = (int) y_label[0];
+    assert( target_class >= 0 && target_class < n );
+    const float maxval = max_element( n, ar );
+    const float z = ar[target_class] - maxval;
+    const float sum = exp_and_sum( n, ar, maxval, NULL, NULL, NULL );
+    scale_and_gradient( n, ar, 1.0f / sum, NULL, grad );
+    if( grad )
+        grad[target_class] -= 1.0f;
+    return logf( sum ) - z;
+}
+
 static void sigmoid( const int n, float *y )
 {
     int i = 0;
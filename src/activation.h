@@ -12,4 +12,8 @@ activation_func       get_activation_func      ( const char * name );
 activation_derivative get_activation_derivative( const activation_func ptr );
 const char *          get_activation_name      ( const activation_func ptr );
 
+/* Fused softmax and crossentropy. The input is the logits, which is overwritten by the softmax. */
+float softmax_crossentropy       ( const int n, float *ar, const float *y_real,  float *grad );
+float sparse_softmax_crossentropy( const int n, float *ar, const float *y_label, float *grad );
+
 #endif /* __ACTIVATION_H__ */
@@ -35,7 +35,7 @@ static void adagrad_optimizer_init( adagrad_t *adagrad, adagrad_properties_t *pr
 
     const unsigned int n_param = neuralnet_total_n_parameters( OPTIMIZER(adagrad)->nn );
 
-    adagrad->r   = simd_malloc( n_param * sizeof(float) );
+    adagrad->r   = simd_malloc_huge( n_param * sizeof(float) );
     assert( adagrad->r );
     memset( adagrad->r, 0, n_param * sizeof(float));
 }
@@ -43,7 +43,7 @@ static void adagrad_optimizer_init( adagrad_t *adagrad, adagrad_properties_t *pr
 static void adagrad_optimizer_free( optimizer_t *opt )
 {
     if( !opt ) return;
-    simd_free( ADAGRAD_OPTIMIZER(opt)->r );
+    simd_free_huge( ADAGRAD_OPTIMIZER(opt)->r );
 }
 
 OPTIMIZER_DEFINE(adagrad, 
@@ -61,8 +61,8 @@ static void accumulate_squared_gradient( const int n, float *r, const float *g )
 #ifdef __AVX__
     const float *g_ptr = g;
     for( ; i <= ((n)-8); i += 8 , r_ptr += 8, g_ptr += 8 ){
-        __m256 gv = _mm256_load_ps( g_ptr );
-        _mm256_store_ps( r_ptr, _mm256_add_ps( _mm256_load_ps( r_ptr ), _mm256_mul_ps( gv, gv ) ) );
+        __m256 gv = _mm256_loadu_ps( g_ptr );
+        _mm256_storeu_ps( r_ptr, _mm256_add_ps( _mm256_loadu_ps( r_ptr ), _mm256_mul_ps( gv, gv ) ) );
     }
 #endif
     for( ; i < n; i++ ){
@@ -83,14 +83,30 @@ static void compute_update( const int n, float *delta_w, const float *r, const f
     const __m256 lr_v = _mm256_set1_ps(-lr);
     const __m256 eps_v = _mm256_set1_ps(epsilon);
     for( ; i <= ((n)-8) ; i += 8, delta_w += 8, r_ptr += 8 ){
-        _mm256_store_ps( delta_w, _mm256_mul_ps( _mm256_load_ps( delta_w ),
-                    _mm256_div_ps( lr_v, _mm256_add_ps( eps_v, _mm256_sqrt_ps( _mm256_load_ps( r_ptr ) )))));
+        _mm256_storeu_ps( delta_w, _mm256_mul_ps( _mm256_loadu_ps( delta_w ),
+                    _mm256_div_ps( lr_v, _mm256_add_ps( eps_v, _mm256_sqrt_ps( _mm256_loadu_ps( r_ptr ) )))));
     }
 #endif
     for( ; i < n; i++)
         *delta_w++ *= -lr / ( epsilon + sqrtf( *r_ptr++ ));
 }
 
+/* The update in Hogwild mode. This is called by all the threads at the same time, and `r` is shared
+   (and raced on) like the weights. */
+static void adagrad_hogwild_update( optimizer_t *opt, float *batchgrad, const param_range_t *ranges, const int n_ranges )
+{
+    adagrad_t *adagrad = ADAGRAD_OPTIMIZER( opt );
+    const float learning_rate = optimizer_hogwild_learning_rate( &adagrad->learning_rate, &adagrad->n_iterations,
+            adagrad->decay );
+
+    for ( int k = 0; k < n_ranges; k++ ){
+        const unsigned int offset = ranges[k].offset;
+        accumulate_squared_gradient( ranges[k].length, adagrad->r + offset, batchgrad + offset );
+        compute_update( ranges[k].length, batchgrad + offset, adagrad->r + offset, learning_rate );
+        neuralnet_update_range( opt->nn, offset, ranges[k].length, batchgrad );
+    }
+}
+
 void adagrad_run_epoch( optimizer_t *opt,
         const unsigned int n_train_samples, const float *train_X, const float *train_Y )
 {
@@ -98,10 +114,16 @@ void adagrad_run_epoch( optimizer_t *opt,
     neuralnet_t *nn = opt->nn;
     const unsigned int n_parameters = neuralnet_total_n_parameters( nn );
 
+    if ( opt->hogwild ){
+        optimizer_run_epoch_hogwild( opt, n_train_samples, train_X, train_Y, adagrad_hogwild_update );
+        return;
+    }
+
     for ( unsigned int i = 0; i < n_train_samples ;  ){
 
         float SIMD_ALIGN(batchgrad[n_parameters]);
         optimizer_calc_batch_gradient( opt, n_train_samples, train_X, train_Y, &i, batchgrad );
+        if( opt->failed ) break;
         if( opt->progress ) opt->progress( i, n_train_samples, "Train: " );
         
         if (adagrad->decay > 0.0f )
@@ -111,6 +133,20 @@ void adagrad_run_epoch( optimizer_t *opt,
         float *delta_w = batchgrad;
         float *r = adagrad->r; 
 
+        /* Lazy update with sparse input. Only the parameter ranges touched by the batch are
+           updated. As r only accumulates, this gives the same result as the dense update. */
+        const param_range_t *ranges;
+        const int n_ranges = optimizer_lazy_ranges( opt, &ranges );
+        if( n_ranges > 0 ){
+            for ( int k = 0; k < n_ranges; k++ ){
+                const unsigned int offset = ranges[k].offset;
+                accumulate_squared_gradient( ranges[k].length, r + offset, delta_w + offset );
+                compute_update( ranges[k].length, delta_w + offset, r + offset, adagrad->learning_rate );
+                neuralnet_update_range( nn, offset, ranges[k].length, delta_w );
+            }
+            continue;
+        }
+
         accumulate_squared_gradient( n_parameters, r, delta_w );
         compute_update( n_parameters, delta_w, r, adagrad->learning_rate /*, epsilon? */ );
 
@@ -2,8 +2,10 @@
 
 #include "simd.h" 
 #include "matrix_operations.h" 
+#include "threadpool.h"
 
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <assert.h>
@@ -25,6 +27,11 @@ struct _adam_t
     /* private stuff - don't touch! */
     float *r;
     float *s;
+    float *range_weights;     /* The weights of a range in the lazy update with weight decay */
+    quantized_state_t *qs;    /* With a quantized state, the first moment and the square root of */
+    quantized_state_t *qu;    /* the second moment are stored here instead of in s and r. */
+    float beta_1_corrected;   /* beta_1^t and beta_2^t after t updates */
+    float beta_2_corrected;
 };
 
 static void adam_optimizer_init( adam_t *adam, adam_properties_t *properties )
@@ -35,11 +42,35 @@ static void adam_optimizer_init( adam_t *adam, adam_properties_t *properties )
     adam->beta_1 = props->beta_1;
     adam->beta_2 = props->beta_2;
     adam->weight_decay = props->weight_decay;
+    adam->beta_1_corrected = 1.0f;
+    adam->beta_2_corrected = 1.0f;
+    adam->r  = adam->s  = NULL;
+    adam->qs = adam->qu = NULL;
+    adam->range_weights = NULL;
 
     const unsigned int n_param = neuralnet_total_n_parameters( OPTIMIZER(adam)->nn );
 
-    adam->r   = simd_malloc( n_param * sizeof(float) );
-    adam->s   = simd_malloc( n_param * sizeof(float) );
+    if( props->state_format != OPTIMIZER_STATE_FP32 ){
+        /* The quantized state is updated in whole blocks, so it is always a dense update */
+        OPTIMIZER(adam)->lazy = false;
+        adam->qs = quantized_state_new( n_param, props->state_format );
+        adam->qu = quantized_state_new( n_param, props->state_format );
+        assert( adam->qs );
+        assert( adam->qu );
+        return;
+    }
+
+    if( OPTIMIZER(adam)->lazy && adam->weight_decay > 0.0f ){
+        /* The longest range is a row of the first layer weights, or all the other layers */
+        const neuralnet_t *nn = OPTIMIZER(adam)->nn;
+        const unsigned int n_out0 = nn->layer[0].n_output;
+        const unsigned int n_rest = n_param - (nn->layer[0].n_input + 1) * n_out0;
+        adam->range_weights = malloc( (n_rest > n_out0 ? n_rest : n_out0) * sizeof(float));
+        assert( adam->range_weights );
+    }
+
+    adam->r   = simd_malloc_huge( n_param * sizeof(float) );
+    adam->s   = simd_malloc_huge( n_param * sizeof(float) );
     assert( adam->r );
     assert( adam->s );
     memset( adam->r, 0, n_param * sizeof(float));
@@ -49,8 +80,11 @@ static void adam_optimizer_init( adam_t *adam, adam_properties_t *properties )
 static void adam_optimizer_free( optimizer_t *opt )
 {
     if( !opt ) return;
-    simd_free( ADAM_OPTIMIZER(opt)->r );
-    simd_free( ADAM_OPTIMIZER(opt)->s );
+    simd_free_huge( ADAM_OPTIMIZER(opt)->r );
+    simd_free_huge( ADAM_OPTIMIZER(opt)->s );
+    quantized_state_free( ADAM_OPTIMIZER(opt)->qs );
+    quantized_state_free( ADAM_OPTIMIZER(opt)->qu );
+    free( ADAM_OPTIMIZER(opt)->range_weights );
 }
 
 OPTIMIZER_DEFINE(adam, 
@@ -70,10 +104,10 @@ static void update_biased_first_moment( const int n , float *s, const float *g,
     __m256 rhov = _mm256_set1_ps( rho );
     __m256 one_minus_rhov = _mm256_set1_ps( 1.0f - rho );
     for( ; i <= ((n)-8); i += 8 , s_ptr += 8, g_ptr += 8 ){
-        __m256 gv = _mm256_load_ps( g_ptr );
-        _mm256_store_ps( s_ptr,
+        __m256 gv = _mm256_loadu_ps( g_ptr );
+        _mm256_storeu_ps( s_ptr,
                 _mm256_add_ps(
-                    _mm256_mul_ps( _mm256_load_ps( s_ptr ), rhov ),
+                    _mm256_mul_ps( _mm256_loadu_ps( s_ptr ), rhov ),
                     _mm256_mul_ps( gv, one_minus_rhov )
                     )
                 );
@@ -99,10 +133,10 @@ static void update_biased_second_moment( const int n, float *r, const float *g,
     __m256 rhov = _mm256_set1_ps( rho );
     __m256 one_minus_rhov = _mm256_set1_ps( 1.0f - rho );
     for( ; i <= ((n)-8); i += 8 , r_ptr += 8, g_ptr += 8 ){
-        __m256 gv = _mm256_load_ps( g_ptr );
-        _mm256_store_ps( r_ptr,
+        __m256 gv = _mm256_loadu_ps( g_ptr );
+        _mm256_storeu_ps( r_ptr,
                 _mm256_add_ps(
-                    _mm256_mul_ps( _mm256_load_ps( r_ptr ), rhov ),
+                    _mm256_mul_ps( _mm256_loadu_ps( r_ptr ), rhov ),
                     _mm256_mul_ps( _mm256_mul_ps( gv, gv ), one_minus_rhov )
                     )
                 );
@@ -130,10 +164,10 @@ static void compute_update_adam( const int n, float *delta_w, const float *s, co
     const __m256 eps_v = _mm256_set1_ps(epsilon);
 
     for( ; i <= ((n)-8) ; i += 8, delta_w += 8, s_ptr += 8, r_ptr += 8 ){
-        const __m256 s_hat = _mm256_div_ps( _mm256_load_ps( s_ptr ), one_minus_rho1_v );
-        const __m256 r_hat = _mm256_div_ps( _mm256_load_ps( r_ptr ), one_minus_rho2_v );
+        const __m256 s_hat = _mm256_div_ps( _mm256_loadu_ps( s_ptr ), one_minus_rho1_v );
+        const __m256 r_hat = _mm256_div_ps( _mm256_loadu_ps( r_ptr ), one_minus_rho2_v );
 
-        _mm256_store_ps( delta_w, 
+        _mm256_storeu_ps( delta_w, 
                 _mm256_div_ps(  _mm256_mul_ps ( lr_v, s_hat ), _mm256_add_ps ( _mm256_sqrt_ps( r_hat ), eps_v ) ));
     }
 #endif
@@ -144,6 +178,137 @@ static void compute_update_adam( const int n, float *delta_w, const float *s, co
     }
 }
 
+/* The update of a block of the quantized state. The moments are dequantized, updated and
+ * requantized in one pass, and the gradient is replaced by the update. The second moment is
+ * stored as its square root, u = sqrt(r), which needs half the dynamic range. */
+static void quantized_update_block( const adam_t *adam, const unsigned int block, const int n, float *g,
+        const float rho1, const float rho2 )
+{
+    float SIMD_ALIGN(s[QUANTIZED_STATE_BLOCK]);
+    float SIMD_ALIGN(u[QUANTIZED_STATE_BLOCK]);
+    quantized_state_load( adam->qs, block, s );
+    quantized_state_load( adam->qu, block, u );
+
+    const float epsilon = 1.0e-8f;
+    const float beta_1 = adam->beta_1;
+    const float beta_2 = adam->beta_2;
+    const float s_scale = -adam->learning_rate / (1.0f - rho1);
+    const float u_scale = 1.0f / sqrtf( 1.0f - rho2 );
+    int i = 0;
+#ifdef __AVX__
+    const __m256 beta_1_v = _mm256_set1_ps( beta_1 );
+    const __m256 one_minus_beta_1_v = _mm256_set1_ps( 1.0f - beta_1 );
+    const __m256 beta_2_v = _mm256_set1_ps( beta_2 );
+    const __m256 one_minus_beta_2_v = _mm256_set1_ps( 1.0f - beta_2 );
+    const __m256 s_scale_v = _mm256_set1_ps( s_scale );
+    const __m256 u_scale_v = _mm256_set1_ps( u_scale );
+    const __m256 eps_v = _mm256_set1_ps( epsilon );
+    for( ; i <= n - 8; i += 8 ){
+        const __m256 gv = _mm256_loadu_ps( g + i );
+        const __m256 sv = _mm256_add_ps( _mm256_mul_ps( _mm256_load_ps( s + i ), beta_1_v ),
+                _mm256_mul_ps( gv, one_minus_beta_1_v ));
+        const __m256 uv = _mm256_load_ps( u + i );
+        const __m256 rv = _mm256_add_ps( _mm256_mul_ps( _mm256_mul_ps( uv, uv ), beta_2_v ),
+                _mm256_mul_ps( _mm256_mul_ps( gv, gv ), one_minus_beta_2_v ));
+        const __m256 new_uv = _mm256_sqrt_ps( rv );
+        _mm256_store_ps( s + i, sv );
+        _mm256_store_ps( u + i, new_uv );
+        _mm256_storeu_ps( g + i, _mm256_div_ps( _mm256_mul_ps( s_scale_v, sv ),
+                    _mm256_add_ps( _mm256_mul_ps( new_uv, u_scale_v ), eps_v )));
+    }
+#endif
+    for( ; i < n; i++ ){
+        s[i] = beta_1 * s[i] + (1.0f - beta_1) * g[i];
+        u[i] = sqrtf( beta_2 * u[i] * u[i] + (1.0f - beta_2) * g[i] * g[i] );
+        g[i] = s_scale * s[i] / (u[i] * u_scale + epsilon);
+    }
+    quantized_state_store( adam->qs, block, s );
+    quantized_state_store( adam->qu, block, u );
+}
+
+static void quantized_update( const adam_t *adam, const unsigned int first, const unsigned int last,
+        const unsigned int n_parameters, float *g, const float rho1, const float rho2 )
+{
+    for( unsigned int block = first; block < last; block++ ){
+        const unsigned int offset = block * QUANTIZED_STATE_BLOCK;
+        const int n = n_parameters - offset < QUANTIZED_STATE_BLOCK ? n_parameters - offset : QUANTIZED_STATE_BLOCK;
+        quantized_update_block( adam, block, n, g + offset, rho1, rho2 );
+    }
+}
+
+/* Lazy update with sparse input. Only the parameter ranges touched by the batch are updated.
+ * The decay of the moments for the batches where a range was not touched, is applied when it
+ * is touched again. The (small) updates from the decayed first moment in those batches are
+ * skipped, which is the difference from the dense update. */
+static void adam_lazy_update( adam_t *adam, const int n_ranges, const param_range_t *ranges, float *g,
+        const float beta_1_corrected, const float beta_2_corrected )
+{
+    neuralnet_t *nn = OPTIMIZER(adam)->nn;
+    float *weights = adam->range_weights;
+
+    for ( int k = 0; k < n_ranges; k++ ){
+        const unsigned int offset = ranges[k].offset;
+        const int n = ranges[k].length;
+        float *s = adam->s + offset;
+        float *r = adam->r + offset;
+        float *delta_w = g + offset;
+
+        if( ranges[k].n_skipped > 0 ){
+            const float s_decay = powf( adam->beta_1, (float) ranges[k].n_skipped );
+            const float r_decay = powf( adam->beta_2, (float) ranges[k].n_skipped );
+            for ( int j = 0; j < n; j++ ){
+                s[j] *= s_decay;
+                r[j] *= r_decay;
+            }
+        }
+        update_biased_first_moment ( n, s, delta_w, adam->beta_1 );
+        update_biased_second_moment( n, r, delta_w, adam->beta_2 );
+        compute_update_adam( n, delta_w, s, r, beta_1_corrected, beta_2_corrected, adam->learning_rate );
+
+        if( weights ){
+            /* The weight decay of the skipped batches is not skipped */
+            const float wd = powf( 1.0f - adam->weight_decay, (float) (ranges[k].n_skipped + 1) ) - 1.0f;
+            neuralnet_get_parameter_range( nn, offset, n, weights );
+            for ( int j = 0; j < n; j++ )
+                delta_w[j] += wd * weights[j];
+        }
+        neuralnet_update_range( nn, offset, n, g );
+    }
+}
+
+/* The dense update in the default thread pool, where each thread updates its slice of the
+ * moments. The slices are whole cache lines. */
+typedef struct {
+    adam_t *adam;
+    float *g;
+    unsigned int n_parameters;
+    float beta_1_corrected;
+    float beta_2_corrected;
+} adam_job_t;
+
+static void adam_update_job( threadpool_t *pool, void *arg, const int thread, const int n_threads )
+{
+    const adam_job_t *job = (const adam_job_t *) arg;
+    const adam_t *adam = job->adam;
+    unsigned int first, last;
+    if( adam->qs ){
+        threadpool_split( quantized_state_n_blocks( adam->qs ), thread, n_threads, &first, &last );
+        quantized_update( adam, first, last, job->n_parameters, job->g, job->beta_1_corrected, job->beta_2_corrected );
+        return;
+    }
+    threadpool_split( (job->n_parameters + 15) / 16, thread, n_threads, &first, &last );
+    const unsigned int offset = first * 16;
+    const unsigned int end = last * 16 < job->n_parameters ? last * 16 : job->n_parameters;
+    if( offset >= end )
+        return;
+    const int n = end - offset;
+    update_biased_first_moment ( n, adam->s + offset, job->g + offset, adam->beta_1 );
+    update_biased_second_moment( n, adam->r + offset, job->g + offset, adam->beta_2 );
+    compute_update_adam( n, job->g + offset, adam->s + offset, adam->r + offset,
+            job->beta_1_corrected, job->beta_2_corrected, adam->learning_rate );
+    (void) pool;
+}
+
 /* This is adding the Decoupled Weight Decay Regulatization suggested by
  * by Ilya Loshchilov, Frank Hutter (2019) aka. AdamW */
 void adam_run_epoch( optimizer_t *opt,
@@ -155,28 +320,44 @@ void adam_run_epoch( optimizer_t *opt,
     neuralnet_t *nn = opt->nn;
     const unsigned int n_parameters = neuralnet_total_n_parameters( nn );
 
-    static float beta_1_corrected = 1.0f;
-    static float beta_2_corrected = 1.0f;
-
     /* One epoch */
     for ( unsigned int i = 0; i < n_train_samples ;  ){
 
         float SIMD_ALIGN(g[n_parameters]);
         optimizer_calc_batch_gradient( opt, n_train_samples, train_X, train_Y, &i, g );
+        if( opt->failed ) break;
         if(opt->progress) opt->progress( i, n_train_samples, "Train: " );
         
-        beta_1_corrected *= adam->beta_1;
-        beta_2_corrected *= adam->beta_2;
-
-        #pragma omp parallel sections
-        {
-            #pragma omp section
-            update_biased_first_moment ( n_parameters, adam->s, g, adam->beta_1 );
-            #pragma omp section
-            update_biased_second_moment( n_parameters, adam->r, g, adam->beta_2 );
+        const float beta_1_corrected = adam->beta_1_corrected *= adam->beta_1;
+        const float beta_2_corrected = adam->beta_2_corrected *= adam->beta_2;
+
+        const param_range_t *ranges;
+        const int n_ranges = optimizer_lazy_ranges( opt, &ranges );
+        if( n_ranges > 0 ){
+            adam_lazy_update( adam, n_ranges, ranges, g, beta_1_corrected, beta_2_corrected );
+            continue;
         }
 
-        compute_update_adam( n_parameters, g, adam->s, adam->r, beta_1_corrected, beta_2_corrected, adam->learning_rate );
+        adam_job_t job = { .adam = adam, .g = g, .n_parameters = n_parameters,
+            .beta_1_corrected = beta_1_corrected, .beta_2_corrected = beta_2_corrected };
+        if( threadpool_run( threadpool_default(), adam_update_job, &job ) < 0 ){
+            if( adam->qs ){
+                const int n_blocks = quantized_state_n_blocks( adam->qs );
+                #pragma omp parallel for
+                for( int block = 0; block < n_blocks; block++ )
+                    quantized_update( adam, block, block + 1, n_parameters, g, beta_1_corrected, beta_2_corrected );
+            } else {
+                #pragma omp parallel sections
+                {
+                    #pragma omp section
+                    update_biased_first_moment ( n_parameters, adam->s, g, adam->beta_1 );
+                    #pragma omp section
+                    update_biased_second_moment( n_parameters, adam->r, g, adam->beta_2 );
+                }
+
+                compute_update_adam( n_parameters, g, adam->s, adam->r, beta_1_corrected, beta_2_corrected, adam->learning_rate );
+            }
+        }
 
         if( adam->weight_decay > 0.0f ){
             float SIMD_ALIGN(weights[n_parameters]);
@@ -1,5 +1,6 @@
 /* This is the implementation of the abstract optimizer type */
 #include "optimizer.h"
+#include "quantized_state.h"
 
 /* ---- Adam (Kingma and Ba, 2014) The name derives from "adaptive moments". ---- */
 /* This implementation adds the Decoupled Weights Decay Regularization
@@ -13,8 +14,10 @@ typedef struct _adam_properties_t {
     float beta_1;
     float beta_2;
     float weight_decay;
+    optimizer_state_format_t state_format;  /* The precision of the moments. See quantized_state.h */
 } adam_properties_t;
 #define ADAM_PROPERTIES(...) \
     &((adam_properties_t)  \
-            { .learning_rate = 0.001f, .beta_1 = 0.9f, .beta_2 = 0.999f, .weight_decay = 1e-4f, __VA_ARGS__ })
+            { .learning_rate = 0.001f, .beta_1 = 0.9f, .beta_2 = 0.999f, .weight_decay = 1e-4f, \
+              .state_format = OPTIMIZER_STATE_FP32, __VA_ARGS__ })
 
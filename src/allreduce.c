@@ -0,0 +1,389 @@
+/* allreduce.c - Øystein Schønning-Johansen 2023 */
+/*
+ vim: ts=4 sw=4 softtabstop=4 expandtab
+*/
+#define _DEFAULT_SOURCE   /* getaddrinfo(), MSG_NOSIGNAL etc. with -std=c99 */
+#include "allreduce.h"
+#include "matrix_operations.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+struct _allreduce_t
+{
+    int           rank;
+    int           world_size;
+    int           send_fd;       /* To the next rank */
+    int           recv_fd;       /* From the previous rank */
+    float        *buffer;        /* Received segment in the reduce-scatter */
+    unsigned int  buffer_size;
+};
+
+/* The host and port of a rank, or the socket path with "unix:" addresses */
+static int rank_address( const char *address, const int rank, char *host, const size_t host_size, int *port )
+{
+    if( !strncmp( address, "unix:", 5 )){
+        *port = -1;
+        return snprintf( host, host_size, "%s.%d", address + 5, rank ) < (int) host_size ? 0 : -1;
+    }
+
+    /* Several entries: one for each rank */
+    const char *entry = address;
+    if( strchr( address, ',' )){
+        for( int r = 0; r < rank && entry; r++ ){
+            entry = strchr( entry, ',' );
+            if( entry ) entry++;
+        }
+        if( !entry )
+            return -1;
+    }
+    const char *colon = strchr( entry, ':' );
+    if( !colon || (size_t) (colon - entry) >= host_size )
+        return -1;
+    memcpy( host, entry, colon - entry );
+    host[colon - entry] = '\0';
+    *port = atoi( colon + 1 ) + (strchr( address, ',' ) ? 0 : rank);
+    return 0;
+}
+
+static int listen_socket( const char *address, const int rank )
+{
+    char host[256];
+    int port;
+    if( rank_address( address, rank, host, sizeof( host ), &port ) < 0 ){
+        fprintf( stderr, "Invalid all-reduce address '%s'.\n", address );
+        return -1;
+    }
+
+    int fd;
+    if( port < 0 ){
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if( strlen( host ) >= sizeof( addr.sun_path )){
+            fprintf( stderr, "Socket path '%s' is too long.\n", host );
+            return -1;
+        }
+        strcpy( addr.sun_path, host );
+        unlink( host );
+        fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+        if( fd < 0 || bind( fd, (struct sockaddr*) &addr, sizeof( addr )) < 0 || listen( fd, 1 ) < 0 ){
+            fprintf( stderr, "Cannot listen on '%s': %s\n", host, strerror( errno ));
+            if( fd >= 0 ) close( fd );
+            return -1;
+        }
+        return fd;
+    }
+
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons( port ), .sin_addr.s_addr = htonl( INADDR_ANY ) };
+    const int one = 1;
+    fd = socket( AF_INET, SOCK_STREAM, 0 );
+    if( fd >= 0 )
+        setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ));
+    if( fd < 0 || bind( fd, (struct sockaddr*) &addr, sizeof( addr )) < 0 || listen( fd, 1 ) < 0 ){
+        fprintf( stderr, "Cannot listen on port %d: %s\n", port, strerror( errno ));
+        if( fd >= 0 ) close( fd );
+        return -1;
+    }
+    return fd;
+}
+
+/* Connects to the next rank. It may not be listening yet, so this is tried again until the timeout. */
+static int connect_socket( const char *address, const int rank )
+{
+    char host[256];
+    int port;
+    if( rank_address( address, rank, host, sizeof( host ), &port ) < 0 ){
+        fprintf( stderr, "Invalid all-reduce address '%s'.\n", address );
+        return -1;
+    }
+
+    const struct timespec pause = { .tv_sec = 0, .tv_nsec = 10 * 1000 * 1000 };
+    for( int waited = 0; waited < ALLREDUCE_TIMEOUT_MS; waited += 10 ){
+        int fd = -1;
+        if( port < 0 ){
+            struct sockaddr_un addr = { .sun_family = AF_UNIX };
+            if( strlen( host ) >= sizeof( addr.sun_path )){
+                fprintf( stderr, "Socket path '%s' is too long.\n", host );
+                return -1;
+            }
+            memcpy( addr.sun_path, host, strlen( host ) + 1 );
+            fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+            if( fd >= 0 && connect( fd, (struct sockaddr*) &addr, sizeof( addr )) == 0 )
+                return fd;
+        } else {
+            char service[16];
+            sprintf( service, "%d", port );
+            struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *info;
+            if( getaddrinfo( host, service, &hints, &info ) != 0 ){
+                fprintf( stderr, "Cannot resolve host '%s'.\n", host );
+                return -1;
+            }
+            fd = socket( info->ai_family, info->ai_socktype, info->ai_protocol );
+            const int ok = fd >= 0 && connect( fd, info->ai_addr, info->ai_addrlen ) == 0;
+            freeaddrinfo( info );
+            if( ok ){
+                const int one = 1;
+                setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ));
+                return fd;
+            }
+        }
+        if( fd >= 0 ) close( fd );
+        nanosleep( &pause, NULL );
+    }
+    fprintf( stderr, "Cannot connect to rank %d at '%s'.\n", rank, host );
+    return -1;
+}
+
+static int accept_socket( const int listen_fd )
+{
+    struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+    if( poll( &pfd, 1, ALLREDUCE_TIMEOUT_MS ) <= 0 ){
+        fprintf( stderr, "Timeout waiting for the previous rank to connect.\n");
+        return -1;
+    }
+    return accept( listen_fd, NULL, NULL );
+}
+
+/**
+  @brief Connect this process to the ring of trainer processes.
+  @param rank The rank of this process (0, ..., world_size-1)
+  @param world_size The number of processes
+  @param address Where the ranks listen. See allreduce.h.
+  @return Pointer to the new all-reduce or NULL on failure.
+
+  All the ranks must call this. It waits (up to ALLREDUCE_TIMEOUT_MS) for the neighbour ranks.
+ */
+allreduce_t *allreduce_new( const int rank, const int world_size, const char *address )
+{
+    if( world_size < 1 || rank < 0 || rank >= world_size || !address ){
+        fprintf( stderr, "Invalid all-reduce rank %d of %d.\n", rank, world_size );
+        return NULL;
+    }
+
+    allreduce_t *ar = calloc( 1, sizeof( allreduce_t ));
+    if( !ar ){
+        fprintf( stderr, "Cannot allocate memory for 'allreduce_t' type.\n");
+        return NULL;
+    }
+    ar->rank       = rank;
+    ar->world_size = world_size;
+    ar->send_fd    = -1;
+    ar->recv_fd    = -1;
+    if( world_size == 1 )
+        return ar;
+
+    /* Listen before connecting, such that the ring can be closed in any order */
+    const int listen_fd = listen_socket( address, rank );
+    if( listen_fd < 0 ){
+        free( ar );
+        return NULL;
+    }
+    ar->send_fd = connect_socket( address, (rank + 1) % world_size );
+    if( ar->send_fd >= 0 )
+        ar->recv_fd = accept_socket( listen_fd );
+    close( listen_fd );
+
+    char host[256];
+    int port;
+    if( rank_address( address, rank, host, sizeof( host ), &port ) == 0 && port < 0 )
+        unlink( host );
+
+    if( ar->send_fd < 0 || ar->recv_fd < 0 ){
+        allreduce_free( ar );
+        return NULL;
+    }
+    fcntl( ar->send_fd, F_SETFL, fcntl( ar->send_fd, F_GETFL ) | O_NONBLOCK );
+    fcntl( ar->recv_fd, F_SETFL, fcntl( ar->recv_fd, F_GETFL ) | O_NONBLOCK );
+    return ar;
+}
+
+/* Sends `n_send` floats to the next rank while receiving `n_recv` floats from the previous rank. The
+   received floats are added to `in` if `add` is true (through the buffer), or else stored in `in`.
+   The floats that have arrived are added while the rest are still being sent and received. Without
+   `add`, the 4 byte words are only copied, so they can also be unsigned ints. */
+static int exchange( allreduce_t *ar, const void *out, const unsigned int n_send,
+        void *in, const unsigned int n_recv, const bool add )
+{
+    const char *send_ptr = (const char*) out;
+    size_t send_left = n_send * sizeof(float);
+    char *recv_ptr = (char*) (add ? ar->buffer : in);
+    const size_t recv_total = n_recv * sizeof(float);
+    size_t received = 0;
+    unsigned int n_done = 0;    /* Floats added */
+
+    while( send_left > 0 || received < recv_total ){
+        struct pollfd fds[2] = {
+            { .fd = ar->send_fd, .events = send_left > 0 ? POLLOUT : 0 },
+            { .fd = ar->recv_fd, .events = received < recv_total ? POLLIN : 0 } };
+        const int ready = poll( fds, 2, ALLREDUCE_TIMEOUT_MS );
+        if( ready < 0 && errno == EINTR )
+            continue;
+        if( ready <= 0 ){
+            fprintf( stderr, "All-reduce of rank %d timed out.\n", ar->rank );
+            return -1;
+        }
+
+        if( send_left > 0 && fds[0].revents ){
+            const ssize_t n = send( ar->send_fd, send_ptr,
+                    send_left < ALLREDUCE_CHUNK_BYTES ? send_left : ALLREDUCE_CHUNK_BYTES, MSG_NOSIGNAL );
+            if( n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ){
+                fprintf( stderr, "All-reduce of rank %d cannot send: %s\n", ar->rank, strerror( errno ));
+                return -1;
+            }
+            if( n > 0 ){
+                send_ptr  += n;
+                send_left -= n;
+            }
+        }
+
+        if( received < recv_total && fds[1].revents ){
+            const size_t want = recv_total - received;
+            const ssize_t n = recv( ar->recv_fd, recv_ptr + received,
+                    want < ALLREDUCE_CHUNK_BYTES ? want : ALLREDUCE_CHUNK_BYTES, 0 );
+            if( n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ){
+                fprintf( stderr, "All-reduce of rank %d lost the previous rank.\n", ar->rank );
+                return -1;
+            }
+            if( n > 0 )
+                received += n;
+            if( add ){
+                const unsigned int n_ready = received / sizeof(float);
+                vector_accumulate_unaligned( n_ready - n_done, (float*) in + n_done, ar->buffer + n_done );
+                n_done = n_ready;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Segment s of a vector of n floats split in `world_size` parts */
+static inline unsigned int segment_start( const unsigned int n, const int world_size, const int s )
+{
+    return (unsigned int) (((unsigned long long) n * s) / world_size);
+}
+
+/**
+  @brief Sum a vector over all the ranks.
+  @param ar The all-reduce
+  @param n Length of the vector. Must be the same in all the ranks.
+  @param data The vector. It is replaced by the sum.
+  @return 0 on success, -1 on failure (like another rank that is gone).
+
+  All the ranks must call this, in the same order.
+ */
+int allreduce_sum( allreduce_t *ar, const unsigned int n, float *data )
+{
+    const int N = ar->world_size;
+    if( N == 1 || n == 0 )
+        return 0;
+
+    const unsigned int max_segment = segment_start( n, N, 1 ) + 1;
+    if( ar->buffer_size < max_segment ){
+        free( ar->buffer );
+        ar->buffer = malloc( max_segment * sizeof(float));
+        if( !ar->buffer ){
+            ar->buffer_size = 0;
+            fprintf( stderr, "Cannot allocate all-reduce buffer.\n");
+            return -1;
+        }
+        ar->buffer_size = max_segment;
+    }
+
+    /* Reduce-scatter: After this, rank r has the sum of segment (r+1) % N */
+    for( int step = 0; step < N - 1; step++ ){
+        const int s_send = (ar->rank - step + N) % N;
+        const int s_recv = (ar->rank - step - 1 + N) % N;
+        const unsigned int send_start = segment_start( n, N, s_send );
+        const unsigned int recv_start = segment_start( n, N, s_recv );
+        if( exchange( ar, data + send_start, segment_start( n, N, s_send + 1 ) - send_start,
+                    data + recv_start, segment_start( n, N, s_recv + 1 ) - recv_start, true ) < 0 )
+            return -1;
+    }
+
+    /* All-gather: Pass the summed segments around */
+    for( int step = 0; step < N - 1; step++ ){
+        const int s_send = (ar->rank + 1 - step + N) % N;
+        const int s_recv = (ar->rank - step + N) % N;
+        const unsigned int send_start = segment_start( n, N, s_send );
+        const unsigned int recv_start = segment_start( n, N, s_recv );
+        if( exchange( ar, data + send_start, segment_start( n, N, s_send + 1 ) - send_start,
+                    data + recv_start, segment_start( n, N, s_recv + 1 ) - recv_start, false ) < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+/**
+  @brief Sum a vector of unsigned integers over all the ranks.
+  @param ar The all-reduce
+  @param n Length of the vector. Must be the same in all the ranks.
+  @param data The vector. It is replaced by the sum.
+  @return 0 on success, -1 on failure.
+
+  This is for short vectors, like sample counts, which are not exact as floats above 2^24. The
+  whole vector is passed N-1 steps around the ring, and each rank adds what it receives.
+ */
+int allreduce_sum_uint( allreduce_t *ar, const unsigned int n, unsigned int *data )
+{
+    if( ar->world_size == 1 || n == 0 )
+        return 0;
+
+    unsigned int *passed = malloc( 2 * n * sizeof(unsigned int));
+    if( !passed ){
+        fprintf( stderr, "Cannot allocate all-reduce buffer.\n");
+        return -1;
+    }
+    unsigned int *received = passed + n;
+    memcpy( passed, data, n * sizeof(unsigned int));
+    for( int step = 0; step < ar->world_size - 1; step++ ){
+        if( exchange( ar, passed, n, received, n, false ) < 0 ){
+            free( passed );
+            return -1;
+        }
+        for( unsigned int i = 0; i < n; i++ )
+            data[i] += received[i];
+        memcpy( passed, received, n * sizeof(unsigned int));
+    }
+    free( passed );
+    return 0;
+}
+
+/**
+  @brief Copy a vector from one rank to all the others.
+  @param ar The all-reduce
+  @param n Length of the vector
+  @param data The vector. Read in the root rank, and written in the others.
+  @param root The rank to copy from
+  @return 0 on success, -1 on failure.
+
+  This is a sum where all but the root rank adds zeros, which is exact.
+ */
+int allreduce_broadcast( allreduce_t *ar, const unsigned int n, float *data, const int root )
+{
+    if( ar->rank != root )
+        memset( data, 0, n * sizeof(float));
+    return allreduce_sum( ar, n, data );
+}
+
+int allreduce_rank( const allreduce_t *ar )       { return ar->rank; }
+int allreduce_world_size( const allreduce_t *ar ) { return ar->world_size; }
+
+void allreduce_free( allreduce_t *ar )
+{
+    if( !ar ) return;
+    if( ar->send_fd >= 0 ) close( ar->send_fd );
+    if( ar->recv_fd >= 0 ) close( ar->recv_fd );
+    free( ar->buffer );
+    free( ar );
+}
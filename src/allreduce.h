@@ -0,0 +1,47 @@
+/* allreduce.h - Øystein Schønning-Johansen 2023 */
+/*
+  vim: ts=4 sw=4 softtabstop=4 expandtab
+ */
+
+/* Ring all-reduce between trainer processes, for data parallel training.
+ *
+ * N processes (ranks 0, ..., N-1) are connected in a ring, where each rank sends to the next rank
+ * and receives from the previous one. The sum of a vector over all the ranks is done in two rounds
+ * of N-1 steps. The vector is split into N segments. In the first round (reduce-scatter), each rank
+ * passes a segment on to the next rank, which adds its own values, such that each rank ends up with
+ * the total sum of one segment. In the second round (all-gather), the summed segments are passed
+ * around the ring. Each rank sends and receives 2 * (N-1)/N of the vector in total, whatever the
+ * number of ranks, so this is bandwidth optimal. The segments are sent and received at the same
+ * time in chunks, and the received chunks are added while the rest is still on the wire.
+ *
+ * All the ranks get the very same sums (to the bit), as each segment is summed by one rank only.
+ *
+ * The address is either "unix:<path>", where rank r listens on the Unix domain socket "<path>.<r>",
+ * or "<host>:<port>", where rank r listens on TCP port <port> + r on <host>. With TCP on several
+ * machines, each rank can be given its own host by listing them: "host0:port,host1:port,...".
+ *
+ * For data parallel training, see `optimizer_set_allreduce()`.
+ */
+#ifndef __ALLREDUCE_H__
+#define __ALLREDUCE_H__
+
+/* The size of the pieces that are sent and received */
+#ifndef ALLREDUCE_CHUNK_BYTES
+#define ALLREDUCE_CHUNK_BYTES (64 * 1024)
+#endif
+
+/* How long to wait for the other ranks (to start up, or to send) before giving up */
+#ifndef ALLREDUCE_TIMEOUT_MS
+#define ALLREDUCE_TIMEOUT_MS 60000
+#endif
+
+typedef struct _allreduce_t allreduce_t;
+
+allreduce_t * allreduce_new       ( const int rank, const int world_size, const char *address );
+int           allreduce_sum       ( allreduce_t *ar, const unsigned int n, float *data );
+int           allreduce_sum_uint  ( allreduce_t *ar, const unsigned int n, unsigned int *data );
+int           allreduce_broadcast ( allreduce_t *ar, const unsigned int n, float *data, const int root );
+int           allreduce_rank      ( const allreduce_t *ar );
+int           allreduce_world_size( const allreduce_t *ar );
+void          allreduce_free      ( allreduce_t *ar );
+#endif /* __ALLREDUCE_H__ */
@@ -0,0 +1,162 @@
+/* async_validation.c - Øystein Schønning-Johansen 2023 */
+/*
+ vim: ts=4 sw=4 softtabstop=4 expandtab
+*/
+#include "async_validation.h"
+#include "evaluate.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <omp.h>
+
+struct _async_validation_t
+{
+    optimizer_t   *opt;
+    neuralnet_t   *shadow;          /* The weights of the epoch that is validated */
+    optimizer_t    view;            /* What the callbacks see: The optimizer with the shadow network */
+    unsigned int   n_valid_samples;
+    const float   *valid_X;
+    const float   *valid_Y;
+    int            n_threads;
+    int            n_threads_before;  /* Restored at free */
+    callback_t   **callbacks;
+    float         *results;         /* Train and validation results of the epoch */
+    int            epoch;           /* Epoch in the shadow, -1 before the first one */
+    bool           running;
+    pthread_t      thread;
+};
+
+static void *validation_thread( void *arg )
+{
+    async_validation_t *av = (async_validation_t*) arg;
+    const int n_metrics = optimizer_get_n_metrics( av->opt );
+
+    /* This only sets the number of threads of the parallel regions started from this thread */
+    omp_set_num_threads( av->n_threads );
+    evaluate( av->shadow, av->n_valid_samples, av->valid_X, av->valid_Y, av->opt->metrics, av->results + n_metrics );
+
+    for( callback_t **cb = av->callbacks; cb && *cb; cb++ )
+        callback_run( *cb, &av->view, av->results, true );
+    return NULL;
+}
+
+/**
+  @brief Create a background validation for an optimizer.
+  @param opt The optimizer. The metrics are taken from the optimizer.
+  @param n_valid_samples Number of validation samples
+  @param valid_X The validation inputs
+  @param valid_Y The validation targets
+  @param props Properties. See ASYNC_VALIDATION_PROPERTIES() in async_validation.h
+  @return Pointer to the new async validation or NULL on failure.
+
+  This reserves `n_threads` of the OpenMP threads for the validation, by lowering the number of
+  threads of the calling thread (the training). It is set back by `async_validation_free()`.
+ */
+async_validation_t *async_validation_new( optimizer_t *opt, const unsigned int n_valid_samples,
+        const float *valid_X, const float *valid_Y, async_validation_properties_t props )
+{
+    if( !opt || !valid_X || !valid_Y || n_valid_samples == 0 || props.n_threads < 1 ){
+        fprintf( stderr, "Async validation needs an optimizer, a validation set and at least one thread.\n");
+        return NULL;
+    }
+
+    async_validation_t *av = calloc( 1, sizeof( async_validation_t ));
+    if( !av ){
+        fprintf( stderr, "Cannot allocate memory for 'async_validation_t' type.\n");
+        return NULL;
+    }
+    av->opt             = opt;
+    av->n_valid_samples = n_valid_samples;
+    av->valid_X         = valid_X;
+    av->valid_Y         = valid_Y;
+    av->n_threads       = props.n_threads;
+    av->epoch           = -1;
+
+    int n_callbacks = 0;
+    for( callback_t **cb = props.callbacks; cb && *cb; cb++ )
+        n_callbacks++;
+
+    av->shadow    = neuralnet_clone_structure( opt->nn );
+    av->results   = calloc( 2 * (optimizer_get_n_metrics( opt ) + 1), sizeof(float));
+    av->callbacks = calloc( n_callbacks + 1, sizeof( callback_t* ));
+    if( !av->shadow || !av->results || !av->callbacks ){
+        fprintf( stderr, "Cannot allocate memory for async validation.\n");
+        async_validation_free( av );
+        return NULL;
+    }
+    if( n_callbacks )
+        memcpy( av->callbacks, props.callbacks, n_callbacks * sizeof( callback_t* ));
+
+    av->n_threads_before = omp_get_max_threads();
+    if( av->n_threads_before > av->n_threads )
+        omp_set_num_threads( av->n_threads_before - av->n_threads );
+    return av;
+}
+
+/**
+  @brief Start the validation of the current weights in the background.
+  @param av The async validation
+  @param train_results The train metrics of the epoch (from `optimizer_run_epoch()`). These are passed on to
+         the callbacks together with the validation metrics.
+  @return The epoch that is validated.
+
+  If the validation of the previous epoch is still running, this waits for it first. Then the weights
+  are copied to the shadow network, and the evaluation and the callbacks are done in a new thread.
+ */
+int async_validation_start( async_validation_t *av, const float *train_results )
+{
+    async_validation_wait( av, NULL );
+
+    const int n_metrics = optimizer_get_n_metrics( av->opt );
+    neuralnet_copy_weights( av->shadow, av->opt->nn );
+    memcpy( av->results, train_results, n_metrics * sizeof(float));
+    av->epoch = av->opt->epoch - 1;
+
+    av->view       = *av->opt;
+    av->view.nn    = av->shadow;
+    av->view.epoch = av->epoch;
+
+    if( pthread_create( &av->thread, NULL, validation_thread, av ) != 0 ){
+        /* Do it right here then, and give the training its threads back */
+        fprintf( stderr, "Warning: Cannot start validation thread. Validating in the calling thread.\n");
+        validation_thread( av );
+        omp_set_num_threads( av->n_threads_before > av->n_threads ? av->n_threads_before - av->n_threads : 1 );
+        return av->epoch;
+    }
+    av->running = true;
+    return av->epoch;
+}
+
+/**
+  @brief Wait for the running validation (if any) to finish.
+  @param av The async validation
+  @param results If not NULL, the train and validation results of the last validated epoch (2 * n_metrics).
+  @return The last validated epoch, or -1 if none is started yet.
+ */
+int async_validation_wait( async_validation_t *av, float *results )
+{
+    if( av->running ){
+        pthread_join( av->thread, NULL );
+        av->running = false;
+    }
+    if( results && av->epoch >= 0 )
+        memcpy( results, av->results, 2 * optimizer_get_n_metrics( av->opt ) * sizeof(float));
+    return av->epoch;
+}
+
+/**
+  @brief Wait for the running validation and free the resources. The callbacks are not freed.
+ */
+void async_validation_free( async_validation_t *av )
+{
+    if( !av ) return;
+    async_validation_wait( av, NULL );
+    if( av->n_threads_before > 0 )
+        omp_set_num_threads( av->n_threads_before );
+    neuralnet_free( av->shadow );
+    free( av->results );
+    free( av->callbacks );
+    free( av );
+}
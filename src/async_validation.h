@@ -0,0 +1,55 @@
+/* async_validation.h - Øystein Schønning-Johansen 2023 */
+/*
+  vim: ts=4 sw=4 softtabstop=4 expandtab
+ */
+
+/* Validation in the background, overlapping with the training of the next epoch.
+ *
+ * Instead of evaluating the validation set at the end of `optimizer_run_epoch()`, while all the
+ * training threads wait, the weights are copied once into a shadow neural network, and the
+ * validation set is evaluated on the shadow by a background thread with its own (small) number
+ * of OpenMP threads. In the meantime, the next epoch is trained with the remaining threads.
+ *
+ * The callbacks are called from the background thread when the validation of an epoch is done,
+ * always in epoch order. They get an optimizer where `nn` is the shadow network (so modelcheckpoint
+ * saves the weights the results belong to) and `epoch` is the epoch of the results. Note that
+ * a callback result, like `earlystopping_do_stop()`, is then known one epoch later than usual.
+ *
+ * Typical usage:
+
+        async_validation_t *av = async_validation_new( opt, n_valid, valid_X, valid_Y,
+                ASYNC_VALIDATION_PROPERTIES( .n_threads = 2, .callbacks = callbacks ));
+
+        for ( int epoch = 0; epoch < n_epochs; epoch++ ){
+            optimizer_run_epoch( opt, n_train, train_X, train_Y, 0, NULL, NULL, results );
+            async_validation_start( av, results );
+        }
+        async_validation_wait( av, results );
+        async_validation_free( av );
+ */
+
+#ifndef __ASYNC_VALIDATION_H__
+#define __ASYNC_VALIDATION_H__
+#include "optimizer.h"
+#include "callback.h"
+
+typedef struct _async_validation_t async_validation_t;
+typedef struct _async_validation_properties_t async_validation_properties_t;
+struct _async_validation_properties_t {
+    int          n_threads;   /* OpenMP threads for the validation. The training gets the rest. */
+    callback_t **callbacks;   /* NULL terminated (or NULL). Called for each epoch from the background thread. */
+};
+
+/* These are the default values. */
+#define ASYNC_VALIDATION_PROPERTIES(...) (async_validation_properties_t) \
+            { .n_threads = 1,       \
+              .callbacks = NULL,    \
+              __VA_ARGS__ }
+
+async_validation_t * async_validation_new  ( optimizer_t *opt, const unsigned int n_valid_samples,
+                                             const float *valid_X, const float *valid_Y,
+                                             async_validation_properties_t props );
+int                  async_validation_start( async_validation_t *av, const float *train_results );
+int                  async_validation_wait ( async_validation_t *av, float *results );
+void                 async_validation_free ( async_validation_t *av );
+#endif /* __ASYNC_VALIDATION_H__ */
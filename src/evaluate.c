@@ -4,54 +4,335 @@
 */
 #include "evaluate.h"
 #include "neuralnet_predict_batch.h"
+#include "activation.h"
+#include "ranking_metrics.h"
+#include "threadpool.h"
 #include "simd.h"
 #include <string.h>
+#include <assert.h>
 
 #include <omp.h>
 
+typedef float (*softmax_loss_func)( const int n, float *ar, const float *y_real, float *grad );
+
+/* With a softmax output layer, the (sparse) categorical crossentropy metric is calculated from the
+   logits with the fused log-sum-exp kernel, and the probabilities for the other metrics come out of
+   the same pass. Returns the fused kernel and sets `fused_metric` to the metric it replaces, or NULL
+   if there is no such metric. */
+static softmax_loss_func get_softmax_loss( const neuralnet_t *nn, metric_func metrics[], metric_func *fused_metric )
+{
+    *fused_metric = NULL;
+    if( nn->layer[nn->n_layers-1].activation_func != get_activation_func( "softmax" ))
+        return NULL;
+
+    const metric_func cce  = get_metric_func( "categorical_crossentropy" );
+    const metric_func scce = get_metric_func( "sparse_categorical_crossentropy" );
+    for ( metric_func *mf_ptr = metrics; *mf_ptr; mf_ptr++ ){
+        if( *mf_ptr == cce || *mf_ptr == scce ){
+            *fused_metric = *mf_ptr;
+            return *mf_ptr == cce ? softmax_crossentropy : sparse_softmax_crossentropy;
+        }
+    }
+    return NULL;
+}
+
+/* Adds the metrics of a block of samples to `sums`. With a fused softmax loss, `y_pred` are the logits,
+   which are turned into probabilities here, and the fused metric comes from the log-sum-exp. All the
+   other metrics are done in one pass by metrics_accumulate_batch(). The ranking metrics are not sums,
+   and are left out here. If `ranking` is given, the samples are added to it. */
+static void accumulate_metrics( metric_func metrics[], const metric_func fused_metric, const softmax_loss_func softmax_loss,
+        const int n_samples, const int n_output, float *y_pred, const float *y_real, const int n_target, float *sums,
+        ranking_state_t *ranking )
+{
+    int n_metrics = 0;
+    for ( metric_func *mf_ptr = metrics; *mf_ptr; mf_ptr++ )
+        n_metrics++;
+
+    float xent = 0.0f;
+    if( softmax_loss )
+        for ( int i = 0; i < n_samples; i++ )   /* Same scaling as in the metric */
+            xent += softmax_loss( n_output, y_pred + i*n_output, y_real + i*n_target, NULL ) / (float) n_output;
+
+    metric_func others[n_metrics + 1];
+    int n_others = 0;
+    for ( int j = 0; j < n_metrics; j++ )
+        if( metrics[j] != fused_metric && !metric_is_ranking( metrics[j] ))
+            others[n_others++] = metrics[j];
+    others[n_others] = NULL;
+
+    float other_sums[n_others + 1];
+    memset( other_sums, 0, (n_others + 1) * sizeof(float));
+    metrics_accumulate_batch( others, n_samples, n_output, y_pred, y_real, n_target, other_sums );
+
+    for ( int j = 0, k = 0; j < n_metrics; j++ )
+        sums[j] += metrics[j] == fused_metric ? xent : metric_is_ranking( metrics[j] ) ? 0.0f : other_sums[k++];
+
+    if( ranking )
+        ranking_state_add( ranking, n_samples, n_output, y_pred, y_real, n_target );
+}
+
+/* A ranking state for the whole data set if there are ranking metrics, else NULL */
+static ranking_state_t *new_ranking_state( metric_func metrics[] )
+{
+    for ( metric_func *mf_ptr = metrics; *mf_ptr; mf_ptr++ )
+        if( metric_is_ranking( *mf_ptr ))
+            return ranking_state_new( metrics_need_exact( metrics ));
+    return NULL;
+}
+
+/* Each thread has its own ranking state. The exact pairs are sorted by each thread before the merge. */
+static void merge_ranking_state( ranking_state_t *ranking, ranking_state_t *local )
+{
+    if( !local )
+        return;
+    ranking_state_sort( local );
+    #pragma omp critical
+    ranking_state_merge( ranking, local );
+    ranking_state_free( local );
+}
+
+static void ranking_results( ranking_state_t *ranking, metric_func metrics[], float *results )
+{
+    if( !ranking )
+        return;
+    for ( int i = 0; metrics[i]; i++ )
+        if( metric_is_ranking( metrics[i] ))
+            results[i] = ranking_state_result( ranking, metrics[i] );
+    ranking_state_free( ranking );
+}
+
+/* The validation set is predicted in chunks of samples. The activations of a chunk (all layers) should fit
+   in the L2 cache, such that the batched forward pass reads each weight once per chunk, and the metrics
+   are calculated while the outputs are still in cache. The memory does not grow with the number of samples. */
+#ifndef EVALUATE_CHUNK_FLOATS
+#define EVALUATE_CHUNK_FLOATS (32 * 1024)
+#endif
+
+static int evaluate_chunk_size( const neuralnet_t *nn, const int n_samples )
+{
+    int floats_per_sample = 0;
+    for( int i = 0; i < nn->n_layers; i++ )
+        floats_per_sample += nn->layer[i].n_output;
+    int chunk = EVALUATE_CHUNK_FLOATS / floats_per_sample;
+    if( chunk < 1 ) chunk = 1;
+    return chunk < n_samples ? chunk : n_samples;
+}
+
+/* The rows of a chunk with sparse input are predicted one at a time. The chunks just save the
+   threads from taking the rows one by one. */
+#define EVALUATE_SPARSE_CHUNK 64
+
+/* The evaluation in the default thread pool. The threads take the next chunk in turn (like the dynamic
+   schedule of OpenMP), and each thread sums its own metrics and ranking state, which are added up after
+   the job. The work memory is the scratch memory of the threads. */
+typedef struct {
+    const neuralnet_t     *nn;
+    metric_func           *metrics;
+    metric_func            fused_metric;
+    softmax_loss_func      softmax_loss;
+    int                    n_metrics;
+    const float           *X;             /* NULL with sparse input */
+    const sparse_matrix_t *sparse_X;
+    const float           *Y;
+    int                    n_samples;
+    int                    chunk;
+    int                    next;          /* The next chunk. Atomic. */
+    float                 *sums;          /* n_threads x n_metrics */
+    ranking_state_t      **ranking;       /* One for each thread, or NULL */
+} evaluate_job_t;
+
+static void evaluate_job( threadpool_t *pool, void *arg, const int thread, const int n_threads )
+{
+    (void) n_threads;
+    evaluate_job_t *job = (evaluate_job_t *) arg;
+    const neuralnet_t *nn = job->nn;
+    const int n_input  = nn->layer[0].n_input;
+    const int n_output = nn->layer[nn->n_layers-1].n_output;
+    const int n_target = neuralnet_target_size( nn );
+    float *sums = job->sums + thread * job->n_metrics;
+    ranking_state_t *ranking = job->ranking ? job->ranking[thread] : NULL;
+    memset( sums, 0, job->n_metrics * sizeof(float));
+
+    const unsigned int workmem_sz = job->sparse_X ? 0 : neuralnet_predict_batch_workmem_size( nn, job->chunk );
+    const unsigned int output_sz  = ((job->sparse_X ? 1 : job->chunk) * n_output + floats_per_simd_register - 1) /
+        floats_per_simd_register * floats_per_simd_register;
+    float *workmem = threadpool_scratch( pool, thread, output_sz + workmem_sz );
+    assert( workmem );
+    float *predictions = workmem + workmem_sz;
+
+    for(;;){
+        const int first = __atomic_fetch_add( &job->next, 1, __ATOMIC_RELAXED ) * job->chunk;
+        if( first >= job->n_samples )
+            break;
+        const int n = first + job->chunk < job->n_samples ? job->chunk : job->n_samples - first;
+        if( job->sparse_X ){
+            for ( int i = first; i < first + n; i++ ){
+                const sparse_vector_t x = sparse_matrix_row( job->sparse_X, i );
+                if( job->softmax_loss )
+                    neuralnet_predict_logits_sparse( nn, &x, predictions );
+                else
+                    neuralnet_predict_sparse( nn, &x, predictions );
+                accumulate_metrics( job->metrics, job->fused_metric, job->softmax_loss, 1, n_output, predictions,
+                        job->Y + (size_t) i * n_target, n_target, sums, ranking );
+            }
+        } else {
+            neuralnet_predict_batch_workmem( nn, n, job->X + (size_t) first * n_input, predictions, workmem,
+                    job->softmax_loss != NULL );
+            accumulate_metrics( job->metrics, job->fused_metric, job->softmax_loss, n, n_output, predictions,
+                    job->Y + (size_t) first * n_target, n_target, sums, ranking );
+        }
+    }
+}
+
+/* Runs the evaluation in the default thread pool, and adds the sums of the metrics to `local_results`.
+   Returns false if there is no pool or it is busy, and then OpenMP is used as before. */
+static bool evaluate_in_pool( evaluate_job_t *job, float *local_results, ranking_state_t *ranking )
+{
+    threadpool_t *pool = threadpool_default();
+    if( !pool )
+        return false;
+    const int n_threads = threadpool_n_threads( pool );
+    float sums[n_threads * job->n_metrics];
+    ranking_state_t *local_ranking[n_threads];
+    for ( int t = 0; t < n_threads; t++ )
+        local_ranking[t] = ranking ? ranking_state_new( metrics_need_exact( job->metrics )) : NULL;
+    job->sums    = sums;
+    job->ranking = ranking ? local_ranking : NULL;
+    job->next    = 0;
+
+    const bool done = threadpool_run( pool, evaluate_job, job ) == 0;
+    for ( int t = 0; t < n_threads; t++ ){
+        for ( int j = 0; done && j < job->n_metrics; j++ )
+            local_results[j] += sums[t * job->n_metrics + j];
+        if( done )
+            merge_ranking_state( ranking, local_ranking[t] );
+        else
+            ranking_state_free( local_ranking[t] );
+    }
+    return done;
+}
+
 void evaluate( neuralnet_t *nn, const int n_valid_samples, const float *valid_X, const float *valid_Y,
         metric_func metrics[], float *results )
 {
-#ifndef USE_CBLAS 
     const int n_input  = nn->layer[0].n_input;
-#endif
     const int n_output = nn->layer[nn->n_layers-1].n_output;
+    const int n_target = neuralnet_target_size( nn );
+
+    int n_metrics = 0;
+    for ( metric_func *mf_ptr = metrics; *mf_ptr; mf_ptr++ )
+        n_metrics++;
+
+    if( n_metrics == 0 ){
+        *results = -1.0f;
+        return;
+    }
+    if( metrics_check_targets( metrics, n_output, n_target ) < 0 ){
+        for ( int j = 0; j < n_metrics; j++ )
+            results[j] = -1.0f;
+        return;
+    }
+    if( n_valid_samples <= 0 ){
+        memset( results, 0, n_metrics * sizeof(float));
+        return;
+    }
+
+    metric_func fused_metric;
+    const softmax_loss_func softmax_loss = get_softmax_loss( nn, metrics, &fused_metric );
+
+    const int chunk = evaluate_chunk_size( nn, n_valid_samples );
+    const int n_chunks = (n_valid_samples + chunk - 1) / chunk;
+    const unsigned int workmem_sz = neuralnet_predict_batch_workmem_size( nn, chunk );
+    const unsigned int output_sz  = (chunk * n_output + floats_per_simd_register - 1) / floats_per_simd_register * floats_per_simd_register;
 
-    metric_func *mf_ptr = metrics;
+    ranking_state_t *ranking = new_ranking_state( metrics );
+
+    float local_results[n_metrics];
+    memset( local_results, 0, n_metrics * sizeof(float));
+    evaluate_job_t job = { .nn = nn, .metrics = metrics, .fused_metric = fused_metric, .softmax_loss = softmax_loss,
+        .n_metrics = n_metrics, .X = valid_X, .Y = valid_Y, .n_samples = n_valid_samples, .chunk = chunk };
+    if( !evaluate_in_pool( &job, local_results, ranking )){
+        #pragma omp parallel reduction(+:local_results[:n_metrics])
+        {
+            /* One allocation per thread, and not per chunk */
+            float *workmem = simd_malloc( (output_sz + workmem_sz) * sizeof(float));
+            assert( workmem );
+            float *predictions = workmem + workmem_sz;
+            ranking_state_t *local_ranking = ranking ? ranking_state_new( metrics_need_exact( metrics )) : NULL;
+
+            #pragma omp for schedule(dynamic)
+            for ( int c = 0; c < n_chunks; c++ ){
+                const int first = c * chunk;
+                const int n = first + chunk < n_valid_samples ? chunk : n_valid_samples - first;
+                neuralnet_predict_batch_workmem( nn, n, valid_X + (size_t) first * n_input, predictions, workmem,
+                        softmax_loss != NULL );
+                accumulate_metrics( metrics, fused_metric, softmax_loss, n, n_output, predictions,
+                        valid_Y + (size_t) first * n_target, n_target, local_results, local_ranking );
+            }
+            simd_free( workmem );
+            merge_ranking_state( ranking, local_ranking );
+        }
+    }
+
+    for ( int i = 0; i < n_metrics; i++ )
+        results[i] = local_results[i] / (float) n_valid_samples;
+    ranking_results( ranking, metrics, results );
+}
+
+/**
+  @brief Same as `evaluate()`, but with the inputs given as a sparse (CSR) matrix.
+ */
+void evaluate_sparse( neuralnet_t *nn, const sparse_matrix_t *valid_X, const float *valid_Y,
+        metric_func metrics[], float *results )
+{
+    const int n_output = nn->layer[nn->n_layers-1].n_output;
+    const int n_target = neuralnet_target_size( nn );
+    const int n_valid_samples = valid_X->n_rows;
 
     int n_metrics = 0;
-    while ( *mf_ptr++ ){
+    for ( metric_func *mf_ptr = metrics; *mf_ptr; mf_ptr++ )
         n_metrics++;
-	}
 
-	if( n_metrics == 0 ){
-		*results = -1.0f;
-		return;
-	}
+    if( n_metrics == 0 ){
+        *results = -1.0f;
+        return;
+    }
+    if( metrics_check_targets( metrics, n_output, n_target ) < 0 ){
+        for ( int j = 0; j < n_metrics; j++ )
+            results[j] = -1.0f;
+        return;
+    }
+
+    metric_func fused_metric;
+    const softmax_loss_func softmax_loss = get_softmax_loss( nn, metrics, &fused_metric );
+
+    ranking_state_t *ranking = new_ranking_state( metrics );
 
     float local_results[n_metrics];
     memset( local_results, 0, n_metrics * sizeof(float));
-#ifdef USE_CBLAS
-    float predictions[ n_output * n_valid_samples ];
-    memset( predictions, 0, n_output * n_valid_samples * sizeof(float));
-    neuralnet_predict_batch( nn, n_valid_samples, valid_X, predictions);
-#endif
-    #pragma omp parallel for reduction(+:local_results[:])
-    for ( int i = 0; i < n_valid_samples; i++ ){
-#ifdef USE_CBLAS
-        float *y_pred = predictions + (i*n_output);
-#else
-        SIMD_ALIGN(float y_pred[n_output]);
-        neuralnet_predict( nn, valid_X + (i*n_input), y_pred );
-#endif
-        float *res = local_results;
-        for ( int j = 0; j < n_metrics; j++ ){
-            float _error = metrics[j]( n_output, y_pred, valid_Y + (i*n_output));
-            *res++ += _error;
+    evaluate_job_t job = { .nn = nn, .metrics = metrics, .fused_metric = fused_metric, .softmax_loss = softmax_loss,
+        .n_metrics = n_metrics, .sparse_X = valid_X, .Y = valid_Y, .n_samples = n_valid_samples,
+        .chunk = EVALUATE_SPARSE_CHUNK };
+    if( !evaluate_in_pool( &job, local_results, ranking )){
+        #pragma omp parallel reduction(+:local_results[:])
+        {
+            ranking_state_t *local_ranking = ranking ? ranking_state_new( metrics_need_exact( metrics )) : NULL;
+            #pragma omp for
+            for ( int i = 0; i < n_valid_samples; i++ ){
+                SIMD_ALIGN(float y_pred[n_output]);
+                const sparse_vector_t x = sparse_matrix_row( valid_X, i );
+                if( softmax_loss )
+                    neuralnet_predict_logits_sparse( nn, &x, y_pred );
+                else
+                    neuralnet_predict_sparse( nn, &x, y_pred );
+                accumulate_metrics( metrics, fused_metric, softmax_loss, 1, n_output, y_pred, valid_Y + (i*n_target),
+                        n_target, local_results, local_ranking );
+            }
+            merge_ranking_state( ranking, local_ranking );
         }
     }
 
-    float *res = results;
     for ( int i = 0; i < n_metrics; i++ )
-        *res++ = local_results[i] / (float) n_valid_samples;
+        results[i] = local_results[i] / (float) n_valid_samples;
+    ranking_results( ranking, metrics, results );
 }
@@ -9,4 +9,6 @@
 
 void evaluate( neuralnet_t *nn, const int n_valid_samples, const float *valid_X, const float *valid_Y,
         metric_func metrics[], float *results );
+void evaluate_sparse( neuralnet_t *nn, const sparse_matrix_t *valid_X, const float *valid_Y,
+        metric_func metrics[], float *results );
 #endif  /* __EVALUATE_H__ */
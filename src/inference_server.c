@@ -0,0 +1,774 @@
+/* inference_server.c - Øystein Schønning-Johansen 2023 */
+/*
+ vim: ts=4 sw=4 softtabstop=4 expandtab
+*/
+#define _DEFAULT_SOURCE   /* MSG_NOSIGNAL, clock_gettime() etc. with -std=c99 */
+#include "inference_server.h"
+#include "neuralnet_predict_batch.h"
+#include "simd.h"
+#include "sync_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+typedef struct _connection_t connection_t;
+typedef struct _batch_t batch_t;
+
+/* The server loop reads the requests, and the workers send the responses. The connection is freed
+   (and the socket closed) when neither the loop nor any batch refers to it. */
+struct _connection_t {
+    int                 fd;
+    int                 refcount;      /* Guarded by the server lock */
+    int                 closed;        /* No more responses. Atomic. */
+    bool                waiting;       /* For a free batch */
+    pthread_mutex_t     send_lock;     /* Several workers can respond at the same time */
+    inference_header_t  header;        /* The request being read */
+    unsigned int        header_bytes;
+    char               *payload;       /* Where the rest of the payload goes, NULL to skip it */
+    size_t              payload_left;
+    batch_t            *batch;         /* The batch of the request being read */
+    connection_t       *next;
+};
+
+typedef struct {
+    connection_t *conn;
+    uint32_t      id;
+    unsigned int  row;
+    unsigned int  n_samples;
+    uint32_t      status;      /* A rejected request has no rows, and is answered with the batch */
+} request_t;
+
+struct _batch_t {
+    float        *input;       /* max_batch x n_input */
+    float        *output;      /* max_batch x n_output */
+    request_t    *request;
+    unsigned int  n_requests;
+    unsigned int  n_rejected;
+    unsigned int  n_rows;
+    int           pending;     /* Payloads that are not read yet */
+    bool          sealed;      /* No more requests, run it when the payloads are read */
+    double        deadline;
+    batch_t      *next;
+};
+
+typedef struct {
+    inference_server_t *server;
+    float              *workmem;
+    pthread_t           thread;
+} worker_t;
+
+struct _inference_server_t {
+    const neuralnet_t  *nn;
+    inference_server_properties_t props;
+    unsigned int        n_input;
+    unsigned int        n_output;
+    char                path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    int                 listen_fd;
+    int                 wake_pipe[2];
+    int                 stop;              /* Atomic */
+    connection_t       *connections;       /* Read by the server loop */
+    unsigned int        n_connections;
+    struct pollfd      *pollfd;
+    connection_t      **polled;
+    unsigned int        poll_size;
+    batch_t            *batches;
+    int                 n_batches;
+    batch_t            *open;              /* Being filled by the server loop */
+    worker_t           *worker;
+    int                 n_workers;         /* Started */
+
+    /* Guarded by the lock */
+    pthread_mutex_t     lock;
+    pthread_cond_t      work_cond;
+    batch_t            *free_list;
+    batch_t            *queue_head;
+    batch_t            *queue_tail;
+    int                 n_queued;
+    int                 n_idle;
+    bool                shutdown;
+    inference_server_stats_t stats;
+};
+
+static void wake( inference_server_t *server )
+{
+    const char c = 0;
+    if( write( server->wake_pipe[1], &c, 1 ) < 0 ){
+        /* The pipe is full, so the loop wakes up anyway */
+    }
+}
+
+/* Sends all the iovecs, waiting for the socket if it is full */
+static int send_all( const int fd, struct iovec *iov, int iovcnt )
+{
+    while( iovcnt > 0 ){
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        const ssize_t sent = sendmsg( fd, &msg, MSG_NOSIGNAL );
+        if( sent < 0 ){
+            if( errno == EINTR )
+                continue;
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            if(( errno == EAGAIN || errno == EWOULDBLOCK ) && poll( &pfd, 1, INFERENCE_SEND_TIMEOUT_MS ) > 0 )
+                continue;
+            return -1;
+        }
+        size_t left = (size_t) sent;
+        while( iovcnt > 0 && left >= iov->iov_len ){
+            left -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if( iovcnt > 0 ){
+            iov->iov_base = (char *) iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return 0;
+}
+
+static int recv_all( const int fd, void *buffer, size_t size )
+{
+    char *p = buffer;
+    while( size > 0 ){
+        const ssize_t got = read( fd, p, size );
+        if( got < 0 && errno == EINTR )
+            continue;
+        if( got <= 0 )
+            return -1;
+        p += got;
+        size -= (size_t) got;
+    }
+    return 0;
+}
+
+static void respond( connection_t *conn, const uint32_t id, const unsigned int n_samples, const uint32_t status,
+        const float *output, const unsigned int n_output )
+{
+    inference_header_t header = { .magic = INFERENCE_MAGIC, .id = id, .n_samples = n_samples, .status = status };
+    struct iovec iov[2] = {
+        { .iov_base = &header, .iov_len = sizeof(header) },
+        { .iov_base = (void *) output, .iov_len = status == INFERENCE_OK ? n_samples * n_output * sizeof(float) : 0 }
+    };
+    pthread_mutex_lock( &conn->send_lock );
+    if( !__atomic_load_n( &conn->closed, __ATOMIC_ACQUIRE ) && send_all( conn->fd, iov, 2 ) < 0 ){
+        __atomic_store_n( &conn->closed, 1, __ATOMIC_RELEASE );
+        shutdown( conn->fd, SHUT_RDWR );  /* The server loop sees this and drops the connection */
+    }
+    pthread_mutex_unlock( &conn->send_lock );
+}
+
+static void connection_release( inference_server_t *server, connection_t *conn )
+{
+    pthread_mutex_lock( &server->lock );
+    const int refcount = --conn->refcount;
+    pthread_mutex_unlock( &server->lock );
+    if( refcount > 0 )
+        return;
+    close( conn->fd );
+    pthread_mutex_destroy( &conn->send_lock );
+    free( conn );
+}
+
+static void *worker_thread( void *arg )
+{
+    worker_t *worker = (worker_t *) arg;
+    inference_server_t *server = worker->server;
+
+    pthread_mutex_lock( &server->lock );
+    server->n_idle++;
+    for(;;){
+        while( !server->queue_head && !server->shutdown )
+            pthread_cond_wait( &server->work_cond, &server->lock );
+        batch_t *batch = server->queue_head;
+        if( !batch )
+            break;
+        server->queue_head = batch->next;
+        if( !server->queue_head )
+            server->queue_tail = NULL;
+        server->n_queued--;
+        server->n_idle--;
+        pthread_mutex_unlock( &server->lock );
+
+        if( batch->n_rows > 0 )
+            neuralnet_predict_batch_workmem( server->nn, batch->n_rows, batch->input, batch->output, worker->workmem, false );
+
+        /* Counted before the answers, such that a client that has its answer sees it in the statistics */
+        pthread_mutex_lock( &server->lock );
+        server->stats.n_requests += batch->n_requests - batch->n_rejected;
+        server->stats.n_rejected += batch->n_rejected;
+        server->stats.n_samples  += batch->n_rows;
+        server->stats.n_batches  += batch->n_rows > 0;
+        pthread_mutex_unlock( &server->lock );
+
+        for( unsigned int i = 0; i < batch->n_requests; i++ ){
+            const request_t *req = batch->request + i;
+            respond( req->conn, req->id, req->n_samples, req->status, batch->output + req->row * server->n_output,
+                    server->n_output );
+            connection_release( server, req->conn );
+        }
+
+        pthread_mutex_lock( &server->lock );
+        batch->n_requests = 0;
+        batch->n_rejected = 0;
+        batch->n_rows     = 0;
+        batch->sealed     = false;
+        batch->next       = server->free_list;
+        server->free_list = batch;
+        server->n_idle++;
+        pthread_mutex_unlock( &server->lock );
+        wake( server );  /* A connection may wait for the batch, or the open batch for an idle worker */
+        pthread_mutex_lock( &server->lock );
+    }
+    server->n_idle--;
+    pthread_mutex_unlock( &server->lock );
+    return NULL;
+}
+
+static void dispatch( inference_server_t *server, batch_t *batch )
+{
+    pthread_mutex_lock( &server->lock );
+    batch->next = NULL;
+    if( server->queue_tail )
+        server->queue_tail->next = batch;
+    else
+        server->queue_head = batch;
+    server->queue_tail = batch;
+    server->n_queued++;
+    pthread_cond_signal( &server->work_cond );
+    pthread_mutex_unlock( &server->lock );
+}
+
+static void seal( inference_server_t *server, batch_t *batch )
+{
+    batch->sealed = true;
+    if( server->open == batch )
+        server->open = NULL;
+    if( batch->pending == 0 )
+        dispatch( server, batch );
+}
+
+/* The payload of the request is read directly into the open batch. A request of the wrong size also
+   goes into the batch, without any rows, such that a worker sends the error like any other answer
+   and the server loop never waits for a slow client. Its payload is skipped. */
+static void assign_request( inference_server_t *server, connection_t *conn )
+{
+    const unsigned int n_samples = conn->header.n_samples;
+    const unsigned int max_batch = (unsigned int) server->props.max_batch;
+    const bool rejected = n_samples == 0 || n_samples > max_batch;
+    const unsigned int n_rows = rejected ? 0 : n_samples;
+    if( server->open && ( server->open->n_rows + n_rows > max_batch || server->open->n_requests == max_batch ))
+        seal( server, server->open );
+
+    if( !server->open ){
+        pthread_mutex_lock( &server->lock );
+        batch_t *batch = server->free_list;
+        if( batch )
+            server->free_list = batch->next;
+        pthread_mutex_unlock( &server->lock );
+        if( !batch ){
+            conn->waiting = true;  /* All the batches are busy. Stop reading from this client. */
+            return;
+        }
+        batch->deadline = now_seconds() + 1.0e-6 * server->props.max_latency_us;
+        server->open = batch;
+    }
+
+    batch_t *batch = server->open;
+    request_t *req = batch->request + batch->n_requests++;
+    req->conn      = conn;
+    req->id        = conn->header.id;
+    req->row       = batch->n_rows;
+    req->n_samples = n_samples;
+    req->status    = rejected ? INFERENCE_ERROR_SIZE : INFERENCE_OK;
+    batch->n_rows += n_rows;
+    batch->n_rejected += rejected;
+    if( !rejected )
+        batch->pending++;
+
+    pthread_mutex_lock( &server->lock );
+    conn->refcount++;
+    pthread_mutex_unlock( &server->lock );
+
+    conn->waiting      = false;
+    conn->batch        = rejected ? NULL : batch;
+    conn->payload      = rejected ? NULL : (char *) (batch->input + req->row * server->n_input);
+    conn->payload_left = (size_t) n_samples * server->n_input * sizeof(float);
+
+    if( batch->n_rows == max_batch || batch->n_requests == max_batch )
+        seal( server, batch );
+}
+
+static int start_request( inference_server_t *server, connection_t *conn )
+{
+    if( conn->header.magic != INFERENCE_MAGIC ){
+        fprintf( stderr, "Invalid inference request. Closing the connection.\n");
+        return -1;
+    }
+    assign_request( server, conn );
+    return 0;
+}
+
+static void finish_request( inference_server_t *server, connection_t *conn )
+{
+    batch_t *batch = conn->batch;
+    conn->batch = NULL;
+    conn->header_bytes = 0;
+    if( batch && --batch->pending == 0 && batch->sealed )
+        dispatch( server, batch );
+}
+
+/* Reads what the client has sent. Returns -1 when the connection is to be closed. */
+static int read_connection( inference_server_t *server, connection_t *conn )
+{
+    char discard[4096];
+    while( !conn->waiting ){
+        ssize_t got;
+        if( conn->header_bytes < sizeof(inference_header_t) ){
+            got = read( conn->fd, (char *) &conn->header + conn->header_bytes, sizeof(inference_header_t) - conn->header_bytes );
+            if( got > 0 ){
+                conn->header_bytes += (unsigned int) got;
+                if( conn->header_bytes == sizeof(inference_header_t) && start_request( server, conn ) < 0 )
+                    return -1;
+            }
+        } else if( conn->payload_left > 0 ){
+            const size_t size = conn->payload ? conn->payload_left :
+                (conn->payload_left < sizeof(discard) ? conn->payload_left : sizeof(discard));
+            got = read( conn->fd, conn->payload ? conn->payload : discard, size );
+            if( got > 0 ){
+                conn->payload_left -= (size_t) got;
+                if( conn->payload )
+                    conn->payload += got;
+            }
+        } else {
+            got = 1;
+        }
+        if( got == 0 )
+            return -1;
+        if( got < 0 )
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        if( conn->header_bytes == sizeof(inference_header_t) && !conn->waiting && conn->payload_left == 0 )
+            finish_request( server, conn );
+    }
+    return 0;
+}
+
+static void close_connection( inference_server_t *server, connection_t *conn )
+{
+    __atomic_store_n( &conn->closed, 1, __ATOMIC_RELEASE );
+    if( conn->batch ){
+        /* The request is computed with whatever was read, but not answered */
+        finish_request( server, conn );
+    }
+    for( connection_t **p = &server->connections; *p; p = &(*p)->next ){
+        if( *p == conn ){
+            *p = conn->next;
+            break;
+        }
+    }
+    server->n_connections--;
+    connection_release( server, conn );
+}
+
+static void accept_connections( inference_server_t *server )
+{
+    for(;;){
+        const int fd = accept( server->listen_fd, NULL, NULL );
+        if( fd < 0 )
+            return;
+        const inference_hello_t hello = { .magic = INFERENCE_MAGIC, .n_input = server->n_input,
+            .n_output = server->n_output, .max_batch = (uint32_t) server->props.max_batch };
+        connection_t *conn = calloc( 1, sizeof(connection_t));
+        if( !conn || fcntl( fd, F_SETFL, O_NONBLOCK ) < 0 ||
+                send( fd, &hello, sizeof(hello), MSG_NOSIGNAL ) != (ssize_t) sizeof(hello) ){
+            fprintf( stderr, "Cannot set up the inference connection.\n");
+            free( conn );
+            close( fd );
+            continue;
+        }
+        conn->fd       = fd;
+        conn->refcount = 1;
+        pthread_mutex_init( &conn->send_lock, NULL );
+        conn->next = server->connections;
+        server->connections = conn;
+        server->n_connections++;
+    }
+}
+
+/**
+  @brief Create an inference server listening on a Unix domain socket.
+  @param nn The neural network. It is used by the worker threads, so it must not be changed or freed
+            while the server runs.
+  @param path The path of the socket. An existing file is replaced.
+  @param props The batching and the workers. See `INFERENCE_SERVER_PROPERTIES()`.
+  @return Pointer to the new server or NULL on failure.
+
+  The workers are started, but no requests are read before `inference_server_run()`.
+ */
+inference_server_t *inference_server_new( const neuralnet_t *nn, const char *path, inference_server_properties_t props )
+{
+    if( !nn || !path || props.max_batch < 1 || props.n_workers < 1 || props.max_latency_us < 0 ){
+        fprintf( stderr, "Invalid inference server properties.\n");
+        return NULL;
+    }
+    inference_server_t *server = calloc( 1, sizeof(inference_server_t));
+    if( !server ){
+        fprintf( stderr, "Cannot allocate memory for 'inference_server_t' type.\n");
+        return NULL;
+    }
+    server->nn           = nn;
+    server->props        = props;
+    server->n_input      = nn->layer[0].n_input;
+    server->n_output     = nn->layer[nn->n_layers - 1].n_output;
+    server->listen_fd    = -1;
+    server->wake_pipe[0] = -1;
+    server->wake_pipe[1] = -1;
+    pthread_mutex_init( &server->lock, NULL );
+    pthread_cond_init( &server->work_cond, NULL );
+
+    if( strlen( path ) >= sizeof( server->path )){
+        fprintf( stderr, "Socket path '%s' is too long.\n", path );
+        inference_server_free( server );
+        return NULL;
+    }
+    strcpy( server->path, path );
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy( addr.sun_path, path );
+    unlink( path );
+    server->listen_fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if( server->listen_fd < 0 || bind( server->listen_fd, (struct sockaddr*) &addr, sizeof( addr )) < 0 ||
+            listen( server->listen_fd, 128 ) < 0 || fcntl( server->listen_fd, F_SETFL, O_NONBLOCK ) < 0 ){
+        fprintf( stderr, "Cannot listen on '%s': %s\n", path, strerror( errno ));
+        server->path[0] = '\0';  /* Not ours to unlink */
+        inference_server_free( server );
+        return NULL;
+    }
+    if( pipe( server->wake_pipe ) < 0 || fcntl( server->wake_pipe[0], F_SETFL, O_NONBLOCK ) < 0 ||
+            fcntl( server->wake_pipe[1], F_SETFL, O_NONBLOCK ) < 0 ){
+        fprintf( stderr, "Cannot create a pipe: %s\n", strerror( errno ));
+        inference_server_free( server );
+        return NULL;
+    }
+
+    /* One batch being filled, one queued for each worker, and one running in each worker */
+    server->batches = calloc( 2 * props.n_workers + 1, sizeof(batch_t));
+    if( !server->batches ){
+        fprintf( stderr, "Cannot allocate memory for the batches.\n");
+        inference_server_free( server );
+        return NULL;
+    }
+    server->n_batches = 2 * props.n_workers + 1;
+    for( int i = 0; i < server->n_batches; i++ ){
+        batch_t *batch = server->batches + i;
+        batch->input   = simd_malloc( props.max_batch * server->n_input * sizeof(float));
+        batch->output  = simd_malloc( props.max_batch * server->n_output * sizeof(float));
+        batch->request = malloc( props.max_batch * sizeof(request_t));
+        if( !batch->input || !batch->output || !batch->request ){
+            fprintf( stderr, "Cannot allocate memory for the batches.\n");
+            inference_server_free( server );
+            return NULL;
+        }
+        batch->next = server->free_list;
+        server->free_list = batch;
+    }
+    server->worker = calloc( props.n_workers, sizeof(worker_t));
+    if( !server->worker ){
+        fprintf( stderr, "Cannot allocate memory for the workers.\n");
+        inference_server_free( server );
+        return NULL;
+    }
+    const unsigned int workmem_size = neuralnet_predict_batch_workmem_size( nn, props.max_batch );
+    for( int i = 0; i < props.n_workers; i++ ){
+        worker_t *worker = server->worker + i;
+        worker->server  = server;
+        worker->workmem = simd_malloc(( workmem_size + 1 ) * sizeof(float));
+        if( !worker->workmem || pthread_create( &worker->thread, NULL, worker_thread, worker ) != 0 ){
+            fprintf( stderr, "Cannot start the inference workers.\n");
+            inference_server_free( server );
+            return NULL;
+        }
+        server->n_workers++;
+    }
+    return server;
+}
+
+/**
+  @brief Serve the clients until `inference_server_stop()` is called.
+  @param server The server
+  @return 0 when stopped, -1 on failure.
+
+  This runs the server loop in the calling thread. It accepts the connections, reads the requests
+  into batches, and hands the batches to the workers.
+ */
+int inference_server_run( inference_server_t *server )
+{
+    int ret = 0;
+    while( !__atomic_load_n( &server->stop, __ATOMIC_ACQUIRE )){
+        const unsigned int n_poll = server->n_connections + 2;
+        if( n_poll > server->poll_size ){
+            struct pollfd *pollfd = realloc( server->pollfd, 2 * n_poll * sizeof(struct pollfd));
+            if( pollfd )
+                server->pollfd = pollfd;
+            connection_t **polled = realloc( server->polled, 2 * n_poll * sizeof(connection_t *));
+            if( polled )
+                server->polled = polled;
+            if( !pollfd || !polled ){
+                fprintf( stderr, "Cannot allocate memory for the connections.\n");
+                ret = -1;
+                break;
+            }
+            server->poll_size = 2 * n_poll;
+        }
+        server->pollfd[0] = (struct pollfd) { .fd = server->wake_pipe[0], .events = POLLIN };
+        server->pollfd[1] = (struct pollfd) { .fd = server->listen_fd, .events = POLLIN };
+        unsigned int n = 2;
+        for( connection_t *conn = server->connections; conn; conn = conn->next ){
+            server->pollfd[n] = (struct pollfd) { .fd = conn->fd, .events = conn->waiting ? 0 : POLLIN };
+            server->polled[n++] = conn;
+        }
+
+        int timeout = -1;
+        if( server->open ){
+            const double left = server->open->deadline - now_seconds();
+            timeout = left > 0.0 ? (int) (left * 1000.0) + 1 : 0;
+        }
+        if( poll( server->pollfd, n, timeout ) < 0 && errno != EINTR ){
+            fprintf( stderr, "Inference server poll failed: %s\n", strerror( errno ));
+            ret = -1;
+            break;
+        }
+
+        if( server->pollfd[0].revents ){
+            char drain[256];
+            while( read( server->wake_pipe[0], drain, sizeof(drain)) > 0 )
+                ;
+        }
+        if( server->pollfd[1].revents )
+            accept_connections( server );
+        for( unsigned int i = 2; i < n; i++ ){
+            connection_t *conn = server->polled[i];
+            if( server->pollfd[i].revents && read_connection( server, conn ) < 0 )
+                close_connection( server, conn );
+        }
+
+        /* The clients waiting for a batch */
+        for( connection_t *conn = server->connections, *next; conn; conn = next ){
+            next = conn->next;
+            if( conn->waiting ){
+                assign_request( server, conn );
+                if( !conn->waiting && read_connection( server, conn ) < 0 )
+                    close_connection( server, conn );
+            }
+        }
+
+        batch_t *batch = server->open;
+        if( batch && batch->pending == 0 ){
+            bool start = now_seconds() >= batch->deadline;
+            if( !start && server->props.dispatch_when_idle ){
+                pthread_mutex_lock( &server->lock );
+                start = server->n_idle > server->n_queued;
+                pthread_mutex_unlock( &server->lock );
+            }
+            if( start )
+                seal( server, batch );
+        } else if( batch && now_seconds() >= batch->deadline ){
+            seal( server, batch );  /* Runs when the payloads are in */
+        }
+    }
+
+    /* Requests that are partly read are dropped, and the rest are answered */
+    for( connection_t *conn = server->connections, *next; conn; conn = next ){
+        next = conn->next;
+        if( conn->batch )
+            close_connection( server, conn );
+    }
+    if( server->open )
+        seal( server, server->open );
+    return ret;
+}
+
+/**
+  @brief Stop the server loop.
+  @param server The server
+
+  `inference_server_run()` returns after the requests that are read are answered. This can be
+  called from another thread or from a signal handler.
+ */
+void inference_server_stop( inference_server_t *server )
+{
+    __atomic_store_n( &server->stop, 1, __ATOMIC_RELEASE );
+    const char c = 0;
+    if( write( server->wake_pipe[1], &c, 1 ) < 0 ){
+        /* Then the loop is woken up anyway */
+    }
+}
+
+/**
+  @brief The number of requests, samples and batches that are done, and the rejected requests.
+  @param server The server
+  @param stats The statistics
+
+  The mean batch size is `n_samples / n_batches`.
+ */
+void inference_server_stats( inference_server_t *server, inference_server_stats_t *stats )
+{
+    pthread_mutex_lock( &server->lock );
+    *stats = server->stats;
+    pthread_mutex_unlock( &server->lock );
+}
+
+/**
+  @brief Free the server.
+  @param server The server
+
+  The batches that are queued are finished, and then the connections are closed and the socket
+  file removed. Call this after `inference_server_run()` has returned.
+ */
+void inference_server_free( inference_server_t *server )
+{
+    if( !server )
+        return;
+
+    pthread_mutex_lock( &server->lock );
+    server->shutdown = true;
+    pthread_cond_broadcast( &server->work_cond );
+    pthread_mutex_unlock( &server->lock );
+    for( int i = 0; i < server->n_workers; i++ )
+        pthread_join( server->worker[i].thread, NULL );
+    for( int i = 0; server->worker && i < server->props.n_workers; i++ )
+        simd_free( server->worker[i].workmem );
+    free( server->worker );
+
+    while( server->connections )
+        close_connection( server, server->connections );
+    if( server->batches ){
+        for( int i = 0; i < server->n_batches; i++ ){
+            simd_free( server->batches[i].input );
+            simd_free( server->batches[i].output );
+            free( server->batches[i].request );
+        }
+        free( server->batches );
+    }
+    free( server->pollfd );
+    free( server->polled );
+    if( server->listen_fd >= 0 )
+        close( server->listen_fd );
+    if( server->path[0] && server->listen_fd >= 0 )
+        unlink( server->path );
+    if( server->wake_pipe[0] >= 0 ) close( server->wake_pipe[0] );
+    if( server->wake_pipe[1] >= 0 ) close( server->wake_pipe[1] );
+    pthread_mutex_destroy( &server->lock );
+    pthread_cond_destroy( &server->work_cond );
+    free( server );
+}
+
+struct _inference_client_t {
+    int               fd;
+    uint32_t          next_id;
+    inference_hello_t hello;
+};
+
+/**
+  @brief Connect to an inference server.
+  @param path The path of the socket
+  @return Pointer to the new client or NULL on failure.
+
+  A client can be used by one thread at a time. Give each thread its own client.
+ */
+inference_client_t *inference_client_connect( const char *path )
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if( strlen( path ) >= sizeof( addr.sun_path )){
+        fprintf( stderr, "Socket path '%s' is too long.\n", path );
+        return NULL;
+    }
+    strcpy( addr.sun_path, path );
+
+    inference_client_t *client = calloc( 1, sizeof(inference_client_t));
+    if( !client ){
+        fprintf( stderr, "Cannot allocate memory for 'inference_client_t' type.\n");
+        return NULL;
+    }
+    client->fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if( client->fd < 0 || connect( client->fd, (struct sockaddr*) &addr, sizeof( addr )) < 0 ){
+        fprintf( stderr, "Cannot connect to '%s': %s\n", path, strerror( errno ));
+        if( client->fd >= 0 ) close( client->fd );
+        free( client );
+        return NULL;
+    }
+    if( recv_all( client->fd, &client->hello, sizeof(client->hello)) < 0 || client->hello.magic != INFERENCE_MAGIC ){
+        fprintf( stderr, "No inference server at '%s'.\n", path );
+        close( client->fd );
+        free( client );
+        return NULL;
+    }
+    return client;
+}
+
+/**
+  @brief Predict on the server.
+  @param client The client
+  @param n_samples The number of samples (up to the max_batch of the server)
+  @param input The inputs (n_samples x n_input)
+  @param output The outputs (n_samples x n_output)
+  @return 0 on success, -1 on failure.
+ */
+int inference_client_predict( inference_client_t *client, const unsigned int n_samples, const float *input, float *output )
+{
+    inference_header_t header = { .magic = INFERENCE_MAGIC, .id = client->next_id++, .n_samples = n_samples, .status = 0 };
+    struct iovec iov[2] = {
+        { .iov_base = &header, .iov_len = sizeof(header) },
+        { .iov_base = (void *) input, .iov_len = n_samples * client->hello.n_input * sizeof(float) }
+    };
+    if( send_all( client->fd, iov, 2 ) < 0 ){
+        fprintf( stderr, "Cannot send the inference request: %s\n", strerror( errno ));
+        return -1;
+    }
+
+    inference_header_t response;
+    if( recv_all( client->fd, &response, sizeof(response)) < 0 || response.magic != INFERENCE_MAGIC ||
+            response.id != header.id ){
+        fprintf( stderr, "Invalid inference response.\n");
+        return -1;
+    }
+    if( response.status != INFERENCE_OK ){
+        fprintf( stderr, "The inference request of %u samples was rejected.\n", n_samples );
+        return -1;
+    }
+    return recv_all( client->fd, output, n_samples * client->hello.n_output * sizeof(float));
+}
+
+/**
+  @brief The number of inputs of the network on the server.
+ */
+int inference_client_n_input( const inference_client_t *client )
+{
+    return (int) client->hello.n_input;
+}
+
+/**
+  @brief The number of outputs of the network on the server.
+ */
+int inference_client_n_output( const inference_client_t *client )
+{
+    return (int) client->hello.n_output;
+}
+
+/**
+  @brief Close the connection and free the client.
+ */
+void inference_client_free( inference_client_t *client )
+{
+    if( !client )
+        return;
+    close( client->fd );
+    free( client );
+}
@@ -0,0 +1,107 @@
+/* inference_server.h - Øystein Schønning-Johansen 2023 */
+/*
+  vim: ts=4 sw=4 softtabstop=4 expandtab
+ */
+
+/* An inference server on a Unix domain socket, with dynamic batching of the requests.
+ *
+ * Services that call `neuralnet_predict()` with one sample at a time, from many threads, never use
+ * the matrix-matrix products of `neuralnet_predict_batch()`. The server collects the requests from
+ * all the connected clients into batches. A batch is started when it is full (`max_batch` samples),
+ * when the first request in it has waited `max_latency_us`, or (with `dispatch_when_idle`) as soon
+ * as a worker thread is idle. Under low load the requests then run one by one without waiting, and
+ * under high load the batches grow while the workers are busy. The batches run on a pool of worker
+ * threads, and the outputs are sent back to the clients.
+ *
+ * The protocol is binary. After the connection, the server sends an `inference_hello_t`. Each request
+ * is an `inference_header_t` followed by n_samples x n_input floats, and each response is a header
+ * (with the id of the request) followed by n_samples x n_output floats. The floats are in the native
+ * byte order, and are read directly into the input matrix of the batch, and sent directly from the
+ * output matrix. A request of more than `max_batch` samples is answered with an error status.
+ *
+ * Typical usage (see examples/inference_daemon.c and examples/inference_loadgen.c):
+
+        inference_server_t *server = inference_server_new( nn, "/tmp/neuralnet.sock",
+                INFERENCE_SERVER_PROPERTIES( .max_batch = 128, .max_latency_us = 500 ));
+        inference_server_run( server );       // Until inference_server_stop() (e.g. from a signal handler)
+        inference_server_free( server );
+
+ * and in the clients:
+
+        inference_client_t *client = inference_client_connect( "/tmp/neuralnet.sock" );
+        inference_client_predict( client, 1, input, output );
+        inference_client_free( client );
+ */
+
+#ifndef __INFERENCE_SERVER_H__
+#define __INFERENCE_SERVER_H__
+#include "neuralnet.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define INFERENCE_MAGIC 0x314e4e53  /* "SNN1" */
+
+/* The status in the responses */
+#define INFERENCE_OK          0
+#define INFERENCE_ERROR_SIZE  1     /* Zero samples, or more than max_batch */
+
+/* How long a worker waits for a client to take a response, before the connection is dropped */
+#ifndef INFERENCE_SEND_TIMEOUT_MS
+#define INFERENCE_SEND_TIMEOUT_MS 5000
+#endif
+
+/* Sent by the server after the connection */
+typedef struct {
+    uint32_t magic;
+    uint32_t n_input;
+    uint32_t n_output;
+    uint32_t max_batch;   /* The largest request */
+} inference_hello_t;
+
+/* In front of each request and response */
+typedef struct {
+    uint32_t magic;
+    uint32_t id;          /* Chosen by the client, returned in the response */
+    uint32_t n_samples;
+    uint32_t status;      /* 0 in the requests */
+} inference_header_t;
+
+typedef struct _inference_server_t inference_server_t;
+typedef struct _inference_client_t inference_client_t;
+
+typedef struct _inference_server_properties_t inference_server_properties_t;
+struct _inference_server_properties_t {
+    int  max_batch;           /* The largest batch, in samples */
+    int  max_latency_us;      /* How long the first request of a batch waits for more requests */
+    int  n_workers;           /* Threads that run the batches */
+    bool dispatch_when_idle;  /* Start the batch at once if a worker is idle, rather than waiting */
+};
+
+/* These are the default values. */
+#define INFERENCE_SERVER_PROPERTIES(...) (inference_server_properties_t) \
+            { .max_batch = 64,              \
+              .max_latency_us = 1000,       \
+              .n_workers = 2,               \
+              .dispatch_when_idle = true,   \
+              __VA_ARGS__ }
+
+typedef struct {
+    unsigned long long n_requests;
+    unsigned long long n_samples;
+    unsigned long long n_batches;
+    unsigned long long n_rejected;
+} inference_server_stats_t;
+
+inference_server_t * inference_server_new  ( const neuralnet_t *nn, const char *path, inference_server_properties_t props );
+int                  inference_server_run  ( inference_server_t *server );
+void                 inference_server_stop ( inference_server_t *server );
+void                 inference_server_stats( inference_server_t *server, inference_server_stats_t *stats );
+void                 inference_server_free ( inference_server_t *server );
+
+inference_client_t * inference_client_connect ( const char *path );
+int                  inference_client_predict ( inference_client_t *client, const unsigned int n_samples,
+                                                const float *input, float *output );
+int                  inference_client_n_input ( const inference_client_t *client );
+int                  inference_client_n_output( const inference_client_t *client );
+void                 inference_client_free    ( inference_client_t *client );
+#endif /* __INFERENCE_SERVER_H__ */
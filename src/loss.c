@@ -5,7 +5,10 @@
 #include "loss.h"
 
 #include <stdint.h> 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <assert.h>
 #include <math.h>
 
 static void mean_squared_error            ( unsigned int n, const float *y_pred, const float *y_real, float *loss );
@@ -13,6 +16,8 @@ static void mean_absolute_error           ( unsigned int n, const float *y_pred,
 static void mean_absolute_percentage_error( unsigned int n, const float *y_pred, const float *y_real, float *loss );
 static void binary_crossentropy           ( unsigned int n, const float *y_pred, const float *y_real, float *loss );
 static void categorical_crossentropy      ( unsigned int n, const float *y_pred, const float *y_real, float *loss );
+static void sparse_categorical_crossentropy( unsigned int n, const float *y_pred, const float *y_real, float *loss );
+static void sampled_softmax               ( unsigned int n, const float *y_pred, const float *y_real, float *loss );
 
 loss_func get_loss_func( const char * name ){
 	return
@@ -28,6 +33,8 @@ loss_func get_loss_func( const char * name ){
 
 		!strcmp( name, "categorical_crossentropy")       ? categorical_crossentropy :
 		!strcmp( name, "binary_crossentropy")            ? binary_crossentropy :
+		!strcmp( name, "sparse_categorical_crossentropy") ? sparse_categorical_crossentropy :
+		!strcmp( name, "sampled_softmax")                 ? sampled_softmax :
 
 		NULL;
 }
@@ -39,6 +46,8 @@ const char * get_loss_name( loss_func ptr ){
 		ptr == mean_absolute_percentage_error ? "mean_absolute_percentage_error" :
 		ptr == binary_crossentropy            ? "binary_crossentropy" :
 		ptr == categorical_crossentropy       ? "categorical_crossentropy" :
+		ptr == sparse_categorical_crossentropy ? "sparse_categorical_crossentropy" :
+		ptr == sampled_softmax                ? "sampled_softmax" :
 		"(unknown)";
 }
 
@@ -85,30 +94,25 @@ static void categorical_crossentropy( unsigned int n, const float *y_pred, const
         loss[i] = (y_pred[i] - y_real[i]);
 }
 
-#if 0
-/* I'm not really satisfied with this code. I'm leaving this dead for now. Here are some issues:
-
-   * if the target class is given as integers, it breaks the "interface" declaration. Of course the
-     loss function declaration can have a void pointer as the target, but then I have to cast inside
-     each and every function. Well...
-   * I need changes in all the optimizers, I need to change the neuralnet code. I need change sevaral places.
-   * I will need special handling every time this is used */
-*/
-static void sparse_categorical_crossentropy_int( unsigned int n, const float *y_pred, const int target_class, float *loss )
+/* The target is here the class label (stored as a float) and not a one-hot encoded vector.
+   The target class is read from y_real[0], and a one-hot vector is never materialized, neither in
+   the dataset nor here. Else this is the same as categorical_crossentropy. The "matching" with the
+   softmax output is done in the same way. See neuralnet_target_size() for how the targets are
+   strided. */
+static void sparse_categorical_crossentropy( unsigned int n, const float *y_pred, const float *y_real, float *loss )
 {
+    const unsigned int target_class = (unsigned int) y_real[0];
     assert( target_class < n );
-    float arr[n];
-    memset( arr, 0, n * sizeof(float));
-    arr[target_class] = 1.0f;
-    categorical_crossentropy( n, y_pred, arr, loss );
+    memcpy( loss, y_pred, n * sizeof(float));
+    loss[target_class] -= 1.0f;
 }
 
-static void sparse_categorical_crossentropy( unsigned int n, const float *y_pred, const float *y_real, float *loss )
+/* The sampled softmax is done in the backpropagation (see sampled_softmax.c), which does not call
+   this function. This is the derivative of the full softmax crossentropy which it estimates. */
+static void sampled_softmax( unsigned int n, const float *y_pred, const float *y_real, float *loss )
 {
-    int target_class = (int) round(*y_real);
-    sparse_categorical_crossentropy_int( n, y_pred, target_class, loss );
+    sparse_categorical_crossentropy( n, y_pred, y_real, loss );
 }
-#endif
 
 static void binary_crossentropy( unsigned int n, const float *y_pred, const float *y_real, float *loss )
 {
@@ -116,3 +120,42 @@ static void binary_crossentropy( unsigned int n, const float *y_pred, const floa
         loss[i] = (y_pred[i] - y_real[i]) / (float) n;
 }
 
+
+/**
+  @brief Convert integer class labels to the float class labels used as targets with the
+         'sparse_categorical_crossentropy' loss.
+  @param n Number of labels
+  @param labels The labels, typically the data of an int32 .npy array.
+  @return Pointer to a new array with n floats or NULL on failure. Free it with free().
+
+  Class labels are exact as floats up to 2^24, which is far more classes than anyone will
+  have in an output layer.
+*/
+float *class_labels_from_int32( unsigned int n, const int32_t *labels )
+{
+    float *y = malloc( n * sizeof(float));
+    if( !y ){
+        fprintf( stderr, "Cannot allocate memory for %u class labels.\n", n );
+        return NULL;
+    }
+    for( unsigned int i = 0; i < n; i++ ){
+        assert( labels[i] >= 0 );
+        y[i] = (float) labels[i];
+    }
+    return y;
+}
+
+/**
+  @brief Same as `class_labels_from_int32()`, but for uint16 labels.
+*/
+float *class_labels_from_uint16( unsigned int n, const uint16_t *labels )
+{
+    float *y = malloc( n * sizeof(float));
+    if( !y ){
+        fprintf( stderr, "Cannot allocate memory for %u class labels.\n", n );
+        return NULL;
+    }
+    for( unsigned int i = 0; i < n; i++ )
+        y[i] = (float) labels[i];
+    return y;
+}
@@ -4,9 +4,14 @@
  */
 #ifndef __LOSS_H__
 #define __LOSS_H__
+#include <stdint.h>
 
 typedef void (*loss_func)(unsigned int n, const float *y_pred, const float *y_real, float *loss );
 loss_func get_loss_func( const char * name );
 const char * get_loss_name( loss_func ptr );
 
+/* Targets for 'sparse_categorical_crossentropy' are class labels, one float per sample */
+float *class_labels_from_int32 ( unsigned int n, const int32_t *labels );
+float *class_labels_from_uint16( unsigned int n, const uint16_t *labels );
+
 #endif /* __LOSS_H__ */
@@ -5,6 +5,7 @@
 #include "matrix_operations.h"
 #include "simd.h"
 #include <assert.h>
+#include <string.h>
 
 #ifdef __AVX__ 
 #include <immintrin.h>
@@ -12,7 +13,6 @@
 
 #ifdef USE_CBLAS
 #include <cblas.h>
-#include <string.h>
 #endif
 
 #ifdef __AVX__  
@@ -40,6 +40,7 @@ void matrix_vector_multiply( int n_rows, int n_cols, const float *matrix, const
     cblas_sgemv( CblasRowMajor, CblasNoTrans,
             n_rows, n_cols, 1.0f, matrix, n_cols, v, 1, 0.0f, y, 1 );
 #else
+    /* Only the first row of the matrix is aligned, unless n_cols is a multiple of the SIMD width */
     const float *m_ptr = matrix;
     for( int i = 0; i < n_rows; i++ ){
         const float *v_ptr = v;
@@ -49,9 +50,9 @@ void matrix_vector_multiply( int n_rows, int n_cols, const float *matrix, const
         __m512 sums = _mm512_setzero_ps ();
         for (; j <= ((n_cols)-16); j += 16, m_ptr += 16, v_ptr += 16){ /* Check if faster: unroll w prefetch */
 #if defined(__FMA__)
-            sums = _mm512_fmadd_ps( _mm512_loadu_ps(v_ptr), _mm512_load_ps(m_ptr), sums);
+            sums = _mm512_fmadd_ps( _mm512_loadu_ps(v_ptr), _mm512_loadu_ps(m_ptr), sums);
 #else
-            sums = _mm512_add_ps (sums, _mm512_mul_ps(_mm512_loadu_ps(v_ptr), _mm512_load_ps(m_ptr)));
+            sums = _mm512_add_ps (sums, _mm512_mul_ps(_mm512_loadu_ps(v_ptr), _mm512_loadu_ps(m_ptr)));
 #endif
         }
         y[i] = _mm512_reduce_add_ps( sums );
@@ -60,9 +61,9 @@ void matrix_vector_multiply( int n_rows, int n_cols, const float *matrix, const
         __m256 sum = _mm256_setzero_ps ();
         for (; j <= ((n_cols)-8); j += 8, m_ptr += 8, v_ptr += 8){ /* Check if faster: unroll w prefetch */
 #if defined(__FMA__)
-            sum = _mm256_fmadd_ps( _mm256_loadu_ps(v_ptr), _mm256_load_ps(m_ptr), sum);
+            sum = _mm256_fmadd_ps( _mm256_loadu_ps(v_ptr), _mm256_loadu_ps(m_ptr), sum);
 #else
-            sum = _mm256_add_ps (sum, _mm256_mul_ps(_mm256_loadu_ps(v_ptr), _mm256_load_ps(m_ptr)));
+            sum = _mm256_add_ps (sum, _mm256_mul_ps(_mm256_loadu_ps(v_ptr), _mm256_loadu_ps(m_ptr)));
 #endif
         }
         y[i] += horizontalsum_avx( sum );
@@ -186,6 +187,159 @@ void vector_matrix_multiply( int n, int m, const float *weight, const float *bia
 #endif /* USE_CBLAS */
 }
 
+/**
+ * @brief Batched version of vector_matrix_multiply(). Y = bias + X * weight, for n_rows samples.
+ *
+ * The input row of the weight matrix is the outer loop, so each row of the weight matrix is read
+ * once for all the samples, instead of once per sample. The samples should therefore be few enough
+ * for the n_rows x m output to stay in cache. The outputs are not expected to be aligned.
+ *
+ * @param n_rows Number of samples (rows in X and Y)
+ * @param n Number of rows in weight (columns in X)
+ * @param m Number of columns in weight (length of bias and columns in Y)
+ * @param x The input samples (row major, n_rows x n)
+ * @param weight The weight matrix (row major, n x m)
+ * @param bias The bias vector
+ * @param y The output (row major, n_rows x m)
+ */
+void matrix_matrix_multiply( int n_rows, int n, int m, const float *x, const float *weight, const float *bias, float *y )
+{
+    for( int r = 0; r < n_rows; r++ )
+        memcpy( y + (size_t) r * m, bias, m * sizeof(float));
+#ifdef USE_CBLAS
+    cblas_sgemm( CblasRowMajor, CblasNoTrans, CblasNoTrans,
+            n_rows, m, n, 1.0f, x, n, weight, m, 1.0f, y, m );
+#else
+    for( int i = 0; i < n; i++ ){
+        const float *weight_row = weight + (size_t) i * m;
+        for( int r = 0; r < n_rows; r++ ){
+            const float inp = x[(size_t) r * n + i];
+            if( !inp ) continue;
+            const float *weight_ptr = weight_row;
+            float *y_ptr = y + (size_t) r * m;
+            int j = 0;
+#ifdef __AVX512F__
+            const __m512 scale512 = _mm512_set1_ps(inp);
+            for (; j <= ((m)-16) ; j += 16, y_ptr += 16, weight_ptr += 16){
+#if defined(__FMA__)
+                _mm512_storeu_ps(y_ptr, _mm512_fmadd_ps( _mm512_loadu_ps(weight_ptr), scale512, _mm512_loadu_ps(y_ptr)));
+#else
+                _mm512_storeu_ps(y_ptr, _mm512_add_ps(_mm512_loadu_ps(y_ptr), _mm512_mul_ps(_mm512_loadu_ps(weight_ptr), scale512)));
+#endif
+            }
+#endif
+#ifdef __AVX__
+            const __m256 scalevec = _mm256_set1_ps(inp);
+            for (; j <= ((m)-8) ; j += 8, y_ptr += 8, weight_ptr += 8){
+#if defined(__FMA__)
+                _mm256_storeu_ps(y_ptr, _mm256_fmadd_ps( _mm256_loadu_ps(weight_ptr), scalevec, _mm256_loadu_ps(y_ptr)));
+#else
+                _mm256_storeu_ps(y_ptr, _mm256_add_ps(_mm256_loadu_ps(y_ptr), _mm256_mul_ps(_mm256_loadu_ps(weight_ptr), scalevec)));
+#endif
+            }
+#endif
+            for(; j < m; j++ )
+                *y_ptr++ += inp * *weight_ptr++;
+        }
+    }
+#endif /* USE_CBLAS */
+}
+
+/**
+ * @brief Sparse version of vector_matrix_multiply(). y = bias + x * weight, where x is sparse.
+ *
+ * Only the rows of the weight matrix that correspond to the nonzero elements of x are
+ * read, so the cost is proportional to the number of nonzeros and not to the input size.
+ *
+ * @param n_nonzero Number of nonzero elements in x
+ * @param index Indices (rows in weight) of the nonzero elements
+ * @param value Values of the nonzero elements. NULL means all values are 1.0f
+ * @param m Number of columns in weight (length of bias and y)
+ * @param weight The weight matrix (row major)
+ * @param bias The bias vector
+ * @param y The output vector
+ */
+void sparse_vector_matrix_multiply( int n_nonzero, const int *index, const float *value,
+        int m, const float *weight, const float *bias, float *y )
+{
+    memcpy( y, bias, m * sizeof(float));
+    for( int k = 0; k < n_nonzero; k++ ){
+        const float inp = value ? value[k] : 1.0f;
+        const float *weight_ptr = weight + ( (long) index[k] * m );  /* Row gather */
+#ifdef USE_CBLAS
+        cblas_saxpy( m, inp, weight_ptr, 1, y, 1 );
+#else
+        float *y_ptr = y;
+        int j = 0;
+#ifdef __AVX512F__
+        const __m512 scale512 = _mm512_set1_ps(inp);
+        for (; j <= ((m)-16) ; j += 16, y_ptr += 16, weight_ptr += 16){
+#if defined(__FMA__)
+            _mm512_storeu_ps(y_ptr, _mm512_fmadd_ps( _mm512_loadu_ps(weight_ptr), scale512, _mm512_loadu_ps(y_ptr)));
+#else
+            _mm512_storeu_ps(y_ptr, _mm512_add_ps(_mm512_loadu_ps(y_ptr), _mm512_mul_ps(_mm512_loadu_ps(weight_ptr), scale512)));
+#endif
+        }
+#endif
+#ifdef __AVX__
+        const __m256 scalevec = _mm256_set1_ps(inp);
+        for (; j <= ((m)-8) ; j += 8, y_ptr += 8, weight_ptr += 8){
+#if defined(__FMA__)
+            _mm256_storeu_ps(y_ptr, _mm256_fmadd_ps( _mm256_loadu_ps(weight_ptr), scalevec, _mm256_loadu_ps(y_ptr)));
+#else
+            _mm256_storeu_ps(y_ptr, _mm256_add_ps(_mm256_loadu_ps(y_ptr), _mm256_mul_ps(_mm256_loadu_ps(weight_ptr), scalevec)));
+#endif
+        }
+#endif
+        for(; j < m; j++ )
+            *y_ptr++ += inp * *weight_ptr++;
+#endif /* USE_CBLAS */
+    }
+}
+
+/**
+ * @brief Sparse version of vector_vector_outer(). matrix[index[k]] = value[k] * y
+ *
+ * Only the rows of the matrix that correspond to the nonzero elements of x are written.
+ * The other rows are left untouched, so it is up to the caller to make sure they are zero.
+ * The rows are written, not added to, so the indices must be unique (as in a sparse_vector_t,
+ * where they are increasing).
+ *
+ * @param n_nonzero Number of nonzero elements in x
+ * @param index Indices (rows in matrix) of the nonzero elements
+ * @param value Values of the nonzero elements. NULL means all values are 1.0f
+ * @param n_cols Number of columns in matrix (length of y)
+ * @param y The dense vector
+ * @param matrix The output matrix (row major)
+ */
+void sparse_vector_vector_outer( int n_nonzero, const int *index, const float *value,
+        int n_cols, const float *y, float *matrix )
+{
+    for( int k = 0; k < n_nonzero; k++ ){
+        assert( k == 0 || index[k] > index[k-1] );
+        const float a = value ? value[k] : 1.0f;
+        float *matrix_ptr = matrix + ( (long) index[k] * n_cols );  /* Row scatter */
+        if( a == 1.0f ){
+            memcpy( matrix_ptr, y, n_cols * sizeof(float));
+            continue;
+        }
+        const float *y_ptr = y;
+        int j = 0;
+#ifdef __AVX512F__
+        __m512 scale512 = _mm512_set1_ps( a );
+        for( ; j <= ((n_cols)-16); j += 16, y_ptr += 16, matrix_ptr += 16)
+            _mm512_storeu_ps( matrix_ptr, _mm512_mul_ps( scale512, _mm512_loadu_ps( y_ptr )) );
+#endif  /* __AVX512F__ */
+#ifdef __AVX__
+        __m256 scale256 = _mm256_set1_ps( a );
+        for( ; j <= ((n_cols)-8); j += 8, y_ptr += 8, matrix_ptr += 8)
+            _mm256_storeu_ps( matrix_ptr, _mm256_mul_ps( scale256, _mm256_loadu_ps( y_ptr )) );
+#endif  /* __AVX__ */
+        for( ; j < n_cols; j++ )
+            *matrix_ptr++ = a * *y_ptr++;
+    }
+}
+
 /**
  * @brief Add vectors a and b,  a = a + b 
  *
@@ -414,3 +568,219 @@ void vector_square_elements ( const int n, float *y, const float *x )
         *y_ptr++ = xval * xval; 
     }
 }
+
+/**
+ * @brief The sum of the squared elements of a vector (the squared L2 norm). The vector does not
+ * have to be aligned.
+ *
+ * @param n Length of the vector
+ * @param x The vector
+ * @return The sum
+ */
+float vector_sum_of_squares( const int n, const float *x )
+{
+    float sum = 0.0f;
+    int i = 0;
+#ifdef __AVX512F__
+    __m512 sum512 = _mm512_setzero_ps();
+    for ( ; i <= ((n)-16); i += 16 ){
+        const __m512 xvec = _mm512_loadu_ps( x + i );
+#if defined(__FMA__)
+        sum512 = _mm512_fmadd_ps( xvec, xvec, sum512 );
+#else
+        sum512 = _mm512_add_ps( sum512, _mm512_mul_ps( xvec, xvec ));
+#endif
+    }
+    sum += _mm512_reduce_add_ps( sum512 );
+#endif
+#ifdef __AVX__
+    __m256 sum256 = _mm256_setzero_ps();
+    for ( ; i <= ((n)-8); i += 8 ){
+        const __m256 xvec = _mm256_loadu_ps( x + i );
+#if defined(__FMA__)
+        sum256 = _mm256_fmadd_ps( xvec, xvec, sum256 );
+#else
+        sum256 = _mm256_add_ps( sum256, _mm256_mul_ps( xvec, xvec ));
+#endif
+    }
+    sum += horizontalsum_avx( sum256 );
+#endif
+    for ( ; i < n; i++ )
+        sum += x[i] * x[i];
+    return sum;
+}
+
+/**
+ * @brief Convert floats to bfloat16, rounded to the nearest even: y = bf16(x)
+ *
+ * @param n Length of the vectors
+ * @param x The float vector
+ * @param y The bfloat16 vector
+ */
+void vector_to_bf16( const int n, const float *x, uint16_t *y )
+{
+    int i = 0;
+#if defined(__AVX512BF16__)
+    for ( ; i <= ((n)-16); i += 16 )
+        _mm256_storeu_si256( (__m256i *) (y + i), (__m256i) _mm512_cvtneps_pbh( _mm512_loadu_ps( x + i )));
+#endif
+#ifdef __AVX2__
+    const __m256i one  = _mm256_set1_epi32( 1 );
+    const __m256i bias = _mm256_set1_epi32( 0x7fff );
+    for ( ; i <= ((n)-8); i += 8 ){
+        const __m256i bits = _mm256_castps_si256( _mm256_loadu_ps( x + i ));
+        const __m256i lsb = _mm256_and_si256( _mm256_srli_epi32( bits, 16 ), one );
+        const __m256i rounded = _mm256_srli_epi32( _mm256_add_epi32( bits, _mm256_add_epi32( bias, lsb )), 16 );
+        _mm_storeu_si128( (__m128i *) (y + i),
+                _mm_packus_epi32( _mm256_castsi256_si128( rounded ), _mm256_extracti128_si256( rounded, 1 )));
+    }
+#endif
+    for ( ; i < n; i++ ){
+        uint32_t bits;
+        memcpy( &bits, x + i, sizeof(float));
+        bits += 0x7fffu + ((bits >> 16) & 1u);
+        y[i] = (uint16_t) (bits >> 16);
+    }
+}
+
+/**
+ * @brief Convert bfloat16 to floats: y = float(x). This is exact.
+ *
+ * @param n Length of the vectors
+ * @param x The bfloat16 vector
+ * @param y The float vector
+ */
+void vector_from_bf16( const int n, const uint16_t *x, float *y )
+{
+    int i = 0;
+#ifdef __AVX512F__
+    for ( ; i <= ((n)-16); i += 16 ){
+        const __m512i wide = _mm512_cvtepu16_epi32( _mm256_loadu_si256( (const __m256i *) (x + i)));
+        _mm512_storeu_ps( y + i, _mm512_castsi512_ps( _mm512_slli_epi32( wide, 16 )));
+    }
+#endif
+#ifdef __AVX2__
+    for ( ; i <= ((n)-8); i += 8 ){
+        const __m256i wide = _mm256_cvtepu16_epi32( _mm_loadu_si128( (const __m128i *) (x + i)));
+        _mm256_storeu_ps( y + i, _mm256_castsi256_ps( _mm256_slli_epi32( wide, 16 )));
+    }
+#endif
+    for ( ; i < n; i++ ){
+        const uint32_t bits = (uint32_t) x[i] << 16;
+        memcpy( y + i, &bits, sizeof(float));
+    }
+}
+
+/* The two bfloat16 of a pair as floats */
+static inline float bf16_low( const uint32_t pair )
+{
+    const uint32_t bits = pair << 16;
+    float f;
+    memcpy( &f, &bits, sizeof(float));
+    return f;
+}
+
+static inline float bf16_high( const uint32_t pair )
+{
+    const uint32_t bits = pair & 0xffff0000u;
+    float f;
+    memcpy( &f, &bits, sizeof(float));
+    return f;
+}
+
+/**
+ * @brief The bfloat16 version of vector_matrix_multiply(). y = bias + input * weight.
+ *
+ * With AVX512-BF16 the two rows of a pair are multiplied and added in one instruction (vdpbf16ps).
+ * Else the pairs are split into floats, which is the same sum, but the products are rounded.
+ *
+ * @param n Number of rows in weight (length of input, which is padded with a zero if n is odd)
+ * @param m Number of columns in weight (length of bias and y)
+ * @param weight The paired bfloat16 weights, (n+1)/2 x m
+ * @param bias The bias vector
+ * @param input The bfloat16 input vector
+ * @param y The output vector
+ */
+void bf16_vector_matrix_multiply( int n, int m, const uint32_t *weight, const float *bias, const uint16_t *input, float *y )
+{
+    memcpy( y, bias, m * sizeof(float));
+    for ( int p = 0; p < (n + 1) / 2; p++ ){
+        uint32_t inp;  /* Two inputs, paired like the weights */
+        memcpy( &inp, input + 2*p, sizeof(uint32_t));
+        if ( !inp ) continue;
+        const uint32_t *weight_ptr = weight + (size_t) p * m;
+        float *y_ptr = y;
+        int j = 0;
+#if defined(__AVX512BF16__)
+        const __m512bh inp512 = (__m512bh) _mm512_set1_epi32( (int) inp );
+        for (; j <= ((m)-16) ; j += 16, y_ptr += 16, weight_ptr += 16 )
+            _mm512_storeu_ps( y_ptr, _mm512_dpbf16_ps( _mm512_loadu_ps( y_ptr ),
+                        (__m512bh) _mm512_loadu_si512( weight_ptr ), inp512 ));
+#endif
+#ifdef __AVX2__
+        const __m256 low256  = _mm256_set1_ps( bf16_low( inp ));
+        const __m256 high256 = _mm256_set1_ps( bf16_high( inp ));
+        const __m256i mask = _mm256_set1_epi32( (int) 0xffff0000u );
+        for (; j <= ((m)-8) ; j += 8, y_ptr += 8, weight_ptr += 8 ){
+            const __m256i w = _mm256_loadu_si256( (const __m256i *) weight_ptr );
+            const __m256 w_low  = _mm256_castsi256_ps( _mm256_slli_epi32( w, 16 ));
+            const __m256 w_high = _mm256_castsi256_ps( _mm256_and_si256( w, mask ));
+#if defined(__FMA__)
+            _mm256_storeu_ps( y_ptr, _mm256_fmadd_ps( w_high, high256,
+                        _mm256_fmadd_ps( w_low, low256, _mm256_loadu_ps( y_ptr ))));
+#else
+            _mm256_storeu_ps( y_ptr, _mm256_add_ps( _mm256_loadu_ps( y_ptr ),
+                        _mm256_add_ps( _mm256_mul_ps( w_low, low256 ), _mm256_mul_ps( w_high, high256 ))));
+#endif
+        }
+#endif
+        for (; j < m; j++, weight_ptr++ )
+            *y_ptr++ += bf16_low( *weight_ptr ) * bf16_low( inp ) + bf16_high( *weight_ptr ) * bf16_high( inp );
+    }
+}
+
+/**
+ * @brief The bfloat16 version of matrix_vector_multiply(). y = matrix * v. Both rows of a pair
+ * are summed in the same pass over the matrix.
+ *
+ * @param n_rows Number of rows in the matrix (length of y)
+ * @param n_cols Number of columns in the matrix (length of v)
+ * @param matrix The paired bfloat16 matrix, (n_rows+1)/2 x n_cols
+ * @param v The bfloat16 vector
+ * @param y The output vector
+ */
+void bf16_matrix_vector_multiply( int n_rows, int n_cols, const uint32_t *matrix, const uint16_t *v, float *y )
+{
+    const uint32_t *m_ptr = matrix;
+    for ( int p = 0; p < (n_rows + 1) / 2; p++ ){
+        float low = 0.0f, high = 0.0f;
+        int j = 0;
+#ifdef __AVX2__
+        const __m256i mask = _mm256_set1_epi32( (int) 0xffff0000u );
+        __m256 low_sum  = _mm256_setzero_ps();
+        __m256 high_sum = _mm256_setzero_ps();
+        for (; j <= ((n_cols)-8); j += 8, m_ptr += 8 ){
+            const __m256i w = _mm256_loadu_si256( (const __m256i *) m_ptr );
+            const __m256 vv = _mm256_castsi256_ps( _mm256_slli_epi32(
+                        _mm256_cvtepu16_epi32( _mm_loadu_si128( (const __m128i *) (v + j))), 16 ));
+#if defined(__FMA__)
+            low_sum  = _mm256_fmadd_ps( _mm256_castsi256_ps( _mm256_slli_epi32( w, 16 )), vv, low_sum );
+            high_sum = _mm256_fmadd_ps( _mm256_castsi256_ps( _mm256_and_si256( w, mask )), vv, high_sum );
+#else
+            low_sum  = _mm256_add_ps( low_sum, _mm256_mul_ps( _mm256_castsi256_ps( _mm256_slli_epi32( w, 16 )), vv ));
+            high_sum = _mm256_add_ps( high_sum, _mm256_mul_ps( _mm256_castsi256_ps( _mm256_and_si256( w, mask )), vv ));
+#endif
+        }
+        low  = horizontalsum_avx( low_sum );
+        high = horizontalsum_avx( high_sum );
+#endif
+        for (; j < n_cols; j++, m_ptr++ ){
+            const float vj = bf16_low( v[j] );
+            low  += bf16_low( *m_ptr ) * vj;
+            high += bf16_high( *m_ptr ) * vj;
+        }
+        y[2*p] = low;
+        if ( 2*p + 1 < n_rows )
+            y[2*p + 1] = high;
+    }
+}
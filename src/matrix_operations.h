@@ -4,6 +4,7 @@
  */
 #ifndef __MATRIX_OPERATIONS_H__
 #define __MATRIX_OPERATIONS_H__
+#include <stdint.h>
 
 /* These functions should only be used by optimizers and the neuralnet! */
 /* Thay are changed continously, so use with care. */
@@ -11,6 +12,13 @@
 void matrix_vector_multiply( int m, int n, const float *weight, const float *y, float *out );
 void vector_matrix_multiply( int n, int m, const float *weight, const float *bias, const float *input, float *y );
 void vector_vector_outer   ( int n_rows, int n_cols, const float *x, const float *y, float *matrix );
+void matrix_matrix_multiply( int n_rows, int n, int m, const float *x, const float *weight, const float *bias, float *y );
+
+/* Sparse versions of the two above, where x is given as an index list with (optional) values */
+void sparse_vector_matrix_multiply( int n_nonzero, const int *index, const float *value,
+        int m, const float *weight, const float *bias, float *y );
+void sparse_vector_vector_outer   ( int n_nonzero, const int *index, const float *value,
+        int n_cols, const float *y, float *matrix );
 
 /* Note. These functions are made for operating on parameter vectors, however, they are
    general enough to do any vector. The only thing to keep in mind is that these
@@ -24,4 +32,13 @@ void vector_divide_by_scalar    ( const int n, float *v, const float scalar );
 void vector_saxpy               ( const int n, float *y, const float alpha, const float *x );
 void vector_saxpby              ( const int n, float *y, const float alpha, const float *x, const float beta );
 void vector_square_elements     ( const int n, float *y, const float *x );
+float vector_sum_of_squares     ( const int n, const float *x );
+
+/* bfloat16 (the upper half of a float) versions for mixed precision, see neuralnet_bf16.h. The
+   weights are "paired": Element p*m + j holds row 2p of the weight matrix in the lower 16 bits and
+   row 2p+1 in the upper 16 bits. The inputs are padded to an even length. The sums are float32. */
+void vector_to_bf16             ( const int n, const float *x, uint16_t *y );
+void vector_from_bf16           ( const int n, const uint16_t *x, float *y );
+void bf16_vector_matrix_multiply( int n, int m, const uint32_t *weight, const float *bias, const uint16_t *input, float *y );
+void bf16_matrix_vector_multiply( int n_rows, int n_cols, const uint32_t *matrix, const uint16_t *v, float *y );
 #endif /* __MATRIX_OPERATIONS_H__ */
@@ -3,11 +3,16 @@
  vim: ts=4 sw=4 softtabstop=4 expandtab 
 */
 #include "metrics.h"
+#include "ranking_metrics.h"
 
 #include <stdint.h> 
+#include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <math.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 static float mean_squared_error            ( const int n, const float *y_pred, const float *y_real );
 static float mean_absolute_error           ( const int n, const float *y_pred, const float *y_real );
@@ -18,6 +23,9 @@ static float categorical_crossentropy      ( const int n, const float *y_pred, c
 static float binary_accuracy               ( const int n, const float *y_pred, const float *y_real );
 static float categorical_accuracy          ( const int n, const float *y_pred, const float *y_real );
 
+static float sparse_categorical_crossentropy( const int n, const float *y_pred, const float *y_real );
+static float sparse_categorical_accuracy    ( const int n, const float *y_pred, const float *y_real );
+
 static float epsilon = 1.0e-7f;
 
 metric_func get_metric_func( const char * name ){
@@ -39,6 +47,18 @@ metric_func get_metric_func( const char * name ){
 		!strcmp( name, "categorical_accuracy")            ? categorical_accuracy :
 		!strcmp( name, "binary_accuracy")            ? binary_accuracy :
 
+		!strcmp( name, "sparse_categorical_crossentropy") ? sparse_categorical_crossentropy :
+		!strcmp( name, "sparse_categorical_accuracy")     ? sparse_categorical_accuracy :
+
+		/* The sampled softmax is only for training. The metric is the full crossentropy */
+		!strcmp( name, "sampled_softmax")                 ? sparse_categorical_crossentropy :
+
+		/* These are handled by evaluate(). See ranking_metrics.h */
+		!strcmp( name, "roc_auc")                         ? roc_auc :
+		!strcmp( name, "pr_auc")                          ? pr_auc :
+		!strcmp( name, "roc_auc_exact")                   ? roc_auc_exact :
+		!strcmp( name, "pr_auc_exact")                    ? pr_auc_exact :
+
 		NULL;
 }
 
@@ -51,6 +71,12 @@ const char * get_metric_name( metric_func ptr ){
 		ptr == categorical_crossentropy       ? "categorical_crossentropy" :
 		ptr == categorical_accuracy           ? "categorical_accuracy" :
 		ptr == binary_accuracy                ? "binary_accuracy" :
+		ptr == sparse_categorical_crossentropy ? "sparse_categorical_crossentropy" :
+		ptr == sparse_categorical_accuracy    ? "sparse_categorical_accuracy" :
+		ptr == roc_auc                        ? "roc_auc" :
+		ptr == pr_auc                         ? "pr_auc" :
+		ptr == roc_auc_exact                  ? "roc_auc_exact" :
+		ptr == pr_auc_exact                   ? "pr_auc_exact" :
 		"(unknown)";
 }
 
@@ -65,7 +91,8 @@ const char * get_metric_name( metric_func ptr ){
 
 */
 
-/* FIXME: These are now really plain and no SIMD yet. */
+/* These are plain scalar loops. See metrics_accumulate_batch() at the end of this file for the SIMD
+   version that does several metrics of many samples in one pass. */
 static float mean_squared_error( const int n, const float *y_pred, const float *y_real)
 {
     float err = 0.0f;
@@ -108,17 +135,15 @@ static float binary_crossentropy(const int n, const float *y_pred, const float *
     return -err / (float) n ;
 }
 
+/* Note that evaluate() uses softmax_crossentropy() (see activation.c) instead of this function when the
+   output activation is softmax. That works on the logits and does not need clipping. Here the log is
+   only taken where the target is nonzero, which for one-hot targets is once. */
 static float categorical_crossentropy(const int n, const float *y_pred, const float *y_real)
 {
-    float clipped_y_pred[n];
-    for( int i = 0; i < n; i++ ){
-        clipped_y_pred[i] = fmaxf( y_pred[i], epsilon );
-        clipped_y_pred[i] = fminf( clipped_y_pred[i], 1.0f - epsilon );
-    }
-
     float err = 0.0f;
     for( int i = 0; i < n; i++ )
-        err += y_real[i] * logf( clipped_y_pred[i] );
+        if( y_real[i] != 0.0f )
+            err += y_real[i] * logf( fminf( fmaxf( y_pred[i], epsilon ), 1.0f - epsilon ));
 
     return -err / (float) n ;
 }
@@ -153,3 +178,308 @@ static float categorical_accuracy( const int n, const float *y_pred, const float
     return pred_maxidx == real_maxidx ? 1.0f : 0.0f;
 }
 
+
+/* The sparse metrics take the class label in y_real[0] instead of a one-hot encoded vector.
+   They give the same results as the categorical metrics on the corresponding one-hot targets. */
+static float sparse_categorical_crossentropy( const int n, const float *y_pred, const float *y_real )
+{
+    const int target_class = (int) y_real[0];
+    assert( target_class >= 0 && target_class < n );
+    const float clipped_y_pred = fminf( fmaxf( y_pred[target_class], epsilon ), 1.0f - epsilon );
+    return -logf( clipped_y_pred ) / (float) n;
+}
+
+static float sparse_categorical_accuracy( const int n, const float *y_pred, const float *y_real )
+{
+    float pred_maxval = y_pred[0];
+    int pred_maxidx = 0;
+    for( int i = 1; i < n; i++ ){
+        if( y_pred[i] > pred_maxval ){
+            pred_maxval = y_pred[i];
+            pred_maxidx = i;
+        }
+    }
+    return pred_maxidx == (int) y_real[0] ? 1.0f : 0.0f;
+}
+
+/* The batch interface. All the requested metrics of a sample are calculated in one pass over the
+   outputs. The clipping, the log and the argmax are shared between the metrics that need them. */
+
+enum {
+    TERM_SQUARED       = 1 << 0,
+    TERM_ABSOLUTE      = 1 << 1,
+    TERM_PERCENTAGE    = 1 << 2,
+    TERM_BINARY_XENT   = 1 << 3,
+    TERM_CATEG_XENT    = 1 << 4,
+    TERM_BINARY_ACC    = 1 << 5,
+    TERM_PRED_ARGMAX   = 1 << 6,
+    TERM_REAL_ARGMAX   = 1 << 7,
+    TERM_CUSTOM        = 1 << 8    /* Not known here. The metric function is called */
+};
+
+typedef struct _metric_terms_t {
+    float squared;      /* sum (y_real - y_pred)^2 */
+    float absolute;     /* sum |y_real - y_pred| */
+    float percentage;   /* sum |y_real - y_pred| / max( y_real, epsilon ) */
+    float binary_xent;  /* sum y_real * log(p) + (1 - y_real) * log(1-p), p clipped */
+    float categ_xent;   /* sum y_real * log(p) where y_real != 0 */
+    float binary_acc;   /* number of rounded outputs equal to the rounded targets */
+    int   pred_argmax;
+    int   real_argmax;
+} metric_terms_t;
+
+static unsigned int metric_terms_needed( const metric_func metric )
+{
+    return
+        metric == mean_squared_error             ? TERM_SQUARED :
+        metric == mean_absolute_error            ? TERM_ABSOLUTE :
+        metric == mean_absolute_percentage_error ? TERM_PERCENTAGE :
+        metric == binary_crossentropy            ? TERM_BINARY_XENT :
+        metric == categorical_crossentropy       ? TERM_CATEG_XENT :
+        metric == binary_accuracy                ? TERM_BINARY_ACC :
+        metric == categorical_accuracy           ? TERM_PRED_ARGMAX | TERM_REAL_ARGMAX :
+        metric == sparse_categorical_accuracy    ? TERM_PRED_ARGMAX :
+        metric == sparse_categorical_crossentropy ? 0 :  /* Only one element. Done in the sum below */
+        TERM_CUSTOM;
+}
+
+#ifdef __AVX2__
+static inline float hsum256_ps( __m256 v )
+{
+    __m128 sum = _mm_add_ps( _mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    sum = _mm_add_ps( sum, _mm_movehl_ps( sum, sum ));
+    sum = _mm_add_ss( sum, _mm_movehdup_ps( sum ));
+    return _mm_cvtss_f32( sum );
+}
+
+/* Natural logarithm of positive numbers. This is the cephes logf() like exp256_ps() in activation.c. */
+static inline __m256 log256_ps( __m256 x )
+{
+    const __m256 one = _mm256_set1_ps( 1.0f );
+    __m256i emm0 = _mm256_srli_epi32( _mm256_castps_si256( x ), 23 );
+
+    /* keep only the fractional part */
+    x = _mm256_and_ps( x, _mm256_castsi256_ps( _mm256_set1_epi32( ~0x7f800000 )));
+    x = _mm256_or_ps( x, _mm256_set1_ps( 0.5f ));
+
+    emm0 = _mm256_sub_epi32( emm0, _mm256_set1_epi32( 0x7f ));
+    __m256 e = _mm256_add_ps( _mm256_cvtepi32_ps( emm0 ), one );
+
+    /* if x < sqrt(1/2) then e -= 1, x = x + x - 1 else x = x - 1 */
+    const __m256 mask = _mm256_cmp_ps( x, _mm256_set1_ps( 0.707106781186547524f ), _CMP_LT_OS );
+    __m256 tmp = _mm256_and_ps( x, mask );
+    x = _mm256_sub_ps( x, one );
+    e = _mm256_sub_ps( e, _mm256_and_ps( one, mask ));
+    x = _mm256_add_ps( x, tmp );
+
+    const __m256 z = _mm256_mul_ps( x, x );
+    __m256 y = _mm256_set1_ps( 7.0376836292E-2f );
+    y = _mm256_add_ps( _mm256_mul_ps( y, x ), _mm256_set1_ps( -1.1514610310E-1f ));
+    y = _mm256_add_ps( _mm256_mul_ps( y, x ), _mm256_set1_ps(  1.1676998740E-1f ));
+    y = _mm256_add_ps( _mm256_mul_ps( y, x ), _mm256_set1_ps( -1.2420140846E-1f ));
+    y = _mm256_add_ps( _mm256_mul_ps( y, x ), _mm256_set1_ps(  1.4249322787E-1f ));
+    y = _mm256_add_ps( _mm256_mul_ps( y, x ), _mm256_set1_ps( -1.6668057665E-1f ));
+    y = _mm256_add_ps( _mm256_mul_ps( y, x ), _mm256_set1_ps(  2.0000714765E-1f ));
+    y = _mm256_add_ps( _mm256_mul_ps( y, x ), _mm256_set1_ps( -2.4999993993E-1f ));
+    y = _mm256_add_ps( _mm256_mul_ps( y, x ), _mm256_set1_ps(  3.3333331174E-1f ));
+    y = _mm256_mul_ps( _mm256_mul_ps( y, x ), z );
+
+    y = _mm256_add_ps( y, _mm256_mul_ps( e, _mm256_set1_ps( -2.12194440e-4f )));
+    y = _mm256_sub_ps( y, _mm256_mul_ps( z, _mm256_set1_ps( 0.5f )));
+    x = _mm256_add_ps( x, y );
+    return _mm256_add_ps( x, _mm256_mul_ps( e, _mm256_set1_ps( 0.693359375f )));
+}
+
+/* Half away from zero, like roundf() */
+static inline __m256 round_away256_ps( const __m256 x )
+{
+    const __m256 sign = _mm256_and_ps( x, _mm256_set1_ps( -0.0f ));
+    const __m256 absx = _mm256_andnot_ps( _mm256_set1_ps( -0.0f ), x );
+    return _mm256_or_ps( _mm256_floor_ps( _mm256_add_ps( absx, _mm256_set1_ps( 0.5f ))), sign );
+}
+
+/* Index of the largest element over the lanes, the first one if there are several. */
+static inline void argmax_reduce256( const __m256 maxval, const __m256i maxidx, float *val, int *idx )
+{
+    float vals[8];
+    int   idxs[8];
+    _mm256_storeu_ps( vals, maxval );
+    _mm256_storeu_si256( (__m256i*) idxs, maxidx );
+    for( int k = 0; k < 8; k++ )
+        if( vals[k] > *val || (vals[k] == *val && idxs[k] < *idx )){
+            *val = vals[k];
+            *idx = idxs[k];
+        }
+}
+#endif
+
+static void metric_terms( const int n, const float *y_pred, const float *y_real, const unsigned int want,
+        metric_terms_t *t )
+{
+    memset( t, 0, sizeof( metric_terms_t ));
+    float pred_max = y_pred[0], real_max = y_real[0];
+    int i = 0;
+#ifdef __AVX2__
+    if( n >= 8 ){
+        const __m256 eps = _mm256_set1_ps( epsilon );
+        const __m256 one_minus_eps = _mm256_set1_ps( 1.0f - epsilon );
+        const __m256 one  = _mm256_set1_ps( 1.0f );
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 absmask = _mm256_castsi256_ps( _mm256_set1_epi32( 0x7fffffff ));
+        __m256 sq = zero, ab = zero, pct = zero, bxent = zero, cxent = zero, bacc = zero;
+        __m256 pmax = _mm256_set1_ps( -INFINITY ), rmax = _mm256_set1_ps( -INFINITY );
+        __m256i pidx = _mm256_setzero_si256(), ridx = _mm256_setzero_si256();
+        __m256i idx = _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 );
+        const __m256i eight = _mm256_set1_epi32( 8 );
+
+        for( ; i <= n - 8; i += 8, idx = _mm256_add_epi32( idx, eight )){
+            const __m256 p = _mm256_loadu_ps( y_pred + i );
+            const __m256 r = _mm256_loadu_ps( y_real + i );
+            if( want & (TERM_SQUARED | TERM_ABSOLUTE | TERM_PERCENTAGE )){
+                const __m256 d = _mm256_sub_ps( r, p );
+                const __m256 absd = _mm256_and_ps( d, absmask );
+                sq  = _mm256_add_ps( sq, _mm256_mul_ps( d, d ));
+                ab  = _mm256_add_ps( ab, absd );
+                if( want & TERM_PERCENTAGE )
+                    pct = _mm256_add_ps( pct, _mm256_and_ps( _mm256_div_ps( d, _mm256_max_ps( r, eps )), absmask ));
+            }
+            if( want & (TERM_BINARY_XENT | TERM_CATEG_XENT )){
+                const __m256 c = _mm256_min_ps( _mm256_max_ps( p, eps ), one_minus_eps );
+                const __m256 logc = log256_ps( c );
+                if( want & TERM_BINARY_XENT )
+                    bxent = _mm256_add_ps( bxent, _mm256_add_ps( _mm256_mul_ps( r, logc ),
+                                _mm256_mul_ps( _mm256_sub_ps( one, r ), log256_ps( _mm256_sub_ps( one, c )))));
+                if( want & TERM_CATEG_XENT )
+                    cxent = _mm256_add_ps( cxent, _mm256_and_ps( _mm256_mul_ps( r, logc ),
+                                _mm256_cmp_ps( r, zero, _CMP_NEQ_UQ )));
+            }
+            if( want & TERM_BINARY_ACC ){
+                const __m256 real = round_away256_ps( _mm256_min_ps( _mm256_max_ps( r, zero ), one ));
+                const __m256 pred = round_away256_ps( p );
+                bacc = _mm256_add_ps( bacc, _mm256_and_ps( _mm256_cmp_ps( real, pred, _CMP_EQ_OQ ), one ));
+            }
+            if( want & TERM_PRED_ARGMAX ){
+                const __m256 gt = _mm256_cmp_ps( p, pmax, _CMP_GT_OQ );
+                pmax = _mm256_blendv_ps( pmax, p, gt );
+                pidx = _mm256_blendv_epi8( pidx, idx, _mm256_castps_si256( gt ));
+            }
+            if( want & TERM_REAL_ARGMAX ){
+                const __m256 gt = _mm256_cmp_ps( r, rmax, _CMP_GT_OQ );
+                rmax = _mm256_blendv_ps( rmax, r, gt );
+                ridx = _mm256_blendv_epi8( ridx, idx, _mm256_castps_si256( gt ));
+            }
+        }
+        t->squared     = hsum256_ps( sq );
+        t->absolute    = hsum256_ps( ab );
+        t->percentage  = hsum256_ps( pct );
+        t->binary_xent = hsum256_ps( bxent );
+        t->categ_xent  = hsum256_ps( cxent );
+        t->binary_acc  = hsum256_ps( bacc );
+        pred_max = -INFINITY;
+        real_max = -INFINITY;
+        if( want & TERM_PRED_ARGMAX ) argmax_reduce256( pmax, pidx, &pred_max, &t->pred_argmax );
+        if( want & TERM_REAL_ARGMAX ) argmax_reduce256( rmax, ridx, &real_max, &t->real_argmax );
+    }
+#endif
+    for( ; i < n; i++ ){
+        const float p = y_pred[i];
+        const float r = y_real[i];
+        if( want & (TERM_SQUARED | TERM_ABSOLUTE | TERM_PERCENTAGE )){
+            t->squared    += (r - p) * (r - p);
+            t->absolute   += fabsf( r - p );
+            t->percentage += fabsf( (r - p) / fmaxf( r, epsilon ));
+        }
+        if( want & (TERM_BINARY_XENT | TERM_CATEG_XENT )){
+            const float c = fminf( fmaxf( p, epsilon ), 1.0f - epsilon );
+            const float logc = logf( c );
+            t->binary_xent += r * logc + (1.0f - r) * logf( 1.0f - c );
+            if( r != 0.0f )
+                t->categ_xent += r * logc;
+        }
+        if( want & TERM_BINARY_ACC )
+            t->binary_acc += roundf( fminf( fmaxf( r, 0.0f ), 1.0f )) == roundf( p ) ? 1.0f : 0.0f;
+        if( p > pred_max ){
+            pred_max = p;
+            t->pred_argmax = i;
+        }
+        if( r > real_max ){
+            real_max = r;
+            t->real_argmax = i;
+        }
+    }
+}
+
+/**
+  @brief Accumulate several metrics over a block of samples in one pass.
+  @param metrics NULL terminated list of metric functions (as given to the optimizer and evaluate())
+  @param n_samples Number of samples in the block
+  @param n_output Number of outputs per sample
+  @param y_pred The predictions (n_samples x n_output)
+  @param y_real The targets. n_target floats per sample.
+  @param n_target Stride of the targets. This is 1 for class labels (sparse metrics), else n_output.
+  @param sums The sum of each metric over the samples is added to this (one per metric).
+
+  The result is the same as calling each metric function on each sample and adding up, but the
+  outputs of a sample are read once for all the metrics, and the work that is common between the
+  metrics (clipping, logarithm, argmax) is only done once. Unknown (custom) metric functions are
+  called the usual way.
+ */
+void metrics_accumulate_batch( metric_func metrics[], const int n_samples, const int n_output,
+        const float *y_pred, const float *y_real, const int n_target, float *sums )
+{
+    unsigned int want = 0;
+    for( metric_func *mf = metrics; *mf; mf++ )
+        want |= metric_terms_needed( *mf );
+    /* With class labels the dense terms make no sense, and the targets are not read */
+    const unsigned int dense_terms = want & ~(TERM_PRED_ARGMAX | TERM_CUSTOM);
+
+    for( int s = 0; s < n_samples; s++ ){
+        const float *pred = y_pred + (size_t) s * n_output;
+        const float *real = y_real + (size_t) s * n_target;
+        metric_terms_t t;
+        if( n_target == n_output || !dense_terms )
+            metric_terms( n_output, pred, n_target == n_output ? real : pred, want & ~TERM_CUSTOM, &t );
+        else
+            memset( &t, 0, sizeof( metric_terms_t ));
+
+        float *sum = sums;
+        for( metric_func *mf = metrics; *mf; mf++, sum++ ){
+            const metric_func m = *mf;
+            *sum +=
+                m == mean_squared_error             ? t.squared / (float) n_output :
+                m == mean_absolute_error            ? t.absolute / (float) n_output :
+                m == mean_absolute_percentage_error ? 100.0f * t.percentage / (float) n_output :
+                m == binary_crossentropy            ? -t.binary_xent / (float) n_output :
+                m == categorical_crossentropy       ? -t.categ_xent / (float) n_output :
+                m == binary_accuracy                ? t.binary_acc / (float) n_output :
+                m == categorical_accuracy           ? (t.pred_argmax == t.real_argmax ? 1.0f : 0.0f) :
+                m == sparse_categorical_accuracy    ? (t.pred_argmax == (int) real[0] ? 1.0f : 0.0f) :
+                m( n_output, pred, real );
+        }
+    }
+}
+
+/**
+  @brief Check that the metrics can be computed from the targets.
+  @param metrics NULL terminated list of metric functions
+  @param n_output Number of outputs per sample
+  @param n_target Number of target values per sample (see neuralnet_target_size())
+  @return 0 if they fit, -1 if not.
+
+  With class labels as the targets (n_target is 1, like with the sparse_categorical_crossentropy
+  loss), only the sparse metrics can be computed, as the others need a target for each output.
+  Custom metrics are not checked.
+ */
+int metrics_check_targets( metric_func metrics[], const int n_output, const int n_target )
+{
+    if( n_target == n_output )
+        return 0;
+    for( metric_func *mf = metrics; *mf; mf++ ){
+        if( metric_terms_needed( *mf ) & ~(TERM_PRED_ARGMAX | TERM_CUSTOM) ){
+            fprintf( stderr, "The metric '%s' needs a target for each output, but the targets are class labels. "
+                    "Use the sparse metrics.\n", get_metric_name( *mf ));
+            return -1;
+        }
+    }
+    return 0;
+}
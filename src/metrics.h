@@ -9,6 +9,10 @@ typedef float (*metric_func)(const int n, const float *y_pred, const float *y_re
 metric_func get_metric_func( const char * name );
 const char * get_metric_name( metric_func ptr );
 
+void metrics_accumulate_batch( metric_func metrics[], const int n_samples, const int n_output,
+        const float *y_pred, const float *y_real, const int n_target, float *sums );
+int  metrics_check_targets( metric_func metrics[], const int n_output, const int n_target );
+
 #define METRIC_FROM_NEURALNET(nnet) get_metric_func( get_loss_name( nnet->loss ))
 #define METRIC_LIST(...) ((metric_func[]){ __VA_ARGS__, NULL })
 
@@ -0,0 +1,286 @@
+/* model_handle.c - Øystein Schønning-Johansen 2023 */
+/*
+ vim: ts=4 sw=4 softtabstop=4 expandtab
+*/
+#define _DEFAULT_SOURCE   /* strdup() and posix_memalign() with -std=c99 */
+#include "model_handle.h"
+#include "neuralnet_predict_batch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define CACHE_LINE 64
+
+/* The network and its version are published together */
+typedef struct {
+    neuralnet_t   *nn;
+    unsigned long  version;
+} model_t;
+
+/* The readers of the even and the odd epochs */
+typedef struct {
+    unsigned int count[2];
+} __attribute__((aligned( CACHE_LINE ))) reader_slot_t;
+
+struct _model_handle_t {
+    model_t        *current;
+    unsigned long   epoch;
+    reader_slot_t   slot[MODEL_HANDLE_SLOTS];
+
+    pthread_mutex_t writer_lock;      /* One swap at a time */
+
+    /* The background reload */
+    pthread_mutex_t reload_lock;
+    pthread_t       reload_thread;
+    bool            reloading;
+    int             reload_status;
+    char           *reload_filename;
+};
+
+/* Each thread gets its own slot (modulo MODEL_HANDLE_SLOTS), the first time it reads */
+static unsigned int next_slot = 0;
+static __thread int thread_slot = -1;
+
+static inline unsigned int *reader_counters( model_handle_t *handle )
+{
+    if( thread_slot < 0 )
+        thread_slot = (int) (__atomic_fetch_add( &next_slot, 1, __ATOMIC_RELAXED ) % MODEL_HANDLE_SLOTS);
+    return handle->slot[thread_slot].count;
+}
+
+/**
+  @brief Create a handle to a neural network that can be swapped while it is used.
+  @param nn The neural network. The handle takes over the network, and frees it when it is swapped out.
+  @return The handle, or NULL on failure. Use model_handle_free() to free the resources.
+*/
+model_handle_t *model_handle_new( neuralnet_t *nn )
+{
+    if( !nn ){
+        fprintf( stderr, "No neural network for the model handle.\n" );
+        return NULL;
+    }
+    model_handle_t *handle = NULL;
+    model_t *model = malloc( sizeof(model_t) );
+    if( !model || posix_memalign( (void **) &handle, CACHE_LINE, sizeof(model_handle_t)) != 0 ){
+        fprintf( stderr, "Cannot allocate the model handle.\n" );
+        free( model );
+        return NULL;
+    }
+    memset( handle, 0, sizeof(model_handle_t) );
+    *model = (model_t) { .nn = nn, .version = 0 };
+    handle->current = model;
+    pthread_mutex_init( &handle->writer_lock, NULL );
+    pthread_mutex_init( &handle->reload_lock, NULL );
+    return handle;
+}
+
+/**
+  @brief Get the current neural network, for predictions. This never blocks.
+  @param handle The model handle.
+  @param ref Where to keep track of the reader. Pass it to model_handle_release() when done.
+  @return The current network. It is valid until model_handle_release() is called.
+*/
+const neuralnet_t *model_handle_acquire( model_handle_t *handle, model_handle_ref_t *ref )
+{
+    unsigned int *counters = reader_counters( handle );
+    for(;;){
+        const unsigned long epoch = __atomic_load_n( &handle->epoch, __ATOMIC_SEQ_CST );
+        unsigned int *counter = counters + (epoch & 1);
+        __atomic_fetch_add( counter, 1, __ATOMIC_SEQ_CST );
+        /* If the epoch has not changed, the writer will see the count before it frees anything that
+           is published now. If it has changed, the writer may already have looked, so try again. */
+        if( __atomic_load_n( &handle->epoch, __ATOMIC_SEQ_CST ) == epoch ){
+            const model_t *model = __atomic_load_n( &handle->current, __ATOMIC_SEQ_CST );
+            ref->nn      = model->nn;
+            ref->version = model->version;
+            ref->counter = counter;
+            return model->nn;
+        }
+        __atomic_fetch_sub( counter, 1, __ATOMIC_RELEASE );
+    }
+}
+
+/**
+  @brief Release the network from model_handle_acquire().
+  @param handle The model handle.
+  @param ref The reference from model_handle_acquire().
+*/
+void model_handle_release( model_handle_t *handle, model_handle_ref_t *ref )
+{
+    (void) handle;
+    __atomic_fetch_sub( ref->counter, 1, __ATOMIC_RELEASE );
+    ref->nn = NULL;
+}
+
+/**
+  @brief Predict one sample with the current network, like neuralnet_predict().
+  @return The version of the network that made the prediction.
+*/
+unsigned long model_handle_predict( model_handle_t *handle, const float *input, float *output )
+{
+    model_handle_ref_t ref;
+    neuralnet_predict( model_handle_acquire( handle, &ref ), input, output );
+    model_handle_release( handle, &ref );
+    return ref.version;
+}
+
+/**
+  @brief Predict a batch of samples with the current network, like neuralnet_predict_batch().
+  @return The version of the network that made the predictions.
+*/
+unsigned long model_handle_predict_batch( model_handle_t *handle, const int n_samples, const float *inputs,
+        float *output )
+{
+    model_handle_ref_t ref;
+    neuralnet_predict_batch( model_handle_acquire( handle, &ref ), n_samples, inputs, output );
+    model_handle_release( handle, &ref );
+    return ref.version;
+}
+
+/* Waits until no reader uses the epoch with the given parity */
+static void wait_for_readers( model_handle_t *handle, const unsigned int parity )
+{
+    for( int s = 0; s < MODEL_HANDLE_SLOTS; s++ )
+        while( __atomic_load_n( &handle->slot[s].count[parity], __ATOMIC_ACQUIRE ) != 0 )
+            sched_yield();
+}
+
+/**
+  @brief Replace the network of the handle. The readers that started before the swap keep on using the old
+  network, and it is freed when they are done. This blocks (without blocking the readers) until then.
+  @param handle The model handle.
+  @param nn The new network. It must have the same number of inputs and outputs as the current network.
+  The handle takes over the network, unless the swap fails.
+  @return 0 on success, -1 on failure.
+*/
+int model_handle_swap( model_handle_t *handle, neuralnet_t *nn )
+{
+    if( !nn ){
+        fprintf( stderr, "No neural network to swap in.\n" );
+        return -1;
+    }
+    pthread_mutex_lock( &handle->writer_lock );
+    model_t *old = handle->current;
+    const neuralnet_t *cur = old->nn;
+    if( nn->layer[0].n_input != cur->layer[0].n_input ||
+            nn->layer[nn->n_layers - 1].n_output != cur->layer[cur->n_layers - 1].n_output ){
+        fprintf( stderr, "Cannot swap in a neural network of %d inputs and %d outputs for one of %d inputs and %d outputs.\n",
+                nn->layer[0].n_input, nn->layer[nn->n_layers - 1].n_output,
+                cur->layer[0].n_input, cur->layer[cur->n_layers - 1].n_output );
+        pthread_mutex_unlock( &handle->writer_lock );
+        return -1;
+    }
+    model_t *model = malloc( sizeof(model_t) );
+    if( !model ){
+        fprintf( stderr, "Cannot allocate the model.\n" );
+        pthread_mutex_unlock( &handle->writer_lock );
+        return -1;
+    }
+    *model = (model_t) { .nn = nn, .version = old->version + 1 };
+
+    /* Publish, and start a new epoch. The readers of the old epoch may use the old network. */
+    __atomic_store_n( &handle->current, model, __ATOMIC_SEQ_CST );
+    const unsigned long epoch = __atomic_load_n( &handle->epoch, __ATOMIC_RELAXED );
+    __atomic_store_n( &handle->epoch, epoch + 1, __ATOMIC_SEQ_CST );
+    wait_for_readers( handle, (unsigned int) (epoch & 1) );
+    pthread_mutex_unlock( &handle->writer_lock );
+
+    neuralnet_free( old->nn );
+    free( old );
+    return 0;
+}
+
+/**
+  @brief Load a network from file (see neuralnet_load_mmap()) and swap it in.
+  @return 0 on success, -1 on failure. On failure, the current network is kept.
+*/
+int model_handle_reload( model_handle_t *handle, const char *filename )
+{
+    neuralnet_t *nn = neuralnet_load_mmap( filename );
+    if( !nn ){
+        fprintf( stderr, "Cannot reload the model from '%s'.\n", filename );
+        return -1;
+    }
+    if( model_handle_swap( handle, nn ) < 0 ){
+        neuralnet_free( nn );
+        return -1;
+    }
+    return 0;
+}
+
+static void *reload_thread( void *arg )
+{
+    model_handle_t *handle = (model_handle_t *) arg;
+    handle->reload_status = model_handle_reload( handle, handle->reload_filename );
+    return NULL;
+}
+
+/**
+  @brief Like model_handle_reload(), but the loading and the swap is done by a background thread. If a
+  background reload is already running, this waits for it first.
+  @return 0 if the reload is started, -1 on failure. Use model_handle_wait() to get the result of the reload.
+*/
+int model_handle_reload_async( model_handle_t *handle, const char *filename )
+{
+    model_handle_wait( handle );
+    pthread_mutex_lock( &handle->reload_lock );
+    free( handle->reload_filename );
+    handle->reload_filename = strdup( filename );
+    if( !handle->reload_filename ){
+        fprintf( stderr, "Cannot allocate the filename.\n" );
+        pthread_mutex_unlock( &handle->reload_lock );
+        return -1;
+    }
+    if( pthread_create( &handle->reload_thread, NULL, reload_thread, handle ) != 0 ){
+        fprintf( stderr, "Cannot start the reload thread.\n" );
+        pthread_mutex_unlock( &handle->reload_lock );
+        return -1;
+    }
+    handle->reloading = true;
+    pthread_mutex_unlock( &handle->reload_lock );
+    return 0;
+}
+
+/**
+  @brief Wait for the background reload from model_handle_reload_async() to finish.
+  @return The result of the reload: 0 on success (or if there was no reload), -1 on failure.
+*/
+int model_handle_wait( model_handle_t *handle )
+{
+    pthread_mutex_lock( &handle->reload_lock );
+    if( handle->reloading ){
+        pthread_join( handle->reload_thread, NULL );
+        handle->reloading = false;
+    }
+    const int status = handle->reload_status;
+    pthread_mutex_unlock( &handle->reload_lock );
+    return status;
+}
+
+/**
+  @brief The version of the current network, which is the number of swaps.
+*/
+unsigned long model_handle_version( model_handle_t *handle )
+{
+    return __atomic_load_n( &handle->epoch, __ATOMIC_ACQUIRE );
+}
+
+/**
+  @brief Free the handle and the current network. A background reload is finished first. There must be
+  no readers.
+*/
+void model_handle_free( model_handle_t *handle )
+{
+    if( !handle ) return;
+    model_handle_wait( handle );
+    neuralnet_free( handle->current->nn );
+    free( handle->current );
+    free( handle->reload_filename );
+    pthread_mutex_destroy( &handle->writer_lock );
+    pthread_mutex_destroy( &handle->reload_lock );
+    free( handle );
+}
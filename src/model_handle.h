@@ -0,0 +1,65 @@
+/* model_handle.h - Øystein Schønning-Johansen 2023 */
+/*
+  vim: ts=4 sw=4 softtabstop=4 expandtab
+ */
+
+/* A handle to the neural network that is served, such that a new network can be swapped in while
+ * other threads are predicting with the current one.
+ *
+ * The readers never block (and never take a lock). They increment a counter on entry and decrement
+ * it on exit, much like read-copy-update (RCU). The writer publishes the new network, and then waits
+ * for the readers that may still use the old network to finish (the grace period) before it frees
+ * the old network. The readers that start after the publishing use the new network.
+ *
+ *     model_handle_t *handle = model_handle_new( neuralnet_load( "model.npz" ));
+ *     ...
+ *     model_handle_predict( handle, input, output );          // From any thread
+ *     ...
+ *     model_handle_reload_async( handle, "model_v2.npz" );    // Loads and swaps in the background
+ *     ...
+ *     model_handle_free( handle );
+ *
+ * To use the network for more than one call:
+ *
+ *     model_handle_ref_t ref;
+ *     const neuralnet_t *nn = model_handle_acquire( handle, &ref );
+ *     ...
+ *     model_handle_release( handle, &ref );
+ *
+ * The network must not be used after the release, and a reader should not hold on to it for long
+ * as this delays the freeing of an old network. A reader must not swap or reload while it holds a
+ * network, since the swap would wait for itself.
+ */
+
+#ifndef __MODEL_HANDLE_H__
+#define __MODEL_HANDLE_H__
+#include "neuralnet.h"
+
+/* Number of reader counters. The readers are spread over these, one per thread, to avoid that the
+   readers on different cores write to the same cache line. */
+#ifndef MODEL_HANDLE_SLOTS
+#define MODEL_HANDLE_SLOTS 64
+#endif
+
+typedef struct _model_handle_t model_handle_t;
+
+/* A network held by a reader. The fields are private. */
+typedef struct {
+    const neuralnet_t *nn;
+    unsigned long      version;   /* Number of swaps before this network was published */
+    unsigned int      *counter;
+} model_handle_ref_t;
+
+model_handle_t *    model_handle_new          ( neuralnet_t *nn );
+const neuralnet_t * model_handle_acquire      ( model_handle_t *handle, model_handle_ref_t *ref );
+void                model_handle_release      ( model_handle_t *handle, model_handle_ref_t *ref );
+unsigned long       model_handle_predict      ( model_handle_t *handle, const float *input, float *output );
+unsigned long       model_handle_predict_batch( model_handle_t *handle, const int n_samples, const float *inputs,
+                                                float *output );
+int                 model_handle_swap         ( model_handle_t *handle, neuralnet_t *nn );
+int                 model_handle_reload       ( model_handle_t *handle, const char *filename );
+int                 model_handle_reload_async ( model_handle_t *handle, const char *filename );
+int                 model_handle_wait         ( model_handle_t *handle );
+unsigned long       model_handle_version      ( model_handle_t *handle );
+void                model_handle_free         ( model_handle_t *handle );
+#endif /* __MODEL_HANDLE_H__ */
@@ -2,6 +2,7 @@
 /* 
  vim: ts=4 sw=4 softtabstop=4 expandtab 
 */
+#define _DEFAULT_SOURCE   /* madvise() with -std=c99 */
 #include "neuralnet.h"
 #include "simd.h"
 #include "activation.h"
@@ -11,15 +12,30 @@
 
 #ifndef PREDICTION_ONLY
 #include "loss.h"
+#include "sampled_softmax.h"
+#include "numa_topology.h"
 #endif
 
 #include <stdio.h>
 #include <string.h>             /* for memcpy */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <math.h>
 #include <assert.h>
 
+static void _predict( const neuralnet_t *nn, const float *input, const sparse_vector_t *sparse_input, float *out,
+        const bool skip_output_activation );
+static void _forward( const neuralnet_t *nn, const sparse_vector_t *sparse_input, float *activations[],
+        const bool skip_output_activation );
+#ifndef PREDICTION_ONLY
+static int  _backpropagation( const neuralnet_t *nn, const float *input, const sparse_vector_t *sparse_input,
+        const float *target, float *grad, float *y_pred, int *columns );
+#endif
+
 #if defined(VERBOSE) 
 static void neuralnet_dump( const neuralnet_t *nn )
 {
@@ -59,8 +75,8 @@ static void print_matrix( int m, int n, const float *v )
 static void _weights_memory_free( neuralnet_t *nn )
 {
     for ( int i = 0; i < nn->n_layers ; i++ ){
-        if (nn->layer[i].weight ) simd_free( nn->layer[i].weight);
-        if (nn->layer[i].bias   ) simd_free( nn->layer[i].bias);
+        if (nn->layer[i].weight ) simd_free_huge( nn->layer[i].weight);
+        if (nn->layer[i].bias   ) simd_free_huge( nn->layer[i].bias);
     }
 }
 
@@ -74,12 +90,12 @@ static bool _weights_memory_allocate( neuralnet_t *nn )
     }
 
     for ( int i = 0; i < nn->n_layers; i++ ){
-        if (NULL == (nn->layer[i].weight = simd_malloc( nn->layer[i].n_input * nn->layer[i].n_output * sizeof( float ))))
+        if (NULL == (nn->layer[i].weight = simd_malloc_huge( nn->layer[i].n_input * nn->layer[i].n_output * sizeof( float ))))
             goto weight_alloc_error;
     }
 
     for ( int i = 0; i < nn->n_layers; i++ ){
-        if (NULL == (nn->layer[i].bias = simd_malloc( nn->layer[i].n_output * sizeof( float ))))
+        if (NULL == (nn->layer[i].bias = simd_malloc_huge( nn->layer[i].n_output * sizeof( float ))))
             goto weight_alloc_error;
     }
 
@@ -108,14 +124,10 @@ static char ** _activation_names_from_npy( npy_array_t *m )
     return ret;
 }
 
-/**
-  @brief Create a new neural network based on specifications in file.
-  @param filename Filename to neural network file.
-  @return Pointer to newly created neural network. Returns NULL on failure. Use neuralnet_free() to free the resources.
-*/
-neuralnet_t *neuralnet_load( const char *filename)
+/* Creates the neural network from the arrays of a neural network file. The arrays are copied, so
+   the list can be freed afterwards. */
+static neuralnet_t *_neuralnet_from_array_list( npy_array_list_t *array_list, const char *filename )
 {
-    npy_array_list_t  *array_list          = NULL;
     npy_array_t      **weights_and_biases  = NULL;
     char             **activation_funcs    = NULL;
     int                wb_idx              = 0;
@@ -123,13 +135,6 @@ neuralnet_t *neuralnet_load( const char *filename)
 
     /* Start with copying data from the 'npy' file into an other array for weights and biases,
        and the activation function names into another array */
-    if( !(array_list = npy_array_list_load( filename )) ) 
-    {
-        /* Oh you poor thing... what did you pass in? */
-        fprintf(stderr, "Cannot read neural network from file '%s'. Make sure you have a valid file.\n", filename );
-        return NULL;
-    }
-
     size_t len = npy_array_list_length( array_list );
 
     if (NULL == (weights_and_biases = malloc( len * sizeof( npy_array_t * )))){
@@ -149,6 +154,10 @@ neuralnet_t *neuralnet_load( const char *filename)
         }
     }
 
+    if( wb_idx == 0 ){
+        fprintf( stderr, "No weights found in file '%s'.\n", filename );
+        goto load_error;
+    }
     assert( (wb_idx % 2) == 0 );  /* There should be one weight and one bias npy arrays for each layer. This should hence be even. */
 
     int n_layers = wb_idx / 2;
@@ -204,7 +213,6 @@ neuralnet_t *neuralnet_load( const char *filename)
 
 load_error:
     /* Clean up */
-    if( array_list )        npy_array_list_free( array_list );
     if( weights_and_biases) free( weights_and_biases );
 
     if( activation_funcs ){
@@ -214,6 +222,63 @@ load_error:
     return nn;
 }
 
+/**
+  @brief Create a new neural network based on specifications in file.
+  @param filename Filename to neural network file.
+  @return Pointer to newly created neural network. Returns NULL on failure. Use neuralnet_free() to free the resources.
+*/
+neuralnet_t *neuralnet_load( const char *filename)
+{
+    npy_array_list_t *array_list = npy_array_list_load( filename );
+    if( !array_list ){
+        /* Oh you poor thing... what did you pass in? */
+        fprintf(stderr, "Cannot read neural network from file '%s'. Make sure you have a valid file.\n", filename );
+        return NULL;
+    }
+    neuralnet_t *nn = _neuralnet_from_array_list( array_list, filename );
+    npy_array_list_free( array_list );
+    return nn;
+}
+
+/**
+  @brief Create a new neural network from file, like neuralnet_load(), but the file is mmap()'ed.
+  @details The weights are copied straight from the page cache into the (aligned) layers, without
+  reading the file through libzip and into temporary arrays first. This is faster and needs less
+  memory for big networks. It only works when the arrays are stored uncompressed in the file, which
+  is the case for neuralnet_save() and numpy.savez(). Other files are read with neuralnet_load().
+  @param filename Filename to neural network file.
+  @return Pointer to newly created neural network. Returns NULL on failure. Use neuralnet_free() to free the resources.
+*/
+neuralnet_t *neuralnet_load_mmap( const char *filename )
+{
+    int fd = open( filename, O_RDONLY );
+    if( fd == -1 ){
+        fprintf(stderr, "Cannot open neural network file '%s'.\n", filename );
+        return NULL;
+    }
+    struct stat st;
+    if( fstat( fd, &st ) == -1 || st.st_size == 0 ){
+        close( fd );
+        return neuralnet_load( filename );
+    }
+    const size_t length = (size_t) st.st_size;
+    char *map = mmap( NULL, length, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if( map == MAP_FAILED )
+        return neuralnet_load( filename );
+    madvise( map, length, MADV_SEQUENTIAL );
+
+    npy_array_list_t *array_list = npy_array_list_view( map, length );
+    if( !array_list ){
+        munmap( map, length );
+        return neuralnet_load( filename );
+    }
+    neuralnet_t *nn = _neuralnet_from_array_list( array_list, filename );
+    npy_array_list_free( array_list );
+    munmap( map, length );
+    return nn;
+}
+
 /**
   @brief Free resources of a neural net.
   @param nn The neural net to free.
@@ -222,10 +287,69 @@ void neuralnet_free( neuralnet_t *nn )
 {
     if( !nn ) return;
     _weights_memory_free( nn );
+    if( nn->node_replica ){
+        for( int node = 0; node < numa_topology_n_nodes(); node++ )
+            neuralnet_free( nn->node_replica[node] );
+        free( nn->node_replica );
+    }
+#ifndef PREDICTION_ONLY
+    sampled_softmax_free( nn->sampled_softmax );
+#endif
     free( nn->layer );
     free( nn );
 }
 
+/**
+  @brief Make a neural net with the same structure as another one, but with its own weights.
+  @param nn The neural net to clone.
+  @return The new neural net, or NULL on failure.
+
+  The layers and the activation functions are the same, and the weights and biases are allocated,
+  but not copied. The loss is kept, as `evaluate()` needs it to find the target size. The clone has
+  no sampled softmax and no NUMA replicas, so it is meant for prediction and evaluation, like the
+  snapshots or the shadow network of the async validation. Free it with `neuralnet_free()`.
+*/
+neuralnet_t *neuralnet_clone_structure( const neuralnet_t *nn )
+{
+    neuralnet_t *clone = malloc( sizeof( neuralnet_t ));
+    if( !clone )
+        return NULL;
+    *clone = *nn;
+    clone->node_replica = NULL;
+#ifndef PREDICTION_ONLY
+    clone->sampled_softmax = NULL;
+#endif
+    clone->layer = calloc( nn->n_layers, sizeof( layer_t ));
+    if( !clone->layer ){
+        free( clone );
+        return NULL;
+    }
+    for( int i = 0; i < nn->n_layers; i++ ){
+        clone->layer[i] = nn->layer[i];
+        clone->layer[i].weight = NULL;
+        clone->layer[i].bias   = NULL;
+    }
+    if( !_weights_memory_allocate( clone )){
+        free( clone->layer );
+        free( clone );
+        return NULL;
+    }
+    return clone;
+}
+
+/**
+  @brief Copy the weights and biases of a neural net into another one with the same structure.
+  @param dst The neural net to copy to, like one made by `neuralnet_clone_structure()`.
+  @param src The neural net to copy from.
+*/
+void neuralnet_copy_weights( neuralnet_t *dst, const neuralnet_t *src )
+{
+    for( int i = 0; i < src->n_layers; i++ ){
+        memcpy( dst->layer[i].weight, src->layer[i].weight, src->layer[i].n_input * src->layer[i].n_output * sizeof(float));
+        memcpy( dst->layer[i].bias, src->layer[i].bias, src->layer[i].n_output * sizeof(float));
+    }
+}
+
 
 /**
   @brief Forward calculate the neural network 
@@ -240,6 +364,75 @@ void neuralnet_free( neuralnet_t *nn )
   of multiple samples in each row, look at the code in `evaluate.c`.
 */
 void neuralnet_predict( const neuralnet_t *nn, const float *input, float *out )
+{
+    _predict( nn, input, NULL, out, false );
+}
+
+/**
+  @brief Forward calculate the neural network with a sparse input sample.
+
+  @param nn The neural net that will do the forward calculaton.
+  @param input Pointer to a sparse input vector (index list and optional values) of one sample.
+  @param out Pointer to an array of predictions (outputs).
+
+  The first layer only gathers the rows of the first layer weight matrix given by the nonzero
+  inputs, so for one-hot encoded data this is much cheaper than `neuralnet_predict()`.
+*/
+void neuralnet_predict_sparse( const neuralnet_t *nn, const sparse_vector_t *input, float *out )
+{
+    _predict( nn, NULL, input, out, false );
+}
+
+/**
+  @brief Same as `neuralnet_predict()`, but the activation function of the output layer is not applied.
+
+  With a softmax output these are the logits. The evaluation uses this to calculate the crossentropy
+  with the fused `softmax_crossentropy()` kernel.
+*/
+void neuralnet_predict_logits( const neuralnet_t *nn, const float *input, float *out )
+{
+    _predict( nn, input, NULL, out, true );
+}
+
+/**
+  @brief Same as `neuralnet_predict_sparse()`, but the activation function of the output layer is not applied.
+*/
+void neuralnet_predict_logits_sparse( const neuralnet_t *nn, const sparse_vector_t *input, float *out )
+{
+    _predict( nn, NULL, input, out, true );
+}
+
+/* Forward calculation through all layers. activations[0] is the dense input. If sparse_input
+   is given it is used in the first layer instead of activations[0]. */
+static void _forward( const neuralnet_t *nn, const sparse_vector_t *sparse_input, float *activations[],
+        const bool skip_output_activation )
+{
+    for( int i = 0; i < nn->n_layers; i++){
+        const layer_t *layer_ptr = nn->layer + i;
+        if( i == 0 && sparse_input )
+            sparse_vector_matrix_multiply(
+                    sparse_input->n_nonzero,
+                    sparse_input->index,
+                    sparse_input->value,
+                    layer_ptr->n_output,
+                    layer_ptr->weight,
+                    layer_ptr->bias,
+                    activations[1]);
+        else
+            vector_matrix_multiply( 
+                    layer_ptr->n_input,
+                    layer_ptr->n_output, // + layer_ptr->n_float_padding,
+                    layer_ptr->weight,
+                    layer_ptr->bias,
+                    activations[i],
+                    activations[i+1]);
+        if( i < nn->n_layers - 1 || !skip_output_activation )
+            layer_ptr->activation_func( layer_ptr->n_output, activations[i+1] );
+    }
+}
+
+static void _predict( const neuralnet_t *nn, const float *input, const sparse_vector_t *sparse_input, float *out,
+        const bool skip_output_activation )
 {
     /* These asserts are important - end user may forget to SIMD_ALIGN memory 
        and then there is a extremly hard bug to find - Think before you remove these assert() */
@@ -278,17 +471,7 @@ void neuralnet_predict( const neuralnet_t *nn, const float *input, float *out )
                 nn->layer[i].n_float_padding);
 #endif
     /* forward */
-    for( int i = 0; i < nn->n_layers; i++){
-        const layer_t *layer_ptr = nn->layer + i;
-        vector_matrix_multiply( 
-                layer_ptr->n_input,
-                layer_ptr->n_output, // + layer_ptr->n_float_padding,
-                layer_ptr->weight,
-                layer_ptr->bias,
-                activations[i],
-                activations[i+1]);
-        layer_ptr->activation_func( layer_ptr->n_output, activations[i+1] );
-    }
+    _forward( nn, sparse_input, activations, skip_output_activation );
 }
 
 #ifndef PREDICTION_ONLY
@@ -426,6 +609,9 @@ void neuralnet_save( const neuralnet_t *nn, const char *filename, ... )
 
 void neuralnet_set_loss ( neuralnet_t *nn, const char *loss_name )
 {
+    nn->softmax_loss = NULL;
+    sampled_softmax_free( nn->sampled_softmax );
+    nn->sampled_softmax = NULL;
     nn->loss = get_loss_func( loss_name );
     if(!nn->loss){
         printf("Warning: Loss function '%s' not found.\n", loss_name);
@@ -448,16 +634,31 @@ void neuralnet_set_loss ( neuralnet_t *nn, const char *loss_name )
         }
     }
 
-    if( nn->loss == get_loss_func( "categorical_crossentropy" ) ){
+    if( nn->loss == get_loss_func( "categorical_crossentropy" ) ||
+        nn->loss == get_loss_func( "sparse_categorical_crossentropy" )){
         if( nn->layer[nn->n_layers-1].activation_func == get_activation_func( "softmax" )){
             nn->layer[nn->n_layers-1].activation_derivative = do_nothing;
+            /* In the backpropagation the softmax and the loss derivative are then done in one pass */
+            nn->softmax_loss = nn->loss == get_loss_func( "categorical_crossentropy" ) ?
+                softmax_crossentropy : sparse_softmax_crossentropy;
         } else {
-            printf("Warning: Using 'categorical_crossentropy' loss function when output activation is not 'softmax'.\n");
+            printf("Warning: Using '%s' loss function when output activation is not 'softmax'.\n", loss_name );
+        }
+    }
+
+    if( nn->loss == get_loss_func( "sampled_softmax" )){
+        if( nn->layer[nn->n_layers-1].activation_func == get_activation_func( "softmax" )){
+            nn->layer[nn->n_layers-1].activation_derivative = do_nothing;
+            nn->sampled_softmax = sampled_softmax_new( nn->layer[nn->n_layers-1].n_output, SAMPLED_SOFTMAX_PROPERTIES() );
+        } else {
+            printf("Warning: Using 'sampled_softmax' loss function when output activation is not 'softmax'.\n");
         }
     }
 
     if( nn->layer[nn->n_layers-1].activation_func == get_activation_func( "softmax" )){
-        if( nn->loss == get_loss_func( "categorical_crossentropy" ) ){
+        if( nn->loss == get_loss_func( "categorical_crossentropy" ) ||
+            nn->loss == get_loss_func( "sparse_categorical_crossentropy" ) ||
+            nn->loss == get_loss_func( "sampled_softmax" )){
             /* All ok. This should have been handled by the statements above */
         } else {
             printf("Warning: Using 'softmax' output activation when loss function is not 'categorical_crossentropy'.\n");
@@ -465,6 +666,22 @@ void neuralnet_set_loss ( neuralnet_t *nn, const char *loss_name )
     }
 }
 
+/**
+  @brief: Number of floats in the target of one sample.
+  @param nn pointer to a `neuralnet_t` structure.
+
+  This is the number of outputs, except for the 'sparse_categorical_crossentropy' and the
+  'sampled_softmax' losses where the target is the class label and takes one float. The training and evaluation code use
+  this as the stride in the target arrays.
+ */
+int neuralnet_target_size( const neuralnet_t *nn )
+{
+    if( nn->loss && ( nn->loss == get_loss_func( "sparse_categorical_crossentropy" ) ||
+                      nn->loss == get_loss_func( "sampled_softmax" )))
+        return 1;
+    return nn->layer[nn->n_layers-1].n_output;
+}
+
 /**
   @brief: Calculates the gradient of the loss w.r.t all parameters in the neural network.
 
@@ -478,6 +695,191 @@ void neuralnet_set_loss ( neuralnet_t *nn, const char *loss_name )
  */
   
 void neuralnet_backpropagation( const neuralnet_t *nn, const float *input, const float *target, float *grad )
+{
+    /* First we set the grad vector to 0.0. The caller always seems forgets! */
+    unsigned int n_param = neuralnet_total_n_parameters( nn );
+    memset( grad, 0, n_param * sizeof(float));
+
+    _backpropagation( nn, input, NULL, target, grad, NULL, NULL );
+}
+
+/**
+  @brief: Calculates the gradient of the loss w.r.t all parameters for a sparse input sample.
+
+  @param nn Pointer to a `neuralnet_t` structure 
+  @param input Pointer the sparse input vector (one sample)
+  @param target Pointer to the desired target values. (of the same sample as in input)
+  @param grad Pointer to the resulting gradient
+
+  The gradient has the same layout as in `neuralnet_backpropagation()`. However, in the gradient
+  of the first layer weights, only the rows given by the nonzero elements of `input` are written.
+  All the other rows of that block must be zero at entry! Clearing them here would cost as much as
+  the dense calculation, and that is exactly what we want to avoid. So, clear `grad` once, and
+  if you reuse it for another sample, clear the rows of the previous sample (or all of it).
+  The rest of the gradient is cleared as usual.
+ */
+void neuralnet_backpropagation_sparse( const neuralnet_t *nn, const sparse_vector_t *input, const float *target, float *grad )
+{
+    const unsigned int n_param = neuralnet_total_n_parameters( nn );
+    const unsigned int w0_end  = (nn->layer[0].n_input + 1) * nn->layer[0].n_output;
+    memset( grad, 0, nn->layer[0].n_output * sizeof(float));
+    memset( grad + w0_end, 0, (n_param - w0_end) * sizeof(float));
+
+    _backpropagation( nn, NULL, input, target, grad, NULL, NULL );
+}
+
+/**
+  @brief: Same as `neuralnet_backpropagation()`, but the output of the forward pass is also written to `output`.
+
+  @param nn Pointer to a `neuralnet_t` structure 
+  @param input Pointer the the input vector (one sample)
+  @param target Pointer to the desired target values. (of the same sample as in input)
+  @param grad Pointer to the resulting gradient
+  @param output Pointer to the output (n_output elements). This is what `neuralnet_predict()` would give.
+
+  The output comes for free from the forward pass of the backpropagation, so the optimizer can
+  accumulate the training metrics without predicting the training set once more. This cannot be
+  used with the 'sampled_softmax' loss, as the full output is then never calculated.
+ */
+void neuralnet_backpropagation_with_output( const neuralnet_t *nn, const float *input, const float *target,
+        float *grad, float *output )
+{
+    unsigned int n_param = neuralnet_total_n_parameters( nn );
+    memset( grad, 0, n_param * sizeof(float));
+
+    _backpropagation( nn, input, NULL, target, grad, output, NULL );
+}
+
+/**
+  @brief: Same as `neuralnet_backpropagation_sparse()`, but the output of the forward pass is also written
+          to `output`. See `neuralnet_backpropagation_with_output()`.
+ */
+void neuralnet_backpropagation_sparse_with_output( const neuralnet_t *nn, const sparse_vector_t *input,
+        const float *target, float *grad, float *output )
+{
+    const unsigned int n_param = neuralnet_total_n_parameters( nn );
+    const unsigned int w0_end  = (nn->layer[0].n_input + 1) * nn->layer[0].n_output;
+    memset( grad, 0, nn->layer[0].n_output * sizeof(float));
+    memset( grad + w0_end, 0, (n_param - w0_end) * sizeof(float));
+
+    _backpropagation( nn, NULL, input, target, grad, output, NULL );
+}
+
+/**
+  @brief: Same as `neuralnet_backpropagation()`, but with the 'sampled_softmax' loss only the sampled columns of
+          the output layer gradient are written.
+
+  @param nn Pointer to a `neuralnet_t` structure with the 'sampled_softmax' loss
+  @param input Pointer the the input vector (one sample)
+  @param target Pointer to the class label of the sample
+  @param grad Pointer to the resulting gradient
+  @param columns The classes of the written output columns (the true class and the sampled classes), sorted and
+         without duplicates. It must have room for `sampled_softmax_max_columns()` classes.
+  @return The number of classes in `columns`.
+
+  The gradient has the same layout as in `neuralnet_backpropagation()`. However, in the gradient of the output
+  layer, only the bias and the weight columns of the classes in `columns` are written, and the rest of that
+  block is not touched. Clearing it would cost as much as the full softmax, just like the first layer rows in
+  `neuralnet_backpropagation_sparse()`. So, only read the columns given back. The layers below are cleared as usual.
+ */
+int neuralnet_backpropagation_sampled( const neuralnet_t *nn, const float *input, const float *target,
+        float *grad, int *columns )
+{
+    assert( nn->sampled_softmax );
+    memset( grad, 0, neuralnet_output_layer_offset( nn ) * sizeof(float));
+
+    return _backpropagation( nn, input, NULL, target, grad, NULL, columns );
+}
+
+/**
+  @brief: Same as `neuralnet_backpropagation_sampled()`, but for a sparse input sample. The rows of the first layer
+          weights are written as in `neuralnet_backpropagation_sparse()`, so the other rows must be zero at entry.
+ */
+int neuralnet_backpropagation_sparse_sampled( const neuralnet_t *nn, const sparse_vector_t *input,
+        const float *target, float *grad, int *columns )
+{
+    assert( nn->sampled_softmax && nn->n_layers > 1 );
+    const unsigned int w0_end = (nn->layer[0].n_input + 1) * nn->layer[0].n_output;
+    memset( grad, 0, nn->layer[0].n_output * sizeof(float));
+    memset( grad + w0_end, 0, (neuralnet_output_layer_offset( nn ) - w0_end) * sizeof(float));
+
+    return _backpropagation( nn, NULL, input, target, grad, NULL, columns );
+}
+
+/**
+  @brief: Calculates the gradient of each output w.r.t all parameters in the neural network. (That is
+          the Jacobian of the output, as used in temporal difference learning.)
+
+  @param nn Pointer to a `neuralnet_t` structure
+  @param input Pointer the the input vector (one sample)
+  @param stride The distance between the gradients in `grads`. It must keep them aligned, like the number
+         of parameters rounded up to a multiple of 16.
+  @param grads Pointer to the resulting gradients, one for each output, in the same layout as in
+         `neuralnet_backpropagation()`. The gradient of output k starts at `grads + k * stride`.
+  @param output Pointer to the output (n_output elements). This is what `neuralnet_predict()` would give.
+
+  This does not use the loss function, so the derivative of the output activation is the real one also
+  when it is "matched" with the loss. The forward pass is done once for all the outputs.
+ */
+void neuralnet_output_gradients( const neuralnet_t *nn, const float *input, const unsigned int stride,
+        float *grads, float *output )
+{
+    assert( is_aligned( grads ) && stride % floats_per_simd_register == 0 );
+    const int last  = nn->n_layers - 1;
+    const int n_out = nn->layer[last].n_output;
+
+    int workmem_sz = 0;
+    for( int i = 0; i < nn->n_layers; i++)
+        workmem_sz += nn->layer[i].n_output;
+
+    float SIMD_ALIGN(workmem[ workmem_sz + nn->layer[0].n_input + (floats_per_simd_register * nn->n_layers) ]);
+    float *activations[nn->n_layers+1];
+    activations[0] = (float*) input;
+    activations[1] = workmem;
+    for( int i = 1; i < nn->n_layers; i++) {
+        int size_w_padding = (nn->layer[i-1].n_output + floats_per_simd_register - 1) / floats_per_simd_register;
+        size_w_padding *= floats_per_simd_register;
+        activations[i+1] = activations[i] + size_w_padding;
+    }
+    _forward( nn, NULL, activations, false );
+    memcpy( output, activations[nn->n_layers], n_out * sizeof(float));
+
+    const activation_derivative output_derivative = get_activation_derivative( nn->layer[last].activation_func );
+    const unsigned int n_param = neuralnet_total_n_parameters( nn );
+    for( int k = 0; k < n_out; k++ ){
+        float *grad = grads + (size_t) k * stride;
+        memset( grad, 0, n_param * sizeof(float));
+
+        float *grad_b[nn->n_layers];
+        float *grad_w[nn->n_layers];
+        float *ptr = grad;
+        for( int i = 0; i < nn->n_layers; i++ ) {
+            grad_b[i] = ptr;
+            ptr += nn->layer[i].n_output;
+            grad_w[i] = ptr;
+            ptr += nn->layer[i].n_input * nn->layer[i].n_output;
+        }
+
+        grad_b[last][k] = 1.0f;
+        for( int layer = last; layer >= 0; layer-- ){
+            const int n_inp = nn->layer[layer].n_input;
+            const int n = nn->layer[layer].n_output;
+            if( layer != last )
+                matrix_vector_multiply( nn->layer[layer+1].n_input, nn->layer[layer+1].n_output,
+                        nn->layer[layer+1].weight, grad_b[layer+1], grad_b[layer] );
+            if( layer == last )
+                output_derivative( n, activations[layer+1], grad_b[layer] );
+            else
+                nn->layer[layer].activation_derivative( n, activations[layer+1], grad_b[layer] );
+            vector_vector_outer( n_inp, n, activations[layer], grad_b[layer], grad_w[layer] );
+        }
+    }
+}
+
+/* The backpropagation itself. grad must be cleared by the caller. With sampled softmax, the sampled
+   classes are written to columns (if not NULL), and the number of them is returned. Otherwise 0. */
+static int _backpropagation( const neuralnet_t *nn, const float *input, const sparse_vector_t *sparse_input,
+        const float *target, float *grad, float *y_pred, int *columns )
 {
     /* These should do */
     assert( is_aligned( grad ));
@@ -497,25 +899,19 @@ void neuralnet_backpropagation( const neuralnet_t *nn, const float *input, const
         assert( is_aligned( activations[i+1] ));
     }
     
-    /* forward */
-    for( int i = 0; i < nn->n_layers; i++){
-        const layer_t *layer_ptr = nn->layer + i;
-        vector_matrix_multiply( 
-                layer_ptr->n_input,
-                layer_ptr->n_output, // + layer_ptr->n_float_padding,
-                layer_ptr->weight,
-                layer_ptr->bias,
-                activations[i],
-                activations[i+1]);
-        layer_ptr->activation_func( layer_ptr->n_output, activations[i+1] );
-    }
+    /* forward. The output softmax is done together with the loss if they are fused. With sampled
+       softmax, the output layer is only calculated for the sampled classes, see below. */
+    sampled_softmax_t *ss = nn->sampled_softmax;
+    if( ss ){
+        assert( !sparse_input || nn->n_layers > 1 );
+        neuralnet_t hidden = *nn;
+        hidden.n_layers--;
+        _forward( &hidden, sparse_input, activations, false );
+    } else
+        _forward( nn, sparse_input, activations, nn->softmax_loss != NULL );
 
     /* backward */
 
-    /* First we set the grad vector to 0.0. The caller always seems forgets! */
-    unsigned int n_param = neuralnet_total_n_parameters( nn );
-    memset( grad, 0, n_param * sizeof(float));
-
     /* Set up some pointers */
     float *grad_b[nn->n_layers];
     float *grad_w[nn->n_layers];
@@ -532,12 +928,28 @@ void neuralnet_backpropagation( const neuralnet_t *nn, const float *input, const
     /* This calls the derivtive of the loss function. See loss.[ch]. */
     float *output = activations[nn->n_layers];
     assert( nn->loss );
-    nn->loss( nn->layer[nn->n_layers-1].n_output, output, target, grad_b[nn->n_layers-1] );
+    const int last = nn->n_layers-1;
+    int n_columns = 0;
+    if( ss ){
+        int sampled_columns[columns ? 1 : sampled_softmax_max_columns( ss )];
+        n_columns = sampled_softmax_backpropagation( ss, nn->layer + last, activations[last], target,
+                grad_b[last], grad_w[last], last > 0 ? grad_b[last-1] : NULL, columns ? columns : sampled_columns );
+    } else if( nn->softmax_loss )
+        nn->softmax_loss( nn->layer[nn->n_layers-1].n_output, output, target, grad_b[nn->n_layers-1] );
+    else
+        nn->loss( nn->layer[nn->n_layers-1].n_output, output, target, grad_b[nn->n_layers-1] );
+
+    /* The fused softmax loss has overwritten the logits with the probabilities, so this is the prediction.
+       The sampled softmax does not calculate the full output. */
+    assert( !(ss && y_pred) );
+    if( y_pred )
+        memcpy( y_pred, output, nn->layer[last].n_output * sizeof(float));
     
-    for( int layer = nn->n_layers-1; layer >= 0; layer-- ){
+    /* The sampled softmax has already done the output layer, and the matrix-vector product into the layer below */
+    for( int layer = ss ? last-1 : last; layer >= 0; layer-- ){
         const int n_inp = nn->layer[layer].n_input;
         const int n_out = nn->layer[layer].n_output;
-        if( layer != nn->n_layers-1 ) {
+        if( layer != last && !(ss && layer == last-1) ) {
             matrix_vector_multiply(
                     nn->layer[layer+1].n_input,   /* n */
                     nn->layer[layer+1].n_output,  /* m */
@@ -548,8 +960,13 @@ void neuralnet_backpropagation( const neuralnet_t *nn, const float *input, const
         nn->layer[layer].activation_derivative( n_out, activations[layer+1], grad_b[layer] );
         
         /* This is actually the outer product */
-        vector_vector_outer( n_inp, n_out, activations[layer], grad_b[layer], grad_w[layer] );
+        if( layer == 0 && sparse_input )  /* Only scatter to the rows that are touched */
+            sparse_vector_vector_outer( sparse_input->n_nonzero, sparse_input->index, sparse_input->value,
+                    n_out, grad_b[layer], grad_w[layer] );
+        else
+            vector_vector_outer( n_inp, n_out, activations[layer], grad_b[layer], grad_w[layer] );
     }
+    return n_columns;
 }
 
 /**
@@ -575,6 +992,73 @@ void neuralnet_update( neuralnet_t *nn, const float *delta_w )
     }
 }
 
+/* Returns a pointer to the parameter at `offset` in the flat parameter vector (same order as in
+   neuralnet_update()), and the number of parameters that follows contiguous in memory from there. */
+static float *_parameter_block( const neuralnet_t *nn, unsigned int offset, unsigned int *n_contiguous )
+{
+    for ( int l = 0; l < nn->n_layers; l++ ){
+        const unsigned int n_inp = nn->layer[l].n_input;
+        const unsigned int n_out = nn->layer[l].n_output;
+        if ( offset < n_out ){
+            *n_contiguous = n_out - offset;
+            return nn->layer[l].bias + offset;
+        }
+        offset -= n_out;
+        if ( offset < n_inp * n_out ){
+            *n_contiguous = n_inp * n_out - offset;
+            return nn->layer[l].weight + offset;
+        }
+        offset -= n_inp * n_out;
+    }
+    *n_contiguous = 0;
+    return NULL;
+}
+
+/**
+  @brief: Update a range of the parameters in the neural network.
+
+  @param nn Pointer to `neuralnet_t` structure.
+  @param offset Offset of the first parameter to update.
+  @param length Number of parameters to update.
+  @param delta_w Pointer to the delta of **all** the parameters. Only delta_w[offset:offset+length] is read.
+
+  This does the same as `neuralnet_update()`, but only for a part of the parameters. This is used
+  by the optimizers when doing lazy (sparse) updates.
+ */
+void neuralnet_update_range( neuralnet_t *nn, unsigned int offset, unsigned int length, const float *delta_w )
+{
+    const float *ptr = delta_w + offset;
+    while ( length > 0 ){
+        unsigned int n;
+        float *params = _parameter_block( nn, offset, &n );
+        assert( params );
+        if ( n > length ) n = length;
+        vector_accumulate_unaligned( n, params, ptr );
+        ptr += n; offset += n; length -= n;
+    }
+}
+
+/**
+  @brief: Get a range of the parameters of the neural network.
+
+  @param nn Pointer to `neuralnet_t` structure.
+  @param offset Offset of the first parameter to get.
+  @param length Number of parameters to get.
+  @param params Pointer to the `length` parameters of the range.
+ */
+void neuralnet_get_parameter_range( const neuralnet_t *nn, unsigned int offset, unsigned int length, float *params )
+{
+    float *ptr = params;
+    while ( length > 0 ){
+        unsigned int n;
+        const float *src = _parameter_block( nn, offset, &n );
+        assert( src );
+        if ( n > length ) n = length;
+        memcpy( ptr, src, n * sizeof(float) );
+        ptr += n; offset += n; length -= n;
+    }
+}
+
 /**
   @brief: Get all parameters of the neural network.
 
@@ -646,6 +1130,7 @@ neuralnet_t * neuralnet_create( const int n_layers, int sizes[], char *activatio
     }
 
     nn->n_layers = n_layers;
+    nn->node_replica = NULL;
     /* The layers vector is also nice to do unaligned */
     nn->layer = malloc( n_layers * sizeof( layer_t ));
     if ( !(nn->layer)){
@@ -680,6 +1165,8 @@ neuralnet_t * neuralnet_create( const int n_layers, int sizes[], char *activatio
 
     /* We really don't want a dangling pointer for the loss function */
     nn->loss = NULL;
+    nn->softmax_loss = NULL;
+    nn->sampled_softmax = NULL;
     /* The user should set the loss function by calling `neuralnet_set_loss( nn, "nameofloss")` */
 
     return nn;
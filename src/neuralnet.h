@@ -5,8 +5,11 @@
 #ifndef __NN_NEURALNET_H__
 #define __NN_NEURALNET_H__
 
+#include "sparse_matrix.h"
+
 typedef struct _neuralnet_t neuralnet_t;
 typedef struct _layer_t layer_t;
+typedef struct _sampled_softmax_t sampled_softmax_t;
 
 struct _layer_t
 {
@@ -22,14 +25,23 @@ struct _neuralnet_t
 {
     int      n_layers;
     layer_t *layer;
+    neuralnet_t **node_replica;  /* A copy on each NUMA node for inference, or NULL. See numa_topology.h */
 #ifndef PREDICTION_ONLY
     void     (*loss)  (const unsigned int n, const float *y_pred, const float *y_true, float *loss );
+    float    (*softmax_loss)(const int n, float *ar, const float *y_true, float *grad );  /* Set by neuralnet_set_loss() */
+    sampled_softmax_t *sampled_softmax;  /* Set by neuralnet_set_loss() with "sampled_softmax". See sampled_softmax.h */
 #endif
 };
 
 neuralnet_t * neuralnet_load             ( const char *filename );
+neuralnet_t * neuralnet_load_mmap        ( const char *filename );
 void          neuralnet_free             (       neuralnet_t *nn); 
+neuralnet_t * neuralnet_clone_structure  ( const neuralnet_t *nn );
+void          neuralnet_copy_weights     (       neuralnet_t *dst, const neuralnet_t *src );
 void          neuralnet_predict          ( const neuralnet_t *nn, const float *input, float *output);
+void          neuralnet_predict_sparse   ( const neuralnet_t *nn, const sparse_vector_t *input, float *output);
+void          neuralnet_predict_logits   ( const neuralnet_t *nn, const float *input, float *output);
+void          neuralnet_predict_logits_sparse( const neuralnet_t *nn, const sparse_vector_t *input, float *output);
 #ifndef PREDICTION_ONLY
 /* Two macros to hide the compound literals */
 #define INT_ARRAY(...) (int[]){__VA_ARGS__}
@@ -37,10 +49,24 @@ void          neuralnet_predict          ( const neuralnet_t *nn, const float *i
 neuralnet_t * neuralnet_create           ( const int n_layers, int sizes[], char *activation_funcs[] );
 void          neuralnet_initialize       (       neuralnet_t *nn, char *initializers[] );
 void          neuralnet_set_loss         (       neuralnet_t *nn, const char *loss_name );
+int           neuralnet_target_size      ( const neuralnet_t *nn );
 void          neuralnet_backpropagation  ( const neuralnet_t *nn, const float *input, const float *desired, float *gradient);
+void          neuralnet_backpropagation_sparse( const neuralnet_t *nn, const sparse_vector_t *input, const float *desired, float *gradient);
+void          neuralnet_backpropagation_with_output( const neuralnet_t *nn, const float *input, const float *desired,
+                                                 float *gradient, float *output );
+void          neuralnet_backpropagation_sparse_with_output( const neuralnet_t *nn, const sparse_vector_t *input,
+                                                 const float *desired, float *gradient, float *output );
+int           neuralnet_backpropagation_sampled( const neuralnet_t *nn, const float *input, const float *desired,
+                                                 float *gradient, int *columns );
+int           neuralnet_backpropagation_sparse_sampled( const neuralnet_t *nn, const sparse_vector_t *input,
+                                                 const float *desired, float *gradient, int *columns );
+void          neuralnet_output_gradients ( const neuralnet_t *nn, const float *input, const unsigned int stride,
+                                                 float *grads, float *output );
 void          neuralnet_save             ( const neuralnet_t *nn, const char *fmt, ...);
 void          neuralnet_update           (       neuralnet_t *nn, const float *delta_w );
 void          neuralnet_get_parameters   ( const neuralnet_t *nn, float *params );
+void          neuralnet_update_range     (       neuralnet_t *nn, unsigned int offset, unsigned int length, const float *delta_w );
+void          neuralnet_get_parameter_range( const neuralnet_t *nn, unsigned int offset, unsigned int length, float *params );
 #endif
 
 static inline int neuralnet_get_n_layers ( const neuralnet_t *nn ) { return nn->n_layers; }
@@ -53,4 +79,12 @@ unsigned int neuralnet_total_n_parameters( const neuralnet_t *nn )
         count += (nn->layer[i].n_input + 1) * nn->layer[i].n_output;
     return count;
 }
+
+/* The offset of the output layer bias in the flat parameter vector. The output layer follows from there. */
+static inline
+unsigned int neuralnet_output_layer_offset( const neuralnet_t *nn )
+{
+    const layer_t *out = nn->layer + nn->n_layers - 1;
+    return neuralnet_total_n_parameters( nn ) - (out->n_input + 1) * out->n_output;
+}
 #endif /* __NN_NEURALNET_H__ */
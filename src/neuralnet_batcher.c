@@ -0,0 +1,301 @@
+/* neuralnet_batcher.c - Øystein Schønning-Johansen 2023 */
+/*
+ vim: ts=4 sw=4 softtabstop=4 expandtab
+*/
+#define _DEFAULT_SOURCE   /* syscall() and clock_gettime() with -std=c99 */
+#include "neuralnet_batcher.h"
+#include "neuralnet_predict_batch.h"
+#include "simd.h"
+#include "sync_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+enum { FUTURE_PENDING, FUTURE_DONE, FUTURE_SLEEPING };
+
+struct _neuralnet_batcher_t {
+    const neuralnet_t  *nn;
+    neuralnet_batcher_properties_t props;
+    unsigned int        n_input;
+    unsigned int        n_output;
+    float              *input;        /* max_batch x n_input */
+    float              *output;       /* max_batch x n_output */
+    float              *workmem;
+    neuralnet_future_t **batch;
+    pthread_t           thread;
+    neuralnet_batcher_stats_t stats;  /* Written by the batcher thread */
+    int                 spin_count;   /* 0 with one core, as the thread we wait for cannot run meanwhile */
+
+    /* The submitters push here, and wake the batcher thread if it sleeps */
+    neuralnet_future_t *head __attribute__((aligned( CACHE_LINE )));
+    int                 sleeping;
+    int                 stop;
+};
+
+/* Everything that is submitted, in the order of submission. The push is a stack, so the list
+   is reversed. The end of the list is returned in `tail`. */
+static neuralnet_future_t *take_all( neuralnet_batcher_t *batcher, neuralnet_future_t **tail )
+{
+    neuralnet_future_t *list = __atomic_exchange_n( &batcher->head, NULL, __ATOMIC_ACQUIRE );
+    neuralnet_future_t *reversed = NULL;
+    *tail = list;
+    while( list ){
+        neuralnet_future_t *next = list->next;
+        list->next = reversed;
+        reversed = list;
+        list = next;
+    }
+    return reversed;
+}
+
+static void wait_for_work( neuralnet_batcher_t *batcher )
+{
+    for( int spin = 0; spin < batcher->spin_count; spin++ ){
+        if( __atomic_load_n( &batcher->head, __ATOMIC_RELAXED ) || __atomic_load_n( &batcher->stop, __ATOMIC_RELAXED ))
+            return;
+        cpu_relax();
+    }
+    for(;;){
+        /* A submitter either sees the flag, or we see its submission */
+        __atomic_store_n( &batcher->sleeping, 1, __ATOMIC_SEQ_CST );
+        if( __atomic_load_n( &batcher->head, __ATOMIC_SEQ_CST ) || __atomic_load_n( &batcher->stop, __ATOMIC_SEQ_CST )){
+            __atomic_store_n( &batcher->sleeping, 0, __ATOMIC_RELAXED );
+            return;
+        }
+        futex_wait( &batcher->sleeping, 1 );
+    }
+}
+
+static void complete( neuralnet_future_t *future )
+{
+    /* The future may be gone as soon as it is done, so the wake may be on a stale address. That
+       only gives a spurious wake-up to someone else, which they handle anyway. */
+    if( __atomic_exchange_n( &future->state, FUTURE_DONE, __ATOMIC_RELEASE ) == FUTURE_SLEEPING )
+        futex_wake( &future->state );
+}
+
+static void run_batch( neuralnet_batcher_t *batcher, const int n )
+{
+    for( int i = 0; i < n; i++ )
+        memcpy( batcher->input + i * batcher->n_input, batcher->batch[i]->input, batcher->n_input * sizeof(float));
+
+    /* The batches are small, so this runs in the batcher thread rather than in an OpenMP region */
+    neuralnet_predict_batch_workmem( batcher->nn, n, batcher->input, batcher->output, batcher->workmem, false );
+
+    /* The statistics first, such that they include the predictions the submitters see as done */
+    __atomic_add_fetch( &batcher->stats.n_requests, n, __ATOMIC_RELAXED );
+    __atomic_add_fetch( &batcher->stats.n_batches, 1, __ATOMIC_RELAXED );
+    for( int i = 0; i < n; i++ ){
+        memcpy( batcher->batch[i]->output, batcher->output + i * batcher->n_output, batcher->n_output * sizeof(float));
+        complete( batcher->batch[i] );
+    }
+}
+
+static void *batcher_thread( void *arg )
+{
+    neuralnet_batcher_t *batcher = (neuralnet_batcher_t *) arg;
+    const int max_batch = batcher->props.max_batch;
+    neuralnet_future_t *backlog = NULL, *backlog_tail = NULL;
+
+    for(;;){
+        if( !backlog ){
+            wait_for_work( batcher );
+            backlog = take_all( batcher, &backlog_tail );
+            if( !backlog && __atomic_load_n( &batcher->stop, __ATOMIC_ACQUIRE ))
+                break;
+        }
+
+        int n = 0;
+        double deadline = 0.0;
+        for(;;){
+            while( backlog && n < max_batch ){
+                batcher->batch[n++] = backlog;
+                backlog = backlog->next;
+            }
+            if( n == max_batch || batcher->props.window_us <= 0 )
+                break;
+            /* The window for more submissions */
+            if( deadline == 0.0 )
+                deadline = now_seconds() + 1.0e-6 * batcher->props.window_us;
+            else if( now_seconds() >= deadline )
+                break;
+            neuralnet_future_t *tail;
+            neuralnet_future_t *more = take_all( batcher, &tail );
+            if( more ){
+                if( backlog )
+                    backlog_tail->next = more;
+                else
+                    backlog = more;
+                backlog_tail = tail;
+            } else if( batcher->spin_count ){
+                cpu_relax();
+            } else {
+                sched_yield();
+            }
+        }
+        if( n > 0 )
+            run_batch( batcher, n );
+    }
+    return NULL;
+}
+
+/**
+  @brief Create a batcher of single sample predictions.
+  @param nn The neural network. It must not be changed or freed while the batcher is in use.
+  @param props The largest batch and the window. See `NEURALNET_BATCHER_PROPERTIES()`.
+  @return Pointer to the new batcher or NULL on failure.
+
+  This starts the batcher thread.
+ */
+neuralnet_batcher_t *neuralnet_batcher_new( const neuralnet_t *nn, neuralnet_batcher_properties_t props )
+{
+    if( !nn || props.max_batch < 1 || props.window_us < 0 ){
+        fprintf( stderr, "Invalid batcher properties.\n");
+        return NULL;
+    }
+    neuralnet_batcher_t *batcher;
+    if( posix_memalign( (void **) &batcher, CACHE_LINE, sizeof(neuralnet_batcher_t)) != 0 ){
+        fprintf( stderr, "Cannot allocate memory for 'neuralnet_batcher_t' type.\n");
+        return NULL;
+    }
+    memset( batcher, 0, sizeof(neuralnet_batcher_t));
+    batcher->nn       = nn;
+    batcher->props    = props;
+    batcher->n_input  = nn->layer[0].n_input;
+    batcher->n_output = nn->layer[nn->n_layers - 1].n_output;
+    batcher->input    = simd_malloc( props.max_batch * batcher->n_input * sizeof(float));
+    batcher->output   = simd_malloc( props.max_batch * batcher->n_output * sizeof(float));
+    batcher->workmem  = simd_malloc(( neuralnet_predict_batch_workmem_size( nn, props.max_batch ) + 1 ) * sizeof(float));
+    batcher->batch    = malloc( props.max_batch * sizeof(neuralnet_future_t *));
+    if( !batcher->input || !batcher->output || !batcher->workmem || !batcher->batch ){
+        fprintf( stderr, "Cannot allocate memory for the batches.\n");
+        simd_free( batcher->input );
+        simd_free( batcher->output );
+        simd_free( batcher->workmem );
+        free( batcher->batch );
+        free( batcher );
+        return NULL;
+    }
+    batcher->spin_count = sysconf( _SC_NPROCESSORS_ONLN ) < 2 ? 0 : NEURALNET_BATCHER_SPIN_COUNT;
+
+    if( pthread_create( &batcher->thread, NULL, batcher_thread, batcher ) != 0 ){
+        fprintf( stderr, "Cannot start the batcher thread.\n");
+        simd_free( batcher->input );
+        simd_free( batcher->output );
+        simd_free( batcher->workmem );
+        free( batcher->batch );
+        free( batcher );
+        return NULL;
+    }
+    return batcher;
+}
+
+/**
+  @brief Submit a sample for prediction.
+  @param batcher The batcher
+  @param input The input of the sample
+  @param output Where the output of the sample is written
+  @param future Caller owned handle of the prediction
+
+  This does not wait, and is safe to call from any number of threads. Wait for the output with
+  `neuralnet_future_wait()`.
+ */
+void neuralnet_batcher_submit( neuralnet_batcher_t *batcher, const float *input, float *output, neuralnet_future_t *future )
+{
+    future->input   = input;
+    future->output  = output;
+    future->batcher = batcher;
+    future->state   = FUTURE_PENDING;
+
+    neuralnet_future_t *head = __atomic_load_n( &batcher->head, __ATOMIC_RELAXED );
+    do {
+        future->next = head;
+    } while( !__atomic_compare_exchange_n( &batcher->head, &head, future, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED ));
+
+    if( __atomic_load_n( &batcher->sleeping, __ATOMIC_SEQ_CST ) &&
+            __atomic_exchange_n( &batcher->sleeping, 0, __ATOMIC_SEQ_CST ))
+        futex_wake( &batcher->sleeping );
+}
+
+/**
+  @brief Wait until the output of a submitted sample is written.
+  @param future The handle from `neuralnet_batcher_submit()`
+ */
+void neuralnet_future_wait( neuralnet_future_t *future )
+{
+    const int spin_count = future->batcher->spin_count;
+    for( int spin = 0; spin < spin_count; spin++ ){
+        if( __atomic_load_n( &future->state, __ATOMIC_ACQUIRE ) == FUTURE_DONE )
+            return;
+        cpu_relax();
+    }
+    int expected = FUTURE_PENDING;
+    if( __atomic_compare_exchange_n( &future->state, &expected, FUTURE_SLEEPING, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE ) ||
+            expected == FUTURE_SLEEPING ){
+        while( __atomic_load_n( &future->state, __ATOMIC_ACQUIRE ) != FUTURE_DONE )
+            futex_wait( &future->state, FUTURE_SLEEPING );
+    }
+}
+
+/**
+  @brief Check whether the output of a submitted sample is written, without waiting.
+  @param future The handle from `neuralnet_batcher_submit()`
+  @return 1 if it is done, otherwise 0.
+ */
+int neuralnet_future_done( neuralnet_future_t *future )
+{
+    return __atomic_load_n( &future->state, __ATOMIC_ACQUIRE ) == FUTURE_DONE;
+}
+
+/**
+  @brief Predict a sample through the batcher. (Submit and wait.)
+  @param batcher The batcher
+  @param input The input of the sample
+  @param output The output of the sample
+
+  This gives the same as `neuralnet_predict()`, and can be called from any number of threads.
+ */
+void neuralnet_batcher_predict( neuralnet_batcher_t *batcher, const float *input, float *output )
+{
+    neuralnet_future_t future;
+    neuralnet_batcher_submit( batcher, input, output, &future );
+    neuralnet_future_wait( &future );
+}
+
+/**
+  @brief The number of predictions and batches that are done.
+  @param batcher The batcher
+  @param stats The statistics
+
+  The mean batch size is `n_requests / n_batches`.
+ */
+void neuralnet_batcher_stats( neuralnet_batcher_t *batcher, neuralnet_batcher_stats_t *stats )
+{
+    stats->n_requests = __atomic_load_n( &batcher->stats.n_requests, __ATOMIC_RELAXED );
+    stats->n_batches  = __atomic_load_n( &batcher->stats.n_batches, __ATOMIC_RELAXED );
+}
+
+/**
+  @brief Free the batcher.
+  @param batcher The batcher
+
+  The submitted samples are predicted before the batcher thread stops.
+ */
+void neuralnet_batcher_free( neuralnet_batcher_t *batcher )
+{
+    if( !batcher )
+        return;
+    __atomic_store_n( &batcher->stop, 1, __ATOMIC_SEQ_CST );
+    __atomic_store_n( &batcher->sleeping, 0, __ATOMIC_SEQ_CST );
+    futex_wake( &batcher->sleeping );
+    pthread_join( batcher->thread, NULL );
+    simd_free( batcher->input );
+    simd_free( batcher->output );
+    simd_free( batcher->workmem );
+    free( batcher->batch );
+    free( batcher );
+}
@@ -0,0 +1,80 @@
+/* neuralnet_batcher.h - Øystein Schønning-Johansen 2023 */
+/*
+  vim: ts=4 sw=4 softtabstop=4 expandtab
+ */
+
+/* Coalescing of concurrent single sample predictions into batches, within one process.
+ *
+ * Application threads that produce one sample at a time submit it to the batcher instead of calling
+ * `neuralnet_predict()`. The submissions are pushed on a lock-free multi-producer single-consumer
+ * queue. A batcher thread takes all that is queued, spins for a short window (`window_us`) to pick
+ * up more submissions, copies the inputs into a batch and runs `neuralnet_predict_batch()` on it.
+ * Then the outputs are written back and the submitters are woken up. The submitters (and the
+ * batcher thread when it is out of work) spin for a while before they sleep on a futex.
+ *
+ * The simplest use is a drop-in replacement of `neuralnet_predict()`:
+ *
+ *     neuralnet_batcher_t *batcher = neuralnet_batcher_new( nn, NEURALNET_BATCHER_PROPERTIES( .max_batch = 64 ));
+ *     ...
+ *     neuralnet_batcher_predict( batcher, input, output );    // From any thread
+ *     ...
+ *     neuralnet_batcher_free( batcher );
+ *
+ * or, to do something else while the prediction runs:
+ *
+ *     neuralnet_future_t future;
+ *     neuralnet_batcher_submit( batcher, input, output, &future );
+ *     ...
+ *     neuralnet_future_wait( &future );
+ *
+ * The future is owned by the caller (it can be on the stack) and must stay alive until the wait
+ * has returned. The input and output must stay alive until then as well.
+ */
+
+#ifndef __NEURALNET_BATCHER_H__
+#define __NEURALNET_BATCHER_H__
+#include "neuralnet.h"
+
+/* Number of times a waiting thread checks for its result (or for work) before it goes to sleep */
+#ifndef NEURALNET_BATCHER_SPIN_COUNT
+#define NEURALNET_BATCHER_SPIN_COUNT 20000
+#endif
+
+typedef struct _neuralnet_batcher_t neuralnet_batcher_t;
+typedef struct _neuralnet_future_t neuralnet_future_t;
+
+/* A submitted prediction. The fields are private. */
+struct _neuralnet_future_t {
+    const float        *input;
+    float              *output;
+    neuralnet_future_t *next;    /* In the queue */
+    neuralnet_batcher_t *batcher; /* Where it is submitted */
+    int                 state;   /* Pending, done or sleeping */
+};
+
+typedef struct _neuralnet_batcher_properties_t neuralnet_batcher_properties_t;
+struct _neuralnet_batcher_properties_t {
+    int max_batch;   /* The largest batch */
+    int window_us;   /* How long the batcher waits for more submissions, when the batch is not full */
+};
+
+/* These are the default values. */
+#define NEURALNET_BATCHER_PROPERTIES(...) (neuralnet_batcher_properties_t) \
+            { .max_batch = 64,      \
+              .window_us = 20,      \
+              __VA_ARGS__ }
+
+typedef struct {
+    unsigned long long n_requests;
+    unsigned long long n_batches;
+} neuralnet_batcher_stats_t;
+
+neuralnet_batcher_t * neuralnet_batcher_new    ( const neuralnet_t *nn, neuralnet_batcher_properties_t props );
+void                  neuralnet_batcher_submit ( neuralnet_batcher_t *batcher, const float *input, float *output,
+                                                 neuralnet_future_t *future );
+void                  neuralnet_future_wait    ( neuralnet_future_t *future );
+int                   neuralnet_future_done    ( neuralnet_future_t *future );
+void                  neuralnet_batcher_predict( neuralnet_batcher_t *batcher, const float *input, float *output );
+void                  neuralnet_batcher_stats  ( neuralnet_batcher_t *batcher, neuralnet_batcher_stats_t *stats );
+void                  neuralnet_batcher_free   ( neuralnet_batcher_t *batcher );
+#endif /* __NEURALNET_BATCHER_H__ */
@@ -0,0 +1,190 @@
+/* neuralnet_bf16.c - Øystein Schønning-Johansen 2023 */
+/*
+ vim: ts=4 sw=4 softtabstop=4 expandtab
+*/
+#include "neuralnet_bf16.h"
+#include "simd.h"
+#include "matrix_operations.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+struct _neuralnet_bf16_t {
+    const neuralnet_t *nn;
+    uint32_t         **weight;   /* The paired weights of each layer. See matrix_operations.h */
+    uint32_t          *memory;
+};
+
+static unsigned int n_pairs( const layer_t *layer )
+{
+    /* Each layer starts on a SIMD boundary */
+    const unsigned int n = (layer->n_input + 1) / 2 * layer->n_output;
+    return (n + 15) & ~15u;
+}
+
+/* An even length, with room for a zero after an odd one */
+static int even( const int n )
+{
+    return (n + 1) & ~1;
+}
+
+/**
+  @brief Create a bfloat16 copy of the weights of a network, for mixed precision backpropagation.
+  @param nn The network. It keeps the float32 weights, and must live as long as the copy.
+  @return The copy, or NULL on failure. Use neuralnet_bf16_free() to free the resources.
+*/
+neuralnet_bf16_t *neuralnet_bf16_new( const neuralnet_t *nn )
+{
+    if( nn->sampled_softmax ){
+        fprintf( stderr, "Mixed precision does not support the sampled softmax loss.\n");
+        return NULL;
+    }
+    neuralnet_bf16_t *nnb = calloc( 1, sizeof(neuralnet_bf16_t));
+    if( !nnb ){
+        fprintf( stderr, "Cannot allocate memory for 'neuralnet_bf16_t' type.\n");
+        return NULL;
+    }
+    nnb->nn = nn;
+    size_t total = 0;
+    for( int l = 0; l < nn->n_layers; l++ )
+        total += n_pairs( nn->layer + l );
+    nnb->weight = malloc( nn->n_layers * sizeof(uint32_t *));
+    nnb->memory = (uint32_t *) simd_malloc_huge( total * sizeof(uint32_t));
+    if( !nnb->weight || !nnb->memory ){
+        fprintf( stderr, "Cannot allocate the bfloat16 weights.\n");
+        neuralnet_bf16_free( nnb );
+        return NULL;
+    }
+    uint32_t *ptr = nnb->memory;
+    for( int l = 0; l < nn->n_layers; l++ ){
+        nnb->weight[l] = ptr;
+        ptr += n_pairs( nn->layer + l );
+    }
+    neuralnet_bf16_sync( nnb );
+    return nnb;
+}
+
+/**
+  @brief Copy the float32 weights of the network into the bfloat16 weights. Call this after the
+  network is updated.
+*/
+void neuralnet_bf16_sync( neuralnet_bf16_t *nnb )
+{
+    const neuralnet_t *nn = nnb->nn;
+    for( int l = 0; l < nn->n_layers; l++ ){
+        const int n = nn->layer[l].n_input;
+        const int m = nn->layer[l].n_output;
+        uint32_t *pairs = nnb->weight[l];
+        uint16_t low[m], high[m];
+        for( int p = 0; p < (n + 1) / 2; p++, pairs += m ){
+            vector_to_bf16( m, nn->layer[l].weight + (size_t) 2*p * m, low );
+            if( 2*p + 1 < n )
+                vector_to_bf16( m, nn->layer[l].weight + (size_t) (2*p + 1) * m, high );
+            else
+                memset( high, 0, m * sizeof(uint16_t));
+            for( int j = 0; j < m; j++ )
+                pairs[j] = (uint32_t) low[j] | (uint32_t) high[j] << 16;
+        }
+    }
+}
+
+/**
+  @brief: Same as `neuralnet_backpropagation_with_output()`, but with the bfloat16 weights, activations
+          and deltas. The gradient is float32 in the same layout.
+
+  @param nnb Pointer to the bfloat16 copy of the network
+  @param input Pointer the the input vector (one sample)
+  @param target Pointer to the desired target values. (of the same sample as in input)
+  @param grad Pointer to the resulting gradient
+  @param output Pointer to the output (n_output elements), or NULL.
+ */
+void neuralnet_bf16_backpropagation_with_output( const neuralnet_bf16_t *nnb, const float *input,
+        const float *target, float *grad, float *output )
+{
+    const neuralnet_t *nn = nnb->nn;
+    const int last = nn->n_layers - 1;
+    assert( nn->loss && !nn->sampled_softmax );
+    memset( grad, 0, neuralnet_total_n_parameters( nn ) * sizeof(float));
+
+    /* The activations in bfloat16, each with an even length. The output stays float32. */
+    int workmem_sz = even( nn->layer[0].n_input );
+    int max_size = nn->layer[0].n_input;
+    for( int i = 0; i < nn->n_layers; i++ ){
+        workmem_sz += even( nn->layer[i].n_output );
+        if( nn->layer[i].n_output > max_size )
+            max_size = nn->layer[i].n_output;
+    }
+    uint16_t activations_mem[workmem_sz];
+    uint16_t *activations[nn->n_layers];
+    activations[0] = activations_mem;
+    for( int i = 1; i < nn->n_layers; i++ )
+        activations[i] = activations[i-1] + even( nn->layer[i-1].n_input );
+    uint16_t delta[even( max_size )];
+    float SIMD_ALIGN(work[max_size]);
+    float SIMD_ALIGN(out[nn->layer[last].n_output]);
+
+    /* forward */
+    const int n_input = nn->layer[0].n_input;
+    vector_to_bf16( n_input, input, activations[0] );
+    if( n_input % 2 )
+        activations[0][n_input] = 0;   /* The padding */
+    for( int i = 0; i < nn->n_layers; i++ ){
+        const layer_t *layer_ptr = nn->layer + i;
+        const int n_out = layer_ptr->n_output;
+        float *y = i == last ? out : work;
+        bf16_vector_matrix_multiply( layer_ptr->n_input, n_out, nnb->weight[i], layer_ptr->bias, activations[i], y );
+        if( i < last || !nn->softmax_loss )
+            layer_ptr->activation_func( n_out, y );
+        if( i < last ){
+            vector_to_bf16( n_out, y, activations[i+1] );
+            if( n_out % 2 )
+                activations[i+1][n_out] = 0;
+        }
+    }
+
+    /* Set up some pointers */
+    float *grad_b[nn->n_layers];
+    float *grad_w[nn->n_layers];
+    float *ptr = grad;
+    for( int i = 0; i < nn->n_layers; i++ ) {
+        grad_b[i] = ptr;
+        ptr += nn->layer[i].n_output;
+        grad_w[i] = ptr;
+        ptr += nn->layer[i].n_input * nn->layer[i].n_output;
+    }
+
+    if( nn->softmax_loss )
+        nn->softmax_loss( nn->layer[last].n_output, out, target, grad_b[last] );
+    else
+        nn->loss( nn->layer[last].n_output, out, target, grad_b[last] );
+    if( output )
+        memcpy( output, out, nn->layer[last].n_output * sizeof(float));
+
+    /* backward */
+    for( int layer = last; layer >= 0; layer-- ){
+        const int n_inp = nn->layer[layer].n_input;
+        const int n_out = nn->layer[layer].n_output;
+        if( layer != last ){
+            /* The delta of the layer above */
+            vector_to_bf16( nn->layer[layer+1].n_output, grad_b[layer+1], delta );
+            bf16_matrix_vector_multiply( nn->layer[layer+1].n_input, nn->layer[layer+1].n_output,
+                    nnb->weight[layer+1], delta, grad_b[layer] );
+            vector_from_bf16( n_out, activations[layer+1], work );
+        }
+        nn->layer[layer].activation_derivative( n_out, layer == last ? out : work, grad_b[layer] );
+
+        vector_from_bf16( n_inp, activations[layer], work );
+        vector_vector_outer( n_inp, n_out, work, grad_b[layer], grad_w[layer] );
+    }
+}
+
+void neuralnet_bf16_free( neuralnet_bf16_t *nnb )
+{
+    if( !nnb ) return;
+    simd_free_huge( (float *) nnb->memory );
+    free( nnb->weight );
+    free( nnb );
+}
@@ -0,0 +1,35 @@
+/* neuralnet_bf16.h - Øystein Schønning-Johansen 2023 */
+/*
+  vim: ts=4 sw=4 softtabstop=4 expandtab
+ */
+
+/* Mixed precision backpropagation with bfloat16.
+ *
+ * The network itself keeps its float32 weights (the "master weights"), which the optimizer
+ * updates as before. A `neuralnet_bf16_t` holds a bfloat16 copy of the weights, made by
+ * `neuralnet_bf16_sync()` after each update. The backpropagation with the copy reads the
+ * bfloat16 weights, and stores the activations of the forward pass and the deltas of the backward
+ * pass as bfloat16. This halves the memory traffic of the matrix-vector products. All the sums
+ * are float32, as are the output, the loss derivative and the gradient.
+ *
+ * With AVX512-BF16 (configure adds -mavx512bf16 when the CPU has it) the forward pass uses the
+ * vdpbf16ps instruction. Without it, the bfloat16 values are converted to float32 in the
+ * registers (AVX2).
+ *
+ * The optimizers use this with `.mixed_precision = true` in `OPTIMIZER_PROPERTIES`, see optimizer.h.
+ * The sampled softmax loss, sparse input and the Hogwild mode are not supported. The optimizer then
+ * warns once and trains in float32.
+ */
+
+#ifndef __NEURALNET_BF16_H__
+#define __NEURALNET_BF16_H__
+#include "neuralnet.h"
+
+typedef struct _neuralnet_bf16_t neuralnet_bf16_t;
+
+neuralnet_bf16_t * neuralnet_bf16_new ( const neuralnet_t *nn );
+void               neuralnet_bf16_sync( neuralnet_bf16_t *nnb );
+void               neuralnet_bf16_backpropagation_with_output( const neuralnet_bf16_t *nnb, const float *input,
+                       const float *target, float *grad, float *output );
+void               neuralnet_bf16_free( neuralnet_bf16_t *nnb );
+#endif /* __NEURALNET_BF16_H__ */
@@ -4,6 +4,10 @@
 */
 #include "neuralnet_predict_batch.h"
 #include "activation.h"
+#include "matrix_operations.h"
+#include "simd.h"
+#include "numa_topology.h"
+#include "threadpool.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -13,17 +17,107 @@
 #include <cblas.h>
 #endif
 
+/**
+  @brief The number of floats of work memory `neuralnet_predict_batch_workmem()` needs for `n_samples`.
+ */
+unsigned int neuralnet_predict_batch_workmem_size( const neuralnet_t *nn, const int n_samples )
+{
+    unsigned int workmem_sz = 0;
+    for( int i = 0; i < nn->n_layers-1; i++){
+        /* Each layer starts aligned, such that the activation functions can do aligned loads */
+        const unsigned int size = nn->layer[i].n_output * n_samples;
+        workmem_sz += (size + floats_per_simd_register - 1) / floats_per_simd_register * floats_per_simd_register;
+    }
+    return workmem_sz;
+}
+
+/**
+  @brief Forward calculation of several samples in given work memory.
+  @param nn The neural network
+  @param n_samples Number of samples
+  @param inputs The inputs (n_samples x n_input)
+  @param output The outputs (n_samples x n_output). Should be aligned.
+  @param workmem Aligned work memory of `neuralnet_predict_batch_workmem_size()` floats
+  @param skip_output_activation If true, the logits are returned. (Like `neuralnet_predict_logits()`)
+
+  This does not allocate, nor is it threaded, so the caller can split a large set into chunks
+  that fit in cache, and give each thread its own work memory. See `evaluate()`.
+ */
+void neuralnet_predict_batch_workmem( const neuralnet_t *nn, const int n_samples, const float *inputs, float *output,
+        float *workmem, const bool skip_output_activation )
+{
+    static activation_func softmax = NULL; /* Keep it static such that get_() is called only once! */
+    if( !softmax )
+        softmax = get_activation_func( "softmax" ); /* Slow? */
+
+    nn = neuralnet_local_replica( nn );  /* The weights on this NUMA node, if there are copies */
+
+    const float *in = inputs;
+    float *out = workmem;
+    for( int i = 0; i < nn->n_layers; i++){
+        const layer_t *layer_ptr = nn->layer + i;
+        if( i == nn->n_layers - 1 )
+            out = output;
+
+        matrix_matrix_multiply( n_samples, layer_ptr->n_input, layer_ptr->n_output,
+                in, layer_ptr->weight, layer_ptr->bias, out );
+
+        if ( i == nn->n_layers - 1 && skip_output_activation )
+            break;
+        /* Softmax is the only activation that is not elementwise */
+        if ( layer_ptr->activation_func == softmax ){
+            for ( int j = 0; j < n_samples; j++ )
+                layer_ptr->activation_func ( layer_ptr->n_output, out + j*layer_ptr->n_output );
+        } else {
+            layer_ptr->activation_func ( layer_ptr->n_output * n_samples, out );
+        }
+
+        in = out;
+        const unsigned int size = layer_ptr->n_output * n_samples;
+        out += (size + floats_per_simd_register - 1) / floats_per_simd_register * floats_per_simd_register;
+    }
+}
+
 #ifndef USE_CBLAS
+typedef struct {
+    const neuralnet_t *nn;
+    int                n_samples;
+    const float       *inputs;
+    float             *output;
+} predict_batch_job_t;
+
+/* Each thread of the default thread pool predicts its part of the samples */
+static void predict_batch_job( threadpool_t *pool, void *arg, const int thread, const int n_threads )
+{
+    (void) pool;
+    const predict_batch_job_t *job = (const predict_batch_job_t *) arg;
+    const int n_inputs = job->nn->layer[0].n_input;
+    const int n_output = job->nn->layer[job->nn->n_layers-1].n_output;
+    const neuralnet_t *local = neuralnet_local_replica( job->nn );
+    unsigned int first, last;
+    threadpool_split( job->n_samples, thread, n_threads, &first, &last );
+    for ( unsigned int i = first; i < last; i++ )
+        neuralnet_predict( local, job->inputs + i*n_inputs, job->output + i*n_output );
+}
+
 /* This is the primitive implemetation using OpenMP to thread th foward calculation of several samples.
  * The recommendation is to us the BLAS implementation, and then add the threading at a higher level in
- * you application. */
+ * you application. With a default thread pool, its threads are used instead of OpenMP. */
 void neuralnet_predict_batch( const neuralnet_t *nn, const int n_samples, const float *inputs, float *output )
 {
     const int n_inputs = nn->layer[0].n_input;
     const int n_output = nn->layer[nn->n_layers-1].n_output;
-#pragma omp parallel for
-    for ( int i = 0; i < n_samples; i++ )
-        neuralnet_predict( nn, inputs + i*n_inputs, output + i*n_output);
+    predict_batch_job_t job = { .nn = nn, .n_samples = n_samples, .inputs = inputs, .output = output };
+    if( threadpool_run( threadpool_default(), predict_batch_job, &job ) == 0 )
+        return;
+#pragma omp parallel
+    {
+        /* The weights on the NUMA node of the thread, if there are copies */
+        const neuralnet_t *local = neuralnet_local_replica( nn );
+#pragma omp for
+        for ( int i = 0; i < n_samples; i++ )
+            neuralnet_predict( local, inputs + i*n_inputs, output + i*n_output);
+    }
 }
 #else
 /* This number depends on your system - how much memory do you want to stack allocate?
@@ -44,10 +138,7 @@ void neuralnet_predict_batch( const neuralnet_t *nn, const int n_samples, const
 void neuralnet_predict_batch( const neuralnet_t *nn, const int n_samples, const float *inputs, float *output )
 {
     /* Make some work memory on stack. First calculate how much we need. */
-    int workmem_sz = 0;
-    for( int i = 0; i < nn->n_layers; i++)
-        workmem_sz += nn->layer[i].n_output;
-    workmem_sz *= n_samples;  /* This size is also in floats */
+    const unsigned int workmem_sz = neuralnet_predict_batch_workmem_size( nn, n_samples );
 
 #if 0
     /* Let's see how often this this fails. */
@@ -87,52 +178,7 @@ void neuralnet_predict_batch( const neuralnet_t *nn, const int n_samples, const
      * cannot overflow.)
      * */
 
-    float workmem[ N_STACK_ALLOC_FLOATS ]; /* can we blow the stack here? */
-    float *activations[nn->n_layers+1];
-    activations[0] = (float*) inputs;
-    activations[1] = workmem;
-
-    for( int i = 1; i < nn->n_layers-1; i++)
-        activations[i+1] = activations[i] + nn->layer[i-1].n_output * n_samples;
-
-    activations[nn->n_layers] = output;
-
-    /* Oh, I have to fill the activations with the biases */
-    for( int i = 0; i < nn->n_layers; i++){
-        const layer_t *layer_ptr = nn->layer + i;
-        const size_t size = layer_ptr->n_output * sizeof(float);
-        for( int j = 0; j < n_samples; j++)
-            memcpy( activations[i+1] + j*layer_ptr->n_output, layer_ptr->bias, size );
-    }
-
-    static activation_func softmax = NULL; /* Keep it static such that get_() is called only once! */
-    if( !softmax )
-        softmax = get_activation_func( "softmax" ); /* Slow? */
-
-    /* Then we do the forward calculation */
-    for( int i = 0; i < nn->n_layers; i++){
-        const layer_t *layer_ptr = nn->layer + i;
-        /* Matrix multiplication */
-        cblas_sgemm( CblasRowMajor, CblasNoTrans, CblasNoTrans,
-                n_samples, layer_ptr->n_output, layer_ptr->n_input,
-                1.0f,                /* alpha (7) */
-                activations[i],      /* A     (8) */
-                layer_ptr->n_input,  /* lda   (9) */
-                layer_ptr->weight,   /* B     (8) */
-                layer_ptr->n_output, /* ldb  (11) */
-                1.0f,                /* beta (12) */
-                activations[i+1],    /* C    (13) */
-                layer_ptr->n_output  /* ldc  (14) */
-                );
-        /* Activation */
-        /* ( I really hope the silly if-condition doesn't kill performance. */
-        if ( layer_ptr->activation_func == softmax ){
-            float *out = activations[i+1];
-            for ( int j = 0; j < n_samples; j++, out += layer_ptr->n_output)
-                layer_ptr->activation_func ( layer_ptr->n_output, out );
-        } else {
-            layer_ptr->activation_func ( layer_ptr->n_output * n_samples, activations[i+1] );
-        }
-    }
+    float SIMD_ALIGN(workmem[ N_STACK_ALLOC_FLOATS ]); /* can we blow the stack here? */
+    neuralnet_predict_batch_workmem( nn, n_samples, inputs, output, workmem, false );
 }
 #endif /* USE_CBLAS */
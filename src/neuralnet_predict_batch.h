@@ -2,5 +2,13 @@
 /* 
  vim: ts=4 sw=4 softtabstop=4 expandtab 
 */
+#ifndef __NEURALNET_PREDICT_BATCH_H__
+#define __NEURALNET_PREDICT_BATCH_H__
 #include "neuralnet.h"
+#include <stdbool.h>
 void neuralnet_predict_batch( const neuralnet_t *nn, const int n_samples, const float *inputs, float *output );
+
+unsigned int neuralnet_predict_batch_workmem_size( const neuralnet_t *nn, const int n_samples );
+void         neuralnet_predict_batch_workmem( const neuralnet_t *nn, const int n_samples, const float *inputs,
+                 float *output, float *workmem, const bool skip_output_activation );
+#endif /* __NEURALNET_PREDICT_BATCH_H__ */
@@ -0,0 +1,195 @@
+/* neuralnet_snapshots.c - Øystein Schønning-Johansen 2023 */
+/*
+ vim: ts=4 sw=4 softtabstop=4 expandtab
+*/
+#define _DEFAULT_SOURCE   /* posix_memalign() with -std=c99 */
+#include "neuralnet_snapshots.h"
+#include "neuralnet_predict_batch.h"
+#include "sync_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define N_BUFFERS  3
+
+struct _neuralnet_snapshots_t {
+    /* Read by the actors. The published word is the version times four plus the buffer index. */
+    unsigned long  published;
+    unsigned int   sequence[N_BUFFERS];
+    neuralnet_t   *buffer[N_BUFFERS];
+
+    /* The learner's */
+    unsigned int   previous;          /* The buffer that was published before the latest */
+    pthread_mutex_t lock;             /* Just in case there is more than one learner anyway */
+    unsigned long long n_published;
+
+    unsigned long long n_retries __attribute__((aligned( CACHE_LINE )));
+};
+
+static int same_architecture( const neuralnet_t *a, const neuralnet_t *b )
+{
+    if( a->n_layers != b->n_layers )
+        return 0;
+    for( int i = 0; i < a->n_layers; i++ )
+        if( a->layer[i].n_input != b->layer[i].n_input || a->layer[i].n_output != b->layer[i].n_output ||
+                a->layer[i].activation_func != b->layer[i].activation_func )
+            return 0;
+    return 1;
+}
+
+/**
+  @brief Create the snapshots of a network. All three buffers start with the weights of the network.
+  @param nn The network of the learner. It is not changed, and not used after this call.
+  @return The snapshots (version 0), or NULL on failure. Use neuralnet_snapshots_free() to free the resources.
+*/
+neuralnet_snapshots_t *neuralnet_snapshots_new( const neuralnet_t *nn )
+{
+    if( !nn ){
+        fprintf( stderr, "No neural network for the snapshots.\n" );
+        return NULL;
+    }
+    neuralnet_snapshots_t *snapshots;
+    if( posix_memalign( (void **) &snapshots, CACHE_LINE, sizeof(neuralnet_snapshots_t)) != 0 ){
+        fprintf( stderr, "Cannot allocate memory for 'neuralnet_snapshots_t' type.\n" );
+        return NULL;
+    }
+    memset( snapshots, 0, sizeof(neuralnet_snapshots_t));
+    pthread_mutex_init( &snapshots->lock, NULL );
+    for( int b = 0; b < N_BUFFERS; b++ ){
+        if( !(snapshots->buffer[b] = neuralnet_clone_structure( nn )) ){
+            fprintf( stderr, "Cannot allocate the weight buffers of the snapshots.\n" );
+            neuralnet_snapshots_free( snapshots );
+            return NULL;
+        }
+        neuralnet_copy_weights( snapshots->buffer[b], nn );
+    }
+    snapshots->published = 0;   /* Version 0 in buffer 0 */
+    snapshots->previous  = 1;
+    return snapshots;
+}
+
+/**
+  @brief Publish the weights of the learner's network as a new version. This never waits for the actors.
+  @param snapshots The snapshots.
+  @param nn The network of the learner. It must have the same architecture as the network the snapshots
+  were created from.
+  @return The new version, or 0 on failure.
+*/
+unsigned long neuralnet_snapshots_publish( neuralnet_snapshots_t *snapshots, const neuralnet_t *nn )
+{
+    if( !same_architecture( nn, snapshots->buffer[0] )){
+        fprintf( stderr, "Cannot publish weights of a neural network with another architecture.\n" );
+        return 0;
+    }
+    pthread_mutex_lock( &snapshots->lock );
+    const unsigned long published = __atomic_load_n( &snapshots->published, __ATOMIC_RELAXED );
+    const unsigned int latest = (unsigned int) (published & 3);
+    const unsigned int back   = N_BUFFERS - latest - snapshots->previous;   /* The third one */
+
+    /* The seqlock: Odd while the buffer is written. The fence keeps the weights from being written
+       before the sequence number is odd. */
+    const unsigned int sequence = __atomic_load_n( &snapshots->sequence[back], __ATOMIC_RELAXED );
+    __atomic_store_n( &snapshots->sequence[back], sequence + 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    neuralnet_copy_weights( snapshots->buffer[back], nn );
+    __atomic_store_n( &snapshots->sequence[back], sequence + 2, __ATOMIC_RELEASE );
+
+    const unsigned long version = (published >> 2) + 1;
+    __atomic_store_n( &snapshots->published, (version << 2) | back, __ATOMIC_RELEASE );
+    snapshots->previous = latest;
+    snapshots->n_published++;
+    pthread_mutex_unlock( &snapshots->lock );
+    return version;
+}
+
+/**
+  @brief Pin the latest published weights. This never waits.
+  @param snapshots The snapshots.
+  @param snapshot Where the pinned snapshot is kept. Check it with neuralnet_snapshots_valid() after use.
+  @return The network with the weights of the snapshot.
+*/
+const neuralnet_t *neuralnet_snapshots_pin( neuralnet_snapshots_t *snapshots, neuralnet_snapshot_t *snapshot )
+{
+    for(;;){
+        const unsigned long published = __atomic_load_n( &snapshots->published, __ATOMIC_ACQUIRE );
+        const unsigned int buffer = (unsigned int) (published & 3);
+        const unsigned int sequence = __atomic_load_n( &snapshots->sequence[buffer], __ATOMIC_ACQUIRE );
+        if( sequence & 1 )
+            continue;   /* Overwritten since it was published. There is a newer version. */
+        snapshot->version  = published >> 2;
+        snapshot->buffer   = buffer;
+        snapshot->sequence = sequence;
+        return snapshots->buffer[buffer];
+    }
+}
+
+/**
+  @brief Check that the weights of a pinned snapshot were not overwritten while they were used.
+  @return 1 if the snapshot is valid, 0 if the results must be computed again with a new snapshot.
+*/
+int neuralnet_snapshots_valid( neuralnet_snapshots_t *snapshots, const neuralnet_snapshot_t *snapshot )
+{
+    /* The fence keeps the reads of the weights from being done after the sequence number is read */
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    if( __atomic_load_n( &snapshots->sequence[snapshot->buffer], __ATOMIC_RELAXED ) == snapshot->sequence )
+        return 1;
+    __atomic_fetch_add( &snapshots->n_retries, 1, __ATOMIC_RELAXED );
+    return 0;
+}
+
+/**
+  @brief Predict one sample with the latest published weights, like neuralnet_predict().
+  @return The version of the weights that made the prediction.
+*/
+unsigned long neuralnet_snapshots_predict( neuralnet_snapshots_t *snapshots, const float *input, float *output )
+{
+    neuralnet_snapshot_t snapshot;
+    do {
+        neuralnet_predict( neuralnet_snapshots_pin( snapshots, &snapshot ), input, output );
+    } while( !neuralnet_snapshots_valid( snapshots, &snapshot ));
+    return snapshot.version;
+}
+
+/**
+  @brief Predict a batch of samples with the latest published weights, like neuralnet_predict_batch().
+  @return The version of the weights that made the predictions.
+*/
+unsigned long neuralnet_snapshots_predict_batch( neuralnet_snapshots_t *snapshots, const int n_samples,
+        const float *inputs, float *output )
+{
+    neuralnet_snapshot_t snapshot;
+    do {
+        neuralnet_predict_batch( neuralnet_snapshots_pin( snapshots, &snapshot ), n_samples, inputs, output );
+    } while( !neuralnet_snapshots_valid( snapshots, &snapshot ));
+    return snapshot.version;
+}
+
+/**
+  @brief The latest published version.
+*/
+unsigned long neuralnet_snapshots_version( neuralnet_snapshots_t *snapshots )
+{
+    return __atomic_load_n( &snapshots->published, __ATOMIC_ACQUIRE ) >> 2;
+}
+
+void neuralnet_snapshots_stats( neuralnet_snapshots_t *snapshots, neuralnet_snapshots_stats_t *stats )
+{
+    pthread_mutex_lock( &snapshots->lock );
+    stats->n_published = snapshots->n_published;
+    pthread_mutex_unlock( &snapshots->lock );
+    stats->n_retries = __atomic_load_n( &snapshots->n_retries, __ATOMIC_RELAXED );
+}
+
+/**
+  @brief Free the snapshots. There must be no actors using them.
+*/
+void neuralnet_snapshots_free( neuralnet_snapshots_t *snapshots )
+{
+    if( !snapshots ) return;
+    for( int b = 0; b < N_BUFFERS; b++ )
+        neuralnet_free( snapshots->buffer[b] );
+    pthread_mutex_destroy( &snapshots->lock );
+    free( snapshots );
+}
@@ -0,0 +1,66 @@
+/* neuralnet_snapshots.h - Øystein Schønning-Johansen 2023 */
+/*
+  vim: ts=4 sw=4 softtabstop=4 expandtab
+ */
+
+/* Versioned snapshots of the weights, for a learner that trains a network while actors predict
+ * with it (like self-play reinforcement learning).
+ *
+ * The learner trains its own network, and now and then publishes the weights. The weights are
+ * copied into one of three buffers, the one that is neither the latest nor the one before that
+ * (triple buffering), and then that buffer is published with a new version number. Each buffer
+ * has a sequence number, which is odd while the learner writes to it (a seqlock).
+ *
+ * An actor pins the latest published buffer and predicts with it. Afterwards it checks that the
+ * sequence number of the buffer has not changed. As the buffer is not reused before two more
+ * versions are published, this only fails if the prediction takes longer than that. Then the
+ * prediction is done again with the latest weights. The actors hence never see torn weights, and
+ * never wait for the learner.
+ *
+ *     neuralnet_snapshots_t *snapshots = neuralnet_snapshots_new( nn );
+ *     ...
+ *     neuralnet_snapshots_publish( snapshots, nn );                // Learner, after some training
+ *     ...
+ *     neuralnet_snapshots_predict( snapshots, input, output );     // Actors, from any thread
+ *
+ * To use the same weights for several predictions (like the positions of a search tree):
+ *
+ *     neuralnet_snapshot_t snapshot;
+ *     do {
+ *         const neuralnet_t *nn = neuralnet_snapshots_pin( snapshots, &snapshot );
+ *         ...                                      // Predictions with nn
+ *     } while( !neuralnet_snapshots_valid( snapshots, &snapshot ));
+ *
+ * The results that are computed with a snapshot must not be used before the snapshot is checked
+ * as valid. There must only be one learner (only one thread calls neuralnet_snapshots_publish()).
+ */
+
+#ifndef __NEURALNET_SNAPSHOTS_H__
+#define __NEURALNET_SNAPSHOTS_H__
+#include "neuralnet.h"
+
+typedef struct _neuralnet_snapshots_t neuralnet_snapshots_t;
+
+/* A pinned snapshot. The fields are private, except the version. */
+typedef struct {
+    unsigned long version;    /* The number of publications before this snapshot */
+    unsigned int  buffer;
+    unsigned int  sequence;
+} neuralnet_snapshot_t;
+
+typedef struct {
+    unsigned long long n_published;
+    unsigned long long n_retries;   /* Predictions that were done again, since the weights were overwritten */
+} neuralnet_snapshots_stats_t;
+
+neuralnet_snapshots_t * neuralnet_snapshots_new          ( const neuralnet_t *nn );
+unsigned long           neuralnet_snapshots_publish      ( neuralnet_snapshots_t *snapshots, const neuralnet_t *nn );
+const neuralnet_t *     neuralnet_snapshots_pin          ( neuralnet_snapshots_t *snapshots, neuralnet_snapshot_t *snapshot );
+int                     neuralnet_snapshots_valid        ( neuralnet_snapshots_t *snapshots, const neuralnet_snapshot_t *snapshot );
+unsigned long           neuralnet_snapshots_predict      ( neuralnet_snapshots_t *snapshots, const float *input, float *output );
+unsigned long           neuralnet_snapshots_predict_batch( neuralnet_snapshots_t *snapshots, const int n_samples,
+                                                           const float *inputs, float *output );
+unsigned long           neuralnet_snapshots_version      ( neuralnet_snapshots_t *snapshots );
+void                    neuralnet_snapshots_stats        ( neuralnet_snapshots_t *snapshots, neuralnet_snapshots_stats_t *stats );
+void                    neuralnet_snapshots_free         ( neuralnet_snapshots_t *snapshots );
+#endif /* __NEURALNET_SNAPSHOTS_H__ */
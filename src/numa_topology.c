@@ -0,0 +1,254 @@
+/* numa_topology.c - Øystein Schønning-Johansen 2023 */
+/*
+ vim: ts=4 sw=4 softtabstop=4 expandtab
+*/
+#define _GNU_SOURCE   /* sched_getcpu() and sched_setaffinity() */
+#include "numa_topology.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+static int n_nodes = 1;
+static int n_cpus = 1;
+static short node_of_cpu[NUMA_TOPOLOGY_MAX_CPUS];
+
+/* Parses a cpulist like "0-3,8-11" */
+static void read_cpulist( const char *filename, const int node )
+{
+    FILE *fp = fopen( filename, "r" );
+    if( !fp )
+        return;
+    char line[4096];
+    if( fgets( line, sizeof(line), fp )){
+        char *p = line;
+        while( *p >= '0' && *p <= '9' ){
+            int first = (int) strtol( p, &p, 10 );
+            int last = first;
+            if( *p == '-' )
+                last = (int) strtol( p + 1, &p, 10 );
+            for( int cpu = first; cpu <= last && cpu < NUMA_TOPOLOGY_MAX_CPUS; cpu++ )
+                node_of_cpu[cpu] = (short) node;
+            if( *p == ',' )
+                p++;
+        }
+    }
+    fclose( fp );
+    if( node + 1 > n_nodes )
+        n_nodes = node + 1;
+}
+
+static void read_topology( void )
+{
+    n_cpus = (int) sysconf( _SC_NPROCESSORS_CONF );
+    if( n_cpus < 1 )
+        n_cpus = 1;
+    if( n_cpus > NUMA_TOPOLOGY_MAX_CPUS )
+        n_cpus = NUMA_TOPOLOGY_MAX_CPUS;
+
+    const char *fake = getenv( "NUMA_TOPOLOGY_NODES" );
+    if( fake && atoi( fake ) > 0 ){
+        n_nodes = atoi( fake ) < NUMA_TOPOLOGY_MAX_NODES ? atoi( fake ) : NUMA_TOPOLOGY_MAX_NODES;
+        for( int cpu = 0; cpu < n_cpus; cpu++ )
+            node_of_cpu[cpu] = (short) (cpu % n_nodes);
+        return;
+    }
+
+    char filename[128];
+    for( int node = 0; node < NUMA_TOPOLOGY_MAX_NODES; node++ ){
+        sprintf( filename, "/sys/devices/system/node/node%d/cpulist", node );
+        read_cpulist( filename, node );
+    }
+}
+
+/**
+  @brief The number of NUMA nodes. The nodes are numbered 0, ..., n_nodes-1.
+*/
+int numa_topology_n_nodes( void )
+{
+    pthread_once( &topology_once, read_topology );
+    return n_nodes;
+}
+
+/**
+  @brief The number of cores (configured, not only online).
+*/
+int numa_topology_n_cpus( void )
+{
+    pthread_once( &topology_once, read_topology );
+    return n_cpus;
+}
+
+/**
+  @brief The node of a core.
+  @param cpu The core
+  @return The node, 0 if it is not known.
+*/
+int numa_topology_node_of_cpu( const int cpu )
+{
+    pthread_once( &topology_once, read_topology );
+    return cpu >= 0 && cpu < n_cpus ? node_of_cpu[cpu] : 0;
+}
+
+/**
+  @brief The cores of a node.
+  @param node The node
+  @param cpus Array for the cores, can be NULL
+  @param max_cpus The size of the `cpus` array
+  @return The number of cores on the node. (Only `max_cpus` of them are written.)
+*/
+int numa_topology_node_cpus( const int node, int *cpus, const int max_cpus )
+{
+    pthread_once( &topology_once, read_topology );
+    int count = 0;
+    for( int cpu = 0; cpu < n_cpus; cpu++ ){
+        if( node_of_cpu[cpu] != node )
+            continue;
+        if( cpus && count < max_cpus )
+            cpus[count] = cpu;
+        count++;
+    }
+    return count;
+}
+
+/**
+  @brief The node of the core that runs the calling thread.
+*/
+int numa_topology_current_node( void )
+{
+    return numa_topology_node_of_cpu( sched_getcpu());
+}
+
+/**
+  @brief Pin the calling thread to the cores of a node.
+  @param node The node, or -1 for all the cores
+  @return 0 on success, -1 if the node has no cores or the pinning fails.
+*/
+int numa_topology_bind_thread( const int node )
+{
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    int n = 0;
+    for( int cpu = 0; cpu < numa_topology_n_cpus() && cpu < CPU_SETSIZE; cpu++ ){
+        if( node >= 0 && node_of_cpu[cpu] != node )
+            continue;
+        CPU_SET( cpu, &set );
+        n++;
+    }
+    if( n == 0 || sched_setaffinity( 0, sizeof(set), &set ) < 0 )
+        return -1;
+    return 0;
+}
+
+/**
+  @brief Pin the calling thread to one core.
+  @param cpu The core
+  @return 0 on success, -1 on failure.
+*/
+int numa_topology_bind_cpu( const int cpu )
+{
+    if( cpu < 0 || cpu >= CPU_SETSIZE )
+        return -1;
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    CPU_SET( cpu, &set );
+    return sched_setaffinity( 0, sizeof(set), &set ) < 0 ? -1 : 0;
+}
+
+/* A replica is made by a thread on its node, such that the weights are placed there at the first touch */
+typedef struct {
+    const neuralnet_t *nn;
+    neuralnet_t *replica;
+    int node;
+} replica_job_t;
+
+static neuralnet_t *replica_new( const neuralnet_t *nn )
+{
+    neuralnet_t *replica = neuralnet_clone_structure( nn );
+    if( replica )
+        neuralnet_copy_weights( replica, nn );
+    return replica;
+}
+
+static void *replica_thread( void *arg )
+{
+    replica_job_t *job = (replica_job_t *) arg;
+    numa_topology_bind_thread( job->node );  /* Just a bit slower if this fails */
+    job->replica = replica_new( job->nn );
+    return NULL;
+}
+
+/**
+  @brief Make a copy of the weights on each NUMA node, for inference.
+  @param nn The neural network
+  @return 0 on success, -1 on failure.
+
+  `neuralnet_predict_batch()` and `evaluate()` then use the copy on the node of the calling
+  thread. The optimizer syncs the copies after each epoch and `optimizer_step()`, before the
+  metrics are evaluated. If the weights are changed otherwise, call `neuralnet_sync_replicas()`.
+  (Calling this function again does the same.) The copies are freed with the network.
+*/
+int neuralnet_replicate_nodes( neuralnet_t *nn )
+{
+    if( nn->node_replica ){
+        neuralnet_sync_replicas( nn );
+        return 0;
+    }
+
+    const int n = numa_topology_n_nodes();
+    replica_job_t job[n];
+    pthread_t thread[n];
+    for( int node = 0; node < n; node++ ){
+        job[node] = (replica_job_t) { .nn = nn, .replica = NULL, .node = node };
+        if( pthread_create( &thread[node], NULL, replica_thread, &job[node] ))
+            job[node].replica = replica_new( nn );  /* Then here, on some node */
+        else
+            pthread_join( thread[node], NULL );
+    }
+
+    neuralnet_t **replicas = malloc( n * sizeof(neuralnet_t *));
+    bool ok = replicas != NULL;
+    for( int node = 0; node < n; node++ )
+        ok = ok && job[node].replica;
+    if( !ok ){
+        fprintf( stderr, "Cannot allocate the copies of the neural network on the NUMA nodes.\n");
+        for( int node = 0; node < n; node++ )
+            neuralnet_free( job[node].replica );
+        free( replicas );
+        return -1;
+    }
+    for( int node = 0; node < n; node++ )
+        replicas[node] = job[node].replica;
+    nn->node_replica = replicas;
+    return 0;
+}
+
+/**
+  @brief Copy the weights to the copies on the NUMA nodes.
+  @param nn The neural network
+
+  The memory of the copies stays on their nodes.
+*/
+void neuralnet_sync_replicas( neuralnet_t *nn )
+{
+    if( !nn->node_replica )
+        return;
+    for( int node = 0; node < numa_topology_n_nodes(); node++ )
+        neuralnet_copy_weights( nn->node_replica[node], nn );
+}
+
+/**
+  @brief The copy of the network on the node of the calling thread.
+  @param nn The neural network
+  @return The copy, or `nn` itself if it has no copies.
+*/
+const neuralnet_t *neuralnet_local_replica( const neuralnet_t *nn )
+{
+    if( !nn->node_replica )
+        return nn;
+    return nn->node_replica[numa_topology_current_node()];
+}
@@ -0,0 +1,47 @@
+/* numa_topology.h - Øystein Schønning-Johansen 2023 */
+/*
+  vim: ts=4 sw=4 softtabstop=4 expandtab
+ */
+
+/* NUMA awareness, without libnuma.
+ *
+ * On machines with several sockets, memory is placed on the node of the thread that first writes
+ * to it (first touch), and a thread on another node reads it over the interconnect. The topology
+ * is read from /sys/devices/system/node. Where that is missing, all the cores are on node 0.
+ *
+ * The tools here:
+ *   - Threads can be pinned to the cores of a node, and the thread pool can pin its threads
+ *     (see `threadpool_pin()` in threadpool.h), such that the batch gradients are summed per node
+ *     before the nodes are combined.
+ *   - A network can have a copy of its weights on each node for inference. `neuralnet_predict_batch()`
+ *     and `evaluate()` use the copy on the node of the calling thread.
+ *   - A dataset can be copied such that its batches are spread over the nodes, see
+ *     `threadpool_place_interleaved()`.
+ *
+ * For testing on a machine with one node, the environment variable NUMA_TOPOLOGY_NODES=<n> splits
+ * the cores into n (fake) nodes, where core c is on node c % n.
+ */
+#ifndef __NUMA_TOPOLOGY_H__
+#define __NUMA_TOPOLOGY_H__
+#include "neuralnet.h"
+
+#ifndef NUMA_TOPOLOGY_MAX_NODES
+#define NUMA_TOPOLOGY_MAX_NODES 64
+#endif
+
+#ifndef NUMA_TOPOLOGY_MAX_CPUS
+#define NUMA_TOPOLOGY_MAX_CPUS 1024
+#endif
+
+int  numa_topology_n_nodes      ( void );
+int  numa_topology_n_cpus       ( void );
+int  numa_topology_node_of_cpu  ( const int cpu );
+int  numa_topology_node_cpus    ( const int node, int *cpus, const int max_cpus );
+int  numa_topology_current_node ( void );
+int  numa_topology_bind_thread  ( const int node );
+int  numa_topology_bind_cpu     ( const int cpu );
+
+int                 neuralnet_replicate_nodes( neuralnet_t *nn );
+void                neuralnet_sync_replicas  ( neuralnet_t *nn );
+const neuralnet_t * neuralnet_local_replica  ( const neuralnet_t *nn );
+#endif /* __NUMA_TOPOLOGY_H__ */
@@ -8,19 +8,26 @@
 #include "evaluate.h"
 #include "matrix_operations.h"
 #include "loss.h"
+#include "ranking_metrics.h"
+#include "threadpool.h"
+#include "sampled_softmax.h"
+#include "numa_topology.h"
 
 #include <string.h>
+#include <math.h>
 #include <time.h>
 #include <assert.h>
 
+#include <omp.h>
+
 static void prepare_shuffle_pivot( optimizer_t *opt, const unsigned n_train_samples )
 {
-    static unsigned int _n_sample = 0;
-    if ( n_train_samples != _n_sample ){
-        _n_sample = n_train_samples;
+    if ( !opt->pivot || n_train_samples != opt->n_pivot ){
+        opt->n_pivot = n_train_samples;
         opt->pivot = realloc( opt->pivot, n_train_samples * sizeof(unsigned int));
         if ( !opt->pivot ){
             fprintf( stderr, "Cannot allocate pivot array.\n");
+            opt->n_pivot = 0;
             return;
         }
         for ( unsigned int i = 0; i < n_train_samples; i++ )
@@ -58,6 +65,274 @@ void optimizer_check_sanity( optimizer_t * opt)
     }
 }
 
+/* Collects the parameter ranges touched by a batch with sparse input: The first layer bias,
+   the rows of the first layer weights that have a nonzero input in any of the samples, and
+   then all the parameters of the other layers. */
+static void collect_lazy_ranges( optimizer_t *opt, const unsigned int start, const int batchsize )
+{
+    const neuralnet_t *nn = opt->nn;
+    const int n_inp0 = nn->layer[0].n_input;
+    const int n_out0 = nn->layer[0].n_output;
+    const unsigned int n_parameters = neuralnet_total_n_parameters( nn );
+    const unsigned int w0_end = (n_inp0 + 1) * n_out0;
+
+    lazy_state_t *lazy = opt->lazy_state;
+    if ( !lazy ){
+        lazy = opt->lazy_state = calloc( 1, sizeof(lazy_state_t));
+        assert( lazy );
+        lazy->last_step = calloc( n_inp0, sizeof(unsigned int));
+        lazy->ranges = malloc( (n_inp0 + 2) * sizeof(param_range_t));
+        assert( lazy->last_step && lazy->ranges );
+    }
+
+    const unsigned int step = ++lazy->n_steps;
+    param_range_t *range = lazy->ranges;
+    *range++ = (param_range_t) { .offset = 0, .length = n_out0, .n_skipped = 0 };
+    for ( int b = 0; b < batchsize; b++ ){
+        const sparse_vector_t x = sparse_matrix_row( opt->sparse_X, opt->pivot[start + b] );
+        for ( int k = 0; k < x.n_nonzero; k++ ){
+            const int row = x.index[k];
+            if ( lazy->last_step[row] == step )
+                continue;  /* Already collected */
+            *range++ = (param_range_t) { .offset = n_out0 + row * n_out0, .length = n_out0,
+                .n_skipped = step - lazy->last_step[row] - 1 };
+            lazy->last_step[row] = step;
+        }
+    }
+    if ( n_parameters > w0_end )
+        *range++ = (param_range_t) { .offset = w0_end, .length = n_parameters - w0_end, .n_skipped = 0 };
+    lazy->n_ranges = range - lazy->ranges;
+}
+
+/* The work memory of the OpenMP threads with lazy updates, allocated once: The gradient of a sample
+   (cleared here, and kept clear by accumulate_sparse_gradient()) and the sum of the ranges, each of
+   the size of the model. Too large for the stacks of the threads with a large sparse first layer. */
+static float **lazy_thread_work( lazy_state_t *lazy, const int n_threads, const unsigned int n_parameters )
+{
+    if ( lazy->n_threads >= n_threads )
+        return lazy->thread_work;
+    const size_t stride = (n_parameters + 15) / 16 * 16;
+    float **work = realloc( lazy->thread_work, n_threads * sizeof(float *));
+    assert( work );
+    for ( int t = lazy->n_threads; t < n_threads; t++ ){
+        work[t] = simd_malloc_huge( 2 * stride * sizeof(float));
+        assert( work[t] );
+        memset( work[t], 0, stride * sizeof(float));
+    }
+    lazy->thread_work = work;
+    lazy->n_threads = n_threads;
+    return work;
+}
+
+/* With lazy updates, only the ranges touched by the batch are cleared, summed and divided in the
+   batch gradient, and the rest of it is not written. The optimizers only read the ranges then. */
+static bool lazy_batch( const optimizer_t *opt )
+{
+    return opt->lazy && opt->sparse_X && !opt->allreduce;
+}
+
+static void clear_ranges( const int n_ranges, const param_range_t *ranges, float *v )
+{
+    for ( int k = 0; k < n_ranges; k++ )
+        memset( v + ranges[k].offset, 0, ranges[k].length * sizeof(float));
+}
+
+static void accumulate_ranges( const int n_ranges, const param_range_t *ranges, float *sum, const float *v )
+{
+    for ( int k = 0; k < n_ranges; k++ )
+        vector_accumulate_unaligned( ranges[k].length, sum + ranges[k].offset, v + ranges[k].offset );
+}
+
+/* Adds the gradient of a sample with sparse input to sum: The first layer bias, the first layer
+   weight rows of the nonzero inputs and the other layers up to `end`. The rows are cleared again
+   in grad, see neuralnet_backpropagation_sparse(). */
+static void accumulate_sparse_gradient( const neuralnet_t *nn, const sparse_vector_t *x, const unsigned int end,
+        float *sum, float *grad )
+{
+    const int n_out0 = nn->layer[0].n_output;
+    const unsigned int w0_end = (nn->layer[0].n_input + 1) * n_out0;
+    vector_accumulate_unaligned( n_out0, sum, grad );
+    vector_accumulate_unaligned( end - w0_end, sum + w0_end, grad + w0_end );
+    for ( int k = 0; k < x->n_nonzero; k++ ){
+        const unsigned int row = n_out0 + x->index[k] * n_out0;
+        vector_accumulate_unaligned( n_out0, sum + row, grad + row );
+        memset( grad + row, 0, n_out0 * sizeof(float));
+    }
+}
+
+/* Adds the output layer bias and weight columns of the sampled classes of a sample to sum. The other
+   columns of the output layer in grad are not written, see neuralnet_backpropagation_sampled(). */
+static void accumulate_sampled_columns( const neuralnet_t *nn, const int n_columns, const int *columns,
+        float *sum, const float *grad )
+{
+    const int n_inp = nn->layer[nn->n_layers-1].n_input;
+    const int n_out = nn->layer[nn->n_layers-1].n_output;
+    const unsigned int offset = neuralnet_output_layer_offset( nn );
+    for ( int i = -1; i < n_inp; i++ ){   /* The bias is row -1 */
+        float *sum_row = sum + offset + n_out + i * n_out;
+        const float *grad_row = grad + offset + n_out + i * n_out;
+        for ( int k = 0; k < n_columns; k++ )
+            sum_row[columns[k]] += grad_row[columns[k]];
+    }
+}
+
+/* The gradient of a sample with sparse input is added to sum. grad is a work area that must be cleared
+   before the first sample, see neuralnet_backpropagation_sparse(). With sampled softmax, only the
+   sampled columns of the output layer are added. */
+static void add_sparse_sample_gradient( const neuralnet_t *nn, const sparse_vector_t *x, const float *y_real,
+        float *sum, float *grad, float *y_pred )
+{
+    if( nn->sampled_softmax ){
+        int columns[sampled_softmax_max_columns( nn->sampled_softmax )];
+        const int n_columns = neuralnet_backpropagation_sparse_sampled( nn, x, y_real, grad, columns );
+        accumulate_sparse_gradient( nn, x, neuralnet_output_layer_offset( nn ), sum, grad );
+        accumulate_sampled_columns( nn, n_columns, columns, sum, grad );
+    } else {
+        neuralnet_backpropagation_sparse_with_output( nn, x, y_real, grad, y_pred );
+        accumulate_sparse_gradient( nn, x, neuralnet_total_n_parameters( nn ), sum, grad );
+    }
+}
+
+/* The gradient of a sample with sampled softmax is added to sum: The layers below the output layer,
+   and the sampled columns of the output layer. */
+static void add_sampled_sample_gradient( const neuralnet_t *nn, const float *input, const float *y_real,
+        float *sum, float *grad )
+{
+    int columns[sampled_softmax_max_columns( nn->sampled_softmax )];
+    const int n_columns = neuralnet_backpropagation_sampled( nn, input, y_real, grad, columns );
+    vector_accumulate_unaligned( neuralnet_output_layer_offset( nn ), sum, grad );
+    accumulate_sampled_columns( nn, n_columns, columns, sum, grad );
+}
+
+/* The batch gradient in the default thread pool. Each thread sums the gradients of its part of
+   the batch in its own scratch memory, and after the barrier, each thread adds up its slice of the
+   parameters from all the threads. The slices are whole cache lines. When the threads are pinned
+   to several NUMA nodes, the sums are first added up within each node, such that only one sum
+   per node is read from the other nodes. */
+typedef struct {
+    optimizer_t   *opt;
+    const float   *train_X;
+    const float   *train_Y;
+    const unsigned int *pivot;      /* NULL if the rows are in order */
+    unsigned int   start;
+    int            batchsize;
+    int            n_metrics;
+    float         *batchgrad;
+    float         *thread_metrics;  /* n_metrics per thread */
+    float        **sums;            /* The sum of each thread */
+    const float   *weights;         /* Of each sample in the batch, or NULL */
+    float         *losses;          /* Of each sample in the batch, or NULL */
+    metric_func    loss_metric;
+    const neuralnet_bf16_t *bf16_nn; /* Mixed precision, or NULL */
+    const param_range_t *ranges;    /* Lazy updates: Only these are summed */
+    int            n_ranges;        /* 0 if not lazy */
+} batch_gradient_job_t;
+
+static void batch_gradient_job( threadpool_t *pool, void *arg, const int thread, const int n_threads )
+{
+    batch_gradient_job_t *job = (batch_gradient_job_t *) arg;
+    const optimizer_t *opt = job->opt;
+    neuralnet_t *nn = opt->nn;
+    const unsigned int n_parameters = neuralnet_total_n_parameters( nn );
+    const unsigned int stride = (n_parameters + 15) & ~15u;
+    const int n_input  = nn->layer[0].n_input;
+    const int n_target = neuralnet_target_size( nn );
+    const int n_output = nn->layer[nn->n_layers-1].n_output;
+    const int n_metrics = job->n_metrics;
+    float *metrics = job->thread_metrics + thread * n_metrics;
+
+    float *sum = threadpool_scratch( pool, thread, 2 * stride + ((n_output + 15) & ~15u));
+    assert( sum );
+    float *grad = sum + stride;
+    float *y_pred = grad + stride;
+    if( job->n_ranges )
+        clear_ranges( job->n_ranges, job->ranges, sum );
+    else
+        memset( sum, 0, n_parameters * sizeof(float));
+    memset( metrics, 0, n_metrics * sizeof(float));
+    job->sums[thread] = sum;
+
+    unsigned int first, last;
+    threadpool_split( job->batchsize, thread, n_threads, &first, &last );
+    if( opt->sparse_X ){
+        /* With lazy updates, the first layer weight rows that are read are always written first */
+        if( !job->n_ranges )
+            memset( grad, 0, n_parameters * sizeof(float));
+        for ( unsigned int b = first; b < last; b++ ){
+            const unsigned int idx = job->pivot ? job->pivot[job->start + b] : job->start + b;
+            const sparse_vector_t x = sparse_matrix_row( opt->sparse_X, idx );
+            const float *y_real = job->train_Y + (idx * n_target);
+            add_sparse_sample_gradient( nn, &x, y_real, sum, grad, n_metrics ? y_pred : NULL );
+            for ( int j = 0; j < n_metrics; j++ )
+                metrics[j] += opt->metrics[j]( n_output, y_pred, y_real );
+        }
+    } else if( nn->sampled_softmax ){
+        /* No metrics, losses or weights, as the full output is not calculated */
+        for ( unsigned int b = first; b < last; b++ ){
+            const unsigned int idx = job->pivot ? job->pivot[job->start + b] : job->start + b;
+            add_sampled_sample_gradient( nn, job->train_X + (idx * n_input), job->train_Y + (idx * n_target), sum, grad );
+        }
+    } else {
+        for ( unsigned int b = first; b < last; b++ ){
+            const unsigned int idx = job->pivot ? job->pivot[job->start + b] : job->start + b;
+            const float *y_real = job->train_Y + (idx * n_target);
+            if( job->bf16_nn )
+                neuralnet_bf16_backpropagation_with_output( job->bf16_nn, job->train_X + (idx * n_input), y_real, grad,
+                        n_metrics || job->losses ? y_pred : NULL );
+            else
+                neuralnet_backpropagation_with_output( nn, job->train_X + (idx * n_input), y_real, grad,
+                        n_metrics || job->losses ? y_pred : NULL );
+            for ( int j = 0; j < n_metrics; j++ )
+                metrics[j] += opt->metrics[j]( n_output, y_pred, y_real );
+            if( job->losses )
+                job->losses[b] = job->loss_metric( n_output, y_pred, y_real );
+            if( job->weights )
+                vector_saxpy( n_parameters, sum, job->weights[b], grad );
+            else
+                vector_accumulate( n_parameters, sum, grad );
+        }
+    }
+
+    threadpool_barrier( pool );
+
+    if( job->n_ranges ){
+        /* The rows are taken round robin by the threads, and the other layers are split */
+        for ( int k = 0; k < job->n_ranges; k++ ){
+            const param_range_t *range = job->ranges + k;
+            unsigned int range_first = 0, range_last = range->length;
+            if( range->length > 1024 )
+                threadpool_split( range->length, thread, n_threads, &range_first, &range_last );
+            else if( k % n_threads != thread )
+                continue;
+            const unsigned int offset = range->offset + range_first;
+            for ( int t = 0; t < n_threads && range_first < range_last; t++ )
+                vector_accumulate_unaligned( range_last - range_first, job->batchgrad + offset, job->sums[t] + offset );
+        }
+        return;
+    }
+
+    unsigned int block_first, block_last, offset, end;
+    const bool numa = threadpool_n_nodes( pool ) > 1;
+    if( numa ){
+        /* The threads on this node add their sums to the sum of the first thread on the node */
+        const threadpool_group_t *group = threadpool_group( pool, thread );
+        threadpool_split( stride / 16, group->rank, group->size, &block_first, &block_last );
+        offset = block_first * 16;
+        end = block_last * 16 < n_parameters ? block_last * 16 : n_parameters;
+        for ( int t = 0; t < n_threads && offset < end; t++ )
+            if( t != group->leader && threadpool_group( pool, t )->leader == group->leader )
+                vector_accumulate( end - offset, job->sums[group->leader] + offset, job->sums[t] + offset );
+        threadpool_barrier( pool );
+    }
+
+    threadpool_split( stride / 16, thread, n_threads, &block_first, &block_last );
+    offset = block_first * 16;
+    end = block_last * 16 < n_parameters ? block_last * 16 : n_parameters;
+    for ( int t = 0; t < n_threads && offset < end; t++ )
+        if( !numa || threadpool_group( pool, t )->leader == t )
+            vector_accumulate( end - offset, job->batchgrad + offset, job->sums[t] + offset );
+}
+
 void optimizer_calc_batch_gradient( optimizer_t *opt, 
         const unsigned int n_train_samples, const float *train_X, const float *train_Y,
         unsigned int *i, float *batchgrad)
@@ -67,35 +342,428 @@ void optimizer_calc_batch_gradient( optimizer_t *opt,
 
     /* There is a bug in OpenMP -- if using reduction on an aligned array, there will be threaded
        copies of the arrays in each thread. These copies will not necesarrily be aligned, but rather
-       follow the previous in memory. Solving this can be done by padding. I've not seen this documented
-       but it seems to work. Hence this padding. */
-#ifdef __AVX__
-#define PADDING_SIZE 16
-    /* Hmmm.... maybe it doesn't work after all? it doesn't work with PADDING_SIZE=32, but
-       it works with PADDING_SIZE=16... why? Is this really a stable solution? */
-    const unsigned int n_param_padding = n_parameters + (PADDING_SIZE - n_parameters % PADDING_SIZE);
-    assert( (n_param_padding % PADDING_SIZE) == 0);
-#else
-    const unsigned int n_param_padding __attribute__((unused))  = n_parameters;
-#endif
-    memset( batchgrad, 0, n_parameters * sizeof(float));  /* Clear the batch grad */
-
+       follow the previous in memory. This used to be solved by padding the reduction length, however
+       that made the reduction write past the end of batchgrad. The accumulation into the threaded
+       copies is done with `vector_accumulate_unaligned()` anyway, so the exact length is used. */
     const int n_input  = nn->layer[0].n_input;
-    const int n_output = nn->layer[nn->n_layers-1].n_output;
+    const int n_target = neuralnet_target_size( nn );
 
     const int remaining_samples = (int) n_train_samples - (int) *i;
-    const int batchsize = remaining_samples < opt->batchsize ? remaining_samples : opt->batchsize;
-#pragma omp parallel for reduction(+:batchgrad[0:n_param_padding])
-    for ( int b = 0 ; b < batchsize; b++){
-        const int idx = *i + b;
-        float SIMD_ALIGN(grad[n_parameters]);
-        neuralnet_backpropagation( nn, train_X + (opt->pivot[idx] * n_input), train_Y + (opt->pivot[idx] * n_output), grad );
-        /* When using OpenMP, OpenMP will not align stack allocated arrays -- we therefore
-           have to use `_unaligned` for this accumulation. :-(  */
-        vector_accumulate_unaligned( n_parameters, batchgrad, grad );
+    int batchsize = remaining_samples < opt->batchsize ? remaining_samples : opt->batchsize;
+
+    /* Lazy updates: The ranges touched by the batch are known from the input before the gradient */
+    const bool lazy = lazy_batch( opt );
+    if( lazy ){
+        collect_lazy_ranges( opt, *i, batchsize );
+        clear_ranges( opt->lazy_state->n_ranges, opt->lazy_state->ranges, batchgrad );
+    } else
+        memset( batchgrad, 0, n_parameters * sizeof(float));  /* Clear the batch grad */
+    const int n_ranges = lazy ? opt->lazy_state->n_ranges : 0;
+    const param_range_t *ranges = lazy ? opt->lazy_state->ranges : NULL;
+
+    /* Experience replay: The batch is sampled from the replay buffer instead, and the rows are
+       then in order. See optimizer_run_epoch_replay(). (The pivot is also NULL in optimizer_step().) */
+    replay_state_t *replay = opt->replay && opt->replay->buffer ? opt->replay : NULL;
+    const unsigned int *pivot = opt->pivot;
+    unsigned int start = *i;
+    if( replay ){
+        batchsize = replay_buffer_sample( replay->buffer, batchsize, replay->X, replay->Y, replay->slots,
+                replay->weights, &replay->seed );
+        if( batchsize == 0 ){
+            *i = n_train_samples;
+            return;
+        }
+        train_X = replay->X;
+        train_Y = replay->Y;
+        pivot   = NULL;
+        start   = 0;
     }
-    *i += batchsize;
-    vector_divide_by_scalar( n_parameters, batchgrad, (float) batchsize );
+    const float *weights = replay ? replay->weights : NULL;
+    float *losses = replay ? replay->losses : NULL;
+
+    /* Mixed precision: The bfloat16 weights are copied from the (updated) weights for each batch. The copy is
+       made when the training starts, see prepare_mixed_precision(). */
+    const neuralnet_bf16_t *bf16_nn = opt->mixed_precision ? opt->bf16_nn : NULL;
+    if( bf16_nn )
+        neuralnet_bf16_sync( opt->bf16_nn );
+
+    /* The train metrics can be accumulated from the outputs of the forward pass. See optimizer_run_epoch(). */
+    const int n_output  = nn->layer[nn->n_layers-1].n_output;
+    const int n_metrics = opt->metric_sums ? opt->n_metrics : 0;
+    float batch_metrics[n_metrics + 1];  /* One extra, as OpenMP does not like a zero length reduction */
+    memset( batch_metrics, 0, (n_metrics + 1) * sizeof(float));
+
+    /* The default thread pool, if any, otherwise OpenMP */
+    threadpool_t *pool = threadpool_default();
+    const int n_threads = threadpool_n_threads( pool );
+    float *sums[n_threads];
+    float thread_metrics[n_threads * n_metrics + 1];
+    batch_gradient_job_t job = { .opt = opt, .train_X = train_X, .train_Y = train_Y, .pivot = pivot, .start = start,
+        .batchsize = batchsize, .n_metrics = n_metrics, .batchgrad = batchgrad,
+        .thread_metrics = thread_metrics, .sums = sums, .weights = weights, .losses = losses,
+        .loss_metric = replay ? replay->loss_metric : NULL, .bf16_nn = bf16_nn, .ranges = ranges, .n_ranges = n_ranges };
+
+    if( threadpool_run( pool, batch_gradient_job, &job ) == 0 ){
+        for ( int t = 0; t < n_threads; t++ )
+            for ( int j = 0; j < n_metrics; j++ )
+                batch_metrics[j] += thread_metrics[t * n_metrics + j];
+    } else if( lazy ){
+        /* Lazy updates. Each thread sums the touched ranges, which are then added to the batch
+           gradient one thread at a time, such that nothing of the size of the model is reduced. */
+        const sparse_matrix_t *X = opt->sparse_X;
+        const int n_omp_threads = omp_get_max_threads();
+        float **work = lazy_thread_work( opt->lazy_state, n_omp_threads, n_parameters );
+#pragma omp parallel num_threads(n_omp_threads) reduction(+:batch_metrics[0:n_metrics+1])
+        {
+            float *grad = work[omp_get_thread_num()];
+            float *sum  = grad + (n_parameters + 15) / 16 * 16;
+            float SIMD_ALIGN(y_pred[n_output]);
+            clear_ranges( n_ranges, ranges, sum );
+#pragma omp for
+            for ( int b = 0 ; b < batchsize; b++){
+                const unsigned int idx = pivot ? pivot[start + b] : start + b;
+                const sparse_vector_t x = sparse_matrix_row( X, idx );
+                const float *y_real = train_Y + (idx * n_target);
+                add_sparse_sample_gradient( nn, &x, y_real, sum, grad, n_metrics ? y_pred : NULL );
+                for ( int j = 0; j < n_metrics; j++ )
+                    batch_metrics[j] += opt->metrics[j]( n_output, y_pred, y_real );
+            }
+#pragma omp critical (lazy_batch_gradient)
+            accumulate_ranges( n_ranges, ranges, batchgrad, sum );
+        }
+    } else if( opt->sparse_X ){
+        /* Sparse input. Only the rows of the first layer weight gradient that are touched by
+           the sample are accumulated (and cleared again for the next sample). */
+        const sparse_matrix_t *X = opt->sparse_X;
+#pragma omp parallel reduction(+:batchgrad[0:n_parameters], batch_metrics[0:n_metrics+1])
+        {
+            float SIMD_ALIGN(grad[n_parameters]);
+            float SIMD_ALIGN(y_pred[n_output]);
+            memset( grad, 0, n_parameters * sizeof(float));
+#pragma omp for
+            for ( int b = 0 ; b < batchsize; b++){
+                const unsigned int idx = pivot ? pivot[start + b] : start + b;
+                const sparse_vector_t x = sparse_matrix_row( X, idx );
+                const float *y_real = train_Y + (idx * n_target);
+                add_sparse_sample_gradient( nn, &x, y_real, batchgrad, grad, n_metrics ? y_pred : NULL );
+                for ( int j = 0; j < n_metrics; j++ )
+                    batch_metrics[j] += opt->metrics[j]( n_output, y_pred, y_real );
+            }
+        }
+    } else if( nn->sampled_softmax ){
+        /* Sampled softmax. The output columns that are not sampled are never written in grad, so it
+           is per thread and not cleared for each sample. */
+#pragma omp parallel reduction(+:batchgrad[0:n_parameters])
+        {
+            float SIMD_ALIGN(grad[n_parameters]);
+#pragma omp for
+            for ( int b = 0 ; b < batchsize; b++){
+                const unsigned int idx = pivot ? pivot[start + b] : start + b;
+                add_sampled_sample_gradient( nn, train_X + (idx * n_input), train_Y + (idx * n_target), batchgrad, grad );
+            }
+        }
+    } else {
+#pragma omp parallel for reduction(+:batchgrad[0:n_parameters], batch_metrics[0:n_metrics+1])
+        for ( int b = 0 ; b < batchsize; b++){
+            const unsigned int idx = pivot ? pivot[start + b] : start + b;
+            float SIMD_ALIGN(grad[n_parameters]);
+            float SIMD_ALIGN(y_pred[n_output]);
+            const float *y_real = train_Y + (idx * n_target);
+            if( bf16_nn )
+                neuralnet_bf16_backpropagation_with_output( bf16_nn, train_X + (idx * n_input), y_real, grad,
+                        n_metrics || losses ? y_pred : NULL );
+            else
+                neuralnet_backpropagation_with_output( nn, train_X + (idx * n_input), y_real, grad,
+                        n_metrics || losses ? y_pred : NULL );
+            for ( int j = 0; j < n_metrics; j++ )
+                batch_metrics[j] += opt->metrics[j]( n_output, y_pred, y_real );
+            if( losses )
+                losses[b] = replay->loss_metric( n_output, y_pred, y_real );
+            if( weights )
+                vector_scale( n_parameters, grad, weights[b] );
+            /* When using OpenMP, OpenMP will not align stack allocated arrays -- we therefore
+               have to use `_unaligned` for this accumulation. :-(  */
+            vector_accumulate_unaligned( n_parameters, batchgrad, grad );
+        }
+    }
+    for ( int j = 0; j < n_metrics; j++ )
+        opt->metric_sums[j] += batch_metrics[j];
+    opt->n_metric_samples += batchsize;
+    if( losses )
+        replay_buffer_update_priorities( replay->buffer, batchsize, replay->slots, losses );
+
+    *i += (unsigned int) batchsize;
+    if( lazy ){
+        for ( int k = 0; k < n_ranges; k++ )
+            for ( unsigned int j = ranges[k].offset; j < ranges[k].offset + ranges[k].length; j++ )
+                batchgrad[j] /= (float) batchsize;
+    } else
+        vector_divide_by_scalar( n_parameters, batchgrad, (float) batchsize );
+
+    /* Data parallel: The mean of the batch gradients of all the ranks. They all get the same. If
+       another rank is gone, the epoch is stopped without this update. */
+    if( opt->allreduce && allreduce_world_size( opt->allreduce ) > 1 ){
+        if( allreduce_sum( opt->allreduce, n_parameters, batchgrad ) < 0 ){
+            fprintf( stderr, "Data parallel training failed. Stopping the epoch.\n");
+            opt->failed = true;
+            memset( batchgrad, 0, n_parameters * sizeof(float));
+            *i = n_train_samples;
+            return;
+        }
+        vector_divide_by_scalar( n_parameters, batchgrad, (float) allreduce_world_size( opt->allreduce ));
+    }
+}
+
+/**
+  @brief Make the training data parallel over several processes.
+  @param opt The optimizer
+  @param ar The all-reduce that connects the processes (see allreduce.h), or NULL to stop
+  @return 0 on success, -1 on failure.
+
+  Each process (rank) trains on its own shard of the training set, with the same network
+  structure and optimizer settings. The batch gradients are averaged over all the ranks with the
+  ring all-reduce in `optimizer_calc_batch_gradient()`, so all the ranks make the same updates, and
+  the replicas stay equal. This copies the weights of rank 0 to the other ranks to get started.
+
+  Each rank trains on as many samples as there are in the smallest shard, such that they run
+  the same number of batches. The train and validation metrics are of the shard of the rank.
+  Lazy updates and the Hogwild mode are not used. The all-reduce is not freed by the optimizer.
+
+  If the all-reduce fails, like when another rank is gone, the epoch is stopped before the update,
+  `opt->failed` is set, and the metrics of the epoch are -1. No more is trained until a new
+  all-reduce is set.
+ */
+int optimizer_set_allreduce( optimizer_t *opt, allreduce_t *ar )
+{
+    opt->allreduce = ar;
+    opt->failed = false;
+    if( !ar )
+        return 0;
+    if( opt->hogwild ){
+        fprintf( stderr, "Warning: The Hogwild mode is not used with data parallel training.\n");
+        opt->hogwild = false;
+    }
+
+    neuralnet_t *nn = opt->nn;
+    for( int l = 0; l < nn->n_layers; l++ ){
+        if( allreduce_broadcast( ar, nn->layer[l].n_output, nn->layer[l].bias, 0 ) < 0 ||
+            allreduce_broadcast( ar, nn->layer[l].n_input * nn->layer[l].n_output, nn->layer[l].weight, 0 ) < 0 ){
+            fprintf( stderr, "Cannot copy the weights from rank 0.\n");
+            opt->allreduce = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* The number of samples all the ranks can train on: The size of the smallest shard. Each rank
+   fills in its own count. Nothing is trained after a failure. */
+static unsigned int data_parallel_n_samples( optimizer_t *opt, const unsigned int n_samples )
+{
+    if( !opt->allreduce || allreduce_world_size( opt->allreduce ) == 1 )
+        return n_samples;
+    if( opt->failed )
+        return 0;
+
+    const int world_size = allreduce_world_size( opt->allreduce );
+    unsigned int counts[world_size];
+    memset( counts, 0, sizeof( counts ));
+    counts[allreduce_rank( opt->allreduce )] = n_samples;
+    if( allreduce_sum_uint( opt->allreduce, world_size, counts ) < 0 ){
+        fprintf( stderr, "Data parallel training failed.\n");
+        opt->failed = true;
+        return 0;
+    }
+    unsigned int n_min = n_samples;
+    for( int r = 0; r < world_size; r++ )
+        if( counts[r] < n_min ) n_min = counts[r];
+    return n_min;
+}
+
+/**
+  @brief Run an epoch Hogwild style.
+  @param opt The optimizer
+  @param n_train_samples Number of training samples
+  @param train_X The inputs (NULL with sparse input, see `optimizer_run_epoch_sparse()`)
+  @param train_Y The targets
+  @param update The update of the optimizer
+
+  Instead of all the threads working on the same batch and one thread updating the weights, each
+  thread takes the next batch, calculates its gradient, and updates the shared weights directly,
+  without any locks. The updates of the threads may then overwrite each other, and a gradient
+  may be of weights that have been changed by other threads in the meantime. With sparse input
+  a batch only touches a few rows of the first layer weights, so such collisions are rare, and
+  only those rows are updated. The threads never wait for each other.
+ */
+void optimizer_run_epoch_hogwild( optimizer_t *opt,
+        const unsigned int n_train_samples, const float *train_X, const float *train_Y,
+        hogwild_update_func update )
+{
+    neuralnet_t *nn = opt->nn;
+    const unsigned int n_parameters = neuralnet_total_n_parameters( nn );
+    const int n_input  = nn->layer[0].n_input;
+    const int n_out0   = nn->layer[0].n_output;
+    const int n_target = neuralnet_target_size( nn );
+    const unsigned int w0_end = (n_input + 1) * n_out0;
+    const unsigned int output_offset = neuralnet_output_layer_offset( nn );
+    const sparse_matrix_t *X = opt->sparse_X;
+
+    unsigned int next = 0;  /* The first sample of the next batch */
+#pragma omp parallel
+    {
+        float *batchgrad = simd_malloc_huge( n_parameters * sizeof(float));
+        float *grad      = simd_malloc_huge( n_parameters * sizeof(float));
+        param_range_t *ranges = malloc( (X ? n_input + 2 : 1) * sizeof(param_range_t));
+        unsigned int *last_batch = X ? calloc( n_input, sizeof(unsigned int)) : NULL;
+        assert( batchgrad && grad && ranges && (!X || last_batch));
+        memset( grad, 0, n_parameters * sizeof(float));
+
+        for ( unsigned int n_batches = 1; ; n_batches++ ){
+            unsigned int start;
+#pragma omp atomic capture
+            { start = next; next += opt->batchsize; }
+            if ( start >= n_train_samples )
+                break;
+            const int batchsize = n_train_samples - start < (unsigned int) opt->batchsize ?
+                (int) (n_train_samples - start) : opt->batchsize;
+
+            int n_ranges = 0;
+            if ( X ){
+                /* Only the first layer rows of the active features. The first sample that touches
+                   a row copies its gradient, the others add to it. */
+                memset( batchgrad, 0, n_out0 * sizeof(float));
+                memset( batchgrad + w0_end, 0, (n_parameters - w0_end) * sizeof(float));
+                ranges[n_ranges++] = (param_range_t) { .offset = 0, .length = n_out0, .n_skipped = 0 };
+                for ( int b = 0; b < batchsize; b++ ){
+                    const sparse_vector_t x = sparse_matrix_row( X, opt->pivot[start + b] );
+                    const float *y_real = train_Y + (opt->pivot[start + b] * n_target);
+                    if ( nn->sampled_softmax ){
+                        int columns[sampled_softmax_max_columns( nn->sampled_softmax )];
+                        const int n_columns = neuralnet_backpropagation_sparse_sampled( nn, &x, y_real, grad, columns );
+                        vector_accumulate_unaligned( output_offset - w0_end, batchgrad + w0_end, grad + w0_end );
+                        accumulate_sampled_columns( nn, n_columns, columns, batchgrad, grad );
+                    } else {
+                        neuralnet_backpropagation_sparse( nn, &x, y_real, grad );
+                        vector_accumulate_unaligned( n_parameters - w0_end, batchgrad + w0_end, grad + w0_end );
+                    }
+                    vector_accumulate( n_out0, batchgrad, grad );
+                    for ( int k = 0; k < x.n_nonzero; k++ ){
+                        const unsigned int row = n_out0 + x.index[k] * n_out0;
+                        if ( last_batch[x.index[k]] != n_batches ){
+                            last_batch[x.index[k]] = n_batches;
+                            memcpy( batchgrad + row, grad + row, n_out0 * sizeof(float));
+                            ranges[n_ranges++] = (param_range_t) { .offset = row, .length = n_out0, .n_skipped = 0 };
+                        } else
+                            vector_accumulate_unaligned( n_out0, batchgrad + row, grad + row );
+                        memset( grad + row, 0, n_out0 * sizeof(float));
+                    }
+                }
+                if ( n_parameters > w0_end )
+                    ranges[n_ranges++] = (param_range_t) { .offset = w0_end, .length = n_parameters - w0_end, .n_skipped = 0 };
+                for ( int k = 0; k < n_ranges; k++ )
+                    for ( unsigned int j = ranges[k].offset; j < ranges[k].offset + ranges[k].length; j++ )
+                        batchgrad[j] /= (float) batchsize;
+            } else {
+                memset( batchgrad, 0, n_parameters * sizeof(float));
+                for ( int b = 0; b < batchsize; b++ ){
+                    const float *x = train_X + (opt->pivot[start + b] * n_input);
+                    const float *y_real = train_Y + (opt->pivot[start + b] * n_target);
+                    if ( nn->sampled_softmax )
+                        add_sampled_sample_gradient( nn, x, y_real, batchgrad, grad );
+                    else {
+                        neuralnet_backpropagation( nn, x, y_real, grad );
+                        vector_accumulate( n_parameters, batchgrad, grad );
+                    }
+                }
+                vector_divide_by_scalar( n_parameters, batchgrad, (float) batchsize );
+                ranges[n_ranges++] = (param_range_t) { .offset = 0, .length = n_parameters, .n_skipped = 0 };
+            }
+
+            update( opt, batchgrad, ranges, n_ranges );
+
+            /* The last one is done after all the threads are done */
+            if ( opt->progress && omp_get_thread_num() == 0 && start + batchsize < n_train_samples )
+                opt->progress( start + batchsize, n_train_samples, "Train: " );
+        }
+        simd_free_huge( batchgrad );
+        simd_free_huge( grad );
+        free( ranges );
+        free( last_batch );
+    }
+    if ( opt->progress )
+        opt->progress( n_train_samples, n_train_samples, "Train: " );
+}
+
+/* Mixed precision is only for the dense backpropagation. The combination is checked once when the
+   training starts, and then the bfloat16 copy of the weights is made. Otherwise it warns, and trains
+   in float32 from then on. */
+static void prepare_mixed_precision( optimizer_t *opt, const bool sparse )
+{
+    if( !opt->mixed_precision )
+        return;
+    const char *unsupported = sparse ? "sparse input" : opt->hogwild ? "the Hogwild mode" :
+        opt->nn->sampled_softmax ? "the sampled softmax loss" : NULL;
+    if( unsupported ){
+        fprintf( stderr, "Mixed precision does not support %s. Training in float32.\n", unsupported );
+        opt->mixed_precision = false;
+        return;
+    }
+    if( !opt->bf16_nn && !(opt->bf16_nn = neuralnet_bf16_new( opt->nn )))
+        opt->mixed_precision = false;
+}
+
+/* See ranking_metrics.h */
+static bool has_ranking_metric( metric_func metrics[] )
+{
+    for ( metric_func *mf_ptr = metrics; mf_ptr && *mf_ptr; mf_ptr++ )
+        if( metric_is_ranking( *mf_ptr ))
+            return true;
+    return false;
+}
+
+/* With `running_metrics`, the train metrics are averaged over the outputs of the forward passes in
+   the training, and the extra prediction of the whole training set after the epoch is saved. Note
+   that the model changes during the epoch, so this is not the same as the metrics of the final
+   model (Keras reports it the same way). The sampled softmax does not calculate the full output,
+   so then the training set is evaluated after the epoch as usual. The same goes for the ranking
+   metrics, which are not averages, and for the Hogwild mode. Returns true if in effect. */
+static bool begin_running_metrics( optimizer_t *opt )
+{
+    if( !opt->running_metrics || opt->n_metrics == 0 || opt->nn->sampled_softmax || opt->hogwild ||
+            has_ranking_metric( opt->metrics )){
+        free( opt->metric_sums );
+        opt->metric_sums = NULL;
+        return false;
+    }
+    if( !opt->metric_sums ){
+        opt->metric_sums = malloc( opt->n_metrics * sizeof(float));
+        if( !opt->metric_sums ){
+            fprintf( stderr, "Cannot allocate train metrics. Evaluating after the epoch instead.\n");
+            return false;
+        }
+    }
+    memset( opt->metric_sums, 0, opt->n_metrics * sizeof(float));
+    opt->n_metric_samples = 0;
+    return true;
+}
+
+static void end_running_metrics( optimizer_t *opt, float *results )
+{
+    for ( int j = 0; j < opt->n_metrics; j++ )
+        results[j] = opt->n_metric_samples ? opt->metric_sums[j] / (float) opt->n_metric_samples : 0.0f;
+
+    /* Don't accumulate if optimizer_calc_batch_gradient() is called outside the epoch */
+    free( opt->metric_sums );
+    opt->metric_sums = NULL;
+}
+
+/* The metrics of an epoch where the data parallel training failed are -1, like in evaluate() */
+static void failed_results( optimizer_t *opt, const bool has_valid, float *results )
+{
+    free( opt->metric_sums );
+    opt->metric_sums = NULL;
+    for ( int j = 0; j < (has_valid ? 2 : 1) * opt->n_metrics; j++ )
+        results[j] = -1.0f;
 }
 
 void optimizer_run_epoch( optimizer_t *self,
@@ -109,12 +777,24 @@ void optimizer_run_epoch( optimizer_t *self,
 
     /* Run the epoch */
     assert ( self->run_epoch );
-    self->run_epoch(self, n_train_samples, train_X, train_Y );
+    prepare_mixed_precision( self, false );
+    const bool running_metrics = begin_running_metrics( self );
+    self->run_epoch(self, data_parallel_n_samples( self, n_train_samples ), train_X, train_Y );
+    neuralnet_sync_replicas( self->nn );  /* evaluate() reads the copies on the NUMA nodes */
 
     /* Calculate the losses */
     /* First the train loss */
     int n_metrics = optimizer_get_n_metrics( self );
-    evaluate( self->nn, n_train_samples, train_X, train_Y, self->metrics, results );  
+    if( self->failed ){
+        failed_results( self, valid_X && valid_Y && n_valid_samples > 0, results );
+        return;
+    }
+    if( running_metrics )
+        end_running_metrics( self, results );
+    else
+        evaluate( self->nn, n_train_samples, train_X, train_Y, self->metrics, results );  
+
+    self->epoch++;
 
     /* and if validation is given - do it */
     bool has_valid = valid_X && valid_Y && n_valid_samples > 0;
@@ -132,3 +812,271 @@ void optimizer_run_epoch( optimizer_t *self,
 #endif
 }
 
+/**
+  @brief Run one epoch of training with sparse (CSR) input data.
+
+  This is the same as `optimizer_run_epoch()`, but the inputs are given as sparse matrices.
+  The number of samples is taken from the number of rows in the matrices. All optimizers
+  can be used, as the sparse input is handled in `optimizer_calc_batch_gradient()`.
+ */
+void optimizer_run_epoch_sparse( optimizer_t *self,
+        const sparse_matrix_t *train_X, const float *train_Y,
+        const sparse_matrix_t *valid_X, const float *valid_Y, float *results )
+{
+    assert( train_X );
+    assert( train_X->n_cols == self->nn->layer[0].n_input );
+    const unsigned int n_train_samples = train_X->n_rows;
+
+    prepare_shuffle_pivot( self, n_train_samples );
+    if( self->shuffle )
+        fisher_yates_shuffle( self->pivot, n_train_samples );
+
+    /* Run the epoch. The dense train_X is not used when sparse_X is set. */
+    assert ( self->run_epoch );
+    prepare_mixed_precision( self, true );
+    const bool running_metrics = begin_running_metrics( self );
+    self->sparse_X = train_X;
+    self->run_epoch(self, data_parallel_n_samples( self, n_train_samples ), NULL, train_Y );
+    self->sparse_X = NULL;
+    neuralnet_sync_replicas( self->nn );
+
+    int n_metrics = optimizer_get_n_metrics( self );
+    if( self->failed ){
+        failed_results( self, valid_X && valid_Y && valid_X->n_rows > 0, results );
+        return;
+    }
+    if( running_metrics )
+        end_running_metrics( self, results );
+    else
+        evaluate_sparse( self->nn, train_X, train_Y, self->metrics, results );
+
+    self->epoch++;
+
+    if( valid_X && valid_Y && valid_X->n_rows > 0 )
+        evaluate_sparse( self->nn, valid_X, valid_Y, self->metrics, results + n_metrics );
+}
+
+/**
+  @brief Make one update of the weights from the gradient of the given rows.
+
+  This is for online training (like streaming data or reinforcement learning), where the rows
+  arrive a few at a time. The rows are used in the given order as one batch, regardless of the
+  batchsize of the optimizer. Unlike `optimizer_run_epoch()` there is no pivot, no evaluation of
+  the metrics, no progress callback and no memory allocation, and the epoch is not counted.
+  All the optimizers can be used, as it runs `run_epoch()` on the single batch.
+
+  @param self The optimizer
+  @param n_samples The number of rows in the batch
+  @param X The inputs, n_samples x n_input
+  @param Y The targets, n_samples x n_target (see neuralnet_target_size())
+ */
+void optimizer_step( optimizer_t *self, const unsigned int n_samples, const float *X, const float *Y )
+{
+    assert( self->run_epoch );
+    if( n_samples == 0 )
+        return;
+
+    unsigned int *pivot = self->pivot;
+    const int batchsize = self->batchsize;
+    const bool hogwild = self->hogwild;
+    void (*progress)( int x, int n, const char *fmt, ...) = self->progress;
+
+    self->pivot     = NULL;    /* The rows in order. See optimizer_calc_batch_gradient(). */
+    self->batchsize = (int) n_samples;
+    self->hogwild   = false;
+    self->progress  = NULL;
+    prepare_mixed_precision( self, false );
+    self->run_epoch( self, n_samples, X, Y );
+    neuralnet_sync_replicas( self->nn );
+    self->pivot     = pivot;
+    self->batchsize = batchsize;
+    self->hogwild   = hogwild;
+    self->progress  = progress;
+}
+
+static bool prepare_replay( optimizer_t *opt, const replay_buffer_t *rb )
+{
+    const int batchsize = opt->batchsize;
+    const bool prioritized = replay_buffer_properties( rb ).prioritized;
+    replay_state_t *replay = opt->replay;
+    if( replay && replay->batchsize == batchsize && (replay->losses != NULL) == prioritized )
+        return true;
+
+    if( !replay ){
+        if( !(replay = calloc( 1, sizeof(replay_state_t))))
+            return false;
+        opt->replay = replay;
+        replay->seed = (unsigned int) time( NULL );
+    }
+    replay->batchsize = batchsize;
+    replay->X       = realloc( replay->X, batchsize * replay_buffer_n_input( rb ) * sizeof(float));
+    replay->Y       = realloc( replay->Y, batchsize * replay_buffer_n_target( rb ) * sizeof(float));
+    replay->slots   = realloc( replay->slots, batchsize * sizeof(unsigned int));
+    free( replay->weights );
+    free( replay->losses );
+    replay->weights = prioritized ? malloc( batchsize * sizeof(float)) : NULL;
+    replay->losses  = prioritized ? malloc( batchsize * sizeof(float)) : NULL;
+    replay->loss_metric = METRIC_FROM_NEURALNET( opt->nn );
+    if( !replay->X || !replay->Y || !replay->slots ||
+            (prioritized && (!replay->weights || !replay->losses || !replay->loss_metric))){
+        replay->batchsize = 0;   /* Try again next time */
+        return false;
+    }
+    return true;
+}
+
+/**
+  @brief Run an "epoch" of training on batches sampled from an experience replay buffer.
+
+  This is like `optimizer_run_epoch()`, but each batch is sampled from the replay buffer (see
+  replay_buffer.h) while other threads may append to it. All the dense optimizers can be used, as
+  the sampling is done in `optimizer_calc_batch_gradient()`. With prioritized sampling, the
+  gradient of each sample is weighted with its importance sampling weight, and the priorities of
+  the sampled rows are set from their loss.
+
+  @param self The optimizer
+  @param replay The replay buffer. The rows must fit the neural network.
+  @param n_batches The number of batches to train. A batch may be sampled short, if its rows are overwritten
+  while they are read, and then the rest of the rows are trained in more batches.
+  @param result The train metrics. These are always the running metrics of the trained batches, as the
+  epoch is not a pass over a fixed training set. With ranking metrics, which are not averages, a sample
+  as large as the buffer is evaluated after the training instead.
+ */
+void optimizer_run_epoch_replay( optimizer_t *self, replay_buffer_t *replay, const unsigned int n_batches,
+        float *result )
+{
+    assert( replay );
+    neuralnet_t *nn = self->nn;
+    if( replay_buffer_n_input( replay ) != nn->layer[0].n_input ||
+            replay_buffer_n_target( replay ) != neuralnet_target_size( nn )){
+        fprintf( stderr, "The rows of the replay buffer do not fit the neural network.\n");
+        return;
+    }
+    if( nn->sampled_softmax ){
+        fprintf( stderr, "Experience replay with sampled softmax is not supported.\n");
+        return;
+    }
+    if( replay_buffer_size( replay ) == 0 ){
+        fprintf( stderr, "The replay buffer is empty.\n");
+        return;
+    }
+    if( !prepare_replay( self, replay )){
+        fprintf( stderr, "Cannot allocate the batches of the replay buffer.\n");
+        return;
+    }
+
+    /* Hogwild reads the rows by its own pivot, so the batches are done the usual way */
+    const bool hogwild = self->hogwild;
+    self->hogwild = false;
+
+    assert ( self->run_epoch );
+    prepare_mixed_precision( self, false );
+    const bool keep_running_metrics = self->running_metrics;
+    self->running_metrics = true;
+    const bool running_metrics = begin_running_metrics( self );
+    self->running_metrics = keep_running_metrics;
+    self->replay->buffer = replay;
+    self->run_epoch( self, n_batches * self->batchsize, NULL, NULL );
+    self->replay->buffer = NULL;
+    neuralnet_sync_replicas( nn );
+    self->hogwild = hogwild;
+
+    if( running_metrics )
+        end_running_metrics( self, result );
+    else {
+        const unsigned int n_rows = replay_buffer_size( replay );
+        float *X = malloc( (size_t) n_rows * replay_buffer_n_input( replay ) * sizeof(float));
+        float *Y = malloc( (size_t) n_rows * replay_buffer_n_target( replay ) * sizeof(float));
+        if( X && Y ){
+            const int n = replay_buffer_sample( replay, (int) n_rows, X, Y, NULL, NULL, &self->replay->seed );
+            evaluate( nn, n, X, Y, self->metrics, result );
+        } else {
+            fprintf( stderr, "Cannot allocate a sample of the replay buffer for the train metrics.\n");
+            for ( int j = 0; j < self->n_metrics; j++ )
+                result[j] = -1.0f;
+        }
+        free( X );
+        free( Y );
+    }
+
+    self->epoch++;
+}
+
+/* The norms of the weights of each layer. In the default thread pool, each thread sums the squares
+   of its slice of each layer, and the sums of the threads are added up afterwards. The sums are
+   in double over chunks, such that the float sums do not lose precision with large layers. */
+#define NORM_CHUNK 4096
+
+typedef struct {
+    int            n_layers;
+    const float  **w;
+    const unsigned int *n;
+    double        *partial;    /* n_layers per thread */
+} layer_norms_job_t;
+
+static double sum_of_squares( const unsigned int n, const float *x )
+{
+    double sum = 0.0;
+    for( unsigned int offset = 0; offset < n; offset += NORM_CHUNK )
+        sum += vector_sum_of_squares( n - offset < NORM_CHUNK ? n - offset : NORM_CHUNK, x + offset );
+    return sum;
+}
+
+static void layer_norms_job( threadpool_t *pool, void *arg, const int thread, const int n_threads )
+{
+    const layer_norms_job_t *job = (const layer_norms_job_t *) arg;
+    for( int l = 0; l < job->n_layers; l++ ){
+        unsigned int first, last;
+        threadpool_split( (job->n[l] + 15) / 16, thread, n_threads, &first, &last );
+        const unsigned int offset = first * 16;
+        const unsigned int end = last * 16 < job->n[l] ? last * 16 : job->n[l];
+        job->partial[thread * job->n_layers + l] = offset < end ? sum_of_squares( end - offset, job->w[l] + offset ) : 0.0;
+    }
+    (void) pool;
+}
+
+/**
+  @brief The L2 norm of the weights of each layer (the biases are not included). This is used by
+  the layer-wise adaptive optimizers, like LARS and LAMB.
+  @param opt The optimizer
+  @param v A vector with the layout of the parameters (like the batch gradient), or NULL for the
+  weights of the neural network
+  @param norms The norms, one for each layer
+*/
+void optimizer_layer_norms( const optimizer_t *opt, const float *v, float *norms )
+{
+    const neuralnet_t *nn = opt->nn;
+    const int n_layers = nn->n_layers;
+    const float *w[n_layers];
+    unsigned int n[n_layers];
+    unsigned int offset = 0;
+    for( int l = 0; l < n_layers; l++ ){
+        n[l] = nn->layer[l].n_input * nn->layer[l].n_output;
+        w[l] = v ? v + offset + nn->layer[l].n_output : nn->layer[l].weight;
+        offset += (nn->layer[l].n_input + 1) * nn->layer[l].n_output;
+    }
+
+    threadpool_t *pool = threadpool_default();
+    const int n_threads = pool ? threadpool_n_threads( pool ) : 1;
+    double partial[n_threads * n_layers];
+    layer_norms_job_t job = { .n_layers = n_layers, .w = w, .n = n, .partial = partial };
+    if( threadpool_run( pool, layer_norms_job, &job ) == 0 ){
+        for( int l = 0; l < n_layers; l++ ){
+            double sum = 0.0;
+            for( int t = 0; t < n_threads; t++ )
+                sum += partial[t * n_layers + l];
+            norms[l] = (float) sqrt( sum );
+        }
+        return;
+    }
+
+    for( int l = 0; l < n_layers; l++ ){
+        const int n_chunks = (n[l] + NORM_CHUNK - 1) / NORM_CHUNK;
+        const float *x = w[l];
+        double sum = 0.0;
+#pragma omp parallel for reduction(+:sum) if(n_chunks > 1)
+        for( int c = 0; c < n_chunks; c++ )
+            sum += sum_of_squares( c == n_chunks - 1 ? n[l] - c * NORM_CHUNK : NORM_CHUNK, x + c * NORM_CHUNK );
+        norms[l] = (float) sqrt( sum );
+    }
+}
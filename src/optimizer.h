@@ -10,6 +10,10 @@
 #include "neuralnet.h"
 #include "metrics.h"
 #include "progress.h"
+#include "allreduce.h"
+#include "replay_buffer.h"
+#include "neuralnet_bf16.h"
+#include "simd.h"
 
 #include <stdlib.h>  /* malloc/free in macros */
 #include <stdio.h>   /* fprintf in macro */
@@ -18,6 +22,43 @@
 #define OPTIMIZER(v) ((optimizer_t*)(v))
 
 typedef struct _optimizer_t optimizer_t;
+typedef struct _param_range_t param_range_t;
+typedef struct _lazy_state_t lazy_state_t;
+typedef struct _replay_state_t replay_state_t;
+
+/* A range of the parameter (and gradient) vector. Used for lazy updates. */
+struct _param_range_t {
+    unsigned int offset;
+    unsigned int length;
+    unsigned int n_skipped;   /* Number of batches since the range was last updated */
+};
+
+/* Bookkeeping of lazy updates with sparse input. Only the first layer weights that are
+   multiplied with a nonzero input in a batch gets a (nonzero) gradient. When the optimizer
+   is lazy, only these rows (and the dense parameters) are updated, and the decay of the
+   optimizer state for the batches where a row was not active is applied when the row
+   becomes active again. See `optimizer_lazy_ranges()`. */
+struct _lazy_state_t {
+    unsigned int   n_steps;    /* Number of batches so far */
+    unsigned int  *last_step;  /* For each row in the first layer weights: batch it was last active */
+    param_range_t *ranges;     /* The ranges touched by the last batch */
+    int            n_ranges;
+    float        **thread_work;  /* For each OpenMP thread: The sample gradient and the sum of the ranges */
+    int            n_threads;
+};
+
+/* The batches sampled from a replay buffer. See `optimizer_run_epoch_replay()`. */
+struct _replay_state_t {
+    replay_buffer_t *buffer;     /* Set during the epoch */
+    int           batchsize;
+    float        *X;             /* The sampled batch */
+    float        *Y;
+    unsigned int *slots;         /* The slots of the sampled rows */
+    float        *weights;       /* The importance sampling weights, or NULL */
+    float        *losses;        /* For the priorities, or NULL */
+    metric_func   loss_metric;
+    unsigned int  seed;
+};
 typedef void (*epoch_func)( optimizer_t *opt, const unsigned int n_samples, const float *X, const float *Y );
 struct _optimizer_t {
     void (*run_epoch)( optimizer_t *opt,
@@ -32,6 +73,20 @@ struct _optimizer_t {
     metric_func  *metrics;  /* NULL terminated */
 	int          n_metrics;
     unsigned int *pivot;    /* Don't touch! */
+    unsigned int n_pivot;   /* Don't touch! */
+    const sparse_matrix_t *sparse_X;  /* Don't touch! Set by optimizer_run_epoch_sparse() */
+    bool         lazy;
+    lazy_state_t *lazy_state;         /* Don't touch! */
+    bool         running_metrics;
+    float        *metric_sums;        /* Don't touch! Train metrics accumulated in the batch gradients */
+    unsigned int n_metric_samples;    /* Don't touch! */
+    int          epoch;               /* Number of epochs run by optimizer_run_epoch{,_sparse,_replay}() */
+    bool         hogwild;
+    allreduce_t  *allreduce;          /* Data parallel training. See optimizer_set_allreduce() */
+    bool         failed;              /* The data parallel training failed. See optimizer_set_allreduce() */
+    replay_state_t *replay;           /* Don't touch! See optimizer_run_epoch_replay() */
+    bool         mixed_precision;
+    neuralnet_bf16_t *bf16_nn;        /* Don't touch! The bfloat16 weights with mixed precision */
 };
 
 #if defined(__GNUC__)
@@ -66,9 +121,23 @@ DLLEXPORT name ## _t * name ## _new( neuralnet_t *nn, optimizer_properties_t opt
     newopt->opt.shuffle    = optconf.shuffle;   \
     newopt->opt.batchsize  = optconf.batchsize; \
     newopt->opt.progress   = optconf.progress;  \
+    newopt->opt.lazy       = optconf.lazy;      \
+    newopt->opt.running_metrics = optconf.running_metrics; \
+    newopt->opt.hogwild    = optconf.hogwild;   \
     newopt->opt.n_metrics  = 0;                 \
     \
     newopt->opt.pivot      = NULL; /* This will be allocated in the main loop */ \
+    newopt->opt.n_pivot    = 0; \
+    newopt->opt.sparse_X   = NULL; \
+    newopt->opt.lazy_state = NULL; \
+    newopt->opt.metric_sums = NULL; \
+    newopt->opt.n_metric_samples = 0; \
+    newopt->opt.epoch = 0; \
+    newopt->opt.allreduce = NULL; \
+    newopt->opt.failed = false; \
+    newopt->opt.replay = NULL; \
+    newopt->opt.mixed_precision = optconf.mixed_precision; \
+    newopt->opt.bf16_nn = NULL; \
     \
     metric_func *mf_ptr = optconf.metrics; \
     if(!mf_ptr) \
@@ -79,6 +148,11 @@ DLLEXPORT name ## _t * name ## _new( neuralnet_t *nn, optimizer_properties_t opt
 	memcpy( newopt->opt.metrics, optconf.metrics, (newopt->opt.n_metrics+1) * sizeof( metric_func )); \
     __VA_ARGS__ ; \
     optimizer_check_sanity( OPTIMIZER(newopt) ); \
+    if ( metrics_check_targets( newopt->opt.metrics, nn->layer[nn->n_layers-1].n_output, \
+                neuralnet_target_size( nn )) < 0 ){ \
+        optimizer_free( OPTIMIZER(newopt) ); \
+        return NULL; \
+    } \
     return newopt; \
 }
 #if 0
@@ -111,6 +185,10 @@ struct _optimizer_properties_t {
     bool shuffle;
     metric_func *metrics;
     void (*progress)( int x, int n, const char *fmt, ...);
+    bool lazy;   /* Only update the active first layer rows with sparse input (adam, RMSprop, adagrad) */
+    bool running_metrics;  /* Train metrics as a running average over the epoch instead of an evaluation after it */
+    bool hogwild;  /* Each thread runs its own batches and updates the weights without locks (SGD, adagrad) */
+    bool mixed_precision;  /* bfloat16 weights, activations and deltas in the backpropagation. See neuralnet_bf16.h */
 };
 
 /* These are the default values. The end user should not edit this but "override" at creation */
@@ -119,17 +197,56 @@ struct _optimizer_properties_t {
               .shuffle   = true,                       \
               .metrics   = NULL,                       \
               .progress  = progress_ascii,             \
+              .lazy      = false,                      \
+              .running_metrics = false,                \
+              .hogwild   = false,                      \
+              .mixed_precision = false,                \
               __VA_ARGS__ }  
 
 void optimizer_calc_batch_gradient( optimizer_t *opt, 
         const unsigned int n_train_samples, const float *train_X, const float *train_Y,
         unsigned int *i, float *batchgrad);
 
+/* Applies the (averaged) gradient of a batch in Hogwild mode. Only the parameters in the ranges are updated.
+   This is called from all the threads at the same time. See `optimizer_run_epoch_hogwild()`. */
+typedef void (*hogwild_update_func)( optimizer_t *opt, float *batchgrad, const param_range_t *ranges, const int n_ranges );
+
+/* Counts the batch and returns its learning rate with the time decay, for a Hogwild update. There is no
+   lock: The count is an atomic increment, and the decay of each batch is multiplied into the shared
+   learning rate with compare-and-swap. The factors commute, so the result is the same as one at a time. */
+static inline float optimizer_hogwild_learning_rate( float *learning_rate, unsigned int *n_iterations, const float decay )
+{
+    const unsigned int n = __atomic_fetch_add( n_iterations, 1, __ATOMIC_RELAXED );
+    float lr, decayed;
+    __atomic_load( learning_rate, &lr, __ATOMIC_RELAXED );
+    if ( decay <= 0.0f )
+        return lr;
+    do {
+        decayed = lr * (1.0f / (1.0f + decay * (float) n));
+    } while ( !__atomic_compare_exchange( learning_rate, &lr, &decayed, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED ));
+    return decayed;
+}
+
+void optimizer_run_epoch_hogwild( optimizer_t *opt,
+        const unsigned int n_train_samples, const float *train_X, const float *train_Y,
+        hogwild_update_func update );
+
 void optimizer_run_epoch( optimizer_t *self,
         const unsigned int n_train_samples, const float *train_X, const float *train_Y,
         const unsigned int n_valid_samples, const float *valid_X, const float *valid_Y, float *result );
 
+void optimizer_run_epoch_sparse( optimizer_t *self,
+        const sparse_matrix_t *train_X, const float *train_Y,
+        const sparse_matrix_t *valid_X, const float *valid_Y, float *result );
+
+void optimizer_step( optimizer_t *self, const unsigned int n_samples, const float *X, const float *Y );
+
+void optimizer_run_epoch_replay( optimizer_t *self, replay_buffer_t *replay, const unsigned int n_batches,
+        float *result );
+
 void optimizer_check_sanity( optimizer_t * opt);
+int  optimizer_set_allreduce( optimizer_t *opt, allreduce_t *ar );
+void optimizer_layer_norms( const optimizer_t *opt, const float *v, float *norms );
 
 static inline void optimizer_free( optimizer_t *opt )
 {
@@ -138,9 +255,39 @@ static inline void optimizer_free( optimizer_t *opt )
         free( opt->metrics );
     if ( opt->pivot )
         free( opt->pivot );
+    if ( opt->lazy_state ){
+        free( opt->lazy_state->last_step );
+        free( opt->lazy_state->ranges );
+        for ( int t = 0; t < opt->lazy_state->n_threads; t++ )
+            simd_free_huge( opt->lazy_state->thread_work[t] );
+        free( opt->lazy_state->thread_work );
+        free( opt->lazy_state );
+    }
+    free( opt->metric_sums );
+    if ( opt->replay ){
+        free( opt->replay->X );
+        free( opt->replay->Y );
+        free( opt->replay->slots );
+        free( opt->replay->weights );
+        free( opt->replay->losses );
+        free( opt->replay );
+    }
+    neuralnet_bf16_free( opt->bf16_nn );
     free( opt );
 }
 
+/* Returns the number of parameter ranges touched by the last batch gradient and sets `ranges`
+   to point to them. Returns 0 if lazy updates are not in effect, and then all the parameters
+   must be updated as usual. In data parallel training, the other ranks touch other rows, so
+   then the updates are not lazy. */
+static inline int optimizer_lazy_ranges( const optimizer_t *opt, const param_range_t **ranges )
+{
+    if ( !opt->lazy || !opt->sparse_X || !opt->lazy_state || opt->allreduce )
+        return 0;
+    *ranges = opt->lazy_state->ranges;
+    return opt->lazy_state->n_ranges;
+}
+
 static inline int optimizer_get_n_metrics( const optimizer_t *opt )
 {
     return opt->n_metrics;
@@ -8,4 +8,7 @@
 #include "adagrad.h"
 #include "RMSprop.h"
 #include "adam.h"
+#include "TD_lambda.h"
+#include "LARS.h"
+#include "LAMB.h"
 #endif /* __OPTIMIZER_IMPLEMENTATIONS_H__ */
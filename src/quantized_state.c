@@ -0,0 +1,152 @@
+/* quantized_state.c - Øystein Schønning-Johansen 2023 */
+/*
+ vim: ts=4 sw=4 softtabstop=4 expandtab
+*/
+#include "quantized_state.h"
+#include "simd.h"
+#include "matrix_operations.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+struct _quantized_state_t {
+    optimizer_state_format_t format;
+    unsigned int   n;
+    unsigned int   n_blocks;
+    void          *data;
+    float         *scales;   /* One per block (int8 only) */
+};
+
+/**
+  @brief Create a quantized state vector. All the values are zero.
+  @param n The number of values
+  @param format OPTIMIZER_STATE_BF16 or OPTIMIZER_STATE_INT8
+  @return The state vector, or NULL on failure. Use quantized_state_free() to free the resources.
+*/
+quantized_state_t *quantized_state_new( const unsigned int n, const optimizer_state_format_t format )
+{
+    if( format != OPTIMIZER_STATE_BF16 && format != OPTIMIZER_STATE_INT8 ){
+        fprintf( stderr, "Quantized optimizer state must be bf16 or int8.\n");
+        return NULL;
+    }
+    quantized_state_t *qs = calloc( 1, sizeof(quantized_state_t));
+    if( !qs ){
+        fprintf( stderr, "Cannot allocate memory for 'quantized_state_t' type.\n");
+        return NULL;
+    }
+    qs->format   = format;
+    qs->n        = n;
+    qs->n_blocks = (n + QUANTIZED_STATE_BLOCK - 1) / QUANTIZED_STATE_BLOCK;
+
+    /* Whole blocks, such that the last block can be written without a tail */
+    const size_t elem_size = format == OPTIMIZER_STATE_BF16 ? sizeof(uint16_t) : sizeof(int8_t);
+    const size_t data_size = (size_t) qs->n_blocks * QUANTIZED_STATE_BLOCK * elem_size;
+    qs->data = simd_malloc_huge( data_size );
+    if( format == OPTIMIZER_STATE_INT8 )
+        qs->scales = simd_malloc_huge( qs->n_blocks * sizeof(float));
+    if( !qs->data || (format == OPTIMIZER_STATE_INT8 && !qs->scales) ){
+        fprintf( stderr, "Cannot allocate the quantized optimizer state.\n");
+        quantized_state_free( qs );
+        return NULL;
+    }
+    memset( qs->data, 0, data_size );
+    if( qs->scales )
+        memset( qs->scales, 0, qs->n_blocks * sizeof(float));
+    return qs;
+}
+
+/**
+  @brief Load a block of the state into float32.
+  @param x QUANTIZED_STATE_BLOCK floats, aligned. Past the end of the state, the values are zero.
+*/
+void quantized_state_load( const quantized_state_t *qs, const unsigned int block, float *x )
+{
+    const size_t offset = (size_t) block * QUANTIZED_STATE_BLOCK;
+    int i = 0;
+    if( qs->format == OPTIMIZER_STATE_BF16 ){
+        vector_from_bf16( QUANTIZED_STATE_BLOCK, (const uint16_t *) qs->data + offset, x );
+    } else {
+        const int8_t *q = (const int8_t *) qs->data + offset;
+        const float scale = qs->scales[block];
+#ifdef __AVX2__
+        const __m256 step_v = _mm256_set1_ps( 1.0f / 127.0f );
+        const __m256 scale_v = _mm256_set1_ps( scale );
+        const __m256 sign_mask = _mm256_set1_ps( -0.0f );
+        for( ; i < QUANTIZED_STATE_BLOCK; i += 8 ){
+            const __m256i wide = _mm256_cvtepi8_epi32( _mm_loadl_epi64( (const __m128i *) (q + i)));
+            const __m256 v = _mm256_mul_ps( _mm256_cvtepi32_ps( wide ), step_v );
+            _mm256_store_ps( x + i, _mm256_mul_ps( _mm256_mul_ps( v, _mm256_andnot_ps( sign_mask, v )), scale_v ));
+        }
+#endif
+        for( ; i < QUANTIZED_STATE_BLOCK; i++ ){
+            const float v = (float) q[i] / 127.0f;
+            x[i] = v * fabsf( v ) * scale;
+        }
+    }
+}
+
+/**
+  @brief Store a block of float32 values into the state. With int8, the scale of the block is its
+  largest absolute value, and the square root of each value relative to the scale is rounded to the
+  nearest of 127 steps. (The square root gives more steps to the small values.)
+  @param x QUANTIZED_STATE_BLOCK floats, aligned. The values past the end of the state must be zero.
+*/
+void quantized_state_store( quantized_state_t *qs, const unsigned int block, const float *x )
+{
+    const size_t offset = (size_t) block * QUANTIZED_STATE_BLOCK;
+    int i = 0;
+    if( qs->format == OPTIMIZER_STATE_BF16 ){
+        vector_to_bf16( QUANTIZED_STATE_BLOCK, x, (uint16_t *) qs->data + offset );
+        return;
+    }
+
+    int8_t *q = (int8_t *) qs->data + offset;
+    float absmax = 0.0f;
+    for( int j = 0; j < QUANTIZED_STATE_BLOCK; j++ )
+        absmax = fmaxf( absmax, fabsf( x[j] ));
+    const float inv_scale = absmax > 0.0f ? 1.0f / absmax : 0.0f;
+    qs->scales[block] = absmax;
+#ifdef __AVX2__
+    const __m256 inv_scale_v = _mm256_set1_ps( inv_scale );
+    const __m256 steps_v = _mm256_set1_ps( 127.0f );
+    const __m256 sign_mask = _mm256_set1_ps( -0.0f );
+    for( ; i < QUANTIZED_STATE_BLOCK; i += 8 ){
+        const __m256 y = _mm256_mul_ps( _mm256_load_ps( x + i ), inv_scale_v );
+        const __m256 v = _mm256_mul_ps( _mm256_sqrt_ps( _mm256_andnot_ps( sign_mask, y )), steps_v );
+        const __m256i wide = _mm256_cvtps_epi32( _mm256_or_ps( v, _mm256_and_ps( sign_mask, y )));
+        const __m128i half = _mm_packs_epi32( _mm256_castsi256_si128( wide ), _mm256_extracti128_si256( wide, 1 ));
+        _mm_storel_epi64( (__m128i *) (q + i), _mm_packs_epi16( half, half ));
+    }
+#endif
+    for( ; i < QUANTIZED_STATE_BLOCK; i++ )
+        q[i] = (int8_t) lrintf( copysignf( sqrtf( fabsf( x[i] * inv_scale )), x[i] ) * 127.0f );
+}
+
+unsigned int quantized_state_n_blocks( const quantized_state_t *qs )
+{
+    return qs->n_blocks;
+}
+
+/**
+  @brief The memory used by the state (without the struct itself).
+*/
+size_t quantized_state_bytes( const quantized_state_t *qs )
+{
+    const size_t elem_size = qs->format == OPTIMIZER_STATE_BF16 ? sizeof(uint16_t) : sizeof(int8_t);
+    return (size_t) qs->n_blocks * (QUANTIZED_STATE_BLOCK * elem_size + (qs->scales ? sizeof(float) : 0));
+}
+
+void quantized_state_free( quantized_state_t *qs )
+{
+    if( !qs ) return;
+    simd_free_huge( (float *) qs->data );
+    simd_free_huge( qs->scales );
+    free( qs );
+}
@@ -0,0 +1,42 @@
+/* quantized_state.h - Øystein Schønning-Johansen 2023 */
+/*
+  vim: ts=4 sw=4 softtabstop=4 expandtab
+ */
+
+/* Optimizer state (like the moments of adam) stored with less precision, to save memory.
+ *
+ * The state is a vector of n floats, stored in blocks of QUANTIZED_STATE_BLOCK values:
+ *
+ *   - OPTIMIZER_STATE_BF16: Each value is a bfloat16, the upper half of the float32 (rounded to
+ *     nearest even). Half the memory of float32 with the same range.
+ *   - OPTIMIZER_STATE_INT8: Each value is an int8, relative to the largest absolute value of its
+ *     block (the scales are kept as float32). A quarter of the memory, plus the scales. The int8 is
+ *     the signed square root of the relative value in 127 steps, such that the smallest nonzero
+ *     value is 1/16129 of the largest, and not 1/127 as with linear steps. A value that is rounded
+ *     to zero in the second moment of adam, makes a (much) too large update.
+ *
+ * The optimizer loads a block into float32, updates it, and stores it again, all in one pass
+ * over the memory (see the adam update kernel).
+ */
+
+#ifndef __QUANTIZED_STATE_H__
+#define __QUANTIZED_STATE_H__
+#include <stddef.h>
+
+#define QUANTIZED_STATE_BLOCK 64
+
+typedef enum {
+    OPTIMIZER_STATE_FP32 = 0,
+    OPTIMIZER_STATE_BF16,
+    OPTIMIZER_STATE_INT8
+} optimizer_state_format_t;
+
+typedef struct _quantized_state_t quantized_state_t;
+
+quantized_state_t * quantized_state_new     ( const unsigned int n, const optimizer_state_format_t format );
+void                quantized_state_load    ( const quantized_state_t *qs, const unsigned int block, float *x );
+void                quantized_state_store   (       quantized_state_t *qs, const unsigned int block, const float *x );
+unsigned int        quantized_state_n_blocks( const quantized_state_t *qs );
+size_t              quantized_state_bytes   ( const quantized_state_t *qs );
+void                quantized_state_free    (       quantized_state_t *qs );
+#endif /* __QUANTIZED_STATE_H__ */
@@ -0,0 +1,253 @@
+/* ranking_metrics.c - Øystein Schønning-Johansen 2023 */
+/*
+ vim: ts=4 sw=4 softtabstop=4 expandtab
+*/
+#include "ranking_metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+typedef struct _score_label_t score_label_t;
+struct _score_label_t {
+    float score;
+    int   positive;
+};
+
+struct _ranking_state_t {
+    uint64_t       pos[RANKING_N_BINS];   /* Histogram of the scores of the positives */
+    uint64_t       neg[RANKING_N_BINS];   /* ... and of the negatives */
+    bool           exact;
+    bool           failed;                /* Out of memory for the pairs */
+    bool           sorted;
+    score_label_t *pairs;                 /* Only in exact mode */
+    size_t         n_pairs;
+    size_t         capacity;
+};
+
+/* The markers. See ranking_metrics.h */
+float roc_auc( const int n, const float *y_pred, const float *y_real )       { (void) n; (void) y_pred; (void) y_real; return 0.0f; }
+float pr_auc( const int n, const float *y_pred, const float *y_real )        { (void) n; (void) y_pred; (void) y_real; return 0.0f; }
+float roc_auc_exact( const int n, const float *y_pred, const float *y_real ) { (void) n; (void) y_pred; (void) y_real; return 0.0f; }
+float pr_auc_exact( const int n, const float *y_pred, const float *y_real )  { (void) n; (void) y_pred; (void) y_real; return 0.0f; }
+
+bool metric_is_ranking( const metric_func metric )
+{
+    return metric == roc_auc || metric == pr_auc || metric == roc_auc_exact || metric == pr_auc_exact;
+}
+
+bool metrics_need_exact( metric_func metrics[] )
+{
+    for ( metric_func *mf_ptr = metrics; *mf_ptr; mf_ptr++ )
+        if( *mf_ptr == roc_auc_exact || *mf_ptr == pr_auc_exact )
+            return true;
+    return false;
+}
+
+/**
+  @brief Create an empty ranking state.
+  @param exact If true, all the scores are stored for the exact areas. The histograms are always there.
+  @return Pointer to the new state or NULL on failure.
+ */
+ranking_state_t *ranking_state_new( const bool exact )
+{
+    ranking_state_t *rs = calloc( 1, sizeof( ranking_state_t ));
+    if( !rs ){
+        fprintf( stderr, "Cannot allocate memory for 'ranking_state_t' type.\n");
+        return NULL;
+    }
+    rs->exact  = exact;
+    rs->sorted = true;
+    return rs;
+}
+
+static inline int score_bin( const float score )
+{
+    /* The negated compare also puts NaN in the first bin */
+    if( !(score > 0.0f) ) return 0;
+    if( score >= 1.0f ) return RANKING_N_BINS - 1;
+    const int bin = (int) (score * (float) RANKING_N_BINS);
+    return bin < RANKING_N_BINS ? bin : RANKING_N_BINS - 1;
+}
+
+static int reserve_pairs( ranking_state_t *rs, const size_t n )
+{
+    if( rs->n_pairs + n <= rs->capacity )
+        return 0;
+    size_t capacity = rs->capacity ? rs->capacity : 1024;
+    while( capacity < rs->n_pairs + n )
+        capacity *= 2;
+    score_label_t *pairs = realloc( rs->pairs, capacity * sizeof( score_label_t ));
+    if( !pairs ){
+        fprintf( stderr, "Cannot allocate memory for the exact ranking metrics.\n");
+        rs->failed = true;
+        return -1;
+    }
+    rs->pairs    = pairs;
+    rs->capacity = capacity;
+    return 0;
+}
+
+/**
+  @brief Add the outputs of a block of samples.
+  @param rs The ranking state
+  @param n_samples Number of samples
+  @param n_output Number of outputs per sample
+  @param y_pred The outputs (scores) of the samples
+  @param y_real The targets. A target of 0.5 or more is a positive. If `n_target` is 1 and `n_output` is
+         more than 1, the targets are class labels.
+  @param n_target Number of targets per sample
+  @return 0 on success, -1 if the pairs of the exact mode could not be stored.
+ */
+int ranking_state_add( ranking_state_t *rs, const int n_samples, const int n_output,
+        const float *y_pred, const float *y_real, const int n_target )
+{
+    const bool labels = n_target == 1 && n_output > 1;
+    if( rs->exact && !rs->failed && reserve_pairs( rs, (size_t) n_samples * n_output ) < 0 )
+        return -1;
+
+    for( int s = 0; s < n_samples; s++ ){
+        const float *pred = y_pred + (size_t) s * n_output;
+        const float *real = y_real + (size_t) s * n_target;
+        for( int k = 0; k < n_output; k++ ){
+            const int positive = labels ? (int) real[0] == k : real[k] >= 0.5f;
+            if( positive )
+                rs->pos[score_bin( pred[k] )]++;
+            else
+                rs->neg[score_bin( pred[k] )]++;
+            if( rs->exact && !rs->failed )
+                rs->pairs[rs->n_pairs++] = (score_label_t) { .score = pred[k], .positive = positive };
+        }
+    }
+    rs->sorted = rs->n_pairs < 2;
+    return 0;
+}
+
+/* Descending, and NaN last */
+static int compare_score( const void *a, const void *b )
+{
+    const float sa = ((const score_label_t*) a)->score;
+    const float sb = ((const score_label_t*) b)->score;
+    return sa > sb ? -1 : sa < sb ? 1 : isnan( sa ) - isnan( sb );
+}
+
+/**
+  @brief Sort the stored pairs (exact mode). Each thread should sort its own state before the states are
+  merged, such that the sorting is done in parallel and the merge is linear.
+ */
+void ranking_state_sort( ranking_state_t *rs )
+{
+    if( !rs->sorted )
+        qsort( rs->pairs, rs->n_pairs, sizeof( score_label_t ), compare_score );
+    rs->sorted = true;
+}
+
+/**
+  @brief Merge `other` into `rs`. `other` is left empty, but must still be freed.
+  @return 0 on success, -1 on failure.
+ */
+int ranking_state_merge( ranking_state_t *rs, ranking_state_t *other )
+{
+    for( int b = 0; b < RANKING_N_BINS; b++ ){
+        rs->pos[b] += other->pos[b];
+        rs->neg[b] += other->neg[b];
+    }
+    rs->failed |= other->failed;
+    if( !rs->exact || rs->failed || other->n_pairs == 0 )
+        return rs->failed ? -1 : 0;
+
+    ranking_state_sort( rs );
+    ranking_state_sort( other );
+    if( rs->n_pairs == 0 ){
+        free( rs->pairs );
+        rs->pairs    = other->pairs;
+        rs->n_pairs  = other->n_pairs;
+        rs->capacity = other->capacity;
+    } else {
+        score_label_t *merged = malloc( (rs->n_pairs + other->n_pairs) * sizeof( score_label_t ));
+        if( !merged ){
+            fprintf( stderr, "Cannot allocate memory for the exact ranking metrics.\n");
+            rs->failed = true;
+            return -1;
+        }
+        size_t i = 0, j = 0, k = 0;
+        while( i < rs->n_pairs && j < other->n_pairs )
+            merged[k++] = compare_score( other->pairs + j, rs->pairs + i ) < 0 ? other->pairs[j++] : rs->pairs[i++];
+        while( i < rs->n_pairs )    merged[k++] = rs->pairs[i++];
+        while( j < other->n_pairs ) merged[k++] = other->pairs[j++];
+        free( rs->pairs );
+        free( other->pairs );
+        rs->pairs    = merged;
+        rs->n_pairs  = k;
+        rs->capacity = k;
+    }
+    other->pairs    = NULL;
+    other->n_pairs  = 0;
+    other->capacity = 0;
+    return 0;
+}
+
+/* Both areas are found in one sweep from the highest score to the lowest, with the samples of equal
+   score (or of the same bin) as one step. The ROC area of a step is a trapezoid, which counts a
+   positive and a negative of equal score as half a correct ordering. The PR area is the average
+   precision: The sum of the precision at each step weighted by the increase in recall. */
+typedef struct _sweep_t sweep_t;
+struct _sweep_t {
+    double tp, fp;
+    double roc, ap;
+};
+
+static inline void sweep_step( sweep_t *sw, const double pos, const double neg )
+{
+    sw->roc += neg * (sw->tp + 0.5 * pos);
+    sw->tp  += pos;
+    sw->fp  += neg;
+    if( pos > 0.0 )
+        sw->ap += pos * sw->tp / (sw->tp + sw->fp);
+}
+
+/**
+  @brief The value of a ranking metric.
+  @param rs The ranking state, with all the samples added (and merged).
+  @param metric One of the ranking metrics
+  @return The area. If there are no positives (or no negatives) the ROC area is 0.5 and the PR area
+          is 0. NaN if the exact mode ran out of memory.
+ */
+float ranking_state_result( ranking_state_t *rs, const metric_func metric )
+{
+    const bool exact = metric == roc_auc_exact || metric == pr_auc_exact;
+    if( exact && (!rs->exact || rs->failed) )
+        return NAN;
+
+    sweep_t sw = { 0.0, 0.0, 0.0, 0.0 };
+    if( exact ){
+        ranking_state_sort( rs );
+        for( size_t i = 0; i < rs->n_pairs; ){
+            double pos = 0.0, neg = 0.0;
+            size_t j = i;
+            for( ; j < rs->n_pairs && compare_score( rs->pairs + i, rs->pairs + j ) == 0; j++ ){
+                if( rs->pairs[j].positive ) pos += 1.0; else neg += 1.0;
+            }
+            sweep_step( &sw, pos, neg );
+            i = j;
+        }
+    } else {
+        for( int b = RANKING_N_BINS - 1; b >= 0; b-- )
+            if( rs->pos[b] || rs->neg[b] )
+                sweep_step( &sw, (double) rs->pos[b], (double) rs->neg[b] );
+    }
+
+    const bool is_roc = metric == roc_auc || metric == roc_auc_exact;
+    if( is_roc )
+        return sw.tp > 0.0 && sw.fp > 0.0 ? (float) (sw.roc / (sw.tp * sw.fp)) : 0.5f;
+    return sw.tp > 0.0 ? (float) (sw.ap / sw.tp) : 0.0f;
+}
+
+void ranking_state_free( ranking_state_t *rs )
+{
+    if( !rs ) return;
+    free( rs->pairs );
+    free( rs );
+}
@@ -0,0 +1,52 @@
+/* ranking_metrics.h - Øystein Schønning-Johansen 2023 */
+/*
+  vim: ts=4 sw=4 softtabstop=4 expandtab
+ */
+
+/* Ranking metrics: Area under the ROC curve and area under the precision-recall curve.
+ *
+ * These are not averages of something per sample, so they cannot be metric functions like the
+ * others in metrics.c. The metric functions `roc_auc` and `pr_auc` (get_metric_func( "roc_auc" ) etc.)
+ * are only markers that can be put in a metric list, for the logger, earlystopping and so on.
+ * evaluate() recognizes them and collects the scores in a `ranking_state_t`. Called per sample,
+ * they just return 0.
+ *
+ * The state is a histogram of the scores of the positives and a histogram of the scores of the
+ * negatives, with RANKING_N_BINS bins over [0,1]. The memory is fixed, and does not grow with the
+ * number of samples. Each thread fills its own state, and they are merged at the end. The areas are
+ * exact up to the bin width. Scores outside [0,1] are clipped.
+ *
+ * The "_exact" variants (roc_auc_exact and pr_auc_exact) store all the (score, label) pairs instead.
+ * Each thread sorts its own pairs, and the sorted runs are merged. This needs memory for all the
+ * outputs of the whole data set.
+ *
+ * With several outputs, each output is a (score, label) pair, which is the micro average. With class
+ * labels as targets (sparse), output k of a sample is positive when the label is k.
+ */
+#ifndef __RANKING_METRICS_H__
+#define __RANKING_METRICS_H__
+#include "metrics.h"
+#include <stdbool.h>
+
+#ifndef RANKING_N_BINS
+#define RANKING_N_BINS 4096
+#endif
+
+typedef struct _ranking_state_t ranking_state_t;
+
+float             roc_auc           ( const int n, const float *y_pred, const float *y_real );
+float             pr_auc            ( const int n, const float *y_pred, const float *y_real );
+float             roc_auc_exact     ( const int n, const float *y_pred, const float *y_real );
+float             pr_auc_exact      ( const int n, const float *y_pred, const float *y_real );
+
+bool              metric_is_ranking ( const metric_func metric );
+bool              metrics_need_exact( metric_func metrics[] );
+
+ranking_state_t * ranking_state_new   ( const bool exact );
+int               ranking_state_add   ( ranking_state_t *rs, const int n_samples, const int n_output,
+                                        const float *y_pred, const float *y_real, const int n_target );
+void              ranking_state_sort  ( ranking_state_t *rs );
+int               ranking_state_merge ( ranking_state_t *rs, ranking_state_t *other );
+float             ranking_state_result( ranking_state_t *rs, const metric_func metric );
+void              ranking_state_free  ( ranking_state_t *rs );
+#endif /* __RANKING_METRICS_H__ */
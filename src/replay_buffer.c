@@ -0,0 +1,289 @@
+/* replay_buffer.c - Øystein Schønning-Johansen 2023 */
+/*
+ vim: ts=4 sw=4 softtabstop=4 expandtab
+*/
+#define _DEFAULT_SOURCE   /* rand_r() with -std=c99 */
+#include "replay_buffer.h"
+#include "simd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sched.h>
+
+#define CACHE_LINE 64
+#define MAX_ATTEMPTS 64   /* Per sampled row, before the sampling gives up */
+
+struct _replay_buffer_t {
+    int            n_input;
+    int            n_target;
+    unsigned int   input_stride;   /* The input and the target of a row each start on a SIMD boundary */
+    unsigned int   row_stride;
+    replay_buffer_properties_t props;
+    float         *rows;
+    unsigned long *sequence;       /* Of each slot: 2t+1 while row t is written, 2t+2 when it is done */
+    double        *tree;           /* The sum-tree. Node 1 is the root, the leaves start at n_leaves */
+    unsigned int   n_leaves;
+    double         max_priority;
+
+    unsigned long  head __attribute__((aligned( CACHE_LINE )));   /* Number of appended rows */
+};
+
+static unsigned int round_up( const unsigned int n )
+{
+    return (n + 15) & ~15u;
+}
+
+static void atomic_add_double( double *x, const double delta )
+{
+    double old, new;
+    __atomic_load( x, &old, __ATOMIC_RELAXED );
+    do {
+        new = old + delta;
+    } while( !__atomic_compare_exchange( x, &old, &new, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ));
+}
+
+static double atomic_load_double( const double *x )
+{
+    double value;
+    __atomic_load( x, &value, __ATOMIC_RELAXED );
+    return value;
+}
+
+static void set_priority( replay_buffer_t *rb, const unsigned int slot, double priority )
+{
+    double old;
+    __atomic_exchange( &rb->tree[rb->n_leaves + slot], &priority, &old, __ATOMIC_RELAXED );
+    const double delta = priority - old;
+    for( unsigned int node = (rb->n_leaves + slot) / 2; node >= 1; node /= 2 )
+        atomic_add_double( &rb->tree[node], delta );
+
+    double max = atomic_load_double( &rb->max_priority );
+    while( priority > max &&
+            !__atomic_compare_exchange( &rb->max_priority, &max, &priority, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ))
+        ;
+}
+
+/**
+  @brief Create a replay buffer.
+  @param n_input The size of the inputs
+  @param n_target The size of the targets (see neuralnet_target_size())
+  @param props Properties. See REPLAY_BUFFER_PROPERTIES() in replay_buffer.h
+  @return The replay buffer, or NULL on failure. Use replay_buffer_free() to free the resources.
+*/
+replay_buffer_t *replay_buffer_new( const int n_input, const int n_target, replay_buffer_properties_t props )
+{
+    if( n_input < 1 || n_target < 1 || props.capacity < 1 || props.alpha < 0.0f || props.beta < 0.0f ||
+            props.epsilon <= 0.0f ){
+        fprintf( stderr, "Replay buffer needs positive sizes, capacity and epsilon, and alpha and beta not negative.\n");
+        return NULL;
+    }
+    replay_buffer_t *rb;
+    if( posix_memalign( (void **) &rb, CACHE_LINE, sizeof(replay_buffer_t)) != 0 ){
+        fprintf( stderr, "Cannot allocate memory for 'replay_buffer_t' type.\n");
+        return NULL;
+    }
+    memset( rb, 0, sizeof(replay_buffer_t));
+    rb->n_input      = n_input;
+    rb->n_target     = n_target;
+    rb->input_stride = round_up( n_input );
+    rb->row_stride   = rb->input_stride + round_up( n_target );
+    rb->props        = props;
+    rb->max_priority = 1.0;
+
+    rb->rows     = simd_malloc_huge( (size_t) props.capacity * rb->row_stride * sizeof(float));
+    rb->sequence = calloc( props.capacity, sizeof(unsigned long));
+    if( props.prioritized ){
+        for( rb->n_leaves = 1; rb->n_leaves < props.capacity; rb->n_leaves *= 2 )
+            ;
+        rb->tree = calloc( 2 * rb->n_leaves, sizeof(double));
+    }
+    if( !rb->rows || !rb->sequence || (props.prioritized && !rb->tree) ){
+        fprintf( stderr, "Cannot allocate the rows of the replay buffer.\n");
+        replay_buffer_free( rb );
+        return NULL;
+    }
+    return rb;
+}
+
+/**
+  @brief Append a row to the replay buffer. This is safe to call from any number of threads. When the
+  buffer is full, the oldest row is overwritten.
+  @return The number of the row (the number of rows appended before it).
+*/
+unsigned long replay_buffer_append( replay_buffer_t *rb, const float *input, const float *target )
+{
+    const unsigned long capacity = rb->props.capacity;
+    const unsigned long t = __atomic_fetch_add( &rb->head, 1, __ATOMIC_RELAXED );
+    const unsigned int slot = (unsigned int) (t % capacity);
+    unsigned long *sequence = rb->sequence + slot;
+
+    /* The writer of the row before, a whole lap ago, must be done. (This only waits if that
+       producer has been stalled while all the other rows have been written.) */
+    const unsigned long expected = t >= capacity ? 2 * (t - capacity) + 2 : 0;
+    while( __atomic_load_n( sequence, __ATOMIC_ACQUIRE ) != expected )
+        sched_yield();
+
+    __atomic_store_n( sequence, 2 * t + 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    float *row = rb->rows + (size_t) slot * rb->row_stride;
+    memcpy( row, input, rb->n_input * sizeof(float));
+    memcpy( row + rb->input_stride, target, rb->n_target * sizeof(float));
+    __atomic_store_n( sequence, 2 * t + 2, __ATOMIC_RELEASE );
+
+    if( rb->tree )
+        set_priority( rb, slot, atomic_load_double( &rb->max_priority ));
+    return t;
+}
+
+/**
+  @brief The number of rows in the buffer. (Some of the last ones may still be written.)
+*/
+unsigned int replay_buffer_size( const replay_buffer_t *rb )
+{
+    const unsigned long head = __atomic_load_n( &rb->head, __ATOMIC_RELAXED );
+    return head < rb->props.capacity ? (unsigned int) head : rb->props.capacity;
+}
+
+/* Copies a row, and returns false if it is not written yet or it was overwritten meanwhile */
+static bool read_row( const replay_buffer_t *rb, const unsigned int slot, float *input, float *target )
+{
+    const unsigned long *sequence = rb->sequence + slot;
+    const unsigned long before = __atomic_load_n( sequence, __ATOMIC_ACQUIRE );
+    if( before == 0 || (before & 1) )
+        return false;
+    const float *row = rb->rows + (size_t) slot * rb->row_stride;
+    memcpy( input, row, rb->n_input * sizeof(float));
+    memcpy( target, row + rb->input_stride, rb->n_target * sizeof(float));
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    return __atomic_load_n( sequence, __ATOMIC_RELAXED ) == before;
+}
+
+/* Walks from the root to the leaf where the cumulative priority passes u */
+static unsigned int find_slot( const replay_buffer_t *rb, double u )
+{
+    unsigned int node = 1;
+    while( node < rb->n_leaves ){
+        const double left = atomic_load_double( &rb->tree[2 * node] );
+        if( u < left ){
+            node = 2 * node;
+        } else {
+            u -= left > 0.0 ? left : 0.0;
+            node = 2 * node + 1;
+        }
+    }
+    return node - rb->n_leaves;
+}
+
+static double random_uniform( unsigned int *seed )
+{
+    return (double) rand_r( seed ) / ((double) RAND_MAX + 1.0);
+}
+
+/**
+  @brief Sample rows from the buffer (with replacement).
+  @param rb The replay buffer
+  @param n The number of rows to sample
+  @param X The inputs of the sampled rows, n x n_input
+  @param Y The targets of the sampled rows, n x n_target
+  @param slots The slots of the sampled rows (for replay_buffer_update_priorities()), or NULL
+  @param weights The importance sampling weights, or NULL. These are 1 with uniform sampling.
+  @param seed The state of the random numbers of the calling thread (see rand_r())
+  @return The number of sampled rows, which is less than n only if the buffer is (nearly) empty.
+*/
+int replay_buffer_sample( replay_buffer_t *rb, const int n, float *X, float *Y, unsigned int *slots, float *weights,
+        unsigned int *seed )
+{
+    const unsigned int size = replay_buffer_size( rb );
+    if( size == 0 )
+        return 0;
+
+    float max_weight = 0.0f;
+    int j;
+    for( j = 0; j < n; j++ ){
+        float *x = X + (size_t) j * rb->n_input;
+        float *y = Y + (size_t) j * rb->n_target;
+        double total = rb->tree ? atomic_load_double( &rb->tree[1] ) : 0.0;
+        unsigned int slot = 0;
+        double priority = 0.0;
+        int attempt;
+        for( attempt = 0; attempt < MAX_ATTEMPTS; attempt++ ){
+            if( total > 0.0 ){
+                /* Stratified: One row from each of n equal parts of the total priority */
+                const double r = random_uniform( seed );
+                slot = find_slot( rb, attempt == 0 ? (j + r) * total / n : r * total );
+                if( slot >= size )
+                    continue;
+                priority = atomic_load_double( &rb->tree[rb->n_leaves + slot] );
+                if( priority <= 0.0 )
+                    continue;
+            } else {
+                slot = (unsigned int) (random_uniform( seed ) * size);
+            }
+            if( read_row( rb, slot, x, y ))
+                break;
+        }
+        if( attempt == MAX_ATTEMPTS )
+            break;
+        if( slots )
+            slots[j] = slot;
+        if( weights ){
+            weights[j] = total > 0.0 && rb->props.beta > 0.0f ?
+                (float) pow( size * priority / total, -rb->props.beta ) : 1.0f;
+            if( weights[j] > max_weight )
+                max_weight = weights[j];
+        }
+    }
+    if( weights )
+        for( int k = 0; k < j; k++ )
+            weights[k] /= max_weight;
+    return j;
+}
+
+/**
+  @brief Set the priorities of rows from their loss: (loss + epsilon)^alpha. This does nothing with uniform
+  sampling. (If a row has been overwritten since it was sampled, the new row gets the priority.)
+*/
+void replay_buffer_update_priorities( replay_buffer_t *rb, const int n, const unsigned int *slots, const float *losses )
+{
+    if( !rb->tree )
+        return;
+    for( int j = 0; j < n; j++ )
+        set_priority( rb, slots[j], pow( fabs( losses[j] ) + rb->props.epsilon, rb->props.alpha ));
+}
+
+/**
+  @brief The priority of a slot, or 0 with uniform sampling.
+*/
+float replay_buffer_priority( const replay_buffer_t *rb, const unsigned int slot )
+{
+    return rb->tree && slot < rb->props.capacity ? (float) atomic_load_double( &rb->tree[rb->n_leaves + slot] ) : 0.0f;
+}
+
+int replay_buffer_n_input( const replay_buffer_t *rb )
+{
+    return rb->n_input;
+}
+
+int replay_buffer_n_target( const replay_buffer_t *rb )
+{
+    return rb->n_target;
+}
+
+replay_buffer_properties_t replay_buffer_properties( const replay_buffer_t *rb )
+{
+    return rb->props;
+}
+
+/**
+  @brief Free the replay buffer. There must be no producers or samplers.
+*/
+void replay_buffer_free( replay_buffer_t *rb )
+{
+    if( !rb ) return;
+    simd_free_huge( rb->rows );
+    free( rb->sequence );
+    free( rb->tree );
+    free( rb );
+}
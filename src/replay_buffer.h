@@ -0,0 +1,73 @@
+/* replay_buffer.h - Øystein Schønning-Johansen 2023 */
+/*
+  vim: ts=4 sw=4 softtabstop=4 expandtab
+ */
+
+/* Experience replay for online and reinforcement learning training.
+ *
+ * A ring buffer of a fixed number of (input, target) rows. Any number of producer threads append
+ * rows, and when the buffer is full the oldest rows are overwritten. The optimizer samples its
+ * batches from the buffer (see `optimizer_run_epoch_replay()`), uniformly or prioritized. There
+ * is no global lock:
+ *
+ *   - A producer takes the next slot with an atomic increment, and writes the row under the
+ *     sequence number of the slot (a seqlock). A sampler that reads a row while it is overwritten
+ *     sees that the sequence number has changed, and samples another row.
+ *   - The priorities are kept in a sum-tree: Each leaf is the priority of a slot and each inner node
+ *     is the sum of its children. A change of a priority is added to all the nodes above it with
+ *     atomic additions, so sampling a slot with probability proportional to its priority is a
+ *     walk from the root to a leaf, also while other threads change priorities.
+ *
+ * The rows are stored with SIMD aligned strides, and they are copied into the batch when they are
+ * sampled.
+ *
+ *     replay_buffer_t *rb = replay_buffer_new( n_input, n_target, REPLAY_BUFFER_PROPERTIES( .capacity = 100000 ));
+ *     ...
+ *     replay_buffer_append( rb, input, target );            // Actors, from any thread
+ *     ...
+ *     optimizer_run_epoch_replay( opt, rb, n_batches, results );    // Learner
+ *
+ * With prioritized sampling, a new row gets the largest priority so far, such that it is sampled
+ * soon. `optimizer_run_epoch_replay()` sets the priorities of the sampled rows from their loss:
+ * (loss + epsilon)^alpha, and weights the gradient of each sample with the importance sampling
+ * weight (N * P(i))^-beta, divided by the largest weight of the batch.
+ */
+
+#ifndef __REPLAY_BUFFER_H__
+#define __REPLAY_BUFFER_H__
+#include <stdbool.h>
+
+typedef struct _replay_buffer_t replay_buffer_t;
+
+typedef struct _replay_buffer_properties_t replay_buffer_properties_t;
+struct _replay_buffer_properties_t {
+    unsigned int capacity;     /* Number of rows */
+    bool         prioritized;  /* Sample in proportion to the priorities, else uniformly */
+    float        alpha;        /* How much the loss counts in the priority. 0 is uniform. */
+    float        beta;         /* Importance sampling correction. 0 is none, 1 is full. */
+    float        epsilon;      /* Added to the loss, such that no row gets priority zero */
+};
+
+/* These are the default values. */
+#define REPLAY_BUFFER_PROPERTIES(...) (replay_buffer_properties_t) \
+            { .capacity    = 65536,     \
+              .prioritized = false,     \
+              .alpha       = 0.6f,      \
+              .beta        = 0.4f,      \
+              .epsilon     = 1.0e-3f,   \
+              __VA_ARGS__ }
+
+replay_buffer_t *         replay_buffer_new             ( const int n_input, const int n_target,
+                                                          replay_buffer_properties_t props );
+unsigned long             replay_buffer_append          ( replay_buffer_t *rb, const float *input, const float *target );
+unsigned int              replay_buffer_size            ( const replay_buffer_t *rb );
+int                       replay_buffer_sample          ( replay_buffer_t *rb, const int n, float *X, float *Y,
+                                                          unsigned int *slots, float *weights, unsigned int *seed );
+void                      replay_buffer_update_priorities( replay_buffer_t *rb, const int n, const unsigned int *slots,
+                                                          const float *losses );
+float                     replay_buffer_priority        ( const replay_buffer_t *rb, const unsigned int slot );
+int                       replay_buffer_n_input         ( const replay_buffer_t *rb );
+int                       replay_buffer_n_target        ( const replay_buffer_t *rb );
+replay_buffer_properties_t replay_buffer_properties     ( const replay_buffer_t *rb );
+void                      replay_buffer_free            ( replay_buffer_t *rb );
+#endif /* __REPLAY_BUFFER_H__ */
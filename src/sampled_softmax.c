@@ -0,0 +1,327 @@
+/* sampled_softmax.c - Øystein Schønning-Johansen 2023 */
+/*
+ vim: ts=4 sw=4 softtabstop=4 expandtab
+*/
+#include "sampled_softmax.h"
+#include "activation.h"
+#include "loss.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+enum { PROPOSAL_UNIFORM, PROPOSAL_LOG_UNIFORM, PROPOSAL_UNIGRAM };
+
+struct _sampled_softmax_t
+{
+    int       n_classes;
+    int       n_sampled;
+    int       proposal;
+    float    *log_expected;  /* log( n_sampled * Q(class) ) for each class. This is the logQ correction. */
+    float    *alias_prob;    /* Alias table (Vose) for the "unigram" proposal. NULL otherwise. */
+    int      *alias;
+    uint64_t  n_draws;       /* Seeds the random number generator of each sample */
+};
+
+/* splitmix64 - each sample gets its own generator, as the backpropagation runs in parallel */
+static inline uint64_t next_random( uint64_t *state )
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static inline float next_uniform( uint64_t *state )
+{
+    return (float) (next_random( state ) >> 40) * (1.0f / 16777216.0f);  /* [0,1) */
+}
+
+static inline int draw_class( const sampled_softmax_t *ss, uint64_t *state )
+{
+    const int n = ss->n_classes;
+    int k;
+    switch( ss->proposal ){
+        case PROPOSAL_LOG_UNIFORM:
+            k = (int) expf( next_uniform( state ) * logf( (float) n + 1.0f )) - 1;
+            return k < 0 ? 0 : k >= n ? n - 1 : k;
+        case PROPOSAL_UNIGRAM:
+            k = (int) (((next_random( state ) >> 32) * (uint64_t) n) >> 32);
+            return next_uniform( state ) < ss->alias_prob[k] ? k : ss->alias[k];
+        default:
+            return (int) (((next_random( state ) >> 32) * (uint64_t) n) >> 32);
+    }
+}
+
+static int compare_int( const void *a, const void *b )
+{
+    const int x = *(const int*) a, y = *(const int*) b;
+    return (x > y) - (x < y);
+}
+
+/* Vose's alias method, such that a class can be drawn from the unigram distribution in O(1) */
+static int build_alias_table( sampled_softmax_t *ss, const float *counts, float *q )
+{
+    const int n = ss->n_classes;
+    double sum = 0.0;
+    for( int i = 0; i < n; i++ ){
+        if( counts[i] < 0.0f ){
+            fprintf( stderr, "Class counts for sampled softmax cannot be negative.\n");
+            return 0;
+        }
+        sum += counts[i];
+    }
+    if( sum <= 0.0 ){
+        fprintf( stderr, "Class counts for sampled softmax must have a positive sum.\n");
+        return 0;
+    }
+
+    ss->alias_prob = malloc( n * sizeof(float));
+    ss->alias      = malloc( n * sizeof(int));
+    int *small     = malloc( n * sizeof(int));
+    int *large     = malloc( n * sizeof(int));
+    if( !ss->alias_prob || !ss->alias || !small || !large ){
+        fprintf( stderr, "Cannot allocate alias table for sampled softmax.\n");
+        free( small );
+        free( large );
+        return 0;
+    }
+
+    int n_small = 0, n_large = 0;
+    for( int i = 0; i < n; i++ ){
+        q[i] = (float) (counts[i] / sum);
+        ss->alias_prob[i] = q[i] * n;
+        ss->alias[i] = i;
+        if( ss->alias_prob[i] < 1.0f )
+            small[n_small++] = i;
+        else
+            large[n_large++] = i;
+    }
+    while( n_small > 0 && n_large > 0 ){
+        const int s = small[--n_small];
+        const int l = large[n_large-1];
+        ss->alias[s] = l;
+        ss->alias_prob[l] -= 1.0f - ss->alias_prob[s];
+        if( ss->alias_prob[l] < 1.0f ){
+            n_large--;
+            small[n_small++] = l;
+        }
+    }
+    /* Rounding leftovers */
+    while( n_large > 0 ) ss->alias_prob[large[--n_large]] = 1.0f;
+    while( n_small > 0 ) ss->alias_prob[small[--n_small]] = 1.0f;
+
+    free( small );
+    free( large );
+    return 1;
+}
+
+/**
+  @brief Create the sampling setup for a sampled softmax output layer.
+  @param n_classes Number of outputs of the output layer.
+  @param props Properties. See SAMPLED_SOFTMAX_PROPERTIES() in sampled_softmax.h
+  @return Pointer to the new sampled softmax or NULL on failure.
+*/
+sampled_softmax_t *sampled_softmax_new( const int n_classes, sampled_softmax_properties_t props )
+{
+    if( n_classes < 2 || props.n_sampled < 1 ){
+        fprintf( stderr, "Sampled softmax with %d classes and %d samples does not make sense.\n",
+                n_classes, props.n_sampled );
+        return NULL;
+    }
+
+    const int proposal =
+        !strcmp( props.proposal, "uniform" )     ? PROPOSAL_UNIFORM :
+        !strcmp( props.proposal, "log_uniform" ) ? PROPOSAL_LOG_UNIFORM :
+        !strcmp( props.proposal, "unigram" )     ? PROPOSAL_UNIGRAM :
+        -1;
+    if( proposal < 0 ){
+        fprintf( stderr, "Unknown proposal distribution '%s' for sampled softmax.\n", props.proposal );
+        return NULL;
+    }
+    if( proposal == PROPOSAL_UNIGRAM && !props.class_counts ){
+        fprintf( stderr, "The 'unigram' proposal distribution for sampled softmax needs class_counts.\n");
+        return NULL;
+    }
+
+    sampled_softmax_t *ss = calloc( 1, sizeof( sampled_softmax_t ));
+    if( !ss ){
+        fprintf( stderr, "Cannot allocate memory for 'sampled_softmax_t' type.\n");
+        return NULL;
+    }
+    ss->n_classes = n_classes;
+    ss->n_sampled = props.n_sampled;
+    ss->proposal  = proposal;
+    ss->log_expected = malloc( n_classes * sizeof(float));
+    if( !ss->log_expected ){
+        fprintf( stderr, "Cannot allocate memory for sampled softmax.\n");
+        sampled_softmax_free( ss );
+        return NULL;
+    }
+
+    /* First the proposal probabilities Q, then log( n_sampled * Q ) */
+    float *q = ss->log_expected;
+    if( proposal == PROPOSAL_UNIGRAM ){
+        if( !build_alias_table( ss, props.class_counts, q )){
+            sampled_softmax_free( ss );
+            return NULL;
+        }
+    } else {
+        const float log_n = logf( (float) n_classes + 1.0f );
+        for( int i = 0; i < n_classes; i++ )
+            q[i] = proposal == PROPOSAL_UNIFORM ? 1.0f / (float) n_classes :
+                logf( ((float) i + 2.0f) / ((float) i + 1.0f) ) / log_n;
+    }
+    for( int i = 0; i < n_classes; i++ )
+        ss->log_expected[i] = logf( (float) ss->n_sampled * fmaxf( q[i], 1.0e-30f ));
+
+    return ss;
+}
+
+/**
+  @brief Free the resources of a sampled softmax.
+*/
+void sampled_softmax_free( sampled_softmax_t *ss )
+{
+    if( !ss ) return;
+    free( ss->log_expected );
+    free( ss->alias_prob );
+    free( ss->alias );
+    free( ss );
+}
+
+/**
+  @brief The largest number of output columns a sample can touch: The true class and the sampled classes.
+*/
+int sampled_softmax_max_columns( const sampled_softmax_t *ss )
+{
+    return ss->n_sampled + 1;
+}
+
+/**
+  @brief Configure the sampled softmax of a neural network.
+  @param nn The neural network. The output activation should be softmax.
+  @param props Properties. See SAMPLED_SOFTMAX_PROPERTIES() in sampled_softmax.h
+
+  This also sets the loss to "sampled_softmax" if not already set.
+*/
+void neuralnet_set_sampled_softmax( neuralnet_t *nn, sampled_softmax_properties_t props )
+{
+    if( nn->loss != get_loss_func( "sampled_softmax" ))
+        neuralnet_set_loss( nn, "sampled_softmax" );
+
+    sampled_softmax_t *ss = sampled_softmax_new( nn->layer[nn->n_layers-1].n_output, props );
+    if( !ss ){
+        fprintf( stderr, "Warning: Keeping the previous sampled softmax setup.\n");
+        return;
+    }
+    sampled_softmax_free( nn->sampled_softmax );
+    nn->sampled_softmax = ss;
+}
+
+/**
+  @brief Forward and backward calculation of a sampled softmax output layer for one sample.
+  @param ss The sampled softmax
+  @param layer The output layer
+  @param input The input to the output layer (the activations of the last hidden layer)
+  @param target The class label of the sample, in target[0].
+  @param grad_b The bias gradient of the output layer. Only the sampled classes are written.
+  @param grad_w The weight gradient of the output layer. Only the sampled columns are written.
+  @param delta_input If not NULL, the derivative w.r.t. the input is written here (n_input elements).
+  @param columns The classes of the written columns, sorted and without duplicates. It must have room
+         for `sampled_softmax_max_columns()` classes.
+  @return The number of classes in `columns`.
+
+  Only the logits of the true class and the sampled classes are calculated. This is a gather of
+  (n_sampled + 1) columns in each row of the weight matrix, instead of the full matrix-vector product.
+  The other columns of grad_b and grad_w are not touched, so the caller only has to read (and clear)
+  the columns it gets back.
+*/
+int sampled_softmax_backpropagation( sampled_softmax_t *ss, const layer_t *layer, const float *input,
+        const float *target, float *grad_b, float *grad_w, float *delta_input, int *columns )
+{
+    const int n_inp = layer->n_input;
+    const int n_out = layer->n_output;
+    const int n = ss->n_sampled + 1;
+    int   classes[n];
+    float logits[n];
+    float d[n];
+
+    classes[0] = (int) target[0];
+    assert( classes[0] >= 0 && classes[0] < n_out );
+
+    uint64_t state;
+    #pragma omp atomic capture
+    state = ss->n_draws++;
+    state *= 0xd1342543de82ef95ULL;
+    for( int s = 1; s < n; s++ )
+        classes[s] = draw_class( ss, &state );
+
+    /* forward: logits = bias + input . W[:,class] */
+    for( int s = 0; s < n; s++ )
+        logits[s] = layer->bias[classes[s]];
+    for( int i = 0; i < n_inp; i++ ){
+        const float h = input[i];
+        if( h == 0.0f ) continue;   /* relu makes this quite common */
+        const float *w = layer->weight + (size_t) i * n_out;
+        int s = 0;
+#ifdef __AVX2__
+        const __m256 h_v = _mm256_set1_ps( h );
+        for( ; s <= n - 8; s += 8 ){
+            const __m256i idx = _mm256_loadu_si256( (const __m256i*) (classes + s));
+            _mm256_storeu_ps( logits + s, _mm256_add_ps( _mm256_loadu_ps( logits + s ),
+                        _mm256_mul_ps( h_v, _mm256_i32gather_ps( w, idx, 4 ))));
+        }
+#endif
+        for( ; s < n; s++ )
+            logits[s] += h * w[classes[s]];
+    }
+
+    /* The logQ correction of the sampled classes. exp( logit ) / (n_sampled * Q) summed over the samples
+       is then an unbiased estimate of the sum over all the other classes in the softmax denominator.
+       Samples that hit the true class are removed. */
+    for( int s = 1; s < n; s++ )
+        logits[s] = classes[s] == classes[0] ? -INFINITY : logits[s] - ss->log_expected[classes[s]];
+
+    /* The true class is at position 0 */
+    const float label = 0.0f;
+    sparse_softmax_crossentropy( n, logits, &label, d );
+
+    /* A class can be drawn more than once. The derivatives are summed for each distinct class (column),
+       such that each column is written once. */
+    memcpy( columns, classes, n * sizeof(int));
+    qsort( columns, n, sizeof(int), compare_int );
+    int n_columns = 1;
+    for( int s = 1; s < n; s++ )
+        if( columns[s] != columns[n_columns-1] )
+            columns[n_columns++] = columns[s];
+    float d_column[n_columns];
+    memset( d_column, 0, n_columns * sizeof(float));
+    for( int s = 0; s < n; s++ ){
+        const int *k = bsearch( classes + s, columns, n_columns, sizeof(int), compare_int );
+        d_column[k - columns] += d[s];
+    }
+
+    /* backward */
+    for( int k = 0; k < n_columns; k++ )
+        grad_b[columns[k]] = d_column[k];
+    for( int i = 0; i < n_inp; i++ ){
+        const float h = input[i];
+        const float *w = layer->weight + (size_t) i * n_out;
+        float *gw = grad_w + (size_t) i * n_out;
+        float delta = 0.0f;
+        for( int k = 0; k < n_columns; k++ ){
+            delta += w[columns[k]] * d_column[k];
+            gw[columns[k]] = h * d_column[k];
+        }
+        if( delta_input )
+            delta_input[i] = delta;
+    }
+    return n_columns;
+}
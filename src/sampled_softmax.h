@@ -0,0 +1,50 @@
+/* sampled_softmax.h - Øystein Schønning-Johansen 2023 */
+/*
+  vim: ts=4 sw=4 softtabstop=4 expandtab
+ */
+
+/* Sampled softmax for training of very large output layers.
+ *
+ * With tens of thousands of classes, the matrix-vector product and the outer product of the
+ * output layer dominate the training. The sampled softmax only calculates the logits and the
+ * gradients for the true class and a few sampled "negative" classes. The negatives are drawn
+ * from a proposal distribution Q, and their logits are corrected by subtracting log( n_sampled * Q ),
+ * such that the softmax denominator is estimated without bias. The gradient is then close to the
+ * gradient of the full softmax crossentropy when n_sampled is not too small.
+ *
+ * This is only used in the training. neuralnet_predict() and evaluate() still do the full softmax.
+ * The targets are class labels, like with the 'sparse_categorical_crossentropy' loss.
+ *
+ * Typical usage:
+
+        neuralnet_set_loss( nn, "sampled_softmax" );   // Default properties, or:
+        neuralnet_set_sampled_softmax( nn, SAMPLED_SOFTMAX_PROPERTIES( .n_sampled = 256, .proposal = "uniform" ));
+ */
+
+#ifndef __SAMPLED_SOFTMAX_H__
+#define __SAMPLED_SOFTMAX_H__
+#include "neuralnet.h"
+
+typedef struct _sampled_softmax_properties_t sampled_softmax_properties_t;
+struct _sampled_softmax_properties_t {
+    int          n_sampled;     /* Number of negative classes sampled for each training sample */
+    const char  *proposal;      /* "uniform", "log_uniform" or "unigram" */
+    const float *class_counts;  /* Class frequencies (n_output of them) for the "unigram" proposal */
+};
+
+/* These are the default values. "log_uniform" assumes the classes are sorted by decreasing frequency. */
+#define SAMPLED_SOFTMAX_PROPERTIES(...) (sampled_softmax_properties_t) \
+            { .n_sampled    = 64,            \
+              .proposal     = "log_uniform", \
+              .class_counts = NULL,          \
+              __VA_ARGS__ }
+
+sampled_softmax_t * sampled_softmax_new ( const int n_classes, sampled_softmax_properties_t props );
+void                sampled_softmax_free( sampled_softmax_t *ss );
+int                 sampled_softmax_max_columns( const sampled_softmax_t *ss );
+
+void neuralnet_set_sampled_softmax( neuralnet_t *nn, sampled_softmax_properties_t props );
+
+int  sampled_softmax_backpropagation( sampled_softmax_t *ss, const layer_t *layer, const float *input,
+        const float *target, float *grad_b, float *grad_w, float *delta_input, int *columns );
+#endif /* __SAMPLED_SOFTMAX_H__ */
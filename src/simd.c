@@ -0,0 +1,96 @@
+/* simd.c - Øystein Schønning-Johansen 2023 */
+/*
+ vim: ts=4 sw=4 softtabstop=4 expandtab
+*/
+#define _DEFAULT_SOURCE   /* MAP_ANONYMOUS, MAP_HUGETLB and madvise() with -std=c99 */
+#include "simd.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+
+/* Each allocation has a header in front, such that `simd_free_huge()` knows how it was made. The
+   header is as large as the largest alignment, so the data is still aligned. */
+#define HEADER_SIZE 64
+
+typedef struct {
+    void   *base;
+    size_t  map_size;   /* The size of the mmap(), or 0 if allocated with posix_memalign() */
+} header_t;
+
+static simd_hugepage_policy_t hugepage_policy = SIMD_HUGEPAGE_NONE;
+
+/**
+  @brief Set the huge page policy for `simd_malloc_huge()`.
+  @param policy SIMD_HUGEPAGE_NONE, SIMD_HUGEPAGE_TRANSPARENT or SIMD_HUGEPAGE_HUGETLB
+*/
+void simd_set_hugepage_policy( const simd_hugepage_policy_t policy )
+{
+    __atomic_store_n( &hugepage_policy, policy, __ATOMIC_RELAXED );
+}
+
+simd_hugepage_policy_t simd_get_hugepage_policy( void )
+{
+    return __atomic_load_n( &hugepage_policy, __ATOMIC_RELAXED );
+}
+
+static float *data_after_header( void *base, const size_t map_size )
+{
+    header_t *header = (header_t *) base;
+    header->base = base;
+    header->map_size = map_size;
+    return (float *) ((char *) base + HEADER_SIZE);
+}
+
+/**
+  @brief Allocate aligned memory, on huge pages if the policy says so.
+  @param size The size in bytes
+  @return The memory, to be freed with `simd_free_huge()`, or NULL on failure.
+*/
+float *simd_malloc_huge( size_t size )
+{
+    const simd_hugepage_policy_t policy = simd_get_hugepage_policy();
+    const size_t huge_size = (size + HEADER_SIZE + SIMD_HUGEPAGE_SIZE - 1) / SIMD_HUGEPAGE_SIZE * SIMD_HUGEPAGE_SIZE;
+    void *base;
+
+    if( policy == SIMD_HUGEPAGE_NONE || size < SIMD_HUGEPAGE_MIN_SIZE ){
+        if( posix_memalign( &base, HEADER_SIZE, size + HEADER_SIZE ))
+            return NULL;
+        return data_after_header( base, 0 );
+    }
+
+#ifdef MAP_HUGETLB
+    if( policy == SIMD_HUGEPAGE_HUGETLB ){
+        base = mmap( NULL, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+        if( base != MAP_FAILED )
+            return data_after_header( base, huge_size );
+
+        static bool warned = false;
+        if( !__atomic_exchange_n( &warned, true, __ATOMIC_RELAXED ))
+            fprintf( stderr, "Warning: No huge pages in the pool (see /proc/sys/vm/nr_hugepages). "
+                    "Using transparent huge pages.\n");
+    }
+#endif
+
+    if( posix_memalign( &base, SIMD_HUGEPAGE_SIZE, huge_size ))
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise( base, huge_size, MADV_HUGEPAGE );  /* Just normal pages if this fails */
+#endif
+    return data_after_header( base, 0 );
+}
+
+/**
+  @brief Free memory from `simd_malloc_huge()`.
+  @param ptr The memory, can be NULL
+*/
+void simd_free_huge( float *ptr )
+{
+    if( !ptr )
+        return;
+    const header_t *header = (const header_t *) ((char *) ptr - HEADER_SIZE);
+    if( header->map_size )
+        munmap( header->base, header->map_size );
+    else
+        free( header->base );
+}
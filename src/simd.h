@@ -64,4 +64,37 @@ simd_free (float *ptr)
 #endif
 }
 
+/* Huge pages for the large buffers: weights, optimizer state and gradients. With 4 kB pages, a
+ * model or a dataset of some hundred MB needs more TLB entries than the CPU has, and every page
+ * walk is a cache miss. With the policy set, `simd_malloc_huge()` places the allocations of at
+ * least SIMD_HUGEPAGE_MIN_SIZE bytes on huge pages:
+ *
+ *   SIMD_HUGEPAGE_TRANSPARENT: Aligned to the huge page size and madvise(MADV_HUGEPAGE). This
+ *                              works when /sys/kernel/mm/transparent_hugepage/enabled is
+ *                              "always" or "madvise".
+ *   SIMD_HUGEPAGE_HUGETLB:     mmap(MAP_HUGETLB) from the reserved pool (vm.nr_hugepages). When
+ *                              the pool is empty, transparent huge pages are used instead.
+ *
+ * Memory from `simd_malloc_huge()` must be freed with `simd_free_huge()`. The policy only
+ * matters for new allocations.
+ */
+typedef enum {
+    SIMD_HUGEPAGE_NONE,
+    SIMD_HUGEPAGE_TRANSPARENT,
+    SIMD_HUGEPAGE_HUGETLB
+} simd_hugepage_policy_t;
+
+#ifndef SIMD_HUGEPAGE_SIZE
+#define SIMD_HUGEPAGE_SIZE (2 * 1024 * 1024)
+#endif
+
+#ifndef SIMD_HUGEPAGE_MIN_SIZE
+#define SIMD_HUGEPAGE_MIN_SIZE (SIMD_HUGEPAGE_SIZE / 2)
+#endif
+
+void                   simd_set_hugepage_policy( const simd_hugepage_policy_t policy );
+simd_hugepage_policy_t simd_get_hugepage_policy( void );
+float *                simd_malloc_huge        ( size_t size );
+void                   simd_free_huge          ( float *ptr );
+
 #endif /* __SIMD_H__ */
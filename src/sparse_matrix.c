@@ -0,0 +1,168 @@
+/* sparse_matrix.c - Øystein Schønning-Johansen 2023 */
+/*
+ vim: ts=4 sw=4 softtabstop=4 expandtab
+*/
+#include "sparse_matrix.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/**
+  @brief Allocate an empty CSR matrix.
+  @param n_rows Number of rows (samples)
+  @param n_cols Number of columns (features)
+  @param nnz Number of nonzero elements to make room for
+  @param with_values If false, no values array is allocated and all nonzeros are 1.0f
+  @return Pointer to the new matrix or NULL on failure. The row_ptr array is zeroed.
+*/
+sparse_matrix_t *sparse_matrix_create( const int n_rows, const int n_cols, const unsigned int nnz, const bool with_values )
+{
+    if( n_rows < 1 || n_cols < 1 ){
+        fprintf( stderr, "Sparse matrix dimensions (%d,%d) do not make sense.\n", n_rows, n_cols );
+        return NULL;
+    }
+
+    sparse_matrix_t *m = calloc( 1, sizeof( sparse_matrix_t ));
+    if( !m ){
+        fprintf( stderr, "Cannot allocate memory for 'sparse_matrix_t' type.\n" );
+        return NULL;
+    }
+    m->n_rows = n_rows;
+    m->n_cols = n_cols;
+
+    m->row_ptr = calloc( n_rows + 1, sizeof( unsigned int ));
+    /* malloc(0) may return NULL, so we allocate at least one element */
+    m->col_idx = malloc( (nnz ? nnz : 1) * sizeof( int ));
+    if( with_values )
+        m->values = malloc( (nnz ? nnz : 1) * sizeof( float ));
+
+    if( !m->row_ptr || !m->col_idx || (with_values && !m->values) ){
+        fprintf( stderr, "Cannot allocate memory for sparse matrix with %u nonzero elements.\n", nnz );
+        sparse_matrix_free( m );
+        return NULL;
+    }
+    return m;
+}
+
+/**
+  @brief Create a CSR matrix from a dense row major matrix.
+  @param n_rows Number of rows (samples)
+  @param n_cols Number of columns (features)
+  @param dense Pointer to the dense n_rows x n_cols matrix
+  @return Pointer to the new matrix or NULL on failure. Use sparse_matrix_free() to free it.
+
+  If all the nonzero elements are exactly 1.0f (one-hot encoded data), the values array is
+  not stored at all, which halves the memory of the sparse representation.
+*/
+sparse_matrix_t *sparse_matrix_from_dense( const int n_rows, const int n_cols, const float *dense )
+{
+    unsigned int nnz = 0;
+    bool all_ones = true;
+    const float *ptr = dense;
+    for( long i = (long) n_rows * n_cols; i--; ptr++ ){
+        if( *ptr != 0.0f ){
+            nnz++;
+            if( *ptr != 1.0f ) all_ones = false;
+        }
+    }
+
+    sparse_matrix_t *m = sparse_matrix_create( n_rows, n_cols, nnz, !all_ones );
+    if( !m )
+        return NULL;
+
+    unsigned int k = 0;
+    ptr = dense;
+    for( int i = 0; i < n_rows; i++ ){
+        m->row_ptr[i] = k;
+        for( int j = 0; j < n_cols; j++, ptr++ ){
+            if( *ptr != 0.0f ){
+                m->col_idx[k] = j;
+                if( m->values ) m->values[k] = *ptr;
+                k++;
+            }
+        }
+    }
+    m->row_ptr[n_rows] = k;
+    assert( k == nnz );
+    return m;
+}
+
+/**
+  @brief Create a CSR matrix from its arrays, without a dense matrix.
+  @param n_rows Number of rows (samples)
+  @param n_cols Number of columns (features)
+  @param indptr The n_rows + 1 offsets of the rows into indices (and values). indptr[0] is 0.
+  @param indices The column of each nonzero element. The columns of each row must be in increasing
+  order, with no duplicates.
+  @param values The value of each nonzero element, or NULL if they are all 1.0f
+  @return Pointer to the new matrix or NULL on failure. Use sparse_matrix_free() to free it.
+
+  The arrays are copied. These are the arrays of a scipy.sparse.csr_matrix (data, indices, indptr),
+  such that a large sparse dataset can be loaded without ever being dense. As with
+  sparse_matrix_from_dense(), the values are not stored if they are all 1.0f.
+*/
+sparse_matrix_t *sparse_matrix_from_csr( const int n_rows, const int n_cols, const unsigned int *indptr,
+        const int *indices, const float *values )
+{
+    if( n_rows < 1 || indptr[0] != 0 ){
+        fprintf( stderr, "The row offsets of the sparse matrix must start at 0.\n" );
+        return NULL;
+    }
+    const unsigned int nnz = indptr[n_rows];
+    for( int i = 0; i < n_rows; i++ ){
+        if( indptr[i+1] < indptr[i] ){
+            fprintf( stderr, "The row offsets of the sparse matrix must not decrease (row %d).\n", i );
+            return NULL;
+        }
+        for( unsigned int k = indptr[i]; k < indptr[i+1]; k++ ){
+            if( indices[k] < 0 || indices[k] >= n_cols || (k > indptr[i] && indices[k] <= indices[k-1]) ){
+                fprintf( stderr, "The columns of row %d of the sparse matrix must be in [0,%d), increasing and unique.\n",
+                        i, n_cols );
+                return NULL;
+            }
+        }
+    }
+
+    bool all_ones = true;
+    for( unsigned int k = 0; values && k < nnz; k++ )
+        if( values[k] != 1.0f ) all_ones = false;
+
+    sparse_matrix_t *m = sparse_matrix_create( n_rows, n_cols, nnz, !all_ones );
+    if( !m )
+        return NULL;
+    memcpy( m->row_ptr, indptr, (n_rows + 1) * sizeof(unsigned int));
+    memcpy( m->col_idx, indices, nnz * sizeof(int));
+    if( m->values )
+        memcpy( m->values, values, nnz * sizeof(float));
+    return m;
+}
+
+/**
+  @brief Free resources of a sparse matrix.
+  @param m The sparse matrix to free.
+*/
+void sparse_matrix_free( sparse_matrix_t *m )
+{
+    if( !m ) return;
+    free( m->row_ptr );
+    free( m->col_idx );
+    free( m->values );
+    free( m );
+}
+
+/**
+  @brief Expand a sparse vector to a dense vector.
+  @param v The sparse vector
+  @param n Length of the dense vector
+  @param dense Output array of length n. All elements are written.
+*/
+void sparse_vector_to_dense( const sparse_vector_t *v, const int n, float *dense )
+{
+    memset( dense, 0, n * sizeof(float));
+    for( int k = 0; k < v->n_nonzero; k++ ){
+        assert( v->index[k] < n );
+        dense[v->index[k]] = v->value ? v->value[k] : 1.0f;
+    }
+}
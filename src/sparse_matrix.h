@@ -0,0 +1,70 @@
+/* sparse_matrix.h - Øystein Schønning-Johansen 2023 */
+/*
+  vim: ts=4 sw=4 softtabstop=4 expandtab
+ */
+
+/* Sparse input representation for one-hot encoded and bag-of-features data.
+ *
+ * A dataset is stored as a CSR (compressed sparse row) matrix. One row is one sample,
+ * and a row can be viewed as a `sparse_vector_t`, which is simply an index list with
+ * optional values. If all stored values are 1.0f (which is the case for one-hot encoded
+ * data), the values array is NULL and only the indices are stored.
+ *
+ * Typical usage:
+
+        sparse_matrix_t *X = sparse_matrix_from_dense( n_samples, n_features, (float*) train_X->data );
+        sparse_vector_t  x = sparse_matrix_row( X, 42 );
+        neuralnet_predict_sparse( nn, &x, output );
+        ...
+        sparse_matrix_free( X );
+
+ * A dataset that is too large to be dense in memory can be built directly from its CSR arrays
+ * with `sparse_matrix_from_csr( n_samples, n_features, indptr, indices, values )`.
+ */
+
+#ifndef __SPARSE_MATRIX_H__
+#define __SPARSE_MATRIX_H__
+
+#include <stdbool.h>
+#include <stddef.h>  /* NULL */
+
+typedef struct _sparse_vector_t sparse_vector_t;
+typedef struct _sparse_matrix_t sparse_matrix_t;
+
+struct _sparse_vector_t
+{
+    int          n_nonzero;
+    const int   *index;     /* Indices of the nonzero elements, in increasing order and unique */
+    const float *value;     /* NULL means all nonzero values are 1.0f */
+};
+
+struct _sparse_matrix_t
+{
+    int           n_rows, n_cols;
+    unsigned int *row_ptr;  /* n_rows + 1 offsets into col_idx (and values) */
+    int          *col_idx;
+    float        *values;   /* NULL means all nonzero values are 1.0f */
+};
+
+sparse_matrix_t * sparse_matrix_create    ( const int n_rows, const int n_cols, const unsigned int nnz, const bool with_values );
+sparse_matrix_t * sparse_matrix_from_dense( const int n_rows, const int n_cols, const float *dense );
+sparse_matrix_t * sparse_matrix_from_csr  ( const int n_rows, const int n_cols, const unsigned int *indptr,
+                                            const int *indices, const float *values );
+void              sparse_matrix_free      ( sparse_matrix_t *m );
+void              sparse_vector_to_dense  ( const sparse_vector_t *v, const int n, float *dense );
+
+static inline unsigned int sparse_matrix_nnz( const sparse_matrix_t *m )
+{
+    return m->row_ptr[m->n_rows];
+}
+
+static inline sparse_vector_t sparse_matrix_row( const sparse_matrix_t *m, const int row )
+{
+    const unsigned int start = m->row_ptr[row];
+    return (sparse_vector_t) {
+        .n_nonzero = (int) (m->row_ptr[row+1] - start),
+        .index     = m->col_idx + start,
+        .value     = m->values ? m->values + start : NULL
+    };
+}
+#endif /* __SPARSE_MATRIX_H__ */
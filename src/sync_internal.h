@@ -0,0 +1,61 @@
+/* sync_internal.h - Øystein Schønning-Johansen 2023 */
+/*
+  vim: ts=4 sw=4 softtabstop=4 expandtab
+ */
+
+/* The small helpers that the thread pool, the batcher and the inference server share: Sleeping and
+ * waking on a futex, the pause in a spin loop, the size of a cache line and a monotonic clock.
+ *
+ * This is not a part of the API. Define _DEFAULT_SOURCE before the includes of the source file, as
+ * syscall() and clock_gettime() are not in -std=c99.
+ */
+
+#ifndef __SYNC_INTERNAL_H__
+#define __SYNC_INTERNAL_H__
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define cpu_relax() _mm_pause()
+#else
+#define cpu_relax() ((void) 0)
+#endif
+
+#define CACHE_LINE 64
+
+/* Sleeps while the word is `value`. It may also return for no reason, so check the word again. */
+static inline void futex_wait( int *word, const int value )
+{
+#ifdef __linux__
+    syscall( SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0 );
+#else
+    (void) word; (void) value;
+    sched_yield();
+#endif
+}
+
+/* Wakes all the threads that sleep on the word */
+static inline void futex_wake( int *word )
+{
+#ifdef __linux__
+    syscall( SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0 );
+#else
+    (void) word;
+#endif
+}
+
+static inline double now_seconds( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (double) ts.tv_sec + 1.0e-9 * (double) ts.tv_nsec;
+}
+#endif /* __SYNC_INTERNAL_H__ */
@@ -0,0 +1,408 @@
+/* threadpool.c - Øystein Schønning-Johansen 2023 */
+/*
+ vim: ts=4 sw=4 softtabstop=4 expandtab
+*/
+#define _DEFAULT_SOURCE   /* syscall() with -std=c99 */
+#include "threadpool.h"
+#include "simd.h"
+#include "numa_topology.h"
+#include "sync_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <omp.h>
+
+/* A word that the threads can wait on, with a count of the threads that sleep on it. The waker
+   only makes the system call when someone sleeps. Each word has its own cache line. */
+typedef struct {
+    int word;
+    int n_sleeping;
+} __attribute__ ((aligned(CACHE_LINE))) wait_word_t;
+
+/* The descriptor of a thread */
+typedef struct {
+    threadpool_t *pool;
+    int           thread;
+    pthread_t     handle;
+    float        *scratch;
+    unsigned int  scratch_size;
+    threadpool_group_t group;
+} __attribute__ ((aligned(CACHE_LINE))) worker_t;
+
+struct _threadpool_t
+{
+    int              n_threads;
+    int              spin_count;        /* No spinning when there are more threads than cores */
+    int              n_nodes;           /* The number of NUMA nodes with threads */
+    threadpool_pinning_t pinning;
+    worker_t        *worker;            /* worker[0] is the thread that calls threadpool_run() */
+    threadpool_func  func;
+    void            *arg;
+    bool             stop;
+    int              busy;
+    wait_word_t      job;               /* The job number, a new number starts the job */
+    wait_word_t      done;              /* The number of workers that are done with the job */
+    wait_word_t      barrier;           /* The barrier number */
+    int              barrier_count __attribute__ ((aligned(CACHE_LINE)));
+};
+
+static threadpool_t *default_pool = NULL;
+
+/* Waits until the word is not `value` any more. Spins first, and then sleeps. The count of
+   sleepers is incremented before the word is checked for the last time, and the waker changes the
+   word before it reads the count, so either the waker sees the sleeper or the sleeper sees the
+   new value. */
+static int wait_for_change( const threadpool_t *pool, wait_word_t *w, const int value )
+{
+    int current;
+    for( int spin = 0; spin < pool->spin_count; spin++ ){
+        if( (current = __atomic_load_n( &w->word, __ATOMIC_ACQUIRE )) != value )
+            return current;
+        cpu_relax();
+    }
+    while( (current = __atomic_load_n( &w->word, __ATOMIC_ACQUIRE )) == value ){
+        __atomic_add_fetch( &w->n_sleeping, 1, __ATOMIC_SEQ_CST );
+        if( __atomic_load_n( &w->word, __ATOMIC_SEQ_CST ) == value )
+            futex_wait( &w->word, value );
+        __atomic_sub_fetch( &w->n_sleeping, 1, __ATOMIC_SEQ_CST );
+    }
+    return current;
+}
+
+static void wake_all( wait_word_t *w )
+{
+    if( __atomic_load_n( &w->n_sleeping, __ATOMIC_SEQ_CST ))
+        futex_wake( &w->word );
+}
+
+static void *worker_main( void *arg )
+{
+    worker_t *self = (worker_t *) arg;
+    threadpool_t *pool = self->pool;
+    int job = 0;
+
+    for(;;){
+        job = wait_for_change( pool, &pool->job, job );
+        if( __atomic_load_n( &pool->stop, __ATOMIC_ACQUIRE ))
+            break;
+        pool->func( pool, pool->arg, self->thread, pool->n_threads );
+        __atomic_add_fetch( &pool->done.word, 1, __ATOMIC_SEQ_CST );
+        wake_all( &pool->done );
+    }
+    return NULL;
+}
+
+/**
+  @brief Create a thread pool.
+  @param n_threads The number of threads, including the thread that runs the jobs. If 0 or less,
+         the number of OpenMP threads is used.
+  @return The thread pool, or NULL on failure.
+
+  The `n_threads - 1` worker threads are started here, and live until `threadpool_free()`.
+*/
+threadpool_t *threadpool_new( const int n_threads )
+{
+    threadpool_t *pool;
+    if( posix_memalign( (void **) &pool, CACHE_LINE, sizeof(threadpool_t))){
+        fprintf( stderr, "Cannot allocate thread pool.\n");
+        return NULL;
+    }
+    *pool = (threadpool_t) { .n_threads = n_threads > 0 ? n_threads : omp_get_max_threads(), .n_nodes = 1 };
+    pool->spin_count = pool->n_threads <= sysconf( _SC_NPROCESSORS_ONLN ) ? THREADPOOL_SPIN_COUNT : 0;
+
+    if( posix_memalign( (void **) &pool->worker, CACHE_LINE, pool->n_threads * sizeof(worker_t))){
+        fprintf( stderr, "Cannot allocate thread pool workers.\n");
+        free( pool );
+        return NULL;
+    }
+    for( int t = 0; t < pool->n_threads; t++ )
+        pool->worker[t] = (worker_t) { .pool = pool, .thread = t,
+            .group = { .node = 0, .index = 0, .leader = 0, .rank = t, .size = pool->n_threads }};
+
+    for( int t = 1; t < pool->n_threads; t++ ){
+        if( pthread_create( &pool->worker[t].handle, NULL, worker_main, &pool->worker[t] )){
+            fprintf( stderr, "Cannot start thread %d of the thread pool.\n", t );
+            pool->n_threads = t;  /* Stop the ones that are started */
+            threadpool_free( pool );
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/**
+  @brief Run a job in all the threads of the pool.
+  @param pool The thread pool
+  @param func The job, which is called with the thread number 0, ..., n_threads-1
+  @param arg The argument to the job
+  @return 0 when the job is done, or -1 if the pool is NULL or busy with another job.
+
+  The calling thread runs the job as thread 0, and returns when all the threads are done. Only
+  one job can run at the time. If the pool is busy (like when the job itself, or another thread,
+  calls `threadpool_run()`), -1 is returned at once, and the caller must do the work some other way.
+*/
+int threadpool_run( threadpool_t *pool, threadpool_func func, void *arg )
+{
+    if( !pool || __atomic_exchange_n( &pool->busy, 1, __ATOMIC_ACQUIRE ))
+        return -1;
+
+    pool->func = func;
+    pool->arg = arg;
+    __atomic_store_n( &pool->done.word, 0, __ATOMIC_RELAXED );
+    __atomic_add_fetch( &pool->job.word, 1, __ATOMIC_SEQ_CST );
+    wake_all( &pool->job );
+
+    func( pool, arg, 0, pool->n_threads );
+
+    int done;
+    while( (done = __atomic_load_n( &pool->done.word, __ATOMIC_ACQUIRE )) != pool->n_threads - 1 )
+        wait_for_change( pool, &pool->done, done );
+
+    __atomic_store_n( &pool->busy, 0, __ATOMIC_RELEASE );
+    return 0;
+}
+
+/**
+  @brief Wait for all the threads of the pool.
+  @param pool The thread pool
+
+  Can only be called from the job, and all the threads of the pool must call it.
+*/
+void threadpool_barrier( threadpool_t *pool )
+{
+    if( pool->n_threads == 1 )
+        return;
+    const int barrier = __atomic_load_n( &pool->barrier.word, __ATOMIC_ACQUIRE );
+    if( __atomic_add_fetch( &pool->barrier_count, 1, __ATOMIC_ACQ_REL ) == pool->n_threads ){
+        /* The last one to arrive opens the barrier */
+        __atomic_store_n( &pool->barrier_count, 0, __ATOMIC_RELAXED );
+        __atomic_add_fetch( &pool->barrier.word, 1, __ATOMIC_SEQ_CST );
+        wake_all( &pool->barrier );
+    } else {
+        wait_for_change( pool, &pool->barrier, barrier );
+    }
+}
+
+/**
+  @brief The scratch memory of a thread.
+  @param pool The thread pool
+  @param thread The thread number
+  @param n_floats The number of floats that are needed
+  @return SIMD aligned memory for at least `n_floats`, or NULL on failure.
+
+  The memory is kept between the jobs, and only reallocated when more is needed. It is not
+  cleared. Only the thread itself should ask for its scratch memory.
+*/
+float *threadpool_scratch( threadpool_t *pool, const int thread, const unsigned int n_floats )
+{
+    worker_t *w = &pool->worker[thread];
+    if( w->scratch_size < n_floats ){
+        simd_free_huge( w->scratch );
+        w->scratch = simd_malloc_huge( n_floats * sizeof(float));
+        w->scratch_size = w->scratch ? n_floats : 0;
+        if( !w->scratch )
+            fprintf( stderr, "Cannot allocate scratch memory for thread %d.\n", thread );
+    }
+    return w->scratch;
+}
+
+int threadpool_n_threads( const threadpool_t *pool )
+{
+    return pool ? pool->n_threads : 1;
+}
+
+/**
+  @brief Stop the threads and free the pool.
+  @param pool The thread pool
+
+  If the pool is the default pool, the default is set to NULL.
+*/
+void threadpool_free( threadpool_t *pool )
+{
+    if( !pool )
+        return;
+    threadpool_t *expected = pool;
+    __atomic_compare_exchange_n( &default_pool, &expected, NULL, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE );
+
+    __atomic_store_n( &pool->stop, true, __ATOMIC_RELEASE );
+    __atomic_add_fetch( &pool->job.word, 1, __ATOMIC_SEQ_CST );
+    futex_wake( &pool->job.word );
+    for( int t = 1; t < pool->n_threads; t++ )
+        pthread_join( pool->worker[t].handle, NULL );
+    for( int t = 0; t < pool->n_threads; t++ )
+        simd_free_huge( pool->worker[t].scratch );
+    free( pool->worker );
+    free( pool );
+}
+
+/* Each thread pins itself */
+static void pin_job( threadpool_t *pool, void *arg, const int thread, const int n_threads )
+{
+    int *n_failed = (int *) arg;
+    int *node = &pool->worker[thread].group.node;
+    int status;
+
+    if( pool->pinning == THREADPOOL_PIN_COMPACT ){
+        /* The k-th core, with the cores in the order of the nodes */
+        int cpu = 0, k = thread % numa_topology_n_cpus();
+        for( int n = 0; n < numa_topology_n_nodes(); n++ ){
+            const int count = numa_topology_node_cpus( n, NULL, 0 );
+            if( k < count ){
+                int cpus[count];
+                numa_topology_node_cpus( n, cpus, count );
+                cpu = cpus[k];
+                break;
+            }
+            k -= count;
+        }
+        *node = numa_topology_node_of_cpu( cpu );
+        status = numa_topology_bind_cpu( cpu );
+    } else if( pool->pinning == THREADPOOL_PIN_SCATTER ){
+        *node = thread % numa_topology_n_nodes();
+        /* A (fake) node without cores is only a group */
+        status = numa_topology_node_cpus( *node, NULL, 0 ) ? numa_topology_bind_thread( *node ) : 0;
+    } else {
+        *node = 0;
+        status = numa_topology_bind_thread( -1 );
+    }
+    if( status < 0 )
+        __atomic_add_fetch( n_failed, 1, __ATOMIC_RELAXED );
+    (void) n_threads;
+}
+
+/**
+  @brief Pin the threads of the pool to cores or NUMA nodes.
+  @param pool The thread pool
+  @param pinning The policy, see `threadpool_pinning_t`
+  @return 0 on success, -1 if the pool is busy or a thread could not be pinned.
+
+  The thread that calls this function is thread 0, and is pinned as well. So the jobs should be
+  run from this thread. The threads are grouped by their node, see `threadpool_group()`.
+*/
+int threadpool_pin( threadpool_t *pool, const threadpool_pinning_t pinning )
+{
+    int n_failed = 0;
+    if( !pool )
+        return -1;
+    pool->pinning = pinning;
+    if( threadpool_run( pool, pin_job, &n_failed ) < 0 )
+        return -1;
+
+    /* The groups, with the nodes numbered in the order of their first thread */
+    pool->n_nodes = 0;
+    for( int t = 0; t < pool->n_threads; t++ ){
+        threadpool_group_t *group = &pool->worker[t].group;
+        group->leader = -1;
+        for( int s = 0; s < t && group->leader < 0; s++ ){
+            if( pool->worker[s].group.node == group->node ){
+                group->index  = pool->worker[s].group.index;
+                group->leader = pool->worker[s].group.leader;
+            }
+        }
+        if( group->leader < 0 ){
+            group->index  = pool->n_nodes++;
+            group->leader = t;
+        }
+        group->rank = 0;
+        group->size = 0;
+        for( int s = 0; s < pool->n_threads; s++ ){
+            if( pool->worker[s].group.node != group->node )
+                continue;
+            group->rank += s < t;
+            group->size++;
+        }
+    }
+    if( n_failed )
+        fprintf( stderr, "Warning: Could not pin %d of the %d threads.\n", n_failed, pool->n_threads );
+    return n_failed ? -1 : 0;
+}
+
+/**
+  @brief The number of NUMA nodes the threads of the pool are on.
+*/
+int threadpool_n_nodes( const threadpool_t *pool )
+{
+    return pool ? pool->n_nodes : 1;
+}
+
+/**
+  @brief The NUMA node of a thread, and the other threads on that node.
+*/
+const threadpool_group_t *threadpool_group( const threadpool_t *pool, const int thread )
+{
+    return &pool->worker[thread].group;
+}
+
+typedef struct {
+    unsigned int  n_blocks;
+    size_t        block_size;   /* In floats */
+    size_t        size;         /* In floats */
+    const float  *data;
+    float        *copy;
+} place_job_t;
+
+static void place_job( threadpool_t *pool, void *arg, const int thread, const int n_threads )
+{
+    const place_job_t *job = (const place_job_t *) arg;
+    const threadpool_group_t *group = threadpool_group( pool, thread );
+    const unsigned int n_nodes = pool->n_nodes;
+    /* The blocks of the node, split over the threads on the node */
+    for( unsigned int b = group->index + n_nodes * group->rank; b < job->n_blocks; b += n_nodes * group->size ){
+        const size_t offset = b * job->block_size;
+        const size_t n = offset + job->block_size < job->size ? job->block_size : job->size - offset;
+        memcpy( job->copy + offset, job->data + offset, n * sizeof(float));
+    }
+    (void) n_threads;
+}
+
+/**
+  @brief Copy a dataset such that the blocks of rows are spread over the NUMA nodes.
+  @param pool The thread pool, pinned with `threadpool_pin()`
+  @param n_rows The number of rows (samples)
+  @param n_cols The number of columns (features)
+  @param data The dataset
+  @param rows_per_block The number of rows in a block, like the batch size
+  @return The copy, to be freed with `simd_free_huge()`, or NULL on failure.
+
+  Block b is written first by the threads on node b % n_nodes, so its memory is placed on that
+  node. (The memory is placed in pages, so the blocks should be larger than a page.) The reads of
+  the batches are then spread evenly over the nodes.
+*/
+float *threadpool_place_interleaved( threadpool_t *pool, const unsigned int n_rows, const unsigned int n_cols,
+        const float *data, const unsigned int rows_per_block )
+{
+    const size_t size = (size_t) n_rows * n_cols;
+    const size_t block_size = (size_t) (rows_per_block ? rows_per_block : 1) * n_cols;
+    place_job_t job = { .n_blocks = (unsigned int) ((size + block_size - 1) / block_size), .block_size = block_size,
+        .size = size, .data = data, .copy = simd_malloc_huge( size * sizeof(float)) };
+    if( !job.copy ){
+        fprintf( stderr, "Cannot allocate memory for the copy of the dataset.\n");
+        return NULL;
+    }
+    if( threadpool_run( pool, place_job, &job ) < 0 )
+        memcpy( job.copy, data, size * sizeof(float));
+    return job.copy;
+}
+
+/**
+  @brief The default thread pool, used by the optimizers.
+  @return The default pool, or NULL if there is none.
+*/
+threadpool_t *threadpool_default( void )
+{
+    return __atomic_load_n( &default_pool, __ATOMIC_ACQUIRE );
+}
+
+/**
+  @brief Set the default thread pool.
+  @param pool The new default pool, or NULL to use OpenMP
+  @return The previous default pool, such that it can be freed.
+*/
+threadpool_t *threadpool_set_default( threadpool_t *pool )
+{
+    return __atomic_exchange_n( &default_pool, pool, __ATOMIC_ACQ_REL );
+}
@@ -0,0 +1,81 @@
+/* threadpool.h - Øystein Schønning-Johansen 2023 */
+/*
+  vim: ts=4 sw=4 softtabstop=4 expandtab
+ */
+
+/* A persistent pool of worker threads, for the parallel parts that run once per batch.
+ *
+ * An OpenMP parallel region (with a reduction) per mini-batch has a fixed cost of waking the
+ * threads, setting up the private copies and joining again. With small batches and small networks
+ * this is comparable to the work itself. The pool keeps its threads alive between the batches.
+ * They spin for a short while when they are out of work, and then sleep on a futex, so a new job
+ * usually starts without a system call. Each thread has its own cache line aligned descriptor and
+ * scratch memory, which is kept from one job to the next.
+ *
+ * The pool is used by `optimizer_calc_batch_gradient()` and the adam update when it is set as the
+ * default pool:
+ *
+ *     threadpool_set_default( threadpool_new( 8 ));
+ *     ...
+ *     threadpool_free( threadpool_set_default( NULL ));
+ *
+ * Without a default pool (or when the pool is busy with another job, like in a background
+ * validation), OpenMP is used as before.
+ *
+ * On NUMA machines the threads can be pinned with `threadpool_pin()`. The threads are then in
+ * groups by their node, and the batch gradient is summed within each node before the nodes are
+ * combined. See also numa_topology.h.
+ */
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+/* Number of times a waiting thread checks for work before it goes to sleep. There is no spinning
+   when the pool has more threads than there are cores. */
+#ifndef THREADPOOL_SPIN_COUNT
+#define THREADPOOL_SPIN_COUNT 20000
+#endif
+
+typedef struct _threadpool_t threadpool_t;
+
+typedef enum {
+    THREADPOOL_PIN_NONE,     /* The threads can run on any core */
+    THREADPOOL_PIN_COMPACT,  /* Thread t on core t, with the cores in the order of the nodes */
+    THREADPOOL_PIN_SCATTER   /* Thread t on node t % n_nodes, on any core of that node */
+} threadpool_pinning_t;
+
+/* The NUMA node of a thread, and the other threads on that node */
+typedef struct {
+    int node;    /* The NUMA node */
+    int index;   /* The node number in the pool, 0, ..., threadpool_n_nodes()-1 */
+    int leader;  /* The first thread on this node */
+    int rank;    /* The number of the thread on this node, 0, ..., size-1 */
+    int size;    /* The number of threads on this node */
+} threadpool_group_t;
+
+/* A job is called in all the threads of the pool, `thread` is 0, ..., n_threads-1 */
+typedef void (*threadpool_func)( threadpool_t *pool, void *arg, const int thread, const int n_threads );
+
+threadpool_t * threadpool_new        ( const int n_threads );
+int            threadpool_run        ( threadpool_t *pool, threadpool_func func, void *arg );
+void           threadpool_barrier    ( threadpool_t *pool );
+float *        threadpool_scratch    ( threadpool_t *pool, const int thread, const unsigned int n_floats );
+int            threadpool_n_threads  ( const threadpool_t *pool );
+void           threadpool_free       ( threadpool_t *pool );
+
+int            threadpool_pin        ( threadpool_t *pool, const threadpool_pinning_t pinning );
+int            threadpool_n_nodes    ( const threadpool_t *pool );
+const threadpool_group_t * threadpool_group( const threadpool_t *pool, const int thread );
+float *        threadpool_place_interleaved( threadpool_t *pool, const unsigned int n_rows, const unsigned int n_cols,
+                                     const float *data, const unsigned int rows_per_block );
+
+threadpool_t * threadpool_default    ( void );
+threadpool_t * threadpool_set_default( threadpool_t *pool );
+
+/* The part [start, end) of `n` items for a thread, such that all the threads get about the same */
+static inline void threadpool_split( const unsigned int n, const int thread, const int n_threads,
+        unsigned int *start, unsigned int *end )
+{
+    *start = (unsigned int) (((unsigned long long) n * thread) / n_threads);
+    *end   = (unsigned int) (((unsigned long long) n * (thread + 1)) / n_threads);
+}
+#endif /* __THREADPOOL_H__ */
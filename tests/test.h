@@ -2,7 +2,9 @@
 /* A simple include file to do some testing */
 
 #include <stddef.h>
+#include <string.h>
 #include <math.h>
+#include "neuralnet.h"
 
 #ifndef __TEST_H__
 #define __TEST_H__
@@ -98,6 +100,15 @@ static inline float test_calculate_min( size_t n, float *values )
     return minval;
 }
 
+static inline float test_max_abs_diff( int n, const float *a, const float *b )
+{
+    float maxdiff = 0.0f;
+    for( int i = 0; i < n; i++ )
+        if( fabsf( a[i] - b[i] ) > maxdiff ) maxdiff = fabsf( a[i] - b[i] );
+    return maxdiff;
+}
+
+/* Copies the weights and biases of src to dst, which must have the same structure */
 #define print_test_summary(n_tests,fail_tests) \
     fprintf(stderr, "------------------------------------\n"); \
     fprintf(stderr, " Summary of '%s'.\n", __FILE__); \
@@ -0,0 +1,138 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "optimizer.h"
+#include "optimizer_implementations.h"
+#include "async_validation.h"
+#include "evaluate.h"
+#include "loss.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* The validation in the background should give the same results as evaluating the
+   weights right after each epoch, and the callbacks should get them in epoch order. */
+
+#define N_EPOCHS 5
+
+/* A callback that records what it gets */
+CALLBACK_DECLARE(recorder);
+struct _recorder_t
+{
+    callback_t cb;
+    int   n_calls;
+    int   epochs[N_EPOCHS];
+    float val_loss[N_EPOCHS];
+    float train_loss[N_EPOCHS];
+    const neuralnet_t *nn[N_EPOCHS];
+};
+
+CALLBACK_DEFINE(recorder,
+        newcb->n_calls = 0;
+);
+
+static void recorder_callback_run( callback_t *cb, optimizer_t *opt, const float *result, bool has_valid )
+{
+    recorder_t *rec = (recorder_t*) cb;
+    if( rec->n_calls >= N_EPOCHS || !has_valid )
+        return;
+    rec->epochs[rec->n_calls]     = opt->epoch;
+    rec->train_loss[rec->n_calls] = result[0];
+    rec->val_loss[rec->n_calls]   = result[optimizer_get_n_metrics( opt )];
+    rec->nn[rec->n_calls]         = opt->nn;
+    rec->n_calls++;
+}
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    const int n_train  = 400;
+    const int n_valid  = 300;
+    const int n_input  = 12;
+    const int n_output = 3;
+
+    srand( 42 );
+    float *X = malloc( (n_train + n_valid) * n_input * sizeof(float));
+    float *Y = calloc( (n_train + n_valid) * n_output, sizeof(float));
+    assert( X && Y );
+    for( int i = 0; i < n_train + n_valid; i++ ){
+        int argmax = 0;
+        for( int j = 0; j < n_input; j++ ){
+            X[i*n_input + j] = (float) rand() / (float) RAND_MAX;
+            if( X[i*n_input + j] > X[i*n_input + argmax] ) argmax = j;
+        }
+        Y[i*n_output + argmax % n_output] = 1.0f;
+    }
+    const float *valid_X = X + n_train * n_input;
+    const float *valid_Y = Y + n_train * n_output;
+
+    neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( n_input, 16, n_output ), STR_ARRAY( "relu", "softmax" ));
+    assert( nn );
+    neuralnet_initialize( nn, NULL );
+    neuralnet_set_loss( nn, "categorical_crossentropy" );
+
+    optimizer_t *sgd = OPTIMIZER( SGD_new( nn,
+                OPTIMIZER_PROPERTIES( .batchsize = 8, .shuffle = false, .progress = NULL,
+                    .metrics = METRIC_LIST( get_metric_func( "categorical_crossentropy" ),
+                                            get_metric_func( "categorical_accuracy" ))),
+                SGD_PROPERTIES( .learning_rate = 0.05f )));
+    assert( sgd );
+    const int n_metrics = optimizer_get_n_metrics( sgd );
+
+    recorder_t *rec = recorder_new( NULL );
+    assert( rec );
+    async_validation_t *av = async_validation_new( sgd, n_valid, valid_X, valid_Y,
+            ASYNC_VALIDATION_PROPERTIES( .callbacks = ((callback_t*[]){ CALLBACK( rec ), NULL })));
+    CHECK_NOT_NULL_MSG( av, "Checking that async validation was created" );
+    assert( av );
+    async_validation_t *bad = async_validation_new( sgd, 0, valid_X, valid_Y, ASYNC_VALIDATION_PROPERTIES());
+    CHECK_CONDITION_MSG( bad == NULL, "Checking that an empty validation set is refused" );
+
+    float results[2 * n_metrics];
+    const int none = async_validation_wait( av, results );
+    CHECK_INT_EQUALS_MSG( none, -1, "Checking that nothing is validated before the first epoch" );
+
+    float expected_val[N_EPOCHS], expected_train[N_EPOCHS];
+    for( int epoch = 0; epoch < N_EPOCHS; epoch++ ){
+        optimizer_run_epoch( sgd, n_train, X, Y, 0, NULL, NULL, results );
+        expected_train[epoch] = results[0];
+        float val_results[n_metrics];
+        evaluate( nn, n_valid, valid_X, valid_Y, sgd->metrics, val_results );
+        expected_val[epoch] = val_results[0];
+        const int started = async_validation_start( av, results );
+        CHECK_INT_EQUALS_MSG( started, epoch, "Checking the epoch number of the validation" );
+    }
+    const int last = async_validation_wait( av, results );
+    CHECK_INT_EQUALS_MSG( last, N_EPOCHS - 1, "Checking the last validated epoch" );
+    CHECK_FLOAT_EQUALS_MSG( results[n_metrics], expected_val[N_EPOCHS-1], 1.0e-6f, "Checking the last validation result" );
+
+    CHECK_INT_EQUALS_MSG( rec->n_calls, N_EPOCHS, "Checking that the callback is called for each epoch" );
+    int in_order = 1;
+    float max_val_diff = 0.0f, max_train_diff = 0.0f;
+    for( int epoch = 0; epoch < rec->n_calls; epoch++ ){
+        in_order &= rec->epochs[epoch] == epoch;
+        in_order &= rec->nn[epoch] != nn;
+        if( fabsf( rec->val_loss[epoch] - expected_val[epoch] ) > max_val_diff )
+            max_val_diff = fabsf( rec->val_loss[epoch] - expected_val[epoch] );
+        if( fabsf( rec->train_loss[epoch] - expected_train[epoch] ) > max_train_diff )
+            max_train_diff = fabsf( rec->train_loss[epoch] - expected_train[epoch] );
+    }
+    CHECK_CONDITION_MSG( in_order, "Checking that the callbacks get the epochs in order with the shadow network" );
+    CHECK_FLOAT_EQUALS_MSG( max_val_diff, 0.0f, 1.0e-6f, "Checking that the validation is of the right weights" );
+    CHECK_FLOAT_EQUALS_MSG( max_train_diff, 0.0f, 0.0f, "Checking that the train results are passed on" );
+
+    async_validation_free( av );
+    callback_free( CALLBACK( rec ));
+    optimizer_free( sgd );
+    neuralnet_free( nn );
+    free( X );
+    free( Y );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
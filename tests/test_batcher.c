@@ -0,0 +1,113 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "neuralnet_batcher.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+
+/* The predictions through the batcher should be the same as neuralnet_predict(), both when the
+   samples are submitted from one thread and from several threads at the same time. */
+
+#define N_THREADS  4
+#define N_SAMPLES  500
+#define N_ASYNC    10
+#define N_INPUT    29
+#define N_OUTPUT   7
+
+typedef struct {
+    neuralnet_batcher_t *batcher;
+    const neuralnet_t *nn;
+    const float *inputs;
+    float maxdiff;
+} predict_job_t;
+
+static void *predict_thread( void *arg )
+{
+    predict_job_t *job = (predict_job_t *) arg;
+    float output[N_OUTPUT], expected[N_OUTPUT];
+    for( int i = 0; i < N_SAMPLES; i++ ){
+        neuralnet_batcher_predict( job->batcher, job->inputs + i * N_INPUT, output );
+        neuralnet_predict( job->nn, job->inputs + i * N_INPUT, expected );
+        for( int k = 0; k < N_OUTPUT; k++ )
+            if( fabsf( output[k] - expected[k] ) > job->maxdiff )
+                job->maxdiff = fabsf( output[k] - expected[k] );
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    srand( 42 );
+    neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( N_INPUT, 64, N_OUTPUT ), STR_ARRAY( "relu", "softmax" ));
+    assert( nn );
+    neuralnet_initialize( nn, NULL );
+
+    float *inputs = malloc( N_THREADS * N_SAMPLES * N_INPUT * sizeof(float));
+    assert( inputs );
+    for( int i = 0; i < N_THREADS * N_SAMPLES * N_INPUT; i++ )
+        inputs[i] = (float) rand() / (float) RAND_MAX - 0.5f;
+
+    neuralnet_batcher_t *batcher = neuralnet_batcher_new( nn, NEURALNET_BATCHER_PROPERTIES( .max_batch = 8, .window_us = 200 ));
+    CHECK_NOT_NULL_MSG( batcher, "Checking that the batcher is created" );
+    assert( batcher );
+
+    fprintf(stderr, KBLU "Testing the futures." KNRM "\n" );
+    neuralnet_future_t future[N_ASYNC];
+    float outputs[N_ASYNC * N_OUTPUT];
+    for( int i = 0; i < N_ASYNC; i++ )
+        neuralnet_batcher_submit( batcher, inputs + i * N_INPUT, outputs + i * N_OUTPUT, future + i );
+    int n_done = 0;
+    float maxdiff = 0.0f;
+    for( int i = 0; i < N_ASYNC; i++ ){
+        float expected[N_OUTPUT];
+        neuralnet_future_wait( future + i );
+        n_done += neuralnet_future_done( future + i );
+        neuralnet_predict( nn, inputs + i * N_INPUT, expected );
+        for( int k = 0; k < N_OUTPUT; k++ )
+            if( fabsf( outputs[i * N_OUTPUT + k] - expected[k] ) > maxdiff )
+                maxdiff = fabsf( outputs[i * N_OUTPUT + k] - expected[k] );
+    }
+    CHECK_INT_EQUALS_MSG( n_done, N_ASYNC, "Checking that the futures are done" );
+    CHECK_FLOAT_EQUALS_MSG( maxdiff, 0.0f, 1.0e-5f, "Checking the predictions of the futures" );
+
+    fprintf(stderr, KBLU "Testing predictions from several threads." KNRM "\n" );
+    predict_job_t job[N_THREADS];
+    pthread_t thread[N_THREADS];
+    for( int t = 0; t < N_THREADS; t++ ){
+        job[t] = (predict_job_t) { .batcher = batcher, .nn = nn, .inputs = inputs + t * N_SAMPLES * N_INPUT, .maxdiff = 0.0f };
+        const int started = pthread_create( &thread[t], NULL, predict_thread, &job[t] );
+        assert( started == 0 );
+    }
+    maxdiff = 0.0f;
+    for( int t = 0; t < N_THREADS; t++ ){
+        pthread_join( thread[t], NULL );
+        if( job[t].maxdiff > maxdiff ) maxdiff = job[t].maxdiff;
+    }
+    CHECK_FLOAT_EQUALS_MSG( maxdiff, 0.0f, 1.0e-5f, "Checking the predictions from several threads" );
+
+    neuralnet_batcher_stats_t stats;
+    neuralnet_batcher_stats( batcher, &stats );
+    CHECK_INT_EQUALS_MSG( (int) stats.n_requests, N_ASYNC + N_THREADS * N_SAMPLES, "Checking the number of predictions" );
+    CHECK_CONDITION_MSG( stats.n_batches < stats.n_requests, "Checking that the predictions are batched" );
+    CHECK_CONDITION_MSG( stats.n_requests <= 8 * stats.n_batches, "Checking the size of the batches" );
+
+    /* The submitted samples are done before the batcher stops */
+    neuralnet_future_t last;
+    neuralnet_batcher_submit( batcher, inputs, outputs, &last );
+    neuralnet_batcher_free( batcher );
+    CHECK_INT_EQUALS_MSG( neuralnet_future_done( &last ), 1, "Checking the prediction submitted before the free" );
+
+    free( inputs );
+    neuralnet_free( nn );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
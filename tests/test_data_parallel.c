@@ -0,0 +1,214 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "optimizer.h"
+#include "optimizer_implementations.h"
+#include "allreduce.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* Several trainer processes on this machine, connected with the ring all-reduce. The test forks
+   the other ranks. Each rank checks its own results and returns the number of failures as the exit
+   status, such that rank 0 can report them.
+
+   Training on N shards with batch size b should be the same as training in one process with batch
+   size N*b, when batch k of the single process is batch k of all the shards. */
+
+#define N_RANKS     3
+#define N_SAMPLES   120   /* In each shard */
+#define N_INPUT     10
+#define N_OUTPUT    2
+#define BATCHSIZE   4
+
+/* The tests of one rank. Returns the number of failures, and the number of tests in `n_tests`. */
+static int run_rank( const int rank, const char *address, const float *X, const float *Y, int *n_tests )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    allreduce_t *ar = allreduce_new( rank, N_RANKS, address );
+    CHECK_NOT_NULL_MSG( ar, "Checking that the ring is connected" );
+    if( !ar ){
+        *n_tests = test_count;
+        return fail_count;
+    }
+
+    /* The sum of odd sizes, and more than the socket buffers */
+    const unsigned int sizes[] = { 1, 2, 7, 1000, 300001 };
+    for( int k = 0; k < 5; k++ ){
+        const unsigned int n = sizes[k];
+        float *data = malloc( n * sizeof(float));
+        assert( data );
+        for( unsigned int i = 0; i < n; i++ )
+            data[i] = (float) (rank + 1) * (float) (i % 100);
+        const int ok = allreduce_sum( ar, n, data );
+        float maxdiff = 0.0f;
+        for( unsigned int i = 0; i < n; i++ )
+            if( fabsf( data[i] - 6.0f * (float) (i % 100)) > maxdiff ) maxdiff = fabsf( data[i] - 6.0f * (float) (i % 100));
+        CHECK_CONDITION_MSG( ok == 0 && maxdiff == 0.0f, "Checking the sum over the ranks" );
+        free( data );
+    }
+
+    /* Integers that are not exact as floats */
+    unsigned int counts[N_RANKS];
+    memset( counts, 0, sizeof( counts ));
+    counts[rank] = (1u << 24) + 1 + rank;
+    int counts_ok = allreduce_sum_uint( ar, N_RANKS, counts ) == 0;
+    for( int r = 0; r < N_RANKS; r++ )
+        counts_ok &= counts[r] == (1u << 24) + 1 + r;
+    CHECK_CONDITION_MSG( counts_ok, "Checking the integer sum over the ranks" );
+
+    /* Different initial weights in all the ranks. Rank 0 wins. */
+    neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( N_INPUT, 8, N_OUTPUT ), STR_ARRAY( "tanh", "softmax" ));
+    assert( nn );
+    srand( 1 + rank );
+    neuralnet_initialize( nn, NULL );
+    neuralnet_set_loss( nn, "categorical_crossentropy" );
+    const int n_params = neuralnet_total_n_parameters( nn );
+
+    /* The reference in a single process, with the same weights as rank 0 */
+    neuralnet_t *single = neuralnet_create( 2, INT_ARRAY( N_INPUT, 8, N_OUTPUT ), STR_ARRAY( "tanh", "softmax" ));
+    assert( single );
+    srand( 1 );
+    neuralnet_initialize( single, NULL );
+    neuralnet_set_loss( single, "categorical_crossentropy" );
+
+    optimizer_t *opt = OPTIMIZER( SGD_new( nn,
+                OPTIMIZER_PROPERTIES( .batchsize = BATCHSIZE, .shuffle = false, .progress = NULL, .hogwild = true,
+                    .metrics = METRIC_LIST( get_metric_func( "categorical_crossentropy" ))),
+                SGD_PROPERTIES( .learning_rate = 0.1f, .momentum = 0.9f )));
+    optimizer_t *single_opt = OPTIMIZER( SGD_new( single,
+                OPTIMIZER_PROPERTIES( .batchsize = N_RANKS * BATCHSIZE, .shuffle = false, .progress = NULL,
+                    .metrics = METRIC_LIST( get_metric_func( "categorical_crossentropy" ))),
+                SGD_PROPERTIES( .learning_rate = 0.1f, .momentum = 0.9f )));
+    assert( opt && single_opt );
+    const int set = optimizer_set_allreduce( opt, ar );
+    CHECK_INT_EQUALS_MSG( set, 0, "Checking that the optimizer is data parallel" );
+    CHECK_CONDITION_MSG( !opt->hogwild, "Checking that the Hogwild mode is turned off" );
+
+    float *params = malloc( n_params * sizeof(float));
+    float *expected = malloc( n_params * sizeof(float));
+    assert( params && expected );
+    neuralnet_get_parameters( nn, params );
+    neuralnet_get_parameters( single, expected );
+    CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( n_params, params, expected ), 0.0f, 0.0f, "Checking that the weights of rank 0 are copied" );
+
+    /* The single process data: batch k is batch k of shard 0, 1, 2 */
+    float *single_X = malloc( N_RANKS * N_SAMPLES * N_INPUT * sizeof(float));
+    float *single_Y = malloc( N_RANKS * N_SAMPLES * N_OUTPUT * sizeof(float));
+    assert( single_X && single_Y );
+    for( int k = 0; k < N_SAMPLES / BATCHSIZE; k++ ){
+        for( int r = 0; r < N_RANKS; r++ ){
+            const int from = r * N_SAMPLES + k * BATCHSIZE;
+            const int to   = (k * N_RANKS + r) * BATCHSIZE;
+            memcpy( single_X + to * N_INPUT, X + from * N_INPUT, BATCHSIZE * N_INPUT * sizeof(float));
+            memcpy( single_Y + to * N_OUTPUT, Y + from * N_OUTPUT, BATCHSIZE * N_OUTPUT * sizeof(float));
+        }
+    }
+
+    /* The last rank has a few more samples, which it should skip */
+    const int n_shard = rank == N_RANKS - 1 ? N_SAMPLES + 3 : N_SAMPLES;
+    float results[1], single_results[1];
+    for( int epoch = 0; epoch < 3; epoch++ ){
+        optimizer_run_epoch( opt, n_shard, X + rank * N_SAMPLES * N_INPUT, Y + rank * N_SAMPLES * N_OUTPUT,
+                0, NULL, NULL, results );
+        optimizer_run_epoch( single_opt, N_RANKS * N_SAMPLES, single_X, single_Y, 0, NULL, NULL, single_results );
+    }
+    neuralnet_get_parameters( nn, params );
+    neuralnet_get_parameters( single, expected );
+    CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( n_params, params, expected ), 0.0f, 1.0e-5f,
+            "Checking that the ranks train like one process with the full batch" );
+
+    /* All the replicas should be equal to the bit. Compare with rank 0. */
+    memcpy( expected, params, n_params * sizeof(float));
+    allreduce_broadcast( ar, n_params, expected, 0 );
+    CHECK_CONDITION_MSG( !memcmp( params, expected, n_params * sizeof(float)), "Checking that the replicas are equal" );
+
+    /* The last rank leaves. The others should stop the epoch and report it, not abort. */
+    if( rank == N_RANKS - 1 ){
+        allreduce_free( ar );
+        ar = NULL;
+    } else {
+        optimizer_run_epoch( opt, n_shard, X + rank * N_SAMPLES * N_INPUT, Y + rank * N_SAMPLES * N_OUTPUT,
+                0, NULL, NULL, results );
+        CHECK_CONDITION_MSG( opt->failed && results[0] == -1.0f, "Checking that a lost rank fails the epoch" );
+    }
+
+    free( single_X );
+    free( single_Y );
+    free( params );
+    free( expected );
+    optimizer_free( opt );
+    optimizer_free( single_opt );
+    neuralnet_free( nn );
+    neuralnet_free( single );
+    allreduce_free( ar );
+    *n_tests = test_count;
+    return fail_count;
+}
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    float *X = malloc( (N_RANKS * N_SAMPLES + 3) * N_INPUT * sizeof(float));
+    float *Y = calloc( (N_RANKS * N_SAMPLES + 3) * N_OUTPUT, sizeof(float));
+    assert( X && Y );
+    srand( 42 );
+    for( int i = 0; i < N_RANKS * N_SAMPLES + 3; i++ ){
+        float sum = 0.0f;
+        for( int j = 0; j < N_INPUT; j++ ){
+            X[i*N_INPUT + j] = 2.0f * (float) rand() / (float) RAND_MAX - 1.0f;
+            sum += X[i*N_INPUT + j];
+        }
+        Y[i*N_OUTPUT + (sum > 0.0f)] = 1.0f;
+    }
+
+    char address[2][128];
+    sprintf( address[0], "unix:/tmp/test_data_parallel_%d", (int) getpid());
+    sprintf( address[1], "127.0.0.1:%d", 20000 + (int) getpid() % 20000 );
+    const char *kind[2] = { "Unix domain sockets", "TCP" };
+
+    for( int a = 0; a < 2; a++ ){
+        fprintf(stderr, KBLU "Testing %d ranks over %s." KNRM "\n", N_RANKS, kind[a] );
+        fflush( stderr );
+        pid_t pids[N_RANKS];
+        for( int rank = 1; rank < N_RANKS; rank++ ){
+            pids[rank] = fork();
+            assert( pids[rank] >= 0 );
+            if( pids[rank] == 0 ){
+                /* Only rank 0 prints */
+                if( !freopen( "/dev/null", "w", stderr )) return 1;
+                int n_tests;
+                const int n_failed = run_rank( rank, address[a], X, Y, &n_tests );
+                free( X );
+                free( Y );
+                exit( n_failed );
+            }
+        }
+        int n_tests;
+        fail_count += run_rank( 0, address[a], X, Y, &n_tests );
+        test_count += n_tests;
+
+        for( int rank = 1; rank < N_RANKS; rank++ ){
+            int status;
+            waitpid( pids[rank], &status, 0 );
+            char msg[128];
+            sprintf( msg, "Checking rank %d", rank );
+            CHECK_CONDITION_MSG( WIFEXITED( status ) && WEXITSTATUS( status ) == 0, msg );
+        }
+    }
+
+    free( X );
+    free( Y );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
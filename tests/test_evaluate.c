@@ -0,0 +1,113 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "neuralnet_predict_batch.h"
+#include "evaluate.h"
+#include "loss.h"
+#include "simd.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* evaluate() predicts the samples in chunks with a batched forward pass. This compares it with
+   predicting one sample at a time. */
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    const int n_samples = 5000;  /* Several chunks, and the last one is not full */
+    const int n_input   = 23;
+    const int n_output  = 7;
+
+    srand( 42 );
+    float *X = malloc( n_samples * n_input * sizeof(float));
+    float *Y = calloc( n_samples * n_output, sizeof(float));
+    float *labels = malloc( n_samples * sizeof(float));
+    assert( X && Y && labels );
+    for( int i = 0; i < n_samples * n_input; i++ )
+        X[i] = (rand() % 3 == 0) ? 0.0f : 2.0f * (float) rand() / (float) RAND_MAX - 1.0f;
+    for( int i = 0; i < n_samples; i++ ){
+        labels[i] = (float) (rand() % n_output);
+        Y[i*n_output + (int) labels[i]] = 1.0f;
+    }
+
+    const char *outputs[] = { "sigmoid", "softmax", "softmax" };
+    const char *losses[]  = { "binary_crossentropy", "categorical_crossentropy", "sparse_categorical_crossentropy" };
+    const char *accuracy[] = { "binary_accuracy", "categorical_accuracy", "sparse_categorical_accuracy" };
+
+    for( int l = 0; l < 3; l++ ){
+        fprintf(stderr, KBLU "Testing with '%s' output and '%s' loss." KNRM "\n", outputs[l], losses[l] );
+        neuralnet_t *nn = neuralnet_create( 3,
+                INT_ARRAY( n_input, 33, 18, n_output ),
+                STR_ARRAY( "relu", "tanh", (char*) outputs[l] ));
+        assert( nn );
+        neuralnet_initialize( nn, NULL );
+        neuralnet_set_loss( nn, losses[l] );
+        const float *targets = neuralnet_target_size( nn ) == 1 ? labels : Y;
+        const int n_target = neuralnet_target_size( nn );
+
+        /* The batched forward pass */
+        float *batch_out = simd_malloc( n_samples * n_output * sizeof(float));
+        assert( batch_out );
+        neuralnet_predict_batch( nn, n_samples, X, batch_out );
+        float maxdiff = 0.0f;
+        for( int i = 0; i < n_samples; i++ ){
+            float SIMD_ALIGN(y_pred[n_output]);
+            neuralnet_predict( nn, X + i*n_input, y_pred );
+            float diff = test_max_abs_diff( n_output, y_pred, batch_out + i*n_output );
+            if( diff > maxdiff ) maxdiff = diff;
+        }
+        CHECK_FLOAT_EQUALS_MSG( maxdiff, 0.0f, 1.0e-5f, "Checking that batched predictions are equal" );
+
+        float *workmem = simd_malloc( neuralnet_predict_batch_workmem_size( nn, 10 ) * sizeof(float));
+        assert( workmem );
+        neuralnet_predict_batch_workmem( nn, 10, X, batch_out, workmem, true );
+        maxdiff = 0.0f;
+        for( int i = 0; i < 10; i++ ){
+            float SIMD_ALIGN(y_pred[n_output]);
+            neuralnet_predict_logits( nn, X + i*n_input, y_pred );
+            float diff = test_max_abs_diff( n_output, y_pred, batch_out + i*n_output );
+            if( diff > maxdiff ) maxdiff = diff;
+        }
+        CHECK_FLOAT_EQUALS_MSG( maxdiff, 0.0f, 1.0e-5f, "Checking that batched logits are equal" );
+
+        /* The metrics */
+        metric_func *metrics = METRIC_LIST( get_metric_func( losses[l] ), get_metric_func( accuracy[l] ),
+                get_metric_func( n_target == n_output ? "mean_squared_error" : "sparse_categorical_accuracy" ));
+        float expected[3] = { 0.0f, 0.0f, 0.0f };
+        for( int i = 0; i < n_samples; i++ ){
+            float SIMD_ALIGN(y_pred[n_output]);
+            neuralnet_predict( nn, X + i*n_input, y_pred );
+            for( int j = 0; j < 3; j++ )
+                expected[j] += metrics[j]( n_output, y_pred, targets + i*n_target );
+        }
+        float results[3];
+        evaluate( nn, n_samples, X, targets, metrics, results );
+        CHECK_FLOAT_EQUALS_MSG( results[0], expected[0] / n_samples, 1.0e-5f, "Checking the loss metric" );
+        CHECK_FLOAT_EQUALS_MSG( results[1], expected[1] / n_samples, 1.0e-6f, "Checking the accuracy metric" );
+        CHECK_FLOAT_EQUALS_MSG( results[2], expected[2] / n_samples, 1.0e-6f, "Checking the third metric" );
+
+        /* Fewer samples than a chunk */
+        float SIMD_ALIGN(y_first[n_output]);
+        neuralnet_predict( nn, X, y_first );
+        const float first = metrics[0]( n_output, y_first, targets );
+        evaluate( nn, 1, X, targets, metrics, results );
+        CHECK_FLOAT_EQUALS_MSG( results[0], first, 1.0e-5f, "Checking evaluation of a single sample" );
+
+        simd_free( workmem );
+        simd_free( batch_out );
+        neuralnet_free( nn );
+    }
+
+    free( X );
+    free( Y );
+    free( labels );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
@@ -0,0 +1,137 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "sparse_matrix.h"
+#include "optimizer.h"
+#include "optimizer_implementations.h"
+#include "evaluate.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <omp.h>
+
+/* With one thread, the Hogwild mode runs the same batches in the same order as the synchronous
+   mode, and the weights should be the same. With more threads the result depends on the timing,
+   so then we only check that it learns. */
+
+static optimizer_t *new_optimizer( int which, neuralnet_t *nn, metric_func *metrics, bool hogwild, bool running_metrics,
+        float momentum )
+{
+    const optimizer_properties_t props = OPTIMIZER_PROPERTIES( .batchsize = 8, .shuffle = false, .metrics = metrics,
+            .progress = NULL, .hogwild = hogwild, .running_metrics = running_metrics );
+    return which == 0 ?
+        OPTIMIZER( SGD_new( nn, props, SGD_PROPERTIES( .learning_rate = 0.05f, .momentum = momentum ))) :
+        OPTIMIZER( adagrad_new( nn, props, ADAGRAD_PROPERTIES( .learning_rate = 0.05f )));
+}
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    const int n_samples = 400;
+    const int n_input   = 117;
+    const int n_output  = 3;
+
+    /* One-hot like data where the class is given by some of the features */
+    srand( 42 );
+    float *X = calloc( n_samples * n_input, sizeof(float));
+    float *Y = calloc( n_samples * n_output, sizeof(float));
+    assert( X && Y );
+    for( int i = 0; i < n_samples; i++ ){
+        const int label = rand() % n_output;
+        for( int j = 0; j < n_input; j++ )
+            if( rand() % 10 == 0 || j % 20 == label ) X[i*n_input + j] = 1.0f;
+        Y[i*n_output + label] = 1.0f;
+    }
+    sparse_matrix_t *sX = sparse_matrix_from_dense( n_samples, n_input, X );
+    assert( sX );
+
+    neuralnet_t *nn   = neuralnet_create( 2, INT_ARRAY( n_input, 16, n_output ), STR_ARRAY( "relu", "softmax" ));
+    neuralnet_t *sync = neuralnet_create( 2, INT_ARRAY( n_input, 16, n_output ), STR_ARRAY( "relu", "softmax" ));
+    neuralnet_t *hog  = neuralnet_create( 2, INT_ARRAY( n_input, 16, n_output ), STR_ARRAY( "relu", "softmax" ));
+    assert( nn && sync && hog );
+    neuralnet_initialize( nn, NULL );
+    neuralnet_set_loss( nn, "categorical_crossentropy" );
+    neuralnet_set_loss( sync, "categorical_crossentropy" );
+    neuralnet_set_loss( hog, "categorical_crossentropy" );
+
+    const int n_params = neuralnet_total_n_parameters( nn );
+    float *sync_params = malloc( n_params * sizeof(float));
+    float *hog_params  = malloc( n_params * sizeof(float));
+    assert( sync_params && hog_params );
+
+    metric_func *metrics = METRIC_LIST( get_metric_func( "categorical_crossentropy" ));
+    const char *names[] = { "SGD", "adagrad" };
+    const int n_threads = omp_get_max_threads();
+
+    for( int which = 0; which < 2; which++ ){
+        for( int sparse = 0; sparse < 2; sparse++ ){
+            fprintf(stderr, KBLU "Testing Hogwild %s with %s input." KNRM "\n", names[which], sparse ? "sparse" : "dense" );
+            neuralnet_copy_weights( sync, nn );
+            neuralnet_copy_weights( hog, nn );
+            /* With sparse input, only the rows in the batch are updated, so the momentum of the others is not applied */
+            const float momentum = sparse ? 0.0f : 0.5f;
+            optimizer_t *sync_opt = new_optimizer( which, sync, metrics, false, false, momentum );
+            optimizer_t *hog_opt  = new_optimizer( which, hog, metrics, true, false, momentum );
+            assert( sync_opt && hog_opt );
+
+            float sync_results[1], hog_results[1];
+            omp_set_num_threads( 1 );
+            for( int epoch = 0; epoch < 2; epoch++ ){
+                if( sparse ){
+                    optimizer_run_epoch_sparse( sync_opt, sX, Y, NULL, NULL, sync_results );
+                    optimizer_run_epoch_sparse( hog_opt, sX, Y, NULL, NULL, hog_results );
+                } else {
+                    optimizer_run_epoch( sync_opt, n_samples, X, Y, 0, NULL, NULL, sync_results );
+                    optimizer_run_epoch( hog_opt, n_samples, X, Y, 0, NULL, NULL, hog_results );
+                }
+            }
+            neuralnet_get_parameters( sync, sync_params );
+            neuralnet_get_parameters( hog, hog_params );
+            CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( n_params, sync_params, hog_params ), 0.0f, 1.0e-5f,
+                    "Checking that one thread gives the same weights as the synchronous mode" );
+            CHECK_FLOAT_EQUALS_MSG( hog_results[0], sync_results[0], 1.0e-5f, "Checking the train loss with one thread" );
+
+            /* All the threads updating at the same time */
+            omp_set_num_threads( n_threads < 4 ? 4 : n_threads );
+            float first_loss;
+            evaluate( hog, n_samples, X, Y, metrics, &first_loss );
+            for( int epoch = 0; epoch < 10; epoch++ ){
+                if( sparse )
+                    optimizer_run_epoch_sparse( hog_opt, sX, Y, NULL, NULL, hog_results );
+                else
+                    optimizer_run_epoch( hog_opt, n_samples, X, Y, 0, NULL, NULL, hog_results );
+            }
+            CHECK_CONDITION_MSG( hog_results[0] < 0.8f * first_loss, "Checking that the loss decreases with many threads" );
+            omp_set_num_threads( n_threads );
+
+            optimizer_free( sync_opt );
+            optimizer_free( hog_opt );
+        }
+    }
+
+    /* The running train metrics are not used in Hogwild mode */
+    optimizer_t *opt = new_optimizer( 0, hog, metrics, true, true, 0.0f );
+    assert( opt );
+    float results[1], expected[1];
+    optimizer_run_epoch( opt, n_samples, X, Y, 0, NULL, NULL, results );
+    evaluate( hog, n_samples, X, Y, metrics, expected );
+    CHECK_FLOAT_EQUALS_MSG( results[0], expected[0], 1.0e-6f, "Checking that the train metrics are evaluated after the epoch" );
+    optimizer_free( opt );
+
+    neuralnet_free( nn );
+    neuralnet_free( sync );
+    neuralnet_free( hog );
+    sparse_matrix_free( sX );
+    free( sync_params );
+    free( hog_params );
+    free( X );
+    free( Y );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
@@ -0,0 +1,49 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "simd.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+/* The huge page allocations should work with all the policies, also when the system has no huge
+   pages (then they are just normal pages). */
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    const simd_hugepage_policy_t policies[] = { SIMD_HUGEPAGE_NONE, SIMD_HUGEPAGE_TRANSPARENT, SIMD_HUGEPAGE_HUGETLB };
+    const char *names[] = { "no", "transparent", "hugetlb" };
+    const size_t sizes[] = { 4, 1000, 5 * SIMD_HUGEPAGE_SIZE + 12 };
+
+    for( int p = 0; p < 3; p++ ){
+        fprintf(stderr, KBLU "Testing allocations with %s huge pages." KNRM "\n", names[p] );
+        simd_set_hugepage_policy( policies[p] );
+        CHECK_INT_EQUALS_MSG( (int) simd_get_hugepage_policy(), (int) policies[p], "Checking the policy" );
+        for( int k = 0; k < 3; k++ ){
+            float *ptr = simd_malloc_huge( sizes[k] );
+            CHECK_NOT_NULL_MSG( ptr, "Checking the allocation" );
+            if( !ptr )
+                continue;
+            CHECK_CONDITION_MSG( ((uintptr_t) ptr) % 64 == 0, "Checking the alignment" );
+            memset( ptr, 0x5a, sizes[k] );
+            CHECK_CONDITION_MSG( ((unsigned char *) ptr)[sizes[k] - 1] == 0x5a, "Checking that all the memory can be written" );
+            simd_free_huge( ptr );
+        }
+    }
+
+    /* The weights are allocated with the policy */
+    neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( 1000, 600, 10 ), STR_ARRAY( "relu", "softmax" ));
+    CHECK_NOT_NULL_MSG( nn, "Checking a network on huge pages" );
+    simd_set_hugepage_policy( SIMD_HUGEPAGE_NONE );
+    neuralnet_free( nn );
+    simd_free_huge( NULL );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
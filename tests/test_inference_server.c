@@ -0,0 +1,147 @@
+#define _POSIX_C_SOURCE 200112L  /* getpid() */
+#include "test.h"
+#include "neuralnet.h"
+#include "inference_server.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* Several clients send requests of a few samples each to the server at the same time. The answers
+   should be the same as neuralnet_predict() of each sample, and the requests should be batched. */
+
+#define N_CLIENTS   4
+#define N_REQUESTS  100
+#define N_INPUT     13
+#define N_OUTPUT    5
+
+typedef struct {
+    const neuralnet_t *nn;
+    const char *path;
+    unsigned int seed;
+    int n_errors;
+    float maxdiff;
+} client_job_t;
+
+static void *server_thread( void *arg )
+{
+    inference_server_run( (inference_server_t *) arg );
+    return NULL;
+}
+
+static void *client_thread( void *arg )
+{
+    client_job_t *job = (client_job_t *) arg;
+    inference_client_t *client = inference_client_connect( job->path );
+    if( !client ){
+        job->n_errors++;
+        return NULL;
+    }
+    float input[3 * N_INPUT], output[3 * N_OUTPUT], expected[N_OUTPUT];
+    for( int r = 0; r < N_REQUESTS; r++ ){
+        const int n_samples = 1 + rand_r( &job->seed ) % 3;
+        for( int i = 0; i < n_samples * N_INPUT; i++ )
+            input[i] = (float) rand_r( &job->seed ) / (float) RAND_MAX - 0.5f;
+        if( inference_client_predict( client, n_samples, input, output ) < 0 ){
+            job->n_errors++;
+            continue;
+        }
+        for( int s = 0; s < n_samples; s++ ){
+            neuralnet_predict( job->nn, input + s * N_INPUT, expected );
+            for( int k = 0; k < N_OUTPUT; k++ )
+                if( fabsf( expected[k] - output[s * N_OUTPUT + k] ) > job->maxdiff )
+                    job->maxdiff = fabsf( expected[k] - output[s * N_OUTPUT + k] );
+        }
+    }
+    inference_client_free( client );
+    return NULL;
+}
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    char path[64];
+    sprintf( path, "/tmp/test_inference_server.%d", (int) getpid());
+
+    srand( 42 );
+    neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( N_INPUT, 32, N_OUTPUT ), STR_ARRAY( "relu", "softmax" ));
+    assert( nn );
+    neuralnet_initialize( nn, NULL );
+
+    /* Wait for the latency budget, such that the requests of the clients end up in the same batches */
+    inference_server_t *server = inference_server_new( nn, path,
+            INFERENCE_SERVER_PROPERTIES( .max_batch = 16, .max_latency_us = 2000, .n_workers = 2,
+                .dispatch_when_idle = false ));
+    CHECK_NOT_NULL_MSG( server, "Checking that the server is created" );
+    assert( server );
+    pthread_t thread;
+    const int started = pthread_create( &thread, NULL, server_thread, server );
+    assert( started == 0 );
+
+    inference_client_t *client = inference_client_connect( path );
+    CHECK_NOT_NULL_MSG( client, "Checking the connection to the server" );
+    assert( client );
+    CHECK_INT_EQUALS_MSG( inference_client_n_input( client ), N_INPUT, "Checking the number of inputs" );
+    CHECK_INT_EQUALS_MSG( inference_client_n_output( client ), N_OUTPUT, "Checking the number of outputs" );
+
+    fprintf(stderr, KBLU "Testing the predictions of concurrent clients." KNRM "\n" );
+    client_job_t job[N_CLIENTS];
+    pthread_t client_threads[N_CLIENTS];
+    for( int c = 0; c < N_CLIENTS; c++ ){
+        job[c] = (client_job_t) { .nn = nn, .path = path, .seed = 17 + c, .n_errors = 0, .maxdiff = 0.0f };
+        const int client_started = pthread_create( &client_threads[c], NULL, client_thread, &job[c] );
+        assert( client_started == 0 );
+    }
+    int n_errors = 0;
+    float maxdiff = 0.0f;
+    for( int c = 0; c < N_CLIENTS; c++ ){
+        pthread_join( client_threads[c], NULL );
+        n_errors += job[c].n_errors;
+        if( job[c].maxdiff > maxdiff ) maxdiff = job[c].maxdiff;
+    }
+    CHECK_INT_EQUALS_MSG( n_errors, 0, "Checking that all the requests are answered" );
+    CHECK_FLOAT_EQUALS_MSG( maxdiff, 0.0f, 1.0e-5f, "Checking the predictions" );
+
+    inference_server_stats_t stats;
+    inference_server_stats( server, &stats );
+    CHECK_INT_EQUALS_MSG( (int) stats.n_requests, N_CLIENTS * N_REQUESTS, "Checking the number of requests" );
+    CHECK_CONDITION_MSG( stats.n_batches < stats.n_requests, "Checking that the requests are batched" );
+    CHECK_CONDITION_MSG( stats.n_samples <= 16 * stats.n_batches, "Checking the size of the batches" );
+
+    fprintf(stderr, KBLU "Testing the rejected requests." KNRM "\n" );
+    float *big_input  = calloc( 17 * N_INPUT, sizeof(float));
+    float *big_output = calloc( 17 * N_OUTPUT, sizeof(float));
+    assert( big_input && big_output );
+    const int too_big = inference_client_predict( client, 17, big_input, big_output );
+    CHECK_INT_EQUALS_MSG( too_big, -1, "Checking that a too large request is rejected" );
+    const int after = inference_client_predict( client, 16, big_input, big_output );
+    CHECK_INT_EQUALS_MSG( after, 0, "Checking the connection after a rejected request" );
+    float expected[N_OUTPUT];
+    neuralnet_predict( nn, big_input, expected );
+    CHECK_FLOAT_EQUALS_MSG( big_output[15 * N_OUTPUT + 2], expected[2], 1.0e-5f, "Checking the prediction of a full batch" );
+    inference_server_stats( server, &stats );
+    CHECK_INT_EQUALS_MSG( (int) stats.n_rejected, 1, "Checking the number of rejected requests" );
+    inference_client_free( client );
+
+    inference_server_stop( server );
+    pthread_join( thread, NULL );
+    inference_server_free( server );
+    CHECK_CONDITION_MSG( access( path, F_OK ) != 0, "Checking that the socket is removed" );
+    inference_client_t *gone = inference_client_connect( path );
+    CHECK_CONDITION_MSG( gone == NULL, "Checking that the server is gone" );
+    inference_client_free( gone );
+
+    free( big_input );
+    free( big_output );
+    neuralnet_free( nn );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
@@ -0,0 +1,147 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "optimizer.h"
+#include "optimizer_implementations.h"
+#include "evaluate.h"
+#include "loss.h"
+#include "metrics.h"
+#include "simd.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* Compares training and evaluation with class labels as targets ('sparse_categorical_crossentropy')
+   with training and evaluation on the same targets one-hot encoded ('categorical_crossentropy').
+   They should give the same results (up to floating point rounding). */
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    const int n_samples = 64;
+    const int n_input   = 20;
+    const int n_classes = 10;
+
+    neuralnet_t *nn = neuralnet_create( 2,
+            INT_ARRAY( n_input, 16, n_classes ),
+            STR_ARRAY( "relu", "softmax" ));
+    CHECK_NOT_NULL_MSG( nn, "Checking that neural network was created" );
+    neuralnet_initialize( nn, NULL );
+
+    srand( 42 );
+    float *X = malloc( n_samples * n_input * sizeof(float));
+    float *Y_onehot = calloc( n_samples * n_classes, sizeof(float));
+    int32_t *labels = malloc( n_samples * sizeof(int32_t));
+    uint16_t *labels16 = malloc( n_samples * sizeof(uint16_t));
+    assert( X && Y_onehot && labels && labels16 );
+    for( int i = 0; i < n_samples * n_input; i++ )
+        X[i] = (float) rand() / (float) RAND_MAX - 0.5f;
+    for( int i = 0; i < n_samples; i++ ){
+        labels[i] = rand() % n_classes;
+        labels16[i] = (uint16_t) labels[i];
+        Y_onehot[i*n_classes + labels[i]] = 1.0f;
+    }
+
+    float *Y = class_labels_from_int32( n_samples, labels );
+    float *Y16 = class_labels_from_uint16( n_samples, labels16 );
+    CHECK_NOT_NULL_MSG( Y, "Checking that int32 labels were converted" );
+    CHECK_NOT_NULL_MSG( Y16, "Checking that uint16 labels were converted" );
+    CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( n_samples, Y, Y16 ), 0.0f, 0.0f, "Checking that int32 and uint16 labels are equal" );
+
+    fprintf(stderr, KBLU "Testing sparse categorical metrics." KNRM "\n" );
+    metric_func cce  = get_metric_func( "categorical_crossentropy" );
+    metric_func scce = get_metric_func( "sparse_categorical_crossentropy" );
+    metric_func acc  = get_metric_func( "categorical_accuracy" );
+    metric_func sacc = get_metric_func( "sparse_categorical_accuracy" );
+    CHECK_NOT_NULL_MSG( scce, "Checking that 'sparse_categorical_crossentropy' metric exists" );
+    CHECK_NOT_NULL_MSG( sacc, "Checking that 'sparse_categorical_accuracy' metric exists" );
+    float maxdiff = 0.0f;
+    for( int i = 0; i < n_samples; i++ ){
+        float SIMD_ALIGN(y_pred[n_classes]);
+        neuralnet_predict( nn, X + i*n_input, y_pred );
+        float diff = fabsf( cce( n_classes, y_pred, Y_onehot + i*n_classes ) - scce( n_classes, y_pred, Y + i ));
+        diff += fabsf( acc( n_classes, y_pred, Y_onehot + i*n_classes ) - sacc( n_classes, y_pred, Y + i ));
+        if( diff > maxdiff ) maxdiff = diff;
+    }
+    CHECK_FLOAT_EQUALS_MSG( maxdiff, 0.0f, 1.0e-6f, "Checking that sparse and one-hot metrics are equal" );
+
+    fprintf(stderr, KBLU "Testing backpropagation with class labels." KNRM "\n" );
+    const unsigned int n_params = neuralnet_total_n_parameters( nn );
+    float *onehot_grad = simd_malloc( n_params * sizeof(float));
+    float *label_grad  = simd_malloc( n_params * sizeof(float));
+    assert( onehot_grad && label_grad );
+    maxdiff = 0.0f;
+    for( int i = 0; i < n_samples; i++ ){
+        neuralnet_set_loss( nn, "categorical_crossentropy" );
+        neuralnet_backpropagation( nn, X + i*n_input, Y_onehot + i*n_classes, onehot_grad );
+        neuralnet_set_loss( nn, "sparse_categorical_crossentropy" );
+        neuralnet_backpropagation( nn, X + i*n_input, Y + i, label_grad );
+        float diff = test_max_abs_diff( n_params, onehot_grad, label_grad );
+        if( diff > maxdiff ) maxdiff = diff;
+    }
+    CHECK_FLOAT_EQUALS_MSG( maxdiff, 0.0f, 1.0e-6f, "Checking that label and one-hot gradients are equal" );
+    CHECK_INT_EQUALS_MSG( neuralnet_target_size( nn ), 1, "Checking target size with class labels" );
+
+    fprintf(stderr, KBLU "Testing training and evaluation with class labels." KNRM "\n" );
+    neuralnet_t *nn_onehot = neuralnet_create( 2, INT_ARRAY( n_input, 16, n_classes ), STR_ARRAY( "relu", "softmax" ));
+    assert( nn_onehot );
+    neuralnet_set_loss( nn_onehot, "categorical_crossentropy" );
+    CHECK_INT_EQUALS_MSG( neuralnet_target_size( nn_onehot ), n_classes, "Checking target size with one-hot targets" );
+    for( int l = 0; l < nn->n_layers; l++ ){
+        memcpy( nn_onehot->layer[l].weight, nn->layer[l].weight, nn->layer[l].n_input * nn->layer[l].n_output * sizeof(float));
+        memcpy( nn_onehot->layer[l].bias, nn->layer[l].bias, nn->layer[l].n_output * sizeof(float));
+    }
+
+    optimizer_t *onehot_sgd = OPTIMIZER( SGD_new( nn_onehot,
+                OPTIMIZER_PROPERTIES( .batchsize = 8, .shuffle = false, .progress = NULL,
+                    .metrics = METRIC_LIST( cce, acc )),
+                SGD_PROPERTIES( .learning_rate = 0.1f )));
+    optimizer_t *label_sgd = OPTIMIZER( SGD_new( nn,
+                OPTIMIZER_PROPERTIES( .batchsize = 8, .shuffle = false, .progress = NULL,
+                    .metrics = METRIC_LIST( scce, sacc )),
+                SGD_PROPERTIES( .learning_rate = 0.1f )));
+
+    float onehot_results[4], label_results[4];
+    const int n_train = n_samples / 2;
+    optimizer_run_epoch( onehot_sgd, n_train, X, Y_onehot, n_samples - n_train,
+            X + n_train * n_input, Y_onehot + n_train * n_classes, onehot_results );
+    optimizer_run_epoch( label_sgd, n_train, X, Y, n_samples - n_train,
+            X + n_train * n_input, Y + n_train, label_results );
+
+    neuralnet_get_parameters( nn_onehot, onehot_grad );
+    neuralnet_get_parameters( nn, label_grad );
+    CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( n_params, onehot_grad, label_grad ), 0.0f, 1.0e-5f,
+            "Checking that label and one-hot training give equal parameters" );
+    CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( 4, onehot_results, label_results ), 0.0f, 1.0e-5f,
+            "Checking that label and one-hot evaluation give equal results" );
+
+    fprintf(stderr, KBLU "Testing dense metrics with class labels." KNRM "\n" );
+    optimizer_t *mismatch = OPTIMIZER( SGD_new( nn, OPTIMIZER_PROPERTIES( .progress = NULL, .metrics = METRIC_LIST( scce, acc )),
+                SGD_PROPERTIES( .learning_rate = 0.1f )));
+    CHECK_CONDITION_MSG( mismatch == NULL, "Checking that categorical_accuracy with class labels is rejected" );
+    evaluate( nn, n_samples, X, Y, METRIC_LIST( sacc, acc ), label_results );
+    CHECK_FLOAT_EQUALS_MSG( label_results[1], -1.0f, 1.0e-6f, "Checking that evaluate() rejects it too" );
+
+    /* clean up */
+    optimizer_free( onehot_sgd );
+    optimizer_free( label_sgd );
+    simd_free( onehot_grad );
+    simd_free( label_grad );
+    free( X );
+    free( Y );
+    free( Y16 );
+    free( Y_onehot );
+    free( labels );
+    free( labels16 );
+    neuralnet_free( nn );
+    neuralnet_free( nn_onehot );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
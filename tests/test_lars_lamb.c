@@ -0,0 +1,154 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "optimizer.h"
+#include "optimizer_implementations.h"
+#include "threadpool.h"
+#include "evaluate.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* With the trust ratio, the size of an update of the weights of a layer relative to the weights is
+   given by the (warmed up) learning rate, whatever the size of the gradient. LAMB without weight
+   decay makes the update of each layer exactly learning_rate * ||w||, and the first LARS update
+   without momentum and weight decay is learning_rate * trust_coefficient * ||w||. */
+
+#define N_SAMPLES 8192
+#define N_INPUT   10
+#define N_OUTPUT  3
+
+static void relative_updates( const neuralnet_t *nn, const float *before, const float *after, float *relative )
+{
+    const float *b = before, *a = after;
+    for( int l = 0; l < nn->n_layers; l++ ){
+        const int n_bias = nn->layer[l].n_output;
+        const int n_weight = nn->layer[l].n_input * n_bias;
+        double delta = 0.0, weight = 0.0;
+        for( int j = n_bias; j < n_bias + n_weight; j++ ){
+            delta  += (a[j] - b[j]) * (a[j] - b[j]);
+            weight += b[j] * b[j];
+        }
+        relative[l] = (float) sqrt( delta / weight );
+        b += n_bias + n_weight;
+        a += n_bias + n_weight;
+    }
+}
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    srand( 42 );
+    float *X = malloc( N_SAMPLES * N_INPUT * sizeof(float));
+    float *Y = calloc( N_SAMPLES * N_OUTPUT, sizeof(float));
+    assert( X && Y );
+    for( int i = 0; i < N_SAMPLES; i++ ){
+        const int label = rand() % N_OUTPUT;
+        for( int j = 0; j < N_INPUT; j++ )
+            X[i*N_INPUT + j] = (float) rand() / (float) RAND_MAX + (j % N_OUTPUT == label ? 0.5f : 0.0f);
+        Y[i*N_OUTPUT + label] = 1.0f;
+    }
+
+    neuralnet_t *nn = neuralnet_create( 3, INT_ARRAY( N_INPUT, 32, 16, N_OUTPUT ), STR_ARRAY( "relu", "relu", "softmax" ));
+    assert( nn );
+    neuralnet_initialize( nn, NULL );
+    neuralnet_set_loss( nn, "categorical_crossentropy" );
+    metric_func *metrics = METRIC_LIST( get_metric_func( "categorical_crossentropy" ));
+    const int n_params = neuralnet_total_n_parameters( nn );
+    float *before = malloc( n_params * sizeof(float));
+    float *after  = malloc( n_params * sizeof(float));
+    assert( before && after );
+
+    fprintf(stderr, KBLU "Testing the norms of the layers." KNRM "\n" );
+    optimizer_t *opt = OPTIMIZER( LARS_new( nn, OPTIMIZER_PROPERTIES( .batchsize = 512, .metrics = metrics, .progress = NULL ),
+                LARS_PROPERTIES( .learning_rate = 1.0f, .momentum = 0.0f, .weight_decay = 0.0f )));
+    CHECK_NOT_NULL_MSG( opt, "Checking that the LARS optimizer is created" );
+    assert( opt );
+    float norms[3], param_norms[3], pool_norms[3], relative[3];
+    optimizer_layer_norms( opt, NULL, norms );
+    neuralnet_get_parameters( nn, before );
+    optimizer_layer_norms( opt, before, param_norms );
+    float max_error = 0.0f;
+    for( int l = 0; l < nn->n_layers; l++ ){
+        const int n = nn->layer[l].n_input * nn->layer[l].n_output;
+        double sum = 0.0;
+        for( int j = 0; j < n; j++ )
+            sum += nn->layer[l].weight[j] * nn->layer[l].weight[j];
+        if( fabsf( norms[l] - (float) sqrt( sum )) > max_error ) max_error = fabsf( norms[l] - (float) sqrt( sum ));
+        if( fabsf( param_norms[l] - norms[l] ) > max_error ) max_error = fabsf( param_norms[l] - norms[l] );
+    }
+    CHECK_FLOAT_EQUALS_MSG( max_error, 0.0f, 1.0e-5f, "Checking the norms of the weights and of a parameter vector" );
+    threadpool_t *pool = threadpool_new( 3 );
+    assert( pool );
+    threadpool_set_default( pool );
+    optimizer_layer_norms( opt, NULL, pool_norms );
+    max_error = 0.0f;
+    for( int l = 0; l < nn->n_layers; l++ )
+        if( fabsf( pool_norms[l] - norms[l] ) > max_error ) max_error = fabsf( pool_norms[l] - norms[l] );
+    CHECK_FLOAT_EQUALS_MSG( max_error, 0.0f, 1.0e-5f, "Checking the norms in the thread pool" );
+
+    fprintf(stderr, KBLU "Testing the trust ratios." KNRM "\n" );
+    optimizer_step( opt, 512, X, Y );
+    neuralnet_get_parameters( nn, after );
+    relative_updates( nn, before, after, relative );
+    max_error = 0.0f;
+    for( int l = 0; l < nn->n_layers; l++ )
+        if( fabsf( relative[l] - 0.001f ) > max_error ) max_error = fabsf( relative[l] - 0.001f );
+    CHECK_FLOAT_EQUALS_MSG( max_error, 0.0f, 1.0e-5f, "Checking the relative LARS update of each layer (thread pool)" );
+    optimizer_free( opt );
+    threadpool_set_default( NULL );
+    threadpool_free( pool );
+
+    opt = OPTIMIZER( LAMB_new( nn, OPTIMIZER_PROPERTIES( .batchsize = 512, .metrics = metrics, .progress = NULL ),
+                LAMB_PROPERTIES( .learning_rate = 0.01f, .weight_decay = 0.0f, .warmup = 4 )));
+    CHECK_NOT_NULL_MSG( opt, "Checking that the LAMB optimizer is created" );
+    assert( opt );
+    float warmed_up[2];
+    max_error = 0.0f;
+    for( int step = 0; step < 2; step++ ){
+        neuralnet_get_parameters( nn, before );
+        optimizer_step( opt, 512, X + step * 512 * N_INPUT, Y + step * 512 * N_OUTPUT );
+        neuralnet_get_parameters( nn, after );
+        relative_updates( nn, before, after, relative );
+        warmed_up[step] = relative[0];
+        for( int l = 1; l < nn->n_layers; l++ )
+            if( fabsf( relative[l] - relative[0] ) > max_error ) max_error = fabsf( relative[l] - relative[0] );
+    }
+    CHECK_FLOAT_EQUALS_MSG( max_error, 0.0f, 1.0e-5f, "Checking that the relative LAMB updates of the layers are the same" );
+    CHECK_FLOAT_EQUALS_MSG( warmed_up[0], 0.0025f, 1.0e-5f, "Checking the learning rate of the first warmup batch" );
+    CHECK_FLOAT_EQUALS_MSG( warmed_up[1], 0.005f, 1.0e-5f, "Checking the learning rate of the second warmup batch" );
+    optimizer_free( opt );
+
+    /* The loss after a few epochs with large batches */
+    const char *names[2] = { "LARS", "LAMB" };
+    for( int which = 0; which < 2; which++ ){
+        fprintf(stderr, KBLU "Testing %s with large batches." KNRM "\n", names[which] );
+        neuralnet_initialize( nn, NULL );
+        const optimizer_properties_t props = OPTIMIZER_PROPERTIES( .batchsize = 512, .shuffle = true,
+                .metrics = metrics, .progress = NULL );
+        opt = which == 0 ?
+            OPTIMIZER( LARS_new( nn, props, LARS_PROPERTIES( .learning_rate = 2.0f, .warmup = 8 ))) :
+            OPTIMIZER( LAMB_new( nn, props, LAMB_PROPERTIES( .learning_rate = 0.02f, .warmup = 8 )));
+        assert( opt );
+        float first_loss, results[1];
+        evaluate( nn, N_SAMPLES, X, Y, metrics, &first_loss );
+        for( int epoch = 0; epoch < 10; epoch++ )
+            optimizer_run_epoch( opt, N_SAMPLES, X, Y, 0, NULL, NULL, results );
+        CHECK_CONDITION_MSG( results[0] < 0.2f * first_loss, "Checking that the loss decreases" );
+        optimizer_free( opt );
+    }
+
+    neuralnet_free( nn );
+    free( before );
+    free( after );
+    free( X );
+    free( Y );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "test.h"
+#include "metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* metrics_accumulate_batch() should give the same as calling each metric function on each sample */
+
+static float custom_metric( const int n, const float *y_pred, const float *y_real )
+{
+    return y_pred[n-1] - y_real[0];
+}
+
+static void reference( metric_func metrics[], int n_samples, int n_output, const float *y_pred,
+        const float *y_real, int n_target, float *sums )
+{
+    for( int s = 0; s < n_samples; s++ )
+        for( int j = 0; metrics[j]; j++ )
+            sums[j] += metrics[j]( n_output, y_pred + s*n_output, y_real + s*n_target );
+}
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    const int n_samples = 50;
+    const int sizes[] = { 1, 3, 8, 17, 64 };
+    srand( 42 );
+
+    metric_func dense[] = {
+        get_metric_func( "mean_squared_error" ),
+        get_metric_func( "mean_absolute_error" ),
+        get_metric_func( "mean_absolute_percentage_error" ),
+        get_metric_func( "binary_crossentropy" ),
+        get_metric_func( "categorical_crossentropy" ),
+        get_metric_func( "binary_accuracy" ),
+        get_metric_func( "categorical_accuracy" ),
+        custom_metric,
+        NULL };
+    const int n_dense = sizeof( dense ) / sizeof( dense[0] ) - 1;
+
+    for( int k = 0; k < (int) (sizeof( sizes ) / sizeof( sizes[0] )); k++ ){
+        const int n_output = sizes[k];
+        float *y_pred = malloc( n_samples * n_output * sizeof(float));
+        float *y_real = calloc( n_samples * n_output, sizeof(float));
+        float *labels = malloc( n_samples * sizeof(float));
+        assert( y_pred && y_real && labels );
+        for( int i = 0; i < n_samples * n_output; i++ ){
+            /* Some exact halves and ties (argmax), and some outside [0,1] for the clipping */
+            const int r = rand() % 10;
+            y_pred[i] = r == 0 ? 0.5f : r == 1 ? -0.5f : r == 2 ? 1.2f : (float) rand() / (float) RAND_MAX;
+        }
+        for( int s = 0; s < n_samples; s++ ){
+            labels[s] = (float) (rand() % n_output);
+            y_real[s*n_output + (int) labels[s]] = 1.0f;
+        }
+
+        char msg[128];
+        float expected[n_dense], got[n_dense];
+        memset( expected, 0, sizeof( expected ));
+        memset( got, 0, sizeof( got ));
+        reference( dense, n_samples, n_output, y_pred, y_real, n_output, expected );
+        metrics_accumulate_batch( dense, n_samples, n_output, y_pred, y_real, n_output, got );
+        for( int j = 0; j < n_dense; j++ ){
+            sprintf( msg, "Checking batch '%s' with %d outputs", get_metric_name( dense[j] ), n_output );
+            CHECK_FLOAT_EQUALS_MSG( got[j], expected[j], 1.0e-5f * (1.0f + fabsf( expected[j] )), msg );
+        }
+
+        /* Targets as probabilities, and not only one-hot */
+        for( int i = 0; i < n_samples * n_output; i++ )
+            y_real[i] = (float) rand() / (float) RAND_MAX;
+        memset( expected, 0, sizeof( expected ));
+        memset( got, 0, sizeof( got ));
+        reference( dense, n_samples, n_output, y_pred, y_real, n_output, expected );
+        metrics_accumulate_batch( dense, n_samples, n_output, y_pred, y_real, n_output, got );
+        float maxdiff = 0.0f;
+        for( int j = 0; j < n_dense; j++ )
+            if( fabsf( got[j] - expected[j] ) / (1.0f + fabsf( expected[j] )) > maxdiff )
+                maxdiff = fabsf( got[j] - expected[j] ) / (1.0f + fabsf( expected[j] ));
+        sprintf( msg, "Checking batch metrics with soft targets and %d outputs", n_output );
+        CHECK_FLOAT_EQUALS_MSG( maxdiff, 0.0f, 1.0e-5f, msg );
+
+        /* Class labels */
+        metric_func sparse[] = { get_metric_func( "sparse_categorical_crossentropy" ),
+            get_metric_func( "sparse_categorical_accuracy" ), NULL };
+        memset( expected, 0, sizeof( expected ));
+        memset( got, 0, sizeof( got ));
+        reference( sparse, n_samples, n_output, y_pred, labels, 1, expected );
+        metrics_accumulate_batch( sparse, n_samples, n_output, y_pred, labels, 1, got );
+        sprintf( msg, "Checking batch sparse metrics with %d outputs", n_output );
+        CHECK_CONDITION_MSG( fabsf( got[0] - expected[0] ) < 1.0e-5f && got[1] == expected[1], msg );
+
+        free( y_pred );
+        free( y_real );
+        free( labels );
+    }
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
@@ -0,0 +1,206 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "neuralnet_bf16.h"
+#include "matrix_operations.h"
+#include "optimizer.h"
+#include "optimizer_implementations.h"
+#include "evaluate.h"
+#include "simd.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* The sizes are odd and not multiples of the SIMD widths, such that all the tails are tested */
+#define N_ROWS 37
+#define N_COLS 29
+
+static float random_value( void )
+{
+    return (float) rand() / (float) RAND_MAX - 0.5f;
+}
+
+static float relative_error( int n, const float *a, const float *b )
+{
+    float max_diff = 0.0f, max_value = 0.0f;
+    for( int i = 0; i < n; i++ ){
+        max_diff  = fmaxf( max_diff, fabsf( a[i] - b[i] ));
+        max_value = fmaxf( max_value, fabsf( b[i] ));
+    }
+    return max_diff / max_value;
+}
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    fprintf(stderr, KBLU "Testing the bfloat16 conversions." KNRM "\n" );
+    srand( 42 );
+    float x[N_ROWS], back[N_ROWS];
+    uint16_t h[N_ROWS + 1];
+    for( int i = 0; i < N_ROWS; i++ )
+        x[i] = random_value() * 100.0f;
+    x[3]  = 1.0f + 1.0f / 256.0f;   /* Halfway, rounded down to even */
+    x[35] = 1.0f + 3.0f / 256.0f;   /* Halfway, rounded up to even */
+    vector_to_bf16( N_ROWS, x, h );
+    vector_from_bf16( N_ROWS, h, back );
+    CHECK_FLOAT_EQUALS_MSG( relative_error( N_ROWS, back, x ), 0.0f, 1.0f / 256.0f, "Checking the round trip" );
+    CHECK_FLOAT_EQUALS_MSG( back[3], 1.0f, 0.0f, "Checking rounding down to even" );
+    CHECK_FLOAT_EQUALS_MSG( back[35], 1.0f + 4.0f / 256.0f, 0.0f, "Checking rounding up to even" );
+
+    fprintf(stderr, KBLU "Testing the bfloat16 matrix products." KNRM "\n" );
+    float *weight = malloc( N_ROWS * N_COLS * sizeof(float));
+    uint32_t *pairs = calloc( (N_ROWS + 1) / 2 * N_COLS, sizeof(uint32_t));
+    float bias[N_COLS], y[N_COLS], expected[N_COLS], v[N_COLS], out[N_ROWS], expected_out[N_ROWS];
+    uint16_t vh[N_COLS], row[N_COLS];
+    assert( weight && pairs );
+    for( int i = 0; i < N_ROWS * N_COLS; i++ )
+        weight[i] = random_value();
+    for( int j = 0; j < N_COLS; j++ ){
+        bias[j] = random_value();
+        v[j] = random_value();
+    }
+    /* The expected results are with the rounded values */
+    for( int i = 0; i < N_ROWS; i++ ){
+        vector_to_bf16( N_COLS, weight + i * N_COLS, row );
+        vector_from_bf16( N_COLS, row, weight + i * N_COLS );
+        for( int j = 0; j < N_COLS; j++ )
+            pairs[i / 2 * N_COLS + j] |= (uint32_t) row[j] << (i % 2 ? 16 : 0);
+    }
+    h[N_ROWS] = 0;
+    vector_from_bf16( N_ROWS, h, x );
+    vector_to_bf16( N_COLS, v, vh );
+    vector_from_bf16( N_COLS, vh, v );
+
+    memcpy( expected, bias, sizeof(bias));
+    for( int i = 0; i < N_ROWS; i++ )
+        for( int j = 0; j < N_COLS; j++ )
+            expected[j] += x[i] * weight[i * N_COLS + j];
+    bf16_vector_matrix_multiply( N_ROWS, N_COLS, pairs, bias, h, y );
+    CHECK_FLOAT_EQUALS_MSG( relative_error( N_COLS, y, expected ), 0.0f, 1.0e-5f, "Checking the vector-matrix product" );
+
+    memset( expected_out, 0, sizeof(expected_out));
+    for( int i = 0; i < N_ROWS; i++ )
+        for( int j = 0; j < N_COLS; j++ )
+            expected_out[i] += weight[i * N_COLS + j] * v[j];
+    out[N_ROWS - 1] = 42.0f;
+    bf16_matrix_vector_multiply( N_ROWS - 1, N_COLS, pairs, vh, out );
+    CHECK_FLOAT_EQUALS_MSG( out[N_ROWS - 1], 42.0f, 0.0f, "Checking that an odd number of rows is not overrun" );
+    bf16_matrix_vector_multiply( N_ROWS, N_COLS, pairs, vh, out );
+    CHECK_FLOAT_EQUALS_MSG( relative_error( N_ROWS, out, expected_out ), 0.0f, 1.0e-5f, "Checking the matrix-vector product" );
+    free( weight );
+    free( pairs );
+
+    /* The activation derivatives need the biases of the gradient to be aligned, as with float32 */
+    fprintf(stderr, KBLU "Testing the mixed precision backpropagation." KNRM "\n" );
+    neuralnet_t *nn = neuralnet_create( 3, INT_ARRAY( 15, 16, 17, 5 ), STR_ARRAY( "tanh", "relu", "softmax" ));
+    assert( nn );
+    neuralnet_initialize( nn, NULL );
+    neuralnet_set_loss( nn, "categorical_crossentropy" );
+    neuralnet_bf16_t *nnb = neuralnet_bf16_new( nn );
+    CHECK_NOT_NULL_MSG( nnb, "Checking that the bfloat16 network is created" );
+    assert( nnb );
+    const int n_params = neuralnet_total_n_parameters( nn );
+    float *grad = simd_malloc( n_params * sizeof(float));
+    float *grad_bf16 = simd_malloc( n_params * sizeof(float));
+    assert( grad && grad_bf16 );
+    float SIMD_ALIGN(input[15]);
+    float SIMD_ALIGN(target[5]) = { 0.0f, 0.0f, 1.0f, 0.0f, 0.0f };
+    float SIMD_ALIGN(output[5]);
+    float SIMD_ALIGN(output_bf16[5]);
+    float max_error = 0.0f, max_output_error = 0.0f;
+    for( int sample = 0; sample < 10; sample++ ){
+        for( int i = 0; i < 15; i++ )
+            input[i] = random_value() * 2.0f;
+        neuralnet_backpropagation_with_output( nn, input, target, grad, output );
+        neuralnet_bf16_backpropagation_with_output( nnb, input, target, grad_bf16, output_bf16 );
+        max_error = fmaxf( max_error, relative_error( n_params, grad_bf16, grad ));
+        max_output_error = fmaxf( max_output_error, relative_error( 5, output_bf16, output ));
+    }
+    CHECK_FLOAT_EQUALS_MSG( max_output_error, 0.0f, 0.01f, "Checking the output against float32" );
+    CHECK_FLOAT_EQUALS_MSG( max_error, 0.0f, 0.02f, "Checking the gradient against float32" );
+    simd_free( grad );
+    simd_free( grad_bf16 );
+    neuralnet_bf16_free( nnb );
+
+    fprintf(stderr, KBLU "Testing training with mixed precision." KNRM "\n" );
+    const int n_samples = 512;
+    float *X = malloc( n_samples * 15 * sizeof(float));
+    float *Y = calloc( n_samples * 5, sizeof(float));
+    assert( X && Y );
+    for( int i = 0; i < n_samples; i++ ){
+        const int label = rand() % 5;
+        for( int j = 0; j < 15; j++ )
+            X[i*15 + j] = random_value() + (j % 5 == label ? 0.5f : 0.0f);
+        Y[i*5 + label] = 1.0f;
+    }
+    metric_func *metrics = METRIC_LIST( get_metric_func( "categorical_crossentropy" ));
+    float first_loss, loss[2];
+    neuralnet_t *trained[2];
+    for( int mixed = 0; mixed < 2; mixed++ ){
+        trained[mixed] = neuralnet_create( 3, INT_ARRAY( 15, 16, 17, 5 ), STR_ARRAY( "tanh", "relu", "softmax" ));
+        assert( trained[mixed] );
+        neuralnet_set_loss( trained[mixed], "categorical_crossentropy" );
+        for( int l = 0; l < nn->n_layers; l++ ){
+            memcpy( trained[mixed]->layer[l].weight, nn->layer[l].weight, nn->layer[l].n_input * nn->layer[l].n_output * sizeof(float));
+            memcpy( trained[mixed]->layer[l].bias, nn->layer[l].bias, nn->layer[l].n_output * sizeof(float));
+        }
+        optimizer_t *opt = OPTIMIZER( adam_new( trained[mixed], OPTIMIZER_PROPERTIES( .batchsize = 16,
+                        .metrics = metrics, .progress = NULL, .mixed_precision = mixed ),
+                    ADAM_PROPERTIES( .learning_rate = 0.005f )));
+        assert( opt );
+        evaluate( trained[mixed], n_samples, X, Y, metrics, &first_loss );
+        float results[1];
+        for( int epoch = 0; epoch < 10; epoch++ )
+            optimizer_run_epoch( opt, n_samples, X, Y, 0, NULL, NULL, results );
+        evaluate( trained[mixed], n_samples, X, Y, metrics, &loss[mixed] );
+        fprintf( stderr, "    %s: loss %.4f -> %.4f\n", mixed ? "mixed" : "float32", first_loss, loss[mixed] );
+        if( mixed ){
+            CHECK_CONDITION_MSG( opt->bf16_nn != NULL, "Checking that the bfloat16 weights are used" );
+        }
+        optimizer_free( opt );
+    }
+    CHECK_CONDITION_MSG( loss[1] < 0.5f * first_loss, "Checking that the loss decreases" );
+    CHECK_FLOAT_EQUALS_MSG( loss[1], loss[0], 0.1f * loss[0], "Checking the loss against float32 training" );
+
+    /* The updates smaller than the bfloat16 precision are kept in the float32 master weights */
+    int n_not_bf16 = 0;
+    const int n_weights = 15 * 16;
+    uint16_t rounded[15 * 16];
+    float SIMD_ALIGN(weights_back[15 * 16]);
+    vector_to_bf16( n_weights, trained[1]->layer[0].weight, rounded );
+    vector_from_bf16( n_weights, rounded, weights_back );
+    for( int i = 0; i < n_weights; i++ )
+        n_not_bf16 += weights_back[i] != trained[1]->layer[0].weight[i];
+    CHECK_CONDITION_MSG( n_not_bf16 > n_weights / 2, "Checking that the master weights are float32" );
+
+    /* Sparse input is not supported, and this is found when the epoch starts */
+    sparse_matrix_t *sX = sparse_matrix_from_dense( n_samples, 15, X );
+    assert( sX );
+    optimizer_t *opt = OPTIMIZER( adam_new( trained[0], OPTIMIZER_PROPERTIES( .batchsize = 16,
+                    .metrics = metrics, .progress = NULL, .mixed_precision = true ), ADAM_PROPERTIES()));
+    assert( opt );
+    float results[1];
+    optimizer_run_epoch_sparse( opt, sX, Y, NULL, NULL, results );
+    CHECK_CONDITION_MSG( !opt->mixed_precision && opt->bf16_nn == NULL, "Checking that sparse input turns mixed precision off" );
+    optimizer_free( opt );
+    sparse_matrix_free( sX );
+
+    neuralnet_set_loss( nn, "sampled_softmax" );
+    nnb = neuralnet_bf16_new( nn );
+    CHECK_CONDITION_MSG( nnb == NULL, "Checking that the sampled softmax is not supported" );
+
+    neuralnet_free( nn );
+    neuralnet_free( trained[0] );
+    neuralnet_free( trained[1] );
+    free( X );
+    free( Y );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
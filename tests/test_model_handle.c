@@ -0,0 +1,153 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "model_handle.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+
+/* Reader threads predict while the main thread swaps in new networks. Each prediction must be the
+   prediction of the network version that model_handle_predict() reports. (Run this with the address
+   sanitizer to check that no network is freed while it is used.) */
+
+#define N_READERS   4
+#define N_VERSIONS  50
+#define N_INPUTS    16
+#define N_INPUT     13
+#define N_OUTPUT    5
+
+static float expected[N_VERSIONS][N_INPUTS * N_OUTPUT];
+static float inputs[N_INPUTS * N_INPUT];
+
+typedef struct {
+    model_handle_t *handle;
+    int             stop;
+    int             n_predictions;
+    int             n_wrong;
+    unsigned long   last_version;
+    int             n_backwards;
+} reader_job_t;
+
+static void *reader_thread( void *arg )
+{
+    reader_job_t *job = (reader_job_t *) arg;
+    float output[N_INPUTS * N_OUTPUT];
+    for( int i = 0; !__atomic_load_n( &job->stop, __ATOMIC_ACQUIRE ); i++ ){
+        const int sample = i % N_INPUTS;
+        unsigned long version;
+        int n = 1;
+        if( i % 4 == 0 ){
+            version = model_handle_predict_batch( job->handle, N_INPUTS, inputs, output );
+            n = N_INPUTS;
+        } else {
+            version = model_handle_predict( job->handle, inputs + sample * N_INPUT, output );
+        }
+        for( int j = 0; j < n; j++ ){
+            const float *want = expected[version] + (n == 1 ? sample : j) * N_OUTPUT;
+            for( int k = 0; k < N_OUTPUT; k++ )
+                if( fabsf( output[j * N_OUTPUT + k] - want[k] ) > 1.0e-5f ){
+                    job->n_wrong++;
+                    break;
+                }
+        }
+        if( version < job->last_version )
+            job->n_backwards++;
+        job->last_version = version;
+        job->n_predictions++;
+    }
+    return NULL;
+}
+
+static neuralnet_t *new_version( const int version )
+{
+    neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( N_INPUT, 8 + version % 7, N_OUTPUT ), STR_ARRAY( "relu", "softmax" ));
+    assert( nn );
+    neuralnet_initialize( nn, NULL );
+    for( int i = 0; i < N_INPUTS; i++ )
+        neuralnet_predict( nn, inputs + i * N_INPUT, expected[version] + i * N_OUTPUT );
+    return nn;
+}
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    srand( 42 );
+    for( int i = 0; i < N_INPUTS * N_INPUT; i++ )
+        inputs[i] = (float) rand() / (float) RAND_MAX - 0.5f;
+
+    model_handle_t *handle = model_handle_new( new_version( 0 ));
+    CHECK_NOT_NULL_MSG( handle, "Checking that the model handle is created" );
+    assert( handle );
+
+    fprintf(stderr, KBLU "Testing swaps while predicting." KNRM "\n" );
+    reader_job_t job[N_READERS];
+    pthread_t thread[N_READERS];
+    for( int t = 0; t < N_READERS; t++ ){
+        job[t] = (reader_job_t) { .handle = handle };
+        const int started = pthread_create( &thread[t], NULL, reader_thread, &job[t] );
+        assert( started == 0 );
+    }
+    int n_failed_swaps = 0;
+    for( int v = 1; v < N_VERSIONS; v++ ){
+        neuralnet_t *nn = new_version( v );
+        if( model_handle_swap( handle, nn ) < 0 ){
+            n_failed_swaps++;
+            neuralnet_free( nn );
+        }
+    }
+    int n_predictions = 0, n_wrong = 0, n_backwards = 0;
+    for( int t = 0; t < N_READERS; t++ ){
+        __atomic_store_n( &job[t].stop, 1, __ATOMIC_RELEASE );
+        pthread_join( thread[t], NULL );
+        n_predictions += job[t].n_predictions;
+        n_wrong       += job[t].n_wrong;
+        n_backwards   += job[t].n_backwards;
+    }
+    CHECK_INT_EQUALS_MSG( n_failed_swaps, 0, "Checking that the swaps succeed" );
+    CHECK_INT_EQUALS_MSG( (int) model_handle_version( handle ), N_VERSIONS - 1, "Checking the version after the swaps" );
+    CHECK_CONDITION_MSG( n_predictions > 0, "Checking that the readers predicted" );
+    CHECK_INT_EQUALS_MSG( n_wrong, 0, "Checking the predictions during the swaps" );
+    CHECK_INT_EQUALS_MSG( n_backwards, 0, "Checking that the readers never see an older version" );
+
+    fprintf(stderr, KBLU "Testing a network of the wrong size." KNRM "\n" );
+    neuralnet_t *wrong = neuralnet_create( 1, INT_ARRAY( N_INPUT + 1, N_OUTPUT ), STR_ARRAY( "softmax" ));
+    assert( wrong );
+    const int swapped = model_handle_swap( handle, wrong );
+    CHECK_INT_EQUALS_MSG( swapped, -1, "Checking that the swap is refused" );
+    CHECK_INT_EQUALS_MSG( (int) model_handle_version( handle ), N_VERSIONS - 1, "Checking that the version is kept" );
+    neuralnet_free( wrong );
+
+    fprintf(stderr, KBLU "Testing reload from file." KNRM "\n" );
+    neuralnet_t *saved = new_version( 0 );
+    neuralnet_save( saved, "test_model_handle.npz" );
+    int reloaded = model_handle_reload_async( handle, "test_model_handle.npz" );
+    CHECK_INT_EQUALS_MSG( reloaded, 0, "Checking that the reload is started" );
+    reloaded = model_handle_wait( handle );
+    CHECK_INT_EQUALS_MSG( reloaded, 0, "Checking the reload" );
+    float output[N_OUTPUT];
+    const unsigned long version = model_handle_predict( handle, inputs, output );
+    CHECK_INT_EQUALS_MSG( (int) version, N_VERSIONS, "Checking the version of the reloaded network" );
+    float maxdiff = 0.0f;
+    for( int k = 0; k < N_OUTPUT; k++ )
+        if( fabsf( output[k] - expected[0][k] ) > maxdiff )
+            maxdiff = fabsf( output[k] - expected[0][k] );
+    CHECK_FLOAT_EQUALS_MSG( maxdiff, 0.0f, 1.0e-6f, "Checking the prediction of the reloaded network" );
+    neuralnet_free( saved );
+    remove( "test_model_handle.npz" );
+
+    reloaded = model_handle_reload_async( handle, "no_such_file.npz" );
+    reloaded = reloaded == 0 ? model_handle_wait( handle ) : reloaded;
+    CHECK_INT_EQUALS_MSG( reloaded, -1, "Checking that a failed reload is reported" );
+    CHECK_INT_EQUALS_MSG( (int) model_handle_version( handle ), N_VERSIONS, "Checking that the network is kept on failure" );
+
+    model_handle_free( handle );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
@@ -0,0 +1,184 @@
+#define _POSIX_C_SOURCE 200112L  /* setenv() */
+#include "test.h"
+#include "neuralnet.h"
+#include "neuralnet_predict_batch.h"
+#include "sparse_matrix.h"
+#include "optimizer.h"
+#include "optimizer_implementations.h"
+#include "evaluate.h"
+#include "threadpool.h"
+#include "numa_topology.h"
+#include "simd.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* The machine is split into two fake NUMA nodes, such that the grouping of the threads, the
+   reduction per node and the copies of the weights are tested on any machine. */
+
+#define N_THREADS 4
+
+static optimizer_t *new_optimizer( neuralnet_t *nn, metric_func *metrics )
+{
+    return OPTIMIZER( SGD_new( nn, OPTIMIZER_PROPERTIES( .batchsize = 16, .shuffle = false, .metrics = metrics,
+                    .progress = NULL ), SGD_PROPERTIES( .learning_rate = 0.05f, .momentum = 0.5f )));
+}
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    setenv( "NUMA_TOPOLOGY_NODES", "2", 1 );
+
+    fprintf(stderr, KBLU "Testing the topology." KNRM "\n" );
+    CHECK_INT_EQUALS_MSG( numa_topology_n_nodes(), 2, "Checking the number of (fake) nodes" );
+    const int n_cpus = numa_topology_n_cpus();
+    const int n_cpus_on_nodes = numa_topology_node_cpus( 0, NULL, 0 ) + numa_topology_node_cpus( 1, NULL, 0 );
+    CHECK_INT_EQUALS_MSG( n_cpus_on_nodes, n_cpus, "Checking that all the cores are on a node" );
+    CHECK_INT_EQUALS_MSG( numa_topology_node_of_cpu( 1 ), (n_cpus > 1 ? 1 : 0), "Checking the node of a core" );
+    const int node = numa_topology_current_node();
+    CHECK_CONDITION_MSG( node == 0 || node == 1, "Checking the node of this thread" );
+
+    fprintf(stderr, KBLU "Testing the pinned thread pool." KNRM "\n" );
+    threadpool_t *pool = threadpool_new( N_THREADS );
+    assert( pool );
+    const int pinned = threadpool_pin( pool, THREADPOOL_PIN_SCATTER );
+    CHECK_INT_EQUALS_MSG( pinned, 0, "Checking that the threads are pinned" );
+    CHECK_INT_EQUALS_MSG( threadpool_n_nodes( pool ), 2, "Checking that the threads are on both nodes" );
+    const threadpool_group_t *group = threadpool_group( pool, 3 );
+    CHECK_CONDITION_MSG( group->node == 1 && group->index == 1 && group->leader == 1 && group->rank == 1 && group->size == 2,
+            "Checking the group of a thread" );
+
+    const int n_rows = 1000, n_cols = 37;
+    float *data = malloc( n_rows * n_cols * sizeof(float));
+    assert( data );
+    for( int i = 0; i < n_rows * n_cols; i++ )
+        data[i] = (float) i;
+    float *placed = threadpool_place_interleaved( pool, n_rows, n_cols, data, 32 );
+    CHECK_NOT_NULL_MSG( placed, "Checking that the dataset is copied" );
+    CHECK_CONDITION_MSG( placed && !memcmp( placed, data, n_rows * n_cols * sizeof(float)),
+            "Checking the copy of the dataset" );
+    simd_free_huge( placed );
+    free( data );
+
+    /* Training with the reduction per node */
+    const int n_samples = 300;
+    const int n_input   = 41;
+    const int n_output  = 3;
+
+    srand( 42 );
+    float *X = calloc( n_samples * n_input, sizeof(float));
+    float *Y = calloc( n_samples * n_output, sizeof(float));
+    assert( X && Y );
+    for( int i = 0; i < n_samples; i++ ){
+        const int label = rand() % n_output;
+        for( int j = 0; j < n_input; j++ )
+            if( rand() % 10 == 0 || j % 20 == label ) X[i*n_input + j] = 1.0f;
+        Y[i*n_output + label] = 1.0f;
+    }
+    sparse_matrix_t *sX = sparse_matrix_from_dense( n_samples, n_input, X );
+    assert( sX );
+
+    neuralnet_t *nn     = neuralnet_create( 2, INT_ARRAY( n_input, 19, n_output ), STR_ARRAY( "relu", "softmax" ));
+    neuralnet_t *omp    = neuralnet_create( 2, INT_ARRAY( n_input, 19, n_output ), STR_ARRAY( "relu", "softmax" ));
+    neuralnet_t *pooled = neuralnet_create( 2, INT_ARRAY( n_input, 19, n_output ), STR_ARRAY( "relu", "softmax" ));
+    assert( nn && omp && pooled );
+    neuralnet_initialize( nn, NULL );
+    neuralnet_set_loss( nn, "categorical_crossentropy" );
+    neuralnet_set_loss( omp, "categorical_crossentropy" );
+    neuralnet_set_loss( pooled, "categorical_crossentropy" );
+
+    const int n_params = neuralnet_total_n_parameters( nn );
+    float *omp_params    = malloc( n_params * sizeof(float));
+    float *pooled_params = malloc( n_params * sizeof(float));
+    assert( omp_params && pooled_params );
+    metric_func *metrics = METRIC_LIST( get_metric_func( "categorical_crossentropy" ));
+
+    for( int sparse = 0; sparse < 2; sparse++ ){
+        neuralnet_copy_weights( omp, nn );
+        neuralnet_copy_weights( pooled, nn );
+        optimizer_t *omp_opt    = new_optimizer( omp, metrics );
+        optimizer_t *pooled_opt = new_optimizer( pooled, metrics );
+        assert( omp_opt && pooled_opt );
+        float results[1];
+        for( int epoch = 0; epoch < 2; epoch++ ){
+            threadpool_set_default( NULL );
+            if( sparse )
+                optimizer_run_epoch_sparse( omp_opt, sX, Y, NULL, NULL, results );
+            else
+                optimizer_run_epoch( omp_opt, n_samples, X, Y, 0, NULL, NULL, results );
+            threadpool_set_default( pool );
+            if( sparse )
+                optimizer_run_epoch_sparse( pooled_opt, sX, Y, NULL, NULL, results );
+            else
+                optimizer_run_epoch( pooled_opt, n_samples, X, Y, 0, NULL, NULL, results );
+        }
+        threadpool_set_default( NULL );
+        neuralnet_get_parameters( omp, omp_params );
+        neuralnet_get_parameters( pooled, pooled_params );
+        CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( n_params, omp_params, pooled_params ), 0.0f, 1.0e-4f,
+                sparse ? "Checking the weights with sparse input and the reduction per node" :
+                         "Checking the weights with the reduction per node" );
+        optimizer_free( omp_opt );
+        optimizer_free( pooled_opt );
+    }
+
+    fprintf(stderr, KBLU "Testing the copies of the weights on the nodes." KNRM "\n" );
+    float *expected  = simd_malloc( n_samples * n_output * sizeof(float));
+    float *predicted = simd_malloc( n_samples * n_output * sizeof(float));
+    assert( expected && predicted );
+    neuralnet_predict_batch( pooled, n_samples, X, expected );
+
+    const int replicated = neuralnet_replicate_nodes( pooled );
+    CHECK_INT_EQUALS_MSG( replicated, 0, "Checking that the weights are copied to the nodes" );
+    CHECK_CONDITION_MSG( neuralnet_local_replica( pooled ) != pooled, "Checking that the local copy is used" );
+    neuralnet_predict_batch( pooled, n_samples, X, predicted );
+    CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( n_samples * n_output, expected, predicted ), 0.0f, 0.0f,
+            "Checking the predictions of the copies" );
+
+    /* The optimizer syncs the copies, so the train loss is the loss of the trained weights */
+    float before[1], trained[1], expected_loss[1];
+    evaluate( pooled, n_samples, X, Y, metrics, before );
+    optimizer_t *opt = new_optimizer( pooled, metrics );
+    assert( opt );
+    optimizer_run_epoch( opt, n_samples, X, Y, 0, NULL, NULL, trained );
+    neuralnet_t *plain = neuralnet_clone_structure( pooled );
+    assert( plain );
+    neuralnet_copy_weights( plain, pooled );
+    evaluate( plain, n_samples, X, Y, metrics, expected_loss );
+    CHECK_CONDITION_MSG( trained[0] < before[0], "Checking that the epoch trains" );
+    CHECK_FLOAT_EQUALS_MSG( trained[0], expected_loss[0], 1.0e-6f, "Checking the train loss with the copies" );
+
+    optimizer_step( opt, 16, X, Y );
+    neuralnet_copy_weights( plain, pooled );
+    neuralnet_predict_batch( plain, n_samples, X, expected );
+    neuralnet_predict_batch( pooled, n_samples, X, predicted );
+    CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( n_samples * n_output, expected, predicted ), 0.0f, 0.0f,
+            "Checking the copies after a step" );
+    optimizer_free( opt );
+    neuralnet_free( plain );
+
+    const int unpinned = threadpool_pin( pool, THREADPOOL_PIN_NONE );
+    CHECK_INT_EQUALS_MSG( unpinned, 0, "Checking that the threads are unpinned" );
+    CHECK_INT_EQUALS_MSG( threadpool_n_nodes( pool ), 1, "Checking that the threads are in one group" );
+
+    threadpool_free( pool );
+    simd_free( expected );
+    simd_free( predicted );
+    neuralnet_free( nn );
+    neuralnet_free( omp );
+    neuralnet_free( pooled );
+    sparse_matrix_free( sX );
+    free( omp_params );
+    free( pooled_params );
+    free( X );
+    free( Y );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
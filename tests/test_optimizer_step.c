@@ -0,0 +1,149 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "optimizer.h"
+#include "optimizer_implementations.h"
+#include "evaluate.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* optimizer_step() on the batches of an epoch, in order, should give the same weights as
+   optimizer_run_epoch() without shuffling. Two optimizers of the same kind are run at the same
+   time, such that state shared between them would make a difference. */
+
+#define N_OPTIMIZERS 4
+
+static optimizer_t *new_optimizer( int which, neuralnet_t *nn, metric_func *metrics, int batchsize, bool shuffle )
+{
+    const optimizer_properties_t props = OPTIMIZER_PROPERTIES( .batchsize = batchsize, .shuffle = shuffle,
+            .metrics = metrics, .progress = NULL );
+    switch( which ){
+        case 0:  return OPTIMIZER( SGD_new( nn, props, SGD_PROPERTIES( .learning_rate = 0.05f, .momentum = 0.5f )));
+        case 1:  return OPTIMIZER( adagrad_new( nn, props, ADAGRAD_PROPERTIES( .learning_rate = 0.05f )));
+        case 2:  return OPTIMIZER( RMSprop_new( nn, props, RMSPROP_PROPERTIES( .learning_rate = 0.01f )));
+        default: return OPTIMIZER( adam_new( nn, props, ADAM_PROPERTIES( .learning_rate = 0.01f )));
+    }
+}
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    const int n_samples = 200;
+    const int n_input   = 10;
+    const int n_output  = 3;
+    const int batchsize = 16;   /* The last batch of an epoch is smaller */
+
+    srand( 42 );
+    float *X = malloc( n_samples * n_input * sizeof(float));
+    float *Y = calloc( n_samples * n_output, sizeof(float));
+    assert( X && Y );
+    for( int i = 0; i < n_samples; i++ ){
+        const int label = rand() % n_output;
+        for( int j = 0; j < n_input; j++ )
+            X[i*n_input + j] = (float) rand() / (float) RAND_MAX + (j % n_output == label ? 0.5f : 0.0f);
+        Y[i*n_output + label] = 1.0f;
+    }
+
+    neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( n_input, 16, n_output ), STR_ARRAY( "relu", "softmax" ));
+    assert( nn );
+    neuralnet_initialize( nn, NULL );
+    neuralnet_set_loss( nn, "categorical_crossentropy" );
+    neuralnet_t *epoch_nn[2], *step_nn[2];
+    for( int k = 0; k < 2; k++ ){
+        epoch_nn[k] = neuralnet_create( 2, INT_ARRAY( n_input, 16, n_output ), STR_ARRAY( "relu", "softmax" ));
+        step_nn[k]  = neuralnet_create( 2, INT_ARRAY( n_input, 16, n_output ), STR_ARRAY( "relu", "softmax" ));
+        assert( epoch_nn[k] && step_nn[k] );
+        neuralnet_set_loss( epoch_nn[k], "categorical_crossentropy" );
+        neuralnet_set_loss( step_nn[k], "categorical_crossentropy" );
+    }
+
+    const int n_params = neuralnet_total_n_parameters( nn );
+    float *epoch_params = malloc( n_params * sizeof(float));
+    float *step_params  = malloc( n_params * sizeof(float));
+    assert( epoch_params && step_params );
+
+    metric_func *metrics = METRIC_LIST( get_metric_func( "categorical_crossentropy" ));
+    const char *names[N_OPTIMIZERS] = { "SGD", "adagrad", "RMSprop", "adam" };
+
+    for( int which = 0; which < N_OPTIMIZERS; which++ ){
+        fprintf(stderr, KBLU "Testing steps of %s." KNRM "\n", names[which] );
+        optimizer_t *epoch_opt[2], *step_opt[2];
+        for( int k = 0; k < 2; k++ ){
+            neuralnet_copy_weights( epoch_nn[k], nn );
+            neuralnet_copy_weights( step_nn[k], nn );
+            epoch_opt[k] = new_optimizer( which, epoch_nn[k], metrics, batchsize, false );
+            step_opt[k]  = new_optimizer( which, step_nn[k], metrics, batchsize, false );
+            assert( epoch_opt[k] && step_opt[k] );
+        }
+
+        /* The second optimizer of each pair trains on the second half of the data */
+        float results[1];
+        for( int epoch = 0; epoch < 3; epoch++ ){
+            for( int k = 0; k < 2; k++ )
+                optimizer_run_epoch( epoch_opt[k], n_samples / 2, X + k * (n_samples / 2) * n_input,
+                        Y + k * (n_samples / 2) * n_output, 0, NULL, NULL, results );
+            for( int start = 0; start < n_samples / 2; start += batchsize ){
+                const int n = start + batchsize < n_samples / 2 ? batchsize : n_samples / 2 - start;
+                for( int k = 0; k < 2; k++ ){
+                    const int first = k * (n_samples / 2) + start;
+                    optimizer_step( step_opt[k], n, X + first * n_input, Y + first * n_output );
+                }
+            }
+        }
+        float maxdiff = 0.0f;
+        for( int k = 0; k < 2; k++ ){
+            neuralnet_get_parameters( epoch_nn[k], epoch_params );
+            neuralnet_get_parameters( step_nn[k], step_params );
+            const float diff = test_max_abs_diff( n_params, epoch_params, step_params );
+            if( diff > maxdiff ) maxdiff = diff;
+        }
+        CHECK_FLOAT_EQUALS_MSG( maxdiff, 0.0f, 1.0e-5f, "Checking that the steps give the same weights as the epochs" );
+        CHECK_INT_EQUALS_MSG( step_opt[0]->epoch, 0, "Checking that the steps are not counted as epochs" );
+        CHECK_INT_EQUALS_MSG( step_opt[0]->batchsize, batchsize, "Checking that the batchsize is kept" );
+        CHECK_CONDITION_MSG( step_opt[0]->pivot == NULL, "Checking that the steps use no pivot" );
+
+        for( int k = 0; k < 2; k++ ){
+            optimizer_free( epoch_opt[k] );
+            optimizer_free( step_opt[k] );
+        }
+    }
+
+    /* The pivot of each optimizer follows its own number of samples */
+    fprintf(stderr, KBLU "Testing the pivots of two optimizers." KNRM "\n" );
+    optimizer_t *a = new_optimizer( 0, epoch_nn[0], metrics, batchsize, true );
+    optimizer_t *b = new_optimizer( 0, epoch_nn[1], metrics, batchsize, true );
+    assert( a && b );
+    float results[1], expected[1];
+    optimizer_run_epoch( a, n_samples, X, Y, 0, NULL, NULL, results );
+    optimizer_run_epoch( b, n_samples, X, Y, 0, NULL, NULL, results );
+    optimizer_run_epoch( a, n_samples / 2, X, Y, 0, NULL, NULL, results );
+    optimizer_run_epoch( b, n_samples / 2, X, Y, 0, NULL, NULL, results );
+    int out_of_range = 0;
+    for( int i = 0; i < n_samples / 2; i++ )
+        if( b->pivot[i] >= (unsigned int) n_samples / 2 )
+            out_of_range++;
+    CHECK_INT_EQUALS_MSG( out_of_range, 0, "Checking that the pivot only has rows of the training set" );
+    evaluate( epoch_nn[1], n_samples / 2, X, Y, metrics, expected );
+    CHECK_FLOAT_EQUALS_MSG( results[0], expected[0], 1.0e-6f, "Checking the train loss of the smaller set" );
+    optimizer_free( a );
+    optimizer_free( b );
+
+    neuralnet_free( nn );
+    for( int k = 0; k < 2; k++ ){
+        neuralnet_free( epoch_nn[k] );
+        neuralnet_free( step_nn[k] );
+    }
+    free( epoch_params );
+    free( step_params );
+    free( X );
+    free( Y );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
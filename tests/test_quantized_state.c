@@ -0,0 +1,168 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "optimizer.h"
+#include "optimizer_implementations.h"
+#include "quantized_state.h"
+#include "evaluate.h"
+#include "simd.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define N_VALUES 100   /* One whole block and one partial block */
+
+/* The largest error of a round trip through the state, relative to the largest value of each block */
+static float round_trip_error( const optimizer_state_format_t format, const float *x, int *n_nonzero_tail )
+{
+    quantized_state_t *qs = quantized_state_new( N_VALUES, format );
+    assert( qs );
+    float SIMD_ALIGN(block[QUANTIZED_STATE_BLOCK]);
+    float max_error = 0.0f;
+    for( unsigned int b = 0; b < quantized_state_n_blocks( qs ); b++ ){
+        const int offset = b * QUANTIZED_STATE_BLOCK;
+        const int n = N_VALUES - offset < QUANTIZED_STATE_BLOCK ? N_VALUES - offset : QUANTIZED_STATE_BLOCK;
+        float absmax = 0.0f;
+        memset( block, 0, sizeof(block));
+        memcpy( block, x + offset, n * sizeof(float));
+        for( int i = 0; i < n; i++ )
+            absmax = fmaxf( absmax, fabsf( block[i] ));
+        quantized_state_store( qs, b, block );
+        memset( block, 0xff, sizeof(block));
+        quantized_state_load( qs, b, block );
+        for( int i = 0; i < n; i++ )
+            max_error = fmaxf( max_error, fabsf( block[i] - x[offset + i] ) / absmax );
+        for( int i = n; i < QUANTIZED_STATE_BLOCK; i++ )
+            *n_nonzero_tail += block[i] != 0.0f;
+    }
+    quantized_state_free( qs );
+    return max_error;
+}
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    fprintf(stderr, KBLU "Testing the round trips of the state." KNRM "\n" );
+    srand( 42 );
+    float x[N_VALUES];
+    for( int i = 0; i < N_VALUES; i++ )
+        x[i] = ((float) rand() / (float) RAND_MAX - 0.5f) * powf( 10.0f, (float) (i % 5) - 2.0f );
+
+    quantized_state_t *qs = quantized_state_new( N_VALUES, OPTIMIZER_STATE_INT8 );
+    CHECK_NOT_NULL_MSG( qs, "Checking that the state is created" );
+    assert( qs );
+    CHECK_INT_EQUALS_MSG( (int) quantized_state_n_blocks( qs ), 2, "Checking the number of blocks" );
+    CHECK_INT_EQUALS_MSG( (int) quantized_state_bytes( qs ), 2 * (QUANTIZED_STATE_BLOCK + 4), "Checking the size of the int8 state" );
+    float SIMD_ALIGN(block[QUANTIZED_STATE_BLOCK]);
+    quantized_state_load( qs, 1, block );
+    float sum = 0.0f;
+    for( int i = 0; i < QUANTIZED_STATE_BLOCK; i++ )
+        sum += fabsf( block[i] );
+    CHECK_FLOAT_EQUALS_MSG( sum, 0.0f, 0.0f, "Checking that a new state is zero" );
+    quantized_state_free( qs );
+    qs = quantized_state_new( N_VALUES, OPTIMIZER_STATE_FP32 );
+    CHECK_CONDITION_MSG( qs == NULL, "Checking that fp32 is not quantized" );
+
+    int n_nonzero_tail = 0;
+    float error = round_trip_error( OPTIMIZER_STATE_BF16, x, &n_nonzero_tail );
+    CHECK_FLOAT_EQUALS_MSG( error, 0.0f, 1.0f / 256.0f, "Checking the round trip of bf16" );
+    error = round_trip_error( OPTIMIZER_STATE_INT8, x, &n_nonzero_tail );
+    CHECK_FLOAT_EQUALS_MSG( error, 0.0f, 1.0f / 127.0f + 1.0e-6f, "Checking the round trip of int8" );
+    CHECK_INT_EQUALS_MSG( n_nonzero_tail, 0, "Checking that the tail of the last block stays zero" );
+
+    /* The bf16 values are rounded to the nearest even */
+    qs = quantized_state_new( 1, OPTIMIZER_STATE_BF16 );
+    assert( qs );
+    memset( block, 0, sizeof(block));
+    block[0] = 1.0f + 1.0f / 256.0f;      /* Halfway between 1 and 1 + 2^-7 */
+    block[1] = 1.0f + 3.0f / 256.0f;      /* Halfway between 1 + 2^-7 and 1 + 2^-6 */
+    block[2] = -3.0e38f;
+    quantized_state_store( qs, 0, block );
+    quantized_state_load( qs, 0, block );
+    CHECK_FLOAT_EQUALS_MSG( block[0], 1.0f, 0.0f, "Checking rounding down to even" );
+    CHECK_FLOAT_EQUALS_MSG( block[1], 1.0f + 4.0f / 256.0f, 0.0f, "Checking rounding up to even" );
+    CHECK_CONDITION_MSG( block[2] < -2.9e38f && isfinite( block[2] ), "Checking a large value" );
+    quantized_state_free( qs );
+
+    /* The small values of an int8 block keep their precision */
+    qs = quantized_state_new( QUANTIZED_STATE_BLOCK, OPTIMIZER_STATE_INT8 );
+    assert( qs );
+    memset( block, 0, sizeof(block));
+    block[0] = 1.0f;
+    block[1] = 1.0e-3f;
+    block[2] = -1.0e-4f;
+    quantized_state_store( qs, 0, block );
+    quantized_state_load( qs, 0, block );
+    CHECK_FLOAT_EQUALS_MSG( block[0], 1.0f, 1.0e-6f, "Checking the largest value of the block" );
+    CHECK_FLOAT_EQUALS_MSG( block[1], 1.0e-3f, 5.0e-5f, "Checking a small value of the block" );
+    CHECK_CONDITION_MSG( block[2] < 0.0f, "Checking that a very small value is not rounded to zero" );
+    quantized_state_free( qs );
+
+    fprintf(stderr, KBLU "Testing adam with a quantized state." KNRM "\n" );
+    const int n_samples = 512;
+    const int n_input   = 10;
+    const int n_output  = 3;
+    float *X = malloc( n_samples * n_input * sizeof(float));
+    float *Y = calloc( n_samples * n_output, sizeof(float));
+    assert( X && Y );
+    for( int i = 0; i < n_samples; i++ ){
+        const int label = rand() % n_output;
+        for( int j = 0; j < n_input; j++ )
+            X[i*n_input + j] = (float) rand() / (float) RAND_MAX + (j % n_output == label ? 0.5f : 0.0f);
+        Y[i*n_output + label] = 1.0f;
+    }
+    neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( n_input, 32, n_output ), STR_ARRAY( "relu", "softmax" ));
+    assert( nn );
+    neuralnet_initialize( nn, NULL );
+    neuralnet_t *trained = neuralnet_create( 2, INT_ARRAY( n_input, 32, n_output ), STR_ARRAY( "relu", "softmax" ));
+    assert( trained );
+    neuralnet_set_loss( trained, "categorical_crossentropy" );
+    metric_func *metrics = METRIC_LIST( get_metric_func( "categorical_crossentropy" ));
+
+    const int n_params = neuralnet_total_n_parameters( nn );
+    float *fp32_params = malloc( n_params * sizeof(float));
+    float *params = malloc( n_params * sizeof(float));
+    assert( fp32_params && params );
+    const char *names[3] = { "fp32", "bf16", "int8" };
+    float first_loss = 0.0f;
+    for( optimizer_state_format_t format = OPTIMIZER_STATE_FP32; format <= OPTIMIZER_STATE_INT8; format++ ){
+        neuralnet_copy_weights( trained, nn );
+        optimizer_t *opt = OPTIMIZER( adam_new( trained, OPTIMIZER_PROPERTIES( .batchsize = 16, .shuffle = false,
+                        .metrics = metrics, .progress = NULL ),
+                    ADAM_PROPERTIES( .learning_rate = 0.005f, .state_format = format )));
+        assert( opt );
+        float results[1], loss;
+        evaluate( trained, n_samples, X, Y, metrics, &first_loss );
+        for( int epoch = 0; epoch < 10; epoch++ )
+            optimizer_run_epoch( opt, n_samples, X, Y, 0, NULL, NULL, results );
+        evaluate( trained, n_samples, X, Y, metrics, &loss );
+        fprintf( stderr, "    %s: loss %.4f -> %.4f\n", names[format], first_loss, loss );
+        CHECK_CONDITION_MSG( loss < 0.5f * first_loss, "Checking that the loss decreases" );
+        if( format == OPTIMIZER_STATE_FP32 ){
+            neuralnet_get_parameters( trained, fp32_params );
+        } else {
+            neuralnet_get_parameters( trained, params );
+            float maxdiff = 0.0f;
+            for( int i = 0; i < n_params; i++ )
+                maxdiff = fmaxf( maxdiff, fabsf( params[i] - fp32_params[i] ));
+            fprintf( stderr, "    %s: largest difference of the weights from fp32 %.4f\n", names[format], maxdiff );
+            CHECK_FLOAT_EQUALS_MSG( maxdiff, 0.0f, 0.1f, "Checking that the weights are close to the fp32 state" );
+        }
+        optimizer_free( opt );
+    }
+
+    neuralnet_free( nn );
+    neuralnet_free( trained );
+    free( fp32_params );
+    free( params );
+    free( X );
+    free( Y );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
@@ -0,0 +1,209 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "evaluate.h"
+#include "metrics.h"
+#include "ranking_metrics.h"
+#include "simd.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* The ranking metrics are compared with the definitions: The ROC area is the probability that a
+   random positive scores higher than a random negative (ties count half), and the PR area is the
+   average precision. */
+
+static double brute_roc_auc( int n, const float *score, const int *positive )
+{
+    double correct = 0.0, pairs = 0.0;
+    for( int i = 0; i < n; i++ ){
+        if( !positive[i] ) continue;
+        for( int j = 0; j < n; j++ ){
+            if( positive[j] ) continue;
+            correct += score[i] > score[j] ? 1.0 : score[i] == score[j] ? 0.5 : 0.0;
+            pairs += 1.0;
+        }
+    }
+    return correct / pairs;
+}
+
+static double brute_average_precision( int n, const float *score, const int *positive )
+{
+    /* Precision at the threshold of each positive, with all samples of equal score included */
+    double sum = 0.0;
+    int n_pos = 0;
+    for( int i = 0; i < n; i++ ){
+        if( !positive[i] ) continue;
+        n_pos++;
+        int tp = 0, all = 0;
+        for( int j = 0; j < n; j++ ){
+            if( score[j] >= score[i] ){
+                all++;
+                tp += positive[j];
+            }
+        }
+        sum += (double) tp / (double) all;
+    }
+    return sum / n_pos;
+}
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    const char *names[] = { "roc_auc", "pr_auc", "roc_auc_exact", "pr_auc_exact" };
+    int names_ok = 1;
+    for( int i = 0; i < 4; i++ ){
+        metric_func m = get_metric_func( names[i] );
+        names_ok &= m != NULL && metric_is_ranking( m ) && !strcmp( get_metric_name( m ), names[i] );
+    }
+    CHECK_CONDITION_MSG( names_ok, "Checking the names of the ranking metrics" );
+    CHECK_CONDITION_MSG( !metric_is_ranking( get_metric_func( "binary_accuracy" )), "Checking that accuracy is not a ranking metric" );
+
+    const metric_func roc = get_metric_func( "roc_auc" );
+    const metric_func pr = get_metric_func( "pr_auc" );
+    const metric_func roc_exact = get_metric_func( "roc_auc_exact" );
+    const metric_func pr_exact = get_metric_func( "pr_auc_exact" );
+
+    /* Scores with a signal and some ties */
+    const int n = 2000;
+    srand( 42 );
+    float *score = malloc( n * sizeof(float));
+    float *target = malloc( n * sizeof(float));
+    int *positive = malloc( n * sizeof(int));
+    assert( score && target && positive );
+    for( int i = 0; i < n; i++ ){
+        positive[i] = rand() % 3 == 0;
+        target[i] = (float) positive[i];
+        const float noise = (float) rand() / (float) RAND_MAX;
+        score[i] = rand() % 10 == 0 ? 0.25f : 0.3f * (float) positive[i] + 0.7f * noise;
+    }
+    const double expected_roc = brute_roc_auc( n, score, positive );
+    const double expected_ap  = brute_average_precision( n, score, positive );
+
+    ranking_state_t *rs = ranking_state_new( true );
+    assert( rs );
+    ranking_state_add( rs, n, 1, score, target, 1 );
+    float value = ranking_state_result( rs, roc_exact );
+    CHECK_FLOAT_EQUALS_MSG( value, (float) expected_roc, 1.0e-6f, "Checking exact ROC AUC" );
+    value = ranking_state_result( rs, pr_exact );
+    CHECK_FLOAT_EQUALS_MSG( value, (float) expected_ap, 1.0e-6f, "Checking exact PR AUC" );
+    value = ranking_state_result( rs, roc );
+    CHECK_FLOAT_EQUALS_MSG( value, (float) expected_roc, 1.0e-3f, "Checking ROC AUC from the histograms" );
+    value = ranking_state_result( rs, pr );
+    CHECK_FLOAT_EQUALS_MSG( value, (float) expected_ap, 1.0e-3f, "Checking PR AUC from the histograms" );
+    ranking_state_free( rs );
+
+    /* Sorted in parts and merged, as done by the threads in evaluate() */
+    ranking_state_t *merged = ranking_state_new( true );
+    assert( merged );
+    for( int part = 0; part < 3; part++ ){
+        ranking_state_t *local = ranking_state_new( true );
+        assert( local );
+        const int first = part * n / 3, last = (part + 1) * n / 3;
+        ranking_state_add( local, last - first, 1, score + first, target + first, 1 );
+        ranking_state_sort( local );
+        ranking_state_merge( merged, local );
+        ranking_state_free( local );
+    }
+    value = ranking_state_result( merged, roc_exact );
+    CHECK_FLOAT_EQUALS_MSG( value, (float) expected_roc, 1.0e-6f, "Checking exact ROC AUC of merged states" );
+    value = ranking_state_result( merged, roc );
+    CHECK_FLOAT_EQUALS_MSG( value, (float) expected_roc, 1.0e-3f, "Checking ROC AUC of merged histograms" );
+    ranking_state_free( merged );
+
+    /* A perfect ranking, all ties and no positives */
+    float perfect[4] = { 0.9f, 0.8f, 0.2f, 0.1f };
+    float labels[4]  = { 1.0f, 1.0f, 0.0f, 0.0f };
+    float ties[4]    = { 0.5f, 0.5f, 0.5f, 0.5f };
+    float none[4]    = { 0.0f, 0.0f, 0.0f, 0.0f };
+    rs = ranking_state_new( true );
+    assert( rs );
+    ranking_state_add( rs, 4, 1, perfect, labels, 1 );
+    value = ranking_state_result( rs, roc );
+    CHECK_FLOAT_EQUALS_MSG( value, 1.0f, 1.0e-6f, "Checking ROC AUC of a perfect ranking" );
+    value = ranking_state_result( rs, pr_exact );
+    CHECK_FLOAT_EQUALS_MSG( value, 1.0f, 1.0e-6f, "Checking PR AUC of a perfect ranking" );
+    ranking_state_free( rs );
+    rs = ranking_state_new( true );
+    assert( rs );
+    ranking_state_add( rs, 4, 1, ties, labels, 1 );
+    value = ranking_state_result( rs, roc_exact );
+    CHECK_FLOAT_EQUALS_MSG( value, 0.5f, 1.0e-6f, "Checking ROC AUC with all scores equal" );
+    ranking_state_free( rs );
+    rs = ranking_state_new( false );
+    assert( rs );
+    ranking_state_add( rs, 4, 1, perfect, none, 1 );
+    value = ranking_state_result( rs, roc );
+    CHECK_FLOAT_EQUALS_MSG( value, 0.5f, 0.0f, "Checking ROC AUC without positives" );
+    value = ranking_state_result( rs, roc_exact );
+    CHECK_CONDITION_MSG( isnan( value ), "Checking that the exact metric needs the exact mode" );
+    ranking_state_free( rs );
+
+    /* In evaluate() together with other metrics */
+    const int n_input = 9;
+    float *X = malloc( n * n_input * sizeof(float));
+    assert( X );
+    for( int i = 0; i < n * n_input; i++ )
+        X[i] = 2.0f * (float) rand() / (float) RAND_MAX - 1.0f;
+    for( int i = 0; i < n; i++ ){
+        positive[i] = X[i*n_input] + 0.5f * X[i*n_input + 1] + 0.3f * (float) rand() / (float) RAND_MAX > 0.1f;
+        target[i] = (float) positive[i];
+    }
+
+    neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( n_input, 12, 1 ), STR_ARRAY( "relu", "sigmoid" ));
+    assert( nn );
+    neuralnet_initialize( nn, NULL );
+    neuralnet_set_loss( nn, "binary_crossentropy" );
+    float acc = 0.0f;
+    for( int i = 0; i < n; i++ ){
+        SIMD_ALIGN(float y_pred[1]);
+        neuralnet_predict( nn, X + i*n_input, y_pred );
+        score[i] = y_pred[0];
+        acc += get_metric_func( "binary_accuracy" )( 1, y_pred, target + i );
+    }
+    metric_func *metrics = METRIC_LIST( get_metric_func( "binary_accuracy" ), roc, pr_exact, roc_exact );
+    float results[4];
+    evaluate( nn, n, X, target, metrics, results );
+    CHECK_FLOAT_EQUALS_MSG( results[0], acc / n, 1.0e-6f, "Checking that the other metrics are not changed" );
+    CHECK_FLOAT_EQUALS_MSG( results[1], (float) brute_roc_auc( n, score, positive ), 1.0e-3f, "Checking ROC AUC in evaluate()" );
+    CHECK_FLOAT_EQUALS_MSG( results[2], (float) brute_average_precision( n, score, positive ), 1.0e-5f, "Checking exact PR AUC in evaluate()" );
+    CHECK_FLOAT_EQUALS_MSG( results[3], (float) brute_roc_auc( n, score, positive ), 1.0e-5f, "Checking exact ROC AUC in evaluate()" );
+    neuralnet_free( nn );
+
+    /* Class labels with a softmax output: Output k of a sample is a positive if the label is k */
+    const int n_output = 3;
+    float *scores = malloc( n * n_output * sizeof(float));
+    int *is_label = malloc( n * n_output * sizeof(int));
+    assert( scores && is_label );
+    for( int i = 0; i < n; i++ )
+        target[i] = (float) (rand() % n_output);
+    nn = neuralnet_create( 2, INT_ARRAY( n_input, 12, n_output ), STR_ARRAY( "relu", "softmax" ));
+    assert( nn );
+    neuralnet_initialize( nn, NULL );
+    neuralnet_set_loss( nn, "sparse_categorical_crossentropy" );
+    for( int i = 0; i < n; i++ ){
+        neuralnet_predict( nn, X + i*n_input, scores + i*n_output );
+        for( int k = 0; k < n_output; k++ )
+            is_label[i*n_output + k] = (int) target[i] == k;
+    }
+    metrics = METRIC_LIST( get_metric_func( "sparse_categorical_crossentropy" ), roc_exact );
+    evaluate( nn, n, X, target, metrics, results );
+    CHECK_FLOAT_EQUALS_MSG( results[1], (float) brute_roc_auc( n * n_output, scores, is_label ), 1.0e-5f,
+            "Checking ROC AUC with class labels and the fused softmax" );
+    neuralnet_free( nn );
+
+    free( scores );
+    free( is_label );
+    free( X );
+    free( score );
+    free( target );
+    free( positive );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
@@ -0,0 +1,199 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "optimizer.h"
+#include "optimizer_implementations.h"
+#include "replay_buffer.h"
+#include "evaluate.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+
+/* Producers append rows where all the values are given by the first one, while a sampler samples.
+   A row that is read while it is overwritten (a torn row) would have values from two rows. */
+
+#define N_PRODUCERS  4
+#define N_APPEND     20000
+#define N_INPUT      37
+#define N_TARGET     3
+
+static void make_row( const float v, float *input, float *target )
+{
+    for( int k = 0; k < N_INPUT; k++ )
+        input[k] = v + (float) k;
+    for( int k = 0; k < N_TARGET; k++ )
+        target[k] = 2.0f * v - (float) k;
+}
+
+static int row_is_consistent( const float *input, const float *target )
+{
+    float x[N_INPUT], y[N_TARGET];
+    make_row( input[0], x, y );
+    return memcmp( x, input, sizeof(x)) == 0 && memcmp( y, target, sizeof(y)) == 0;
+}
+
+typedef struct {
+    replay_buffer_t *rb;
+    int              id;
+} producer_job_t;
+
+static void *producer_thread( void *arg )
+{
+    producer_job_t *job = (producer_job_t *) arg;
+    float input[N_INPUT], target[N_TARGET];
+    for( int i = 0; i < N_APPEND; i++ ){
+        make_row( (float) (job->id * N_APPEND + i), input, target );
+        replay_buffer_append( job->rb, input, target );
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    float input[N_INPUT], target[N_TARGET];
+    float X[64 * N_INPUT], Y[64 * N_TARGET];
+    unsigned int slots[64];
+    unsigned int seed = 42;
+
+    fprintf(stderr, KBLU "Testing the size and the wraparound." KNRM "\n" );
+    replay_buffer_t *rb = replay_buffer_new( N_INPUT, N_TARGET, REPLAY_BUFFER_PROPERTIES( .capacity = 8 ));
+    CHECK_NOT_NULL_MSG( rb, "Checking that the replay buffer is created" );
+    assert( rb );
+    int n = replay_buffer_sample( rb, 4, X, Y, NULL, NULL, &seed );
+    CHECK_INT_EQUALS_MSG( n, 0, "Checking that an empty buffer samples nothing" );
+    unsigned long number = 0;
+    for( int t = 0; t < 20; t++ ){
+        make_row( (float) t, input, target );
+        number = replay_buffer_append( rb, input, target );
+    }
+    CHECK_INT_EQUALS_MSG( (int) number, 19, "Checking the number of the last row" );
+    CHECK_INT_EQUALS_MSG( (int) replay_buffer_size( rb ), 8, "Checking the size of a full buffer" );
+    n = replay_buffer_sample( rb, 64, X, Y, slots, NULL, &seed );
+    CHECK_INT_EQUALS_MSG( n, 64, "Checking the number of sampled rows" );
+    int n_old = 0, n_wrong = 0;
+    for( int j = 0; j < n; j++ ){
+        if( X[j * N_INPUT] < 12.0f ) n_old++;
+        if( !row_is_consistent( X + j * N_INPUT, Y + j * N_TARGET ) || (int) X[j * N_INPUT] % 8 != (int) slots[j] )
+            n_wrong++;
+    }
+    CHECK_INT_EQUALS_MSG( n_old, 0, "Checking that the oldest rows are overwritten" );
+    CHECK_INT_EQUALS_MSG( n_wrong, 0, "Checking the sampled rows and their slots" );
+    replay_buffer_free( rb );
+
+    fprintf(stderr, KBLU "Testing sampling while producers append." KNRM "\n" );
+    rb = replay_buffer_new( N_INPUT, N_TARGET, REPLAY_BUFFER_PROPERTIES( .capacity = 64, .prioritized = true ));
+    assert( rb );
+    producer_job_t job[N_PRODUCERS];
+    pthread_t thread[N_PRODUCERS];
+    for( int t = 0; t < N_PRODUCERS; t++ ){
+        job[t] = (producer_job_t) { .rb = rb, .id = t };
+        const int started = pthread_create( &thread[t], NULL, producer_thread, &job[t] );
+        assert( started == 0 );
+    }
+    int n_sampled = 0;
+    float losses[64];
+    n_wrong = 0;
+    while( replay_buffer_size( rb ) < 64 || n_sampled < 100000 ){
+        n = replay_buffer_sample( rb, 64, X, Y, slots, NULL, &seed );
+        for( int j = 0; j < n; j++ ){
+            if( !row_is_consistent( X + j * N_INPUT, Y + j * N_TARGET ))
+                n_wrong++;
+            losses[j] = (float) (j % 7);
+        }
+        replay_buffer_update_priorities( rb, n, slots, losses );
+        n_sampled += n;
+    }
+    for( int t = 0; t < N_PRODUCERS; t++ )
+        pthread_join( thread[t], NULL );
+    CHECK_INT_EQUALS_MSG( n_wrong, 0, "Checking that no sampled row is torn" );
+    n = replay_buffer_sample( rb, 64, X, Y, NULL, NULL, &seed );
+    CHECK_INT_EQUALS_MSG( n, 64, "Checking the number of sampled rows after the producers" );
+    replay_buffer_free( rb );
+
+    fprintf(stderr, KBLU "Testing prioritized sampling." KNRM "\n" );
+    rb = replay_buffer_new( N_INPUT, N_TARGET, REPLAY_BUFFER_PROPERTIES( .capacity = 4, .prioritized = true,
+                .alpha = 1.0f, .beta = 1.0f, .epsilon = 1.0e-6f ));
+    assert( rb );
+    for( int t = 0; t < 4; t++ ){
+        make_row( (float) t, input, target );
+        replay_buffer_append( rb, input, target );
+    }
+    CHECK_FLOAT_EQUALS_MSG( replay_buffer_priority( rb, 3 ), 1.0f, 1.0e-6f, "Checking the priority of a new row" );
+    const unsigned int all_slots[4] = { 0, 1, 2, 3 };
+    const float all_losses[4] = { 1.0f, 2.0f, 3.0f, 4.0f };
+    replay_buffer_update_priorities( rb, 4, all_slots, all_losses );
+    CHECK_FLOAT_EQUALS_MSG( replay_buffer_priority( rb, 2 ), 3.0f, 1.0e-5f, "Checking the priority from the loss" );
+    int counts[4] = { 0 };
+    float weights[64];
+    float weight_of_slot[4] = { 0.0f };
+    for( int i = 0; i < 1000; i++ ){
+        n = replay_buffer_sample( rb, 64, X, Y, slots, weights, &seed );
+        assert( n == 64 );
+        for( int j = 0; j < n; j++ ){
+            counts[slots[j]]++;
+            weight_of_slot[slots[j]] = weights[j];
+        }
+    }
+    float max_error = 0.0f;
+    for( int s = 0; s < 4; s++ )
+        if( fabsf( counts[s] / 64000.0f - (s + 1) / 10.0f ) > max_error )
+            max_error = fabsf( counts[s] / 64000.0f - (s + 1) / 10.0f );
+    CHECK_FLOAT_EQUALS_MSG( max_error, 0.0f, 0.01f, "Checking that the slots are sampled in proportion to the priorities" );
+    CHECK_FLOAT_EQUALS_MSG( weight_of_slot[0], 1.0f, 1.0e-5f, "Checking the largest importance sampling weight" );
+    CHECK_FLOAT_EQUALS_MSG( weight_of_slot[3], 0.25f, 1.0e-5f, "Checking the smallest importance sampling weight" );
+    replay_buffer_free( rb );
+
+    fprintf(stderr, KBLU "Testing training from the replay buffer." KNRM "\n" );
+    const int n_features = 8;
+    neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( n_features, 16, 1 ), STR_ARRAY( "tanh", "linear" ));
+    assert( nn );
+    neuralnet_set_loss( nn, "mean_squared_error" );
+    metric_func *metrics = METRIC_LIST( get_metric_func( "mean_squared_error" ));
+    srand( 42 );
+    float test_X[256 * 8], test_Y[256];
+    for( int prioritized = 0; prioritized < 2; prioritized++ ){
+        neuralnet_initialize( nn, NULL );
+        rb = replay_buffer_new( n_features, 1, REPLAY_BUFFER_PROPERTIES( .capacity = 512, .prioritized = prioritized ));
+        assert( rb );
+        for( int i = 0; i < 1024; i++ ){
+            float x[8], y = 0.0f;
+            for( int k = 0; k < n_features; k++ ){
+                x[k] = (float) rand() / (float) RAND_MAX - 0.5f;
+                y += (k % 2 ? 0.5f : -0.25f) * x[k];
+            }
+            if( i >= 1024 - 256 ){
+                memcpy( test_X + (i - 768) * n_features, x, sizeof(x));
+                test_Y[i - 768] = y;
+            }
+            replay_buffer_append( rb, x, &y );
+        }
+        optimizer_t *opt = prioritized ?
+            OPTIMIZER( adam_new( nn, OPTIMIZER_PROPERTIES( .batchsize = 16, .metrics = metrics, .progress = NULL ),
+                        ADAM_PROPERTIES( .learning_rate = 0.01f ))) :
+            OPTIMIZER( SGD_new( nn, OPTIMIZER_PROPERTIES( .batchsize = 16, .metrics = metrics, .progress = NULL,
+                        .running_metrics = true ), SGD_PROPERTIES( .learning_rate = 0.05f )));
+        assert( opt );
+        float first_loss, last_loss, results[1];
+        evaluate( nn, 256, test_X, test_Y, metrics, &first_loss );
+        for( int epoch = 0; epoch < 20; epoch++ )
+            optimizer_run_epoch_replay( opt, rb, 32, results );
+        evaluate( nn, 256, test_X, test_Y, metrics, &last_loss );
+        CHECK_CONDITION_MSG( last_loss < 0.2f * first_loss, "Checking that the loss decreases" );
+        CHECK_CONDITION_MSG( results[0] < 0.2f * first_loss, "Checking the train loss" );
+        CHECK_INT_EQUALS_MSG( opt->epoch, 20, "Checking the number of epochs" );
+        CHECK_CONDITION_MSG( opt->running_metrics == !prioritized, "Checking that the running_metrics option is kept" );
+        optimizer_free( opt );
+        replay_buffer_free( rb );
+    }
+    neuralnet_free( nn );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
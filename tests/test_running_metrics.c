@@ -0,0 +1,117 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "sparse_matrix.h"
+#include "optimizer.h"
+#include "optimizer_implementations.h"
+#include "evaluate.h"
+#include "loss.h"
+#include "simd.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* The train metrics can be accumulated from the outputs of the forward pass in the backpropagation,
+   instead of evaluating the training set after the epoch. */
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    const int n_samples = 64;
+    const int n_input   = 20;
+    const int n_output  = 5;
+
+    srand( 42 );
+    float *X = malloc( n_samples * n_input * sizeof(float));
+    float *Y = calloc( n_samples * n_output, sizeof(float));
+    float *labels = malloc( n_samples * sizeof(float));
+    assert( X && Y && labels );
+    for( int i = 0; i < n_samples * n_input; i++ )
+        X[i] = (rand() % 4 == 0) ? (float) rand() / (float) RAND_MAX : 0.0f;
+    for( int i = 0; i < n_samples; i++ ){
+        labels[i] = (float) (i % n_output);
+        Y[i*n_output + (i % n_output)] = 1.0f;
+    }
+
+    const char *losses[] = { "binary_crossentropy", "categorical_crossentropy", "sparse_categorical_crossentropy" };
+    const char *outputs[] = { "sigmoid", "softmax", "softmax" };
+    const char *accuracy[] = { "binary_accuracy", "categorical_accuracy", "sparse_categorical_accuracy" };
+
+    for( int l = 0; l < 3; l++ ){
+        fprintf(stderr, KBLU "Testing with '%s' loss." KNRM "\n", losses[l] );
+        neuralnet_t *nn = neuralnet_create( 2,
+                INT_ARRAY( n_input, 16, n_output ),
+                STR_ARRAY( "relu", (char*) outputs[l] ));
+        assert( nn );
+        neuralnet_initialize( nn, NULL );
+        neuralnet_set_loss( nn, losses[l] );
+        const float *targets = neuralnet_target_size( nn ) == 1 ? labels : Y;
+        const int n_target = neuralnet_target_size( nn );
+
+        /* The output from the backpropagation should be the prediction */
+        const unsigned int n_params = neuralnet_total_n_parameters( nn );
+        float *grad     = simd_malloc( n_params * sizeof(float));
+        float *grad_ref = simd_malloc( n_params * sizeof(float));
+        assert( grad && grad_ref );
+        float maxdiff = 0.0f, graddiff = 0.0f;
+        for( int i = 0; i < n_samples; i++ ){
+            float SIMD_ALIGN(y_pred[n_output]);
+            float SIMD_ALIGN(y_out[n_output]);
+            neuralnet_predict( nn, X + i*n_input, y_pred );
+            neuralnet_backpropagation_with_output( nn, X + i*n_input, targets + i*n_target, grad, y_out );
+            neuralnet_backpropagation( nn, X + i*n_input, targets + i*n_target, grad_ref );
+            float diff = test_max_abs_diff( n_output, y_pred, y_out );
+            if( diff > maxdiff ) maxdiff = diff;
+            diff = test_max_abs_diff( n_params, grad, grad_ref );
+            if( diff > graddiff ) graddiff = diff;
+        }
+        CHECK_FLOAT_EQUALS_MSG( maxdiff, 0.0f, 1.0e-6f, "Checking that the backpropagation output is the prediction" );
+        CHECK_FLOAT_EQUALS_MSG( graddiff, 0.0f, 0.0f, "Checking that the gradient is unchanged" );
+
+        /* With the whole set in one batch, the running metrics are the metrics before the update */
+        metric_func *metrics = METRIC_LIST( get_metric_func( losses[l] ), get_metric_func( accuracy[l] ));
+        float expected[2], results[2];
+        evaluate( nn, n_samples, X, targets, metrics, expected );
+
+        optimizer_t *sgd = OPTIMIZER( SGD_new( nn,
+                    OPTIMIZER_PROPERTIES( .batchsize = n_samples, .metrics = metrics, .progress = NULL,
+                        .running_metrics = true ),
+                    SGD_PROPERTIES( .learning_rate = 0.1f )));
+        optimizer_run_epoch( sgd, n_samples, X, targets, 0, NULL, NULL, results );
+        CHECK_FLOAT_EQUALS_MSG( results[0], expected[0], 1.0e-5f, "Checking running average of the loss metric" );
+        CHECK_FLOAT_EQUALS_MSG( results[1], expected[1], 1.0e-5f, "Checking running average of the accuracy" );
+        CHECK_CONDITION_MSG( sgd->metric_sums == NULL, "Checking that nothing is accumulated after the epoch" );
+
+        /* Without the flag, the training set is evaluated after the epoch */
+        sgd->running_metrics = false;
+        optimizer_run_epoch( sgd, n_samples, X, targets, 0, NULL, NULL, results );
+        evaluate( nn, n_samples, X, targets, metrics, expected );
+        CHECK_FLOAT_EQUALS_MSG( results[0], expected[0], 1.0e-6f, "Checking exact end of epoch evaluation" );
+
+        /* Same with sparse input */
+        sparse_matrix_t *sX = sparse_matrix_from_dense( n_samples, n_input, X );
+        assert( sX );
+        evaluate_sparse( nn, sX, targets, metrics, expected );
+        sgd->running_metrics = true;
+        optimizer_run_epoch_sparse( sgd, sX, targets, NULL, NULL, results );
+        CHECK_FLOAT_EQUALS_MSG( results[0], expected[0], 1.0e-5f, "Checking running average with sparse input" );
+
+        optimizer_free( sgd );
+        sparse_matrix_free( sX );
+        simd_free( grad );
+        simd_free( grad_ref );
+        neuralnet_free( nn );
+    }
+
+    free( X );
+    free( Y );
+    free( labels );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
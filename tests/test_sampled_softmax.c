@@ -0,0 +1,147 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "sampled_softmax.h"
+#include "optimizer.h"
+#include "optimizer_implementations.h"
+#include "evaluate.h"
+#include "loss.h"
+#include "metrics.h"
+#include "simd.h"
+#include "threadpool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <assert.h>
+
+/* Tests of the sampled softmax. With many samples the gradient should be close to the gradient of
+   the full softmax crossentropy, and with few samples only the sampled output columns are touched. */
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    const int n_input = 10, n_classes = 20;
+    neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( n_input, 16, n_classes ), STR_ARRAY( "relu", "softmax" ));
+    assert( nn );
+    neuralnet_initialize( nn, NULL );
+
+    const unsigned int n_params = neuralnet_total_n_parameters( nn );
+    float *full_grad    = simd_malloc( n_params * sizeof(float));
+    float *sampled_grad = simd_malloc( n_params * sizeof(float));
+    assert( full_grad && sampled_grad );
+
+    srand( 42 );
+    float SIMD_ALIGN(input[n_input]);
+    for( int i = 0; i < n_input; i++ )
+        input[i] = (float) rand() / (float) RAND_MAX;
+    const float target = 7.0f;
+
+    neuralnet_set_loss( nn, "sparse_categorical_crossentropy" );
+    neuralnet_backpropagation( nn, input, &target, full_grad );
+
+    neuralnet_set_loss( nn, "sampled_softmax" );
+    CHECK_NOT_NULL_MSG( nn->sampled_softmax, "Checking that 'sampled_softmax' loss sets up the sampling" );
+    CHECK_INT_EQUALS_MSG( neuralnet_target_size( nn ), 1, "Checking that the targets are class labels" );
+    CHECK_CONDITION_MSG( get_metric_func( "sampled_softmax" ) == get_metric_func( "sparse_categorical_crossentropy" ),
+            "Checking that the metric is the full crossentropy" );
+
+    fprintf(stderr, KBLU "Testing sampled gradient against the full gradient." KNRM "\n" );
+    float class_counts[n_classes];
+    for( int i = 0; i < n_classes; i++ )
+        class_counts[i] = (float) (1 + i % 4);
+    const char *proposals[] = { "uniform", "log_uniform", "unigram" };
+    for( int p = 0; p < 3; p++ ){
+        char msg[80];
+        neuralnet_set_sampled_softmax( nn, SAMPLED_SOFTMAX_PROPERTIES( .n_sampled = 50000,
+                    .proposal = proposals[p], .class_counts = class_counts ));
+        neuralnet_backpropagation( nn, input, &target, sampled_grad );
+        sprintf( msg, "Checking sampled gradient with '%s' proposal", proposals[p] );
+        CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( n_params, full_grad, sampled_grad ), 0.0f, 0.02f, msg );
+    }
+
+    fprintf(stderr, KBLU "Testing that only sampled classes are touched." KNRM "\n" );
+    neuralnet_set_sampled_softmax( nn, SAMPLED_SOFTMAX_PROPERTIES( .n_sampled = 3, .proposal = "uniform" ));
+    neuralnet_backpropagation( nn, input, &target, sampled_grad );
+    const float *grad_b_out = sampled_grad + (n_input + 1) * 16;
+    int n_touched = 0;
+    for( int j = 0; j < n_classes; j++ )
+        n_touched += grad_b_out[j] != 0.0f;
+    CHECK_CONDITION_MSG( n_touched >= 1 && n_touched <= 4, "Checking number of touched output classes" );
+    CHECK_CONDITION_MSG( grad_b_out[7] < 0.0f, "Checking that the true class gradient is negative" );
+
+    fprintf(stderr, KBLU "Testing that only the sampled columns are written." KNRM "\n" );
+    {
+        const unsigned int output_offset = neuralnet_output_layer_offset( nn );
+        for( unsigned int j = output_offset; j < n_params; j++ )
+            sampled_grad[j] = 123.0f;
+        int columns[4];
+        const int n_columns = neuralnet_backpropagation_sampled( nn, input, &target, sampled_grad, columns );
+        CHECK_CONDITION_MSG( n_columns >= 1 && n_columns <= 4, "Checking number of sampled columns" );
+        int sorted = 1, has_target = 0;
+        for( int k = 0; k < n_columns; k++ ){
+            sorted &= k == 0 || columns[k] > columns[k-1];
+            has_target |= columns[k] == 7;
+        }
+        CHECK_CONDITION_MSG( sorted && has_target, "Checking that the columns are sorted, unique and with the true class" );
+        int n_untouched = 0;
+        for( unsigned int j = output_offset; j < n_params; j++ )
+            n_untouched += sampled_grad[j] == 123.0f;
+        CHECK_INT_EQUALS_MSG( n_untouched, (n_classes - n_columns) * (16 + 1), "Checking that the other columns are not written" );
+        CHECK_CONDITION_MSG( sampled_grad[output_offset + 7] < 0.0f, "Checking the true class gradient" );
+    }
+
+    sampled_softmax_t *ss = sampled_softmax_new( n_classes, SAMPLED_SOFTMAX_PROPERTIES( .proposal = "zipf" ));
+    CHECK_CONDITION_MSG( ss == NULL, "Checking that unknown proposal fails" );
+    ss = sampled_softmax_new( n_classes, SAMPLED_SOFTMAX_PROPERTIES( .proposal = "unigram" ));
+    CHECK_CONDITION_MSG( ss == NULL, "Checking that unigram proposal without counts fails" );
+
+    fprintf(stderr, KBLU "Testing training with sampled softmax." KNRM "\n" );
+    {
+        const int n_samples = 400;
+        float *X = malloc( n_samples * n_input * sizeof(float));
+        float *Y = malloc( n_samples * sizeof(float));
+        assert( X && Y );
+        for( int i = 0; i < n_samples; i++ ){
+            const int label = rand() % n_classes;
+            Y[i] = (float) label;
+            for( int j = 0; j < n_input; j++ )
+                X[i*n_input + j] = 0.1f * ((float) rand() / (float) RAND_MAX - 0.5f) + ((label >> (j % 5)) & 1);
+        }
+        neuralnet_set_sampled_softmax( nn, SAMPLED_SOFTMAX_PROPERTIES( .n_sampled = 5, .proposal = "uniform" ));
+        metric_func *metrics = METRIC_LIST( get_metric_func( "sampled_softmax" ));
+        optimizer_t *sgd = OPTIMIZER( SGD_new( nn,
+                    OPTIMIZER_PROPERTIES( .batchsize = 8, .metrics = metrics, .progress = NULL ),
+                    SGD_PROPERTIES( .learning_rate = 0.1f )));
+        float before, after;
+        evaluate( nn, n_samples, X, Y, metrics, &before );
+        for( int epoch = 0; epoch < 20; epoch++ )
+            optimizer_run_epoch( sgd, n_samples, X, Y, 0, NULL, NULL, &after );
+        CHECK_CONDITION_MSG( after < 0.5f * before, "Checking that the full crossentropy decreases" );
+
+        /* The same in the thread pool */
+        threadpool_t *pool = threadpool_new( 3 );
+        threadpool_set_default( pool );
+        neuralnet_initialize( nn, NULL );
+        evaluate( nn, n_samples, X, Y, metrics, &before );
+        for( int epoch = 0; epoch < 20; epoch++ )
+            optimizer_run_epoch( sgd, n_samples, X, Y, 0, NULL, NULL, &after );
+        CHECK_CONDITION_MSG( after < 0.5f * before, "Checking that the full crossentropy decreases in the thread pool" );
+        threadpool_set_default( NULL );
+        threadpool_free( pool );
+        optimizer_free( sgd );
+        free( X );
+        free( Y );
+    }
+
+    simd_free( full_grad );
+    simd_free( sampled_grad );
+    neuralnet_free( nn );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
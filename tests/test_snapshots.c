@@ -0,0 +1,153 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "neuralnet_snapshots.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+
+/* A learner publishes new weights as fast as it can, while actors predict. All the weights of
+   version v are the same value, w(v), so the prediction of version v is known, and a prediction
+   with a mix of two versions (torn weights) is different. */
+
+#define N_ACTORS     4
+#define N_PUBLISH    2000
+#define N_INPUT      32
+#define N_HIDDEN     64
+#define N_OUTPUT     4
+
+static float weight_of_version( const unsigned long version )
+{
+    return 1.0f + (float) (version % 100) / 64.0f;
+}
+
+static void set_weights( neuralnet_t *nn, const float w )
+{
+    for( int l = 0; l < nn->n_layers; l++ ){
+        for( int i = 0; i < nn->layer[l].n_input * nn->layer[l].n_output; i++ )
+            nn->layer[l].weight[i] = w;
+        memset( nn->layer[l].bias, 0, nn->layer[l].n_output * sizeof(float));
+    }
+}
+
+typedef struct {
+    neuralnet_snapshots_t *snapshots;
+    int                    stop;
+    int                    n_predictions;
+    int                    n_wrong;
+    int                    n_backwards;
+} actor_job_t;
+
+static void *actor_thread( void *arg )
+{
+    actor_job_t *job = (actor_job_t *) arg;
+    float input[2 * N_INPUT], output[2 * N_OUTPUT];
+    for( int i = 0; i < 2 * N_INPUT; i++ )
+        input[i] = 1.0f;
+    unsigned long last_version = 0;
+    for( int i = 0; !__atomic_load_n( &job->stop, __ATOMIC_ACQUIRE ); i++ ){
+        unsigned long version;
+        int n = 1;
+        if( i % 2 ){
+            version = neuralnet_snapshots_predict_batch( job->snapshots, 2, input, output );
+            n = 2;
+        } else {
+            version = neuralnet_snapshots_predict( job->snapshots, input, output );
+        }
+        const float w = weight_of_version( version );
+        const float expected = (float) N_INPUT * N_HIDDEN * w * w;
+        for( int k = 0; k < n * N_OUTPUT; k++ )
+            if( fabsf( output[k] - expected ) > 1.0e-5f * expected ){
+                job->n_wrong++;
+                break;
+            }
+        if( version < last_version )
+            job->n_backwards++;
+        last_version = version;
+        job->n_predictions++;
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( N_INPUT, N_HIDDEN, N_OUTPUT ), STR_ARRAY( "linear", "linear" ));
+    assert( nn );
+    set_weights( nn, weight_of_version( 0 ));
+
+    neuralnet_snapshots_t *snapshots = neuralnet_snapshots_new( nn );
+    CHECK_NOT_NULL_MSG( snapshots, "Checking that the snapshots are created" );
+    assert( snapshots );
+    CHECK_INT_EQUALS_MSG( (int) neuralnet_snapshots_version( snapshots ), 0, "Checking the first version" );
+
+    fprintf(stderr, KBLU "Testing the seqlock." KNRM "\n" );
+    neuralnet_snapshot_t snapshot;
+    neuralnet_snapshots_pin( snapshots, &snapshot );
+    set_weights( nn, weight_of_version( 1 ));
+    const unsigned long first = neuralnet_snapshots_publish( snapshots, nn );
+    CHECK_INT_EQUALS_MSG( (int) first, 1, "Checking the version of the publication" );
+    int valid = neuralnet_snapshots_valid( snapshots, &snapshot );
+    CHECK_INT_EQUALS_MSG( valid, 1, "Checking that a snapshot survives one publication" );
+    set_weights( nn, weight_of_version( 2 ));
+    neuralnet_snapshots_publish( snapshots, nn );
+    valid = neuralnet_snapshots_valid( snapshots, &snapshot );
+    CHECK_INT_EQUALS_MSG( valid, 1, "Checking that a snapshot survives two publications" );
+    set_weights( nn, weight_of_version( 3 ));
+    neuralnet_snapshots_publish( snapshots, nn );
+    valid = neuralnet_snapshots_valid( snapshots, &snapshot );
+    CHECK_INT_EQUALS_MSG( valid, 0, "Checking that a snapshot is invalid after three publications" );
+    const neuralnet_t *pinned = neuralnet_snapshots_pin( snapshots, &snapshot );
+    CHECK_INT_EQUALS_MSG( (int) snapshot.version, 3, "Checking the version of the pinned snapshot" );
+    CHECK_FLOAT_EQUALS_MSG( pinned->layer[1].weight[0], weight_of_version( 3 ), 0.0f, "Checking the weights of the pinned snapshot" );
+
+    fprintf(stderr, KBLU "Testing publications while predicting." KNRM "\n" );
+    actor_job_t job[N_ACTORS];
+    pthread_t thread[N_ACTORS];
+    for( int t = 0; t < N_ACTORS; t++ ){
+        job[t] = (actor_job_t) { .snapshots = snapshots };
+        const int started = pthread_create( &thread[t], NULL, actor_thread, &job[t] );
+        assert( started == 0 );
+    }
+    unsigned long version = 3;
+    for( int i = 0; i < N_PUBLISH; i++ ){
+        set_weights( nn, weight_of_version( version + 1 ));
+        version = neuralnet_snapshots_publish( snapshots, nn );
+    }
+    int n_predictions = 0, n_wrong = 0, n_backwards = 0;
+    for( int t = 0; t < N_ACTORS; t++ ){
+        __atomic_store_n( &job[t].stop, 1, __ATOMIC_RELEASE );
+        pthread_join( thread[t], NULL );
+        n_predictions += job[t].n_predictions;
+        n_wrong       += job[t].n_wrong;
+        n_backwards   += job[t].n_backwards;
+    }
+    CHECK_INT_EQUALS_MSG( (int) version, N_PUBLISH + 3, "Checking the version after the publications" );
+    CHECK_INT_EQUALS_MSG( (int) neuralnet_snapshots_version( snapshots ), N_PUBLISH + 3, "Checking the latest version" );
+    CHECK_CONDITION_MSG( n_predictions > 0, "Checking that the actors predicted" );
+    CHECK_INT_EQUALS_MSG( n_wrong, 0, "Checking that no prediction used torn weights" );
+    CHECK_INT_EQUALS_MSG( n_backwards, 0, "Checking that the actors never see an older version" );
+
+    neuralnet_snapshots_stats_t stats;
+    neuralnet_snapshots_stats( snapshots, &stats );
+    CHECK_INT_EQUALS_MSG( (int) stats.n_published, N_PUBLISH + 3, "Checking the number of publications" );
+
+    fprintf(stderr, KBLU "Testing another architecture." KNRM "\n" );
+    neuralnet_t *other = neuralnet_create( 2, INT_ARRAY( N_INPUT, N_HIDDEN + 1, N_OUTPUT ), STR_ARRAY( "linear", "linear" ));
+    assert( other );
+    const unsigned long refused = neuralnet_snapshots_publish( snapshots, other );
+    CHECK_INT_EQUALS_MSG( (int) refused, 0, "Checking that the publication is refused" );
+    neuralnet_free( other );
+
+    neuralnet_snapshots_free( snapshots );
+    neuralnet_free( nn );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "activation.h"
+#include "evaluate.h"
+#include "metrics.h"
+#include "simd.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <assert.h>
+
+/* Compares the fused softmax crossentropy kernel with the softmax activation followed by the
+   categorical crossentropy metric and loss derivative. */
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    activation_func softmax = get_activation_func( "softmax" );
+    metric_func cce = get_metric_func( "categorical_crossentropy" );
+    assert( softmax && cce );
+
+    srand( 42 );
+    const int sizes[] = { 3, 8, 17, 100 };
+    for( unsigned int k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++ ){
+        const int n = sizes[k];
+        float SIMD_ALIGN(logits[n]);
+        float SIMD_ALIGN(probs[n]);
+        float SIMD_ALIGN(fused[n]);
+        float SIMD_ALIGN(target[n]);
+        float SIMD_ALIGN(grad[n]);
+        float SIMD_ALIGN(expected_grad[n]);
+        char msg[80];
+
+        for( int i = 0; i < n; i++ ){
+            logits[i] = 4.0f * ((float) rand() / (float) RAND_MAX - 0.5f);
+            target[i] = 0.0f;
+        }
+        const int label = rand() % n;
+        target[label] = 1.0f;
+
+        memcpy( probs, logits, n * sizeof(float));
+        softmax( n, probs );
+        for( int i = 0; i < n; i++ )
+            expected_grad[i] = probs[i] - target[i];
+
+        memcpy( fused, logits, n * sizeof(float));
+        const float xent = softmax_crossentropy( n, fused, target, grad );
+
+        sprintf( msg, "Checking fused softmax probabilities (n=%d)", n );
+        CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( n, probs, fused ), 0.0f, 1.0e-6f, msg );
+        sprintf( msg, "Checking fused crossentropy (n=%d)", n );
+        CHECK_FLOAT_EQUALS_MSG( xent / (float) n, cce( n, probs, target ), 1.0e-5f, msg );
+        sprintf( msg, "Checking fused loss derivative (n=%d)", n );
+        CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( n, grad, expected_grad ), 0.0f, 1.0e-6f, msg );
+
+        const float y_label = (float) label;
+        memcpy( fused, logits, n * sizeof(float));
+        const float sparse_xent = sparse_softmax_crossentropy( n, fused, &y_label, grad );
+        sprintf( msg, "Checking sparse fused crossentropy (n=%d)", n );
+        CHECK_FLOAT_EQUALS_MSG( sparse_xent, xent, 1.0e-5f, msg );
+        sprintf( msg, "Checking sparse fused loss derivative (n=%d)", n );
+        CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( n, grad, expected_grad ), 0.0f, 1.0e-6f, msg );
+    }
+
+    fprintf(stderr, KBLU "Testing numerical stability." KNRM "\n" );
+    {
+        float SIMD_ALIGN(logits[3]) = { 1000.0f, 2000.0f, 3000.0f };
+        float SIMD_ALIGN(target[3]) = { 1.0f, 0.0f, 0.0f };
+        /* A clipped probability would give -log(1e-7) here */
+        const float xent = softmax_crossentropy( 3, logits, target, NULL );
+        CHECK_FLOAT_EQUALS_MSG( xent, 2000.0f, 1.0e-3f,
+                "Checking crossentropy of very wrong prediction" );
+        CHECK_FLOAT_EQUALS_MSG( logits[2], 1.0f, 1.0e-6f, "Checking softmax of large logits" );
+    }
+
+    fprintf(stderr, KBLU "Testing evaluate() with softmax output." KNRM "\n" );
+    {
+        const int n_samples = 50, n_input = 12, n_output = 10;
+        neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( n_input, 16, n_output ), STR_ARRAY( "relu", "softmax" ));
+        assert( nn );
+        neuralnet_initialize( nn, NULL );
+        neuralnet_set_loss( nn, "categorical_crossentropy" );
+
+        float *X = malloc( n_samples * n_input * sizeof(float));
+        float *Y = calloc( n_samples * n_output, sizeof(float));
+        assert( X && Y );
+        for( int i = 0; i < n_samples * n_input; i++ )
+            X[i] = (float) rand() / (float) RAND_MAX - 0.5f;
+        for( int i = 0; i < n_samples; i++ )
+            Y[i*n_output + rand() % n_output] = 1.0f;
+
+        metric_func acc = get_metric_func( "categorical_accuracy" );
+        float results[2], expected[2] = { 0.0f, 0.0f };
+        evaluate( nn, n_samples, X, Y, METRIC_LIST( cce, acc ), results );
+        for( int i = 0; i < n_samples; i++ ){
+            float SIMD_ALIGN(y_pred[n_output]);
+            neuralnet_predict( nn, X + i*n_input, y_pred );
+            expected[0] += cce( n_output, y_pred, Y + i*n_output ) / (float) n_samples;
+            expected[1] += acc( n_output, y_pred, Y + i*n_output ) / (float) n_samples;
+        }
+        CHECK_FLOAT_EQUALS_MSG( results[0], expected[0], 1.0e-5f, "Checking evaluated crossentropy" );
+        CHECK_FLOAT_EQUALS_MSG( results[1], expected[1], 1.0e-5f, "Checking evaluated accuracy" );
+
+        free( X );
+        free( Y );
+        neuralnet_free( nn );
+    }
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
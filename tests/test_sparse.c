@@ -0,0 +1,188 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "sparse_matrix.h"
+#include "optimizer.h"
+#include "optimizer_implementations.h"
+#include "simd.h"
+#include "threadpool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* Compares the sparse input code paths with the dense ones. They should give the
+   same results (up to floating point rounding). */
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    const int n_samples = 100;
+    const int n_input   = 117;  /* Same as the one-hot encoded mushrooms */
+    const int n_output  = 3;
+
+    neuralnet_t *nn = neuralnet_create( 2,
+            INT_ARRAY( n_input, 21, n_output ),
+            STR_ARRAY( "relu", "softmax" ));
+    CHECK_NOT_NULL_MSG( nn, "Checking that neural network was created" );
+    neuralnet_initialize( nn, NULL );
+    neuralnet_set_loss( nn, "categorical_crossentropy" );
+
+    /* Some data which is one-hot encoded. Every fifth sample has a non-one value. */
+    srand( 42 );
+    float *X = calloc( n_samples * n_input, sizeof(float));
+    float *Y = calloc( n_samples * n_output, sizeof(float));
+    assert( X && Y );
+    for( int i = 0; i < n_samples; i++ ){
+        for( int j = 0; j < n_input; j++ )
+            if( rand() % 10 == 0 ) X[i*n_input + j] = (i % 5) ? 1.0f : 0.5f;
+        Y[i*n_output + (i % n_output)] = 1.0f;
+    }
+
+    sparse_matrix_t *sX = sparse_matrix_from_dense( n_samples, n_input, X );
+    CHECK_NOT_NULL_MSG( sX, "Checking that sparse matrix was created" );
+    CHECK_CONDITION_MSG( sX->values != NULL, "Checking that values are stored for non one-hot data" );
+
+    unsigned int nnz = 0;
+    for( int i = 0; i < n_samples * n_input; i++ ) nnz += X[i] != 0.0f;
+    CHECK_INT_EQUALS_MSG( nnz, sparse_matrix_nnz( sX ), "Checking number of nonzero elements" );
+
+    fprintf(stderr, KBLU "Testing sparse_matrix_from_csr." KNRM "\n" );
+    sparse_matrix_t *cX = sparse_matrix_from_csr( n_samples, n_input, sX->row_ptr, sX->col_idx, sX->values );
+    CHECK_NOT_NULL_MSG( cX, "Checking that sparse matrix was created from the CSR arrays" );
+    assert( cX );
+    CHECK_CONDITION_MSG( !memcmp( cX->row_ptr, sX->row_ptr, (n_samples + 1) * sizeof(unsigned int)) &&
+            !memcmp( cX->col_idx, sX->col_idx, nnz * sizeof(int)) && !memcmp( cX->values, sX->values, nnz * sizeof(float)),
+            "Checking that the CSR arrays are the same as from the dense matrix" );
+    sparse_matrix_free( cX );
+    const unsigned int one_hot_ptr[3] = { 0, 2, 3 };
+    const int one_hot_idx[3] = { 1, 4, 0 }, duplicate_idx[3] = { 4, 4, 0 };
+    const float ones[3] = { 1.0f, 1.0f, 1.0f };
+    cX = sparse_matrix_from_csr( 2, n_input, one_hot_ptr, one_hot_idx, ones );
+    CHECK_CONDITION_MSG( cX && cX->values == NULL, "Checking that values of one-hot data are not stored" );
+    sparse_matrix_free( cX );
+    cX = sparse_matrix_from_csr( 2, n_input, one_hot_ptr, duplicate_idx, NULL );
+    CHECK_CONDITION_MSG( cX == NULL, "Checking that duplicate columns are rejected" );
+
+    fprintf(stderr, KBLU "Testing neuralnet_predict_sparse." KNRM "\n" );
+    float maxdiff = 0.0f;
+    for( int i = 0; i < n_samples; i++ ){
+        float SIMD_ALIGN(dense_out[n_output]);
+        float SIMD_ALIGN(sparse_out[n_output]);
+        const sparse_vector_t x = sparse_matrix_row( sX, i );
+        neuralnet_predict( nn, X + i*n_input, dense_out );
+        neuralnet_predict_sparse( nn, &x, sparse_out );
+        float diff = test_max_abs_diff( n_output, dense_out, sparse_out );
+        if( diff > maxdiff ) maxdiff = diff;
+    }
+    CHECK_FLOAT_EQUALS_MSG( maxdiff, 0.0f, 1.0e-6f, "Checking that sparse and dense predictions are equal" );
+
+    fprintf(stderr, KBLU "Testing neuralnet_backpropagation_sparse." KNRM "\n" );
+    const unsigned int n_params = neuralnet_total_n_parameters( nn );
+    float *dense_grad  = simd_malloc( n_params * sizeof(float));
+    float *sparse_grad = simd_malloc( n_params * sizeof(float));
+    assert( dense_grad && sparse_grad );
+    memset( sparse_grad, 0, n_params * sizeof(float));
+    maxdiff = 0.0f;
+    for( int i = 0; i < n_samples; i++ ){
+        const sparse_vector_t x = sparse_matrix_row( sX, i );
+        neuralnet_backpropagation( nn, X + i*n_input, Y + i*n_output, dense_grad );
+        memset( sparse_grad, 0, n_params * sizeof(float));
+        neuralnet_backpropagation_sparse( nn, &x, Y + i*n_output, sparse_grad );
+        float diff = test_max_abs_diff( n_params, dense_grad, sparse_grad );
+        if( diff > maxdiff ) maxdiff = diff;
+    }
+    CHECK_FLOAT_EQUALS_MSG( maxdiff, 0.0f, 1.0e-6f, "Checking that sparse and dense gradients are equal" );
+
+    fprintf(stderr, KBLU "Testing optimizer_run_epoch_sparse." KNRM "\n" );
+    neuralnet_t *nn_copy = neuralnet_create( 2, INT_ARRAY( n_input, 21, n_output ), STR_ARRAY( "relu", "softmax" ));
+    assert( nn_copy );
+    neuralnet_set_loss( nn_copy, "categorical_crossentropy" );
+    for( int l = 0; l < nn->n_layers; l++ ){
+        memcpy( nn_copy->layer[l].weight, nn->layer[l].weight, nn->layer[l].n_input * nn->layer[l].n_output * sizeof(float));
+        memcpy( nn_copy->layer[l].bias, nn->layer[l].bias, nn->layer[l].n_output * sizeof(float));
+    }
+
+    metric_func *metrics = METRIC_LIST( get_metric_func( "categorical_crossentropy" ));
+    optimizer_t *dense_sgd = OPTIMIZER( SGD_new( nn,
+                OPTIMIZER_PROPERTIES( .batchsize = 8, .shuffle = false, .metrics = metrics, .progress = NULL ),
+                SGD_PROPERTIES( .learning_rate = 0.1f )));
+    optimizer_t *sparse_sgd = OPTIMIZER( SGD_new( nn_copy,
+                OPTIMIZER_PROPERTIES( .batchsize = 8, .shuffle = false, .metrics = metrics, .progress = NULL ),
+                SGD_PROPERTIES( .learning_rate = 0.1f )));
+
+    float dense_results[2], sparse_results[2];
+    optimizer_run_epoch( dense_sgd, n_samples, X, Y, 0, NULL, NULL, dense_results );
+    optimizer_run_epoch_sparse( sparse_sgd, sX, Y, NULL, NULL, sparse_results );
+
+    neuralnet_get_parameters( nn, dense_grad );
+    neuralnet_get_parameters( nn_copy, sparse_grad );
+    CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( n_params, dense_grad, sparse_grad ), 0.0f, 1.0e-5f,
+            "Checking that sparse and dense training give equal parameters" );
+    CHECK_FLOAT_EQUALS_MSG( dense_results[0], sparse_results[0], 1.0e-5f,
+            "Checking that sparse and dense evaluation give equal loss" );
+
+    fprintf(stderr, KBLU "Testing lazy updates." KNRM "\n" );
+    /* Adagrad and RMSprop (without momentum) should give the same result with lazy updates. The
+       third time is adagrad with the batch gradients in a thread pool. */
+    threadpool_t *pool = threadpool_new( 3 );
+    assert( pool );
+    for( int lazy_opt = 0; lazy_opt < 3; lazy_opt++ ){
+        if( lazy_opt == 2 )
+            threadpool_set_default( pool );
+        for( int l = 0; l < nn->n_layers; l++ ){
+            memcpy( nn_copy->layer[l].weight, nn->layer[l].weight, nn->layer[l].n_input * nn->layer[l].n_output * sizeof(float));
+            memcpy( nn_copy->layer[l].bias, nn->layer[l].bias, nn->layer[l].n_output * sizeof(float));
+        }
+        optimizer_t *eager = lazy_opt != 1 ?
+            OPTIMIZER( adagrad_new( nn,
+                OPTIMIZER_PROPERTIES( .batchsize = 4, .shuffle = false, .metrics = metrics, .progress = NULL ),
+                ADAGRAD_PROPERTIES( .learning_rate = 0.01f ))) :
+            OPTIMIZER( RMSprop_new( nn,
+                OPTIMIZER_PROPERTIES( .batchsize = 4, .shuffle = false, .metrics = metrics, .progress = NULL ),
+                RMSPROP_PROPERTIES( .learning_rate = 0.001f )));
+        optimizer_t *lazy = lazy_opt != 1 ?
+            OPTIMIZER( adagrad_new( nn_copy,
+                OPTIMIZER_PROPERTIES( .batchsize = 4, .shuffle = false, .metrics = metrics, .progress = NULL, .lazy = true ),
+                ADAGRAD_PROPERTIES( .learning_rate = 0.01f ))) :
+            OPTIMIZER( RMSprop_new( nn_copy,
+                OPTIMIZER_PROPERTIES( .batchsize = 4, .shuffle = false, .metrics = metrics, .progress = NULL, .lazy = true ),
+                RMSPROP_PROPERTIES( .learning_rate = 0.001f )));
+
+        for( int epoch = 0; epoch < 2; epoch++ ){
+            optimizer_run_epoch_sparse( eager, sX, Y, NULL, NULL, dense_results );
+            optimizer_run_epoch_sparse( lazy, sX, Y, NULL, NULL, sparse_results );
+        }
+        CHECK_NOT_NULL_MSG( lazy->lazy_state, "Checking that lazy state is allocated" );
+        CHECK_CONDITION_MSG( lazy->lazy_state->n_ranges < n_input + 2, "Checking that not all rows are updated" );
+
+        neuralnet_get_parameters( nn, dense_grad );
+        neuralnet_get_parameters( nn_copy, sparse_grad );
+        CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( n_params, dense_grad, sparse_grad ), 0.0f, 1.0e-5f,
+                lazy_opt == 0 ? "Checking that lazy adagrad gives equal parameters" :
+                lazy_opt == 1 ? "Checking that lazy RMSprop gives equal parameters" :
+                                "Checking that lazy adagrad gives equal parameters in the thread pool" );
+        optimizer_free( eager );
+        optimizer_free( lazy );
+    }
+    threadpool_set_default( NULL );
+    threadpool_free( pool );
+
+    /* clean up */
+    optimizer_free( dense_sgd );
+    optimizer_free( sparse_sgd );
+    simd_free( dense_grad );
+    simd_free( sparse_grad );
+    sparse_matrix_free( sX );
+    free( X );
+    free( Y );
+    neuralnet_free( nn );
+    neuralnet_free( nn_copy );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
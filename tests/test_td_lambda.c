@@ -0,0 +1,132 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "optimizer.h"
+#include "optimizer_implementations.h"
+#include "simd.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* The random walk of Sutton (1988): Five states in a row, starting in the middle, with a step to
+   the left or the right at random. The episode ends to the left of the first state with the reward
+   0, or to the right of the last state with the reward 1. The value of state i is then (i+1)/6.
+   The second output gets the opposite reward, so its value is 1 - (i+1)/6. */
+
+#define N_STATES 5
+
+static int random_walk( float *states, float *rewards )
+{
+    for( int s = N_STATES / 2, t = 0; ; t++ ){
+        memset( states + t * N_STATES, 0, N_STATES * sizeof(float));
+        states[t * N_STATES + s] = 1.0f;
+        rewards[2 * t] = rewards[2 * t + 1] = 0.0f;
+        s += rand() % 2 ? 1 : -1;
+        if( s == N_STATES || s < 0 ){
+            rewards[2 * t + (s < 0)] = 1.0f;
+            return t + 1;
+        }
+    }
+}
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    fprintf(stderr, KBLU "Testing the output gradients." KNRM "\n" );
+    neuralnet_t *nn = neuralnet_create( 2, INT_ARRAY( 6, 5, 3 ), STR_ARRAY( "tanh", "sigmoid" ));
+    assert( nn );
+    neuralnet_initialize( nn, NULL );
+    neuralnet_set_loss( nn, "binary_crossentropy" );  /* The output derivative is "matched" away */
+    const unsigned int n_params = neuralnet_total_n_parameters( nn );
+    const unsigned int stride = (n_params + 15) & ~15u;
+    float *grads = simd_malloc( 3 * stride * sizeof(float));
+    float *params = malloc( n_params * sizeof(float));
+    float *delta = calloc( n_params, sizeof(float));
+    assert( grads && params && delta );
+    float SIMD_ALIGN(input[6]) = { 0.5f, -0.2f, 0.1f, 0.9f, -0.7f, 0.3f };
+    float SIMD_ALIGN(output[3]);
+    float SIMD_ALIGN(expected[3]);
+    neuralnet_output_gradients( nn, input, stride, grads, output );
+    neuralnet_predict( nn, input, expected );
+    CHECK_FLOAT_EQUALS_MSG( output[1], expected[1], 1.0e-6f, "Checking the output of the forward pass" );
+
+    /* Central differences */
+    const float h = 1.0e-2f;
+    float max_error = 0.0f;
+    for( unsigned int p = 0; p < n_params; p++ ){
+        float SIMD_ALIGN(plus[3]);
+        float SIMD_ALIGN(minus[3]);
+        delta[p] = h;
+        neuralnet_update( nn, delta );
+        neuralnet_predict( nn, input, plus );
+        delta[p] = -2.0f * h;
+        neuralnet_update( nn, delta );
+        neuralnet_predict( nn, input, minus );
+        delta[p] = h;
+        neuralnet_update( nn, delta );
+        delta[p] = 0.0f;
+        for( int k = 0; k < 3; k++ ){
+            const float error = fabsf( (plus[k] - minus[k]) / (2.0f * h) - grads[k * stride + p] );
+            if( error > max_error ) max_error = error;
+        }
+    }
+    CHECK_FLOAT_EQUALS_MSG( max_error, 0.0f, 1.0e-3f, "Checking the gradients against finite differences" );
+    neuralnet_free( nn );
+    simd_free( grads );
+    free( params );
+    free( delta );
+
+    fprintf(stderr, KBLU "Testing TD(lambda) on a random walk." KNRM "\n" );
+    srand( 42 );
+    nn = neuralnet_create( 1, INT_ARRAY( N_STATES, 2 ), STR_ARRAY( "linear" ));
+    assert( nn );
+    neuralnet_set_loss( nn, "mean_squared_error" );
+    memset( nn->layer[0].weight, 0, N_STATES * 2 * sizeof(float));
+    memset( nn->layer[0].bias, 0, 2 * sizeof(float));
+    optimizer_t *td = OPTIMIZER( TD_lambda_new( nn, OPTIMIZER_PROPERTIES( .progress = NULL,
+                    .metrics = METRIC_LIST( get_metric_func( "mean_squared_error" ))),
+                TD_LAMBDA_PROPERTIES( .learning_rate = 0.01f, .lambda = 0.8f )));
+    CHECK_NOT_NULL_MSG( td, "Checking that the optimizer is created" );
+    assert( td );
+
+    /* The values are averaged over the last episodes, as they keep moving with the noise of the walks */
+    float states[1000 * N_STATES], rewards[1000 * 2];
+    float mean_value[N_STATES][2] = {{ 0.0f }};
+    for( int episode = 0; episode < 6000; episode++ ){
+        const int n = random_walk( states, rewards );
+        optimizer_step( td, n, states, rewards );
+        for( int s = 0; episode >= 5000 && s < N_STATES; s++ ){
+            float SIMD_ALIGN(state[N_STATES]) = { 0.0f };
+            float SIMD_ALIGN(value[2]);
+            state[s] = 1.0f;
+            neuralnet_predict( nn, state, value );
+            mean_value[s][0] += value[0] / 1000.0f;
+            mean_value[s][1] += value[1] / 1000.0f;
+        }
+    }
+    float rms = 0.0f;
+    for( int s = 0; s < N_STATES; s++ ){
+        const float v = (float) (s + 1) / (N_STATES + 1);
+        rms += (mean_value[s][0] - v) * (mean_value[s][0] - v) + (mean_value[s][1] - (1.0f - v)) * (mean_value[s][1] - (1.0f - v));
+    }
+    rms = sqrtf( rms / (2 * N_STATES) );
+    CHECK_FLOAT_EQUALS_MSG( rms, 0.0f, 0.05f, "Checking the learned values of the states" );
+
+    /* The running train metrics are of the values against the TD targets */
+    float results[1];
+    const int n = random_walk( states, rewards );
+    td->running_metrics = true;
+    optimizer_run_epoch( td, n, states, rewards, 0, NULL, NULL, results );
+    CHECK_CONDITION_MSG( results[0] > 0.0f && results[0] < 0.1f, "Checking the train loss of an episode" );
+
+    optimizer_free( td );
+    neuralnet_free( nn );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}
@@ -0,0 +1,216 @@
+#include "test.h"
+#include "neuralnet.h"
+#include "sparse_matrix.h"
+#include "optimizer.h"
+#include "optimizer_implementations.h"
+#include "evaluate.h"
+#include "threadpool.h"
+#include "neuralnet_predict_batch.h"
+#include "simd.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* The thread pool itself, and then that the optimizers train the same way with the thread pool
+   as with OpenMP. The sums are done in another order, so the weights are only about the same. */
+
+#define N_THREADS 4
+#define N_JOBS    2000
+
+/* Each thread writes its number, and after the barrier, checks what the others wrote */
+typedef struct {
+    int job;
+    int seen[N_THREADS];
+    int n_errors[N_THREADS];
+    int nested[N_THREADS];
+} barrier_job_t;
+
+static void barrier_job( threadpool_t *pool, void *arg, const int thread, const int n_threads )
+{
+    barrier_job_t *job = (barrier_job_t *) arg;
+    job->seen[thread] = job->job * N_THREADS + thread;
+    threadpool_barrier( pool );
+    for( int t = 0; t < n_threads; t++ )
+        if( __atomic_load_n( &job->seen[t], __ATOMIC_RELAXED ) != job->job * N_THREADS + t )
+            job->n_errors[thread]++;
+    threadpool_barrier( pool );
+    job->nested[thread] = threadpool_run( pool, barrier_job, arg );
+}
+
+static void scratch_job( threadpool_t *pool, void *arg, const int thread, const int n_threads )
+{
+    float **scratch = (float **) arg;
+    (void) n_threads;
+    scratch[thread] = threadpool_scratch( pool, thread, 1000 + thread );
+}
+
+static optimizer_t *new_optimizer( neuralnet_t *nn, metric_func *metrics )
+{
+    return OPTIMIZER( SGD_new( nn, OPTIMIZER_PROPERTIES( .batchsize = 32, .shuffle = false, .metrics = metrics,
+                    .progress = NULL, .running_metrics = true ),
+                SGD_PROPERTIES( .learning_rate = 0.05f, .momentum = 0.5f )));
+}
+
+int main(int argc, char *argv[] )
+{
+    int test_count = 0;
+    int fail_count = 0;
+
+    if(argc == 1)
+        fprintf(stderr, KBLU "Running '%s'\n" KNRM, argv[0] );
+
+    fprintf(stderr, KBLU "Testing the thread pool." KNRM "\n" );
+    const int no_pool = threadpool_run( NULL, barrier_job, NULL );
+    CHECK_INT_EQUALS_MSG( no_pool, -1, "Checking that a job cannot run without a pool" );
+
+    threadpool_t *pool = threadpool_new( N_THREADS );
+    CHECK_NOT_NULL_MSG( pool, "Checking that the pool is created" );
+    assert( pool );
+    CHECK_INT_EQUALS_MSG( threadpool_n_threads( pool ), N_THREADS, "Checking the number of threads" );
+
+    barrier_job_t job;
+    int n_failed_runs = 0, n_errors = 0, n_nested = 0;
+    for( job.job = 0; job.job < N_JOBS; job.job++ ){
+        memset( job.n_errors, 0, sizeof(job.n_errors));
+        if( threadpool_run( pool, barrier_job, &job ) < 0 )
+            n_failed_runs++;
+        for( int t = 0; t < N_THREADS; t++ ){
+            n_errors += job.n_errors[t];
+            n_nested += job.nested[t] == 0;
+        }
+    }
+    CHECK_INT_EQUALS_MSG( n_failed_runs, 0, "Checking that all the jobs run" );
+    CHECK_INT_EQUALS_MSG( n_errors, 0, "Checking that all the threads wait at the barrier" );
+    CHECK_INT_EQUALS_MSG( n_nested, 0, "Checking that a busy pool does not run another job" );
+
+    float *scratch[N_THREADS], *again[N_THREADS];
+    threadpool_run( pool, scratch_job, scratch );
+    threadpool_run( pool, scratch_job, again );
+    int n_kept = 0;
+    for( int t = 0; t < N_THREADS; t++ )
+        n_kept += scratch[t] && scratch[t] == again[t];
+    CHECK_INT_EQUALS_MSG( n_kept, N_THREADS, "Checking that the scratch memory is kept between the jobs" );
+
+    unsigned int first, last, covered = 0;
+    for( int t = 0; t < 7; t++ ){
+        threadpool_split( 100, t, 7, &first, &last );
+        covered += first == covered ? last - first : 1000;
+    }
+    CHECK_INT_EQUALS_MSG( (int) covered, 100, "Checking that the split covers all the items" );
+
+    /* Training with the thread pool */
+    const int n_samples = 500;
+    const int n_input   = 67;
+    const int n_output  = 3;
+
+    srand( 42 );
+    float *X = calloc( n_samples * n_input, sizeof(float));
+    float *Y = calloc( n_samples * n_output, sizeof(float));
+    assert( X && Y );
+    for( int i = 0; i < n_samples; i++ ){
+        const int label = rand() % n_output;
+        for( int j = 0; j < n_input; j++ )
+            if( rand() % 10 == 0 || j % 20 == label ) X[i*n_input + j] = 1.0f;
+        Y[i*n_output + label] = 1.0f;
+    }
+    sparse_matrix_t *sX = sparse_matrix_from_dense( n_samples, n_input, X );
+    assert( sX );
+
+    neuralnet_t *nn   = neuralnet_create( 2, INT_ARRAY( n_input, 13, n_output ), STR_ARRAY( "relu", "softmax" ));
+    neuralnet_t *omp  = neuralnet_create( 2, INT_ARRAY( n_input, 13, n_output ), STR_ARRAY( "relu", "softmax" ));
+    neuralnet_t *pooled = neuralnet_create( 2, INT_ARRAY( n_input, 13, n_output ), STR_ARRAY( "relu", "softmax" ));
+    assert( nn && omp && pooled );
+    neuralnet_initialize( nn, NULL );
+    neuralnet_set_loss( nn, "categorical_crossentropy" );
+    neuralnet_set_loss( omp, "categorical_crossentropy" );
+    neuralnet_set_loss( pooled, "categorical_crossentropy" );
+
+    const int n_params = neuralnet_total_n_parameters( nn );
+    float *omp_params    = malloc( n_params * sizeof(float));
+    float *pooled_params = malloc( n_params * sizeof(float));
+    assert( omp_params && pooled_params );
+    metric_func *metrics = METRIC_LIST( get_metric_func( "categorical_crossentropy" ));
+
+    for( int sparse = 0; sparse < 2; sparse++ ){
+        fprintf(stderr, KBLU "Testing SGD in the thread pool with %s input." KNRM "\n", sparse ? "sparse" : "dense" );
+        neuralnet_copy_weights( omp, nn );
+        neuralnet_copy_weights( pooled, nn );
+        optimizer_t *omp_opt    = new_optimizer( omp, metrics );
+        optimizer_t *pooled_opt = new_optimizer( pooled, metrics );
+        assert( omp_opt && pooled_opt );
+
+        float omp_results[1], pooled_results[1];
+        for( int epoch = 0; epoch < 3; epoch++ ){
+            threadpool_set_default( NULL );
+            if( sparse )
+                optimizer_run_epoch_sparse( omp_opt, sX, Y, NULL, NULL, omp_results );
+            else
+                optimizer_run_epoch( omp_opt, n_samples, X, Y, 0, NULL, NULL, omp_results );
+            threadpool_set_default( pool );
+            if( sparse )
+                optimizer_run_epoch_sparse( pooled_opt, sX, Y, NULL, NULL, pooled_results );
+            else
+                optimizer_run_epoch( pooled_opt, n_samples, X, Y, 0, NULL, NULL, pooled_results );
+        }
+        neuralnet_get_parameters( omp, omp_params );
+        neuralnet_get_parameters( pooled, pooled_params );
+        CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( n_params, omp_params, pooled_params ), 0.0f, 1.0e-4f,
+                "Checking that the thread pool gives the same weights as OpenMP" );
+        CHECK_FLOAT_EQUALS_MSG( pooled_results[0], omp_results[0], 1.0e-4f, "Checking the running train loss" );
+
+        optimizer_free( omp_opt );
+        optimizer_free( pooled_opt );
+    }
+
+    fprintf(stderr, KBLU "Testing adam in the thread pool." KNRM "\n" );
+    neuralnet_copy_weights( pooled, nn );
+    optimizer_t *opt = OPTIMIZER( adam_new( pooled, OPTIMIZER_PROPERTIES( .batchsize = 32, .metrics = metrics,
+                    .progress = NULL ), ADAM_PROPERTIES( .learning_rate = 0.01f )));
+    assert( opt );
+    float first_loss, results[1];
+    evaluate( pooled, n_samples, X, Y, metrics, &first_loss );
+    for( int epoch = 0; epoch < 5; epoch++ )
+        optimizer_run_epoch( opt, n_samples, X, Y, 0, NULL, NULL, results );
+    CHECK_CONDITION_MSG( results[0] < 0.5f * first_loss, "Checking that the loss decreases" );
+    optimizer_free( opt );
+
+    fprintf(stderr, KBLU "Testing the evaluation and the prediction in the thread pool." KNRM "\n" );
+    metric_func *eval_metrics = METRIC_LIST( get_metric_func( "categorical_crossentropy" ),
+            get_metric_func( "categorical_accuracy" ), get_metric_func( "roc_auc_exact" ));
+    float omp_eval[2][3], pooled_eval[2][3];
+    float *omp_pred    = simd_malloc( n_samples * n_output * sizeof(float));
+    float *pooled_pred = simd_malloc( n_samples * n_output * sizeof(float));
+    assert( omp_pred && pooled_pred );
+    threadpool_set_default( NULL );
+    evaluate( pooled, n_samples, X, Y, eval_metrics, omp_eval[0] );
+    evaluate_sparse( pooled, sX, Y, eval_metrics, omp_eval[1] );
+    neuralnet_predict_batch( pooled, n_samples, X, omp_pred );
+    threadpool_set_default( pool );
+    evaluate( pooled, n_samples, X, Y, eval_metrics, pooled_eval[0] );
+    evaluate_sparse( pooled, sX, Y, eval_metrics, pooled_eval[1] );
+    neuralnet_predict_batch( pooled, n_samples, X, pooled_pred );
+    CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( 3, omp_eval[0], pooled_eval[0] ), 0.0f, 1.0e-5f,
+            "Checking the evaluation in the thread pool" );
+    CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( 3, omp_eval[1], pooled_eval[1] ), 0.0f, 1.0e-5f,
+            "Checking the sparse evaluation in the thread pool" );
+    CHECK_FLOAT_EQUALS_MSG( test_max_abs_diff( n_samples * n_output, omp_pred, pooled_pred ), 0.0f, 1.0e-6f,
+            "Checking the predictions in the thread pool" );
+    simd_free( omp_pred );
+    simd_free( pooled_pred );
+
+    threadpool_free( pool );
+    CHECK_CONDITION_MSG( threadpool_default() == NULL, "Checking that the default pool is reset when it is freed" );
+
+    neuralnet_free( nn );
+    neuralnet_free( omp );
+    neuralnet_free( pooled );
+    sparse_matrix_free( sX );
+    free( omp_params );
+    free( pooled_params );
+    free( X );
+    free( Y );
+
+    print_test_summary(test_count, fail_count );
+    return 0;
+}